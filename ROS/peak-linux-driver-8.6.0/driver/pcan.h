@@ -73,6 +73,7 @@
 #define HW_USB_FD         18	/* same as Device ID (why not?) */
 #define HW_PCIE_FD        19	/* this kind of PCIe runs uCAN FPGA */
 #define HW_USB_X6         20	/* same as Device ID (why not?) */
+#define HW_VIRTUAL        21	/* no hardware: virtual CAN-FD adapter */
 
 /* compatibility */
 #define HW_PCI_FD         HW_PCIE_FD
@@ -59,6 +59,7 @@
 /* new bits indicate valid values in the corresponding fields */
 #define PCANFD_TIMESTAMP	0x01000000
 #define PCANFD_HWTIMESTAMP	0x02000000
+#define PCANFD_TIMESTAMP_NS	0x04000000	/* "timestamp_ns" is valid */
 #define PCANFD_ERRCNT		0x10000000
 #define PCANFD_BUSLOAD		0x20000000
 
@@ -142,7 +143,13 @@ struct pcanfd_msg {
 	__u16	data_len;	/* true length (not the DLC) */
 	__u32	id;		/* CAN / STATUS / ERROR Id. */
 	__u32	flags;		/* PCANFD_xxx definitions */
-	struct timeval	timestamp;	/* timestamp of the event */
+	union {
+		struct timeval	timestamp;	/* timestamp of the event */
+
+		/* if PCANFD_TIMESTAMP_NS (see PCANFD_INIT_TS_MONO_NS).
+		 * Note: aligned(4) keeps the layout of 32-bit ABIs */
+		__u64	timestamp_ns __attribute__((packed, aligned(4)));
+	};
 	__u8	ctrlr_data[PCANFD_MAXCTRLRDATALEN];
 	__u8	data[PCANFD_MAXDATALEN] __attribute__((aligned(8)));
 };
@@ -182,8 +189,15 @@ struct pcan_bittiming {
 #define PCANFD_INIT_TS_HOST_REL		0x00000000 /* rel. to host init time */
 #define PCANFD_INIT_TS_DEV_REL		0x00000010 /* rel. to device init time*/
 #define PCANFD_INIT_TS_DRV_REL		0x00000020 /* rel. to driver init time*/
+#define PCANFD_INIT_TS_MONO_NS		0x00000030 /* CLOCK_MONOTONIC ns */
 #define PCANFD_INIT_TS_FMT_MASK		0x00000030
 
+/* PCANFD_INIT_TS_MONO_NS: msgs timestamps are given in their "timestamp_ns"
+ * field (and PCANFD_TIMESTAMP_NS is set in their flags) as a 64-bit count of
+ * ns in the CLOCK_MONOTONIC time base, which is not disturbed by the steps of
+ * the time of day. If PCANFD_OPT_HWTIMESTAMP_MODE is PCANFD_OPT_HWTIMESTAMP_RAW,
+ * "timestamp_ns" is the raw hardware time (in ns) instead. */
+
 /* (time is relative) */
 #define PCANFD_INIT_TS_ABS		PCANFD_INIT_TS_HOST_REL
 
@@ -239,6 +253,18 @@ struct pcanfd_msg_filter {
 	__u32	msg_flags;		/* will be passed to applications */
 };
 
+/* msg_flags bits defining the kind of the filter (default is ID range):
+ * - PCANFD_FILTER_MASK: msgs whose (ID & id_to) == id_from are passed,
+ * - PCANFD_FILTER_ID: msgs whose ID == id_from are passed (id_to is unused).
+ * Other bits (PCANFD_MSG_RTR, PCANFD_MSG_EXT) keep their meaning. Besides the
+ * search of the ID ranges, filtering a msg whose ID is not an 11-bit ID costs
+ * one lookup per distinct id_to used by the PCANFD_FILTER_MASK filters, plus
+ * one for all the PCANFD_FILTER_ID filters. */
+#define PCANFD_FILTER_RANGE		0x00000000
+#define PCANFD_FILTER_MASK		0x40000000
+#define PCANFD_FILTER_ID		0x80000000
+#define PCANFD_FILTER_KIND		0xc0000000
+
 /* filters list base type (0 item list) */
 struct __array_of_struct(pcanfd_msg_filter, 0);
 
@@ -312,6 +338,12 @@ enum {
 	PCANFD_IO_DIGITAL_CLR,		/* clr multiple dig I/O pins to 0 */
 	PCANFD_IO_ANALOG_VAL,		/* get single analog input pin value */
 
+	/* open path specific options: */
+	PCANFD_OPT_RX_FIFO_SIZE,	/* private Rx fifo size (0=shared) */
+	PCANFD_OPT_RW_MODE,		/* read()/write() data format */
+	PCANFD_OPT_FILTERS_SCOPE,	/* chain PCANFD_xxx_FILTERS act on */
+	PCANFD_OPT_RX_COALESCE,		/* Rx wake-ups coalescing */
+
 	PCANFD_OPT_MAX
 };
 
@@ -349,11 +381,144 @@ enum {
 	PCANFD_OPT_HWTIMESTAMP_MAX
 };
 
+/* PCANFD_OPT_RX_FIFO_SIZE option:
+ * count of msgs of the private Rx fifo of the open path. By default (0), all
+ * the paths opened on a channel share the same Rx fifo (each msg is read by
+ * one path only). Setting a non-null size gives the path its own Rx fifo, in
+ * which it receives a copy of every msg. This can be done once per path. */
+
+/* PCANFD_OPT_RW_MODE option:
+ * format of the data read() from and write() to the device node. In records
+ * mode, read() and write() (as well as readv() and writev()) move arrays of
+ * struct pcanfd_msg (count = length / sizeof(struct pcanfd_msg)) without any
+ * formatting. */
+enum {
+	PCANFD_RW_MODE_TEXT,		/* text lines (default) */
+	PCANFD_RW_MODE_RECORDS,		/* struct pcanfd_msg records */
+
+	PCANFD_RW_MODE_MAX
+};
+
+/* PCANFD_OPT_FILTERS_SCOPE option:
+ * chain of msgs filters the PCANFD_ADD_FILTERS and PCANFD_GET_FILTERS ioctl()
+ * of an open path act on. By default (unless the driver is loaded with
+ * pathfilters=1), filters are those of the channel, shared by all the paths
+ * opened on it. With the PATH scope, each path owns its filters, which don't
+ * change what the other paths opened on the same channel receive. Adding the
+ * first filter to the chain of a path gives it a private Rx fifo (see
+ * PCANFD_OPT_RX_FIFO_SIZE) if it doesn't already own one. */
+enum {
+	PCANFD_FILTERS_SCOPE_DEVICE,	/* filters of the channel (default) */
+	PCANFD_FILTERS_SCOPE_PATH,	/* filters of the open path */
+
+	PCANFD_FILTERS_SCOPE_MAX
+};
+
+/* PCANFD_OPT_RX_COALESCE option:
+ * coalescing of the wake-ups of the tasks waiting for msgs on the open path
+ * (read(), PCANFD_RECV_MSG[S], poll()). Instead of being woken up by each
+ * msg, they're woken up once "min_count" msgs are pending, or "max_latency_us"
+ * microseconds after a msg has been received, whichever comes first. A null
+ * "max_latency_us" doesn't bound the latency. Setting both fields to 0
+ * (default) disables the coalescing. Setting this option gives the path its
+ * own Rx fifo (see PCANFD_OPT_RX_FIFO_SIZE), if it doesn't already own one. */
+struct pcanfd_rx_coalesce {
+	__u32	min_count;
+	__u32	max_latency_us;
+};
+
 /* PCANFD_OPT_XXX_VERSION major, minor and subminor fields */
 #define PCANFD_OPT_VER_MAJ(v)		(((v) >> 24) & 0xff)
 #define PCANFD_OPT_VER_MIN(v)		(((v) >> 16) & 0xff)
 #define PCANFD_OPT_VER_SUB(v)		(((v) >> 8) & 0xff)
 
+/* mmap() Rx ring:
+ * mapping /dev/pcanX (offset 0, MAP_SHARED) gives the open path its own Rx
+ * ring, into which the driver directly writes every received msg. The 1st page
+ * of the mapping is the header below, the msgs ring follows at "msgs_offset".
+ * The driver only writes "head", the application only writes "tail". Both are
+ * free running indexes: msgs[tail % msg_count] is the next msg to read while
+ * tail != head. poll() notifies POLLIN when the ring is not empty. */
+#define PCANFD_RX_RING_MAGIC	0x5043524e	/* "PCRN" */
+#define PCANFD_RX_RING_ALIGN	64
+
+struct pcanfd_rx_ring {
+	__u32	magic;		/* PCANFD_RX_RING_MAGIC */
+	__u32	msg_count;	/* count of msgs in the ring (power of 2) */
+	__u32	msg_size;	/* sizeof(struct pcanfd_msg) */
+	__u32	msgs_offset;	/* offset of msgs[0] from this header */
+	__u32	lost_count;	/* count of msgs lost because ring was full */
+
+	__u32	head __attribute__((aligned(PCANFD_RX_RING_ALIGN)));
+	__u32	tail __attribute__((aligned(PCANFD_RX_RING_ALIGN)));
+};
+
+/* PCANFD_SET_BPF:
+ * classic BPF program (same encoding as struct sock_filter) run on each CAN
+ * and CAN-FD msg before it is copied into the Rx fifo of the open path. As
+ * with sockets, BPF_LD|BPF_ABS and BPF_LD|BPF_IND load the following packet in
+ * network byte order, and BPF_LD|BPF_LEN loads its length (12 + data_len):
+ *
+ *	offset	size
+ *	0	4		id
+ *	4	4		flags (PCANFD_MSG_xxx)
+ *	8	2		type (PCANFD_TYPE_xxx)
+ *	10	2		data_len
+ *	12	data_len	data[]
+ *
+ * The value the program returns is the count of data bytes to keep: 0 drops
+ * the msg, a value lower than data_len truncates it (CAN-FD msgs are truncated
+ * to the largest valid CAN-FD length not above it). STATUS and ERROR msgs are
+ * not given to the program. An empty program (count = 0) detaches the current
+ * one. Like msgs filters, a program gives the path its own Rx fifo. */
+#define PCANFD_BPF_OFF_ID		0
+#define PCANFD_BPF_OFF_FLAGS		4
+#define PCANFD_BPF_OFF_TYPE		8
+#define PCANFD_BPF_OFF_DATA_LEN		10
+#define PCANFD_BPF_OFF_DATA		12
+
+#define PCANFD_BPF_MAXINSNS		4096
+
+struct pcanfd_bpf_insn {
+	__u16	code;
+	__u8	jt;
+	__u8	jf;
+	__u32	k;
+};
+
+/* BPF program base type (0 instruction program) */
+struct __array_of_struct(pcanfd_bpf_insn, 0);
+
+#define pcanfd_bpf_insns	pcanfd_bpf_insns_0
+
+/* PCANFD_RECV_MSGS_TIMEOUT:
+ * same as PCANFD_RECV_MSGS_LIST, except that the task waits until at least
+ * "min_count" msgs can be read, or until the CLOCK_MONOTONIC absolute time
+ * "deadline_ns" is reached, whichever comes first. Up to "count" msgs are then
+ * read at once into the user array "list", and "count" is set to the number of
+ * msgs read. It is 0 if the deadline has been reached while no msg was
+ * received. A null "deadline_ns" doesn't bound the wait, while a non-blocking
+ * path never waits. "min_count" is limited to "count" and to the size of the
+ * Rx fifo. Like msgs filters, waiting gives the path its own Rx fifo (see
+ * PCANFD_OPT_RX_FIFO_SIZE), so that the task is woken up once only, when
+ * "min_count" msgs are pending. */
+struct pcanfd_msgs_timeout {
+	__u64	deadline_ns;
+	__u32	min_count;
+	__u32	count;
+	__u64	list;		/* (struct pcanfd_msg *) */
+};
+
+/* PCANFD_SEND_MSGS_LIST, PCANFD_RECV_MSGS_LIST:
+ * same as PCANFD_SEND_MSGS and PCANFD_RECV_MSGS, except that the list of msgs
+ * is not stored after "count" but at the user address "list", so that any
+ * array of struct pcanfd_msg can be used as is. */
+struct pcanfd_msgs_list {
+	__u32	count;
+	__u32	reserved;
+	__u64	list;		/* (struct pcanfd_msg *) */
+};
+
 /* ioctls codes */
 #define PCANFD_SEQ_START		0x90
 
@@ -371,6 +536,10 @@ enum {
 	PCANFD_SEQ_GET_BITTIMING_RANGES,	/* options above instead */
 	PCANFD_SEQ_GET_OPTION,
 	PCANFD_SEQ_SET_OPTION,
+	PCANFD_SEQ_SET_BPF,
+	PCANFD_SEQ_RECV_MSGS_TIMEOUT,
+	PCANFD_SEQ_SEND_MSGS_LIST,
+	PCANFD_SEQ_RECV_MSGS_LIST,
 };
 
 #define PCANFD_SET_INIT		_IOW(PCAN_MAGIC_NUMBER, PCANFD_SEQ_SET_INIT,\
@@ -414,4 +583,15 @@ enum {
 					struct pcanfd_option)
 #define PCANFD_SET_OPTION	_IOW(PCAN_MAGIC_NUMBER, PCANFD_SEQ_SET_OPTION,\
 					struct pcanfd_option)
+#define PCANFD_SET_BPF		_IOW(PCAN_MAGIC_NUMBER, PCANFD_SEQ_SET_BPF,\
+					struct pcanfd_bpf_insns)
+#define PCANFD_RECV_MSGS_TIMEOUT	_IOWR(PCAN_MAGIC_NUMBER,\
+					      PCANFD_SEQ_RECV_MSGS_TIMEOUT,\
+					      struct pcanfd_msgs_timeout)
+#define PCANFD_SEND_MSGS_LIST	_IOWR(PCAN_MAGIC_NUMBER,\
+					      PCANFD_SEQ_SEND_MSGS_LIST,\
+					      struct pcanfd_msgs_list)
+#define PCANFD_RECV_MSGS_LIST	_IOWR(PCAN_MAGIC_NUMBER,\
+					      PCANFD_SEQ_RECV_MSGS_LIST,\
+					      struct pcanfd_msgs_list)
 #endif
@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Classic BPF programs run on the msgs received by an open path.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * The programs are run by the small interpreter below rather than by the
+ * kernel one: the latter only knows about sk_buff packets, and isn't usable
+ * from the RT Rx path.
+ */
+#include "src/pcan_common.h"
+#include "src/pcan_bpf.h"
+#include "src/pcanfd_ucan.h"
+
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/filter.h>
+
+/* not defined by older kernels */
+#ifndef BPF_MOD
+#define BPF_MOD		0x90
+#endif
+#ifndef BPF_XOR
+#define BPF_XOR		0xa0
+#endif
+#ifndef BPF_MEMWORDS
+#define BPF_MEMWORDS	16
+#endif
+
+/* size of the packet seen by the programs */
+#define PCAN_BPF_PKT_SIZE	(PCANFD_BPF_OFF_DATA + PCANFD_MAXDATALEN)
+
+struct pcan_bpf_prog {
+	u32			count;
+	struct pcanfd_bpf_insn	insns[0];
+};
+
+/* return 0 if the instruction at "pc" can be run safely */
+static int pcan_bpf_check_insn(const struct pcanfd_bpf_insn *insn, u32 pc,
+			       u32 count)
+{
+	const u32 next = count - pc - 1;	/* count of insns after pc */
+
+	switch (insn->code) {
+
+	case BPF_LD | BPF_W | BPF_ABS:
+	case BPF_LD | BPF_H | BPF_ABS:
+	case BPF_LD | BPF_B | BPF_ABS:
+	case BPF_LD | BPF_W | BPF_IND:
+	case BPF_LD | BPF_H | BPF_IND:
+	case BPF_LD | BPF_B | BPF_IND:
+	case BPF_LD | BPF_W | BPF_LEN:
+	case BPF_LD | BPF_IMM:
+	case BPF_LDX | BPF_W | BPF_IMM:
+	case BPF_LDX | BPF_W | BPF_LEN:
+	case BPF_LDX | BPF_B | BPF_MSH:
+	case BPF_ALU | BPF_ADD | BPF_K:
+	case BPF_ALU | BPF_ADD | BPF_X:
+	case BPF_ALU | BPF_SUB | BPF_K:
+	case BPF_ALU | BPF_SUB | BPF_X:
+	case BPF_ALU | BPF_MUL | BPF_K:
+	case BPF_ALU | BPF_MUL | BPF_X:
+	case BPF_ALU | BPF_DIV | BPF_X:
+	case BPF_ALU | BPF_MOD | BPF_X:
+	case BPF_ALU | BPF_AND | BPF_K:
+	case BPF_ALU | BPF_AND | BPF_X:
+	case BPF_ALU | BPF_OR | BPF_K:
+	case BPF_ALU | BPF_OR | BPF_X:
+	case BPF_ALU | BPF_XOR | BPF_K:
+	case BPF_ALU | BPF_XOR | BPF_X:
+	case BPF_ALU | BPF_LSH | BPF_X:
+	case BPF_ALU | BPF_RSH | BPF_X:
+	case BPF_ALU | BPF_NEG:
+	case BPF_RET | BPF_K:
+	case BPF_RET | BPF_A:
+	case BPF_MISC | BPF_TAX:
+	case BPF_MISC | BPF_TXA:
+		return 0;
+
+	case BPF_LD | BPF_MEM:
+	case BPF_LDX | BPF_MEM:
+	case BPF_ST:
+	case BPF_STX:
+		return (insn->k < BPF_MEMWORDS) ? 0 : -EINVAL;
+
+	case BPF_ALU | BPF_DIV | BPF_K:
+	case BPF_ALU | BPF_MOD | BPF_K:
+		return insn->k ? 0 : -EINVAL;
+
+	case BPF_ALU | BPF_LSH | BPF_K:
+	case BPF_ALU | BPF_RSH | BPF_K:
+		return (insn->k < 32) ? 0 : -EINVAL;
+
+	/* only forward jumps inside the program are allowed */
+	case BPF_JMP | BPF_JA:
+		return (insn->k < next) ? 0 : -EINVAL;
+
+	case BPF_JMP | BPF_JEQ | BPF_K:
+	case BPF_JMP | BPF_JEQ | BPF_X:
+	case BPF_JMP | BPF_JGT | BPF_K:
+	case BPF_JMP | BPF_JGT | BPF_X:
+	case BPF_JMP | BPF_JGE | BPF_K:
+	case BPF_JMP | BPF_JGE | BPF_X:
+	case BPF_JMP | BPF_JSET | BPF_K:
+	case BPF_JMP | BPF_JSET | BPF_X:
+		return (insn->jt < next && insn->jf < next) ? 0 : -EINVAL;
+	}
+
+	return -EINVAL;
+}
+
+/* check and copy a program given by the application */
+int pcan_bpf_create(struct pcan_bpf_prog **pprog,
+		    const struct pcanfd_bpf_insn *insns, u32 count)
+{
+	struct pcan_bpf_prog *prog;
+	u32 pc;
+
+	if (!count || count > PCANFD_BPF_MAXINSNS)
+		return -EINVAL;
+
+	/* a program can't go beyond its last instruction */
+	if (BPF_CLASS(insns[count-1].code) != BPF_RET)
+		return -EINVAL;
+
+	for (pc = 0; pc < count; pc++)
+		if (pcan_bpf_check_insn(insns + pc, pc, count)) {
+			pr_err(DEVICE_NAME ": %s(): invalid insn #%u "
+				"(code=%04xh)\n", __func__, pc, insns[pc].code);
+			return -EINVAL;
+		}
+
+	prog = pcan_malloc(sizeof(*prog) + count * sizeof(*insns), GFP_KERNEL);
+	if (!prog)
+		return -ENOMEM;
+
+	prog->count = count;
+	memcpy(prog->insns, insns, count * sizeof(*insns));
+
+	*pprog = prog;
+
+	return 0;
+}
+
+void *pcan_bpf_free(struct pcan_bpf_prog *prog)
+{
+	return pcan_free(prog);
+}
+
+/* return the count of bytes loaded by a BPF_LD instruction */
+static inline u32 pcan_bpf_size(u16 code)
+{
+	switch (BPF_SIZE(code)) {
+	case BPF_W:
+		return 4;
+	case BPF_H:
+		return 2;
+	}
+
+	return 1;
+}
+
+/* store "size" bytes of "v" into pkt in network byte order */
+static inline void pcan_bpf_store(u8 *pkt, u32 v, u32 size)
+{
+	while (size--) {
+		pkt[size] = (u8 )v;
+		v >>= 8;
+	}
+}
+
+/* load "size" bytes at "off" from pkt in network byte order */
+static inline int pcan_bpf_load(const u8 *pkt, u32 len, u32 off, u32 size,
+				u32 *v)
+{
+	if (off >= len || size > len - off)
+		return -EINVAL;
+
+	for (*v = 0, pkt += off; size--; pkt++)
+		*v = (*v << 8) | *pkt;
+
+	return 0;
+}
+
+/* run the program over the packet view of a msg */
+static u32 pcan_bpf_run(const struct pcan_bpf_prog *prog,
+			const struct pcanfd_msg *msg)
+{
+	const struct pcanfd_bpf_insn *insn = prog->insns;
+	u8 pkt[PCAN_BPF_PKT_SIZE];
+	u32 mem[BPF_MEMWORDS] = { 0, };
+	u32 len, A = 0, X = 0;
+
+	len = min_t(u32, msg->data_len, PCANFD_MAXDATALEN);
+
+	pcan_bpf_store(pkt + PCANFD_BPF_OFF_ID, msg->id, 4);
+	pcan_bpf_store(pkt + PCANFD_BPF_OFF_FLAGS, msg->flags, 4);
+	pcan_bpf_store(pkt + PCANFD_BPF_OFF_TYPE, msg->type, 2);
+	pcan_bpf_store(pkt + PCANFD_BPF_OFF_DATA_LEN, len, 2);
+	memcpy(pkt + PCANFD_BPF_OFF_DATA, msg->data, len);
+
+	len += PCANFD_BPF_OFF_DATA;
+
+	/* the program has been checked: jumps are forward and end on a RET */
+	for ( ; ; insn++) {
+
+		switch (insn->code) {
+
+		case BPF_LD | BPF_W | BPF_ABS:
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_ABS:
+			if (pcan_bpf_load(pkt, len, insn->k,
+					  pcan_bpf_size(insn->code), &A))
+				return 0;
+			break;
+
+		case BPF_LD | BPF_W | BPF_IND:
+		case BPF_LD | BPF_H | BPF_IND:
+		case BPF_LD | BPF_B | BPF_IND:
+			if (pcan_bpf_load(pkt, len, X + insn->k,
+					  pcan_bpf_size(insn->code), &A))
+				return 0;
+			break;
+
+		case BPF_LDX | BPF_B | BPF_MSH:
+			if (pcan_bpf_load(pkt, len, insn->k, 1, &X))
+				return 0;
+			X = (X & 0xf) << 2;
+			break;
+
+		case BPF_LD | BPF_W | BPF_LEN:
+			A = len;
+			break;
+		case BPF_LDX | BPF_W | BPF_LEN:
+			X = len;
+			break;
+		case BPF_LD | BPF_IMM:
+			A = insn->k;
+			break;
+		case BPF_LDX | BPF_W | BPF_IMM:
+			X = insn->k;
+			break;
+		case BPF_LD | BPF_MEM:
+			A = mem[insn->k];
+			break;
+		case BPF_LDX | BPF_MEM:
+			X = mem[insn->k];
+			break;
+		case BPF_ST:
+			mem[insn->k] = A;
+			break;
+		case BPF_STX:
+			mem[insn->k] = X;
+			break;
+
+		case BPF_ALU | BPF_ADD | BPF_K:
+			A += insn->k;
+			break;
+		case BPF_ALU | BPF_ADD | BPF_X:
+			A += X;
+			break;
+		case BPF_ALU | BPF_SUB | BPF_K:
+			A -= insn->k;
+			break;
+		case BPF_ALU | BPF_SUB | BPF_X:
+			A -= X;
+			break;
+		case BPF_ALU | BPF_MUL | BPF_K:
+			A *= insn->k;
+			break;
+		case BPF_ALU | BPF_MUL | BPF_X:
+			A *= X;
+			break;
+		case BPF_ALU | BPF_DIV | BPF_K:
+			A /= insn->k;
+			break;
+		case BPF_ALU | BPF_DIV | BPF_X:
+			if (!X)
+				return 0;
+			A /= X;
+			break;
+		case BPF_ALU | BPF_MOD | BPF_K:
+			A %= insn->k;
+			break;
+		case BPF_ALU | BPF_MOD | BPF_X:
+			if (!X)
+				return 0;
+			A %= X;
+			break;
+		case BPF_ALU | BPF_AND | BPF_K:
+			A &= insn->k;
+			break;
+		case BPF_ALU | BPF_AND | BPF_X:
+			A &= X;
+			break;
+		case BPF_ALU | BPF_OR | BPF_K:
+			A |= insn->k;
+			break;
+		case BPF_ALU | BPF_OR | BPF_X:
+			A |= X;
+			break;
+		case BPF_ALU | BPF_XOR | BPF_K:
+			A ^= insn->k;
+			break;
+		case BPF_ALU | BPF_XOR | BPF_X:
+			A ^= X;
+			break;
+		case BPF_ALU | BPF_LSH | BPF_K:
+			A <<= insn->k;
+			break;
+		case BPF_ALU | BPF_LSH | BPF_X:
+			A = (X < 32) ? A << X : 0;
+			break;
+		case BPF_ALU | BPF_RSH | BPF_K:
+			A >>= insn->k;
+			break;
+		case BPF_ALU | BPF_RSH | BPF_X:
+			A = (X < 32) ? A >> X : 0;
+			break;
+		case BPF_ALU | BPF_NEG:
+			A = -A;
+			break;
+
+		case BPF_JMP | BPF_JA:
+			insn += insn->k;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_K:
+			insn += (A == insn->k) ? insn->jt : insn->jf;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_X:
+			insn += (A == X) ? insn->jt : insn->jf;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_K:
+			insn += (A > insn->k) ? insn->jt : insn->jf;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_X:
+			insn += (A > X) ? insn->jt : insn->jf;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_K:
+			insn += (A >= insn->k) ? insn->jt : insn->jf;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_X:
+			insn += (A >= X) ? insn->jt : insn->jf;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_K:
+			insn += (A & insn->k) ? insn->jt : insn->jf;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_X:
+			insn += (A & X) ? insn->jt : insn->jf;
+			break;
+
+		case BPF_MISC | BPF_TAX:
+			X = A;
+			break;
+		case BPF_MISC | BPF_TXA:
+			A = X;
+			break;
+
+		case BPF_RET | BPF_K:
+			return insn->k;
+		case BPF_RET | BPF_A:
+			return A;
+
+		default:
+			/* can't happen with a checked program */
+			return 0;
+		}
+	}
+}
+
+/*
+ * run the program over a received msg. Returns NULL if the msg is dropped,
+ * "rx" if it is accepted as is, or "tmp" that is a truncated copy of "rx".
+ */
+struct pcanfd_rxmsg *pcan_bpf_filter(const struct pcan_bpf_prog *prog,
+				     struct pcanfd_rxmsg *rx,
+				     struct pcanfd_rxmsg *tmp)
+{
+	u32 keep;
+
+	if (!prog)
+		return rx;
+
+	switch (rx->msg.type) {
+	case PCANFD_TYPE_CAN20_MSG:
+	case PCANFD_TYPE_CANFD_MSG:
+		break;
+	default:
+		return rx;
+	}
+
+	keep = pcan_bpf_run(prog, &rx->msg);
+	if (!keep)
+		return NULL;
+
+	if (keep >= rx->msg.data_len)
+		return rx;
+
+	/* a CAN FD msg can't have any length: keep the largest valid one */
+	if (rx->msg.type == PCANFD_TYPE_CANFD_MSG) {
+		u8 dlc = pcan_len2dlc(keep);
+
+		if (pcan_dlc2len(dlc) > keep)
+			dlc--;
+
+		keep = pcan_dlc2len(dlc);
+	}
+
+	*tmp = *rx;
+	tmp->msg.data_len = keep;
+
+	return tmp;
+}
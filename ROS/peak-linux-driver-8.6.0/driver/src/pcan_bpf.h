@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Classic BPF programs run on the msgs received by an open path.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+#ifndef __PCAN_BPF_H__
+#define __PCAN_BPF_H__
+
+#include "src/pcan_common.h"
+#include "src/pcan_main.h"
+
+struct pcan_bpf_prog;
+
+int pcan_bpf_create(struct pcan_bpf_prog **pprog,
+		    const struct pcanfd_bpf_insn *insns, u32 count);
+void *pcan_bpf_free(struct pcan_bpf_prog *prog);
+struct pcanfd_rxmsg *pcan_bpf_filter(const struct pcan_bpf_prog *prog,
+				     struct pcanfd_rxmsg *rx,
+				     struct pcanfd_rxmsg *tmp);
+
+#endif
@@ -116,6 +116,14 @@
  * time from the future. */
 #define PCAN_HANDLE_CLOCK_DRIFT	
 
+/* if defined, the clock of each CAN-FD adapter is exposed as a (read-only)
+ * PTP hardware clock, that is, a /dev/ptpN device (see pcan_ptp.c) */
+#if defined(NO_RT) && defined(PCAN_HANDLE_CLOCK_DRIFT) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0) && \
+	(defined(CONFIG_PTP_1588_CLOCK) || defined(CONFIG_PTP_1588_CLOCK_MODULE))
+#define PCAN_PTP_SUPPORT
+#endif
+
 /* helper to compare version numbers */
 #define VER_NUM(x, y, z)	((((((x) << 8) | (y)) << 8) | (z)) << 8)
 #define VER_MAJ(x)		(((x) >> 24) & 0xff)
@@ -148,6 +156,46 @@ static inline int timeval_cmp(struct timeval *tv0, struct timeval *tv1)
 
 #define timeval_is_older(t1, t2)		timeval_cmp(t1, t2) < 0
 
+#include <linux/math64.h>
+
+static inline void us_to_timeval(u64 us, struct timeval *tv)
+{
+	u32 rem;
+
+	tv->tv_sec = div_u64_rem(us, USEC_PER_SEC, &rem);
+	tv->tv_usec = rem;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+/* acquire/release accesses (since 3.14) */
+#define smp_store_release(p, v)						\
+do {									\
+	smp_mb();							\
+	ACCESS_ONCE(*(p)) = (v);					\
+} while (0)
+
+#define smp_load_acquire(p)						\
+({									\
+	typeof(*(p)) ___p1 = ACCESS_ONCE(*(p));				\
+	smp_mb();							\
+	___p1;								\
+})
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,16,0)
+/* (a * mul) >> shift without overflowing 64 bits (since 3.16) */
+static inline u64 mul_u64_u32_shr(u64 a, u32 mul, unsigned int shift)
+{
+	u32 ah = a >> 32, al = a;
+	u64 ret = ((u64 )al * mul) >> shift;
+
+	if (ah)
+		ret += ((u64 )ah * mul) << (32 - shift);
+
+	return ret;
+}
+#endif
+
 #ifdef NO_RT
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,17,0)
@@ -170,6 +218,12 @@ static inline u64 pcan_getnow_ns(void)
 #endif
 }
 
+/* CLOCK_MONOTONIC time (deadlines given by applications) */
+static inline u64 pcan_getmono_ns(void)
+{
+	return pcan_getnow_ns();
+}
+
 static inline void pcan_getnow_ts(struct timespec *ts, u64 *ptv_ns)
 {
 	getrawmonotonic(ts);
@@ -235,6 +289,12 @@ static inline u64 pcan_getnow_ns(void)
 	return rtdm_clock_read();
 }
 
+/* CLOCK_MONOTONIC time (deadlines given by applications) */
+static inline u64 pcan_getmono_ns(void)
+{
+	return rtdm_clock_read_monotonic();
+}
+
 static inline void pcan_gettimeofday_ex(struct timeval *tv, u64 *ptv_ns)
 {
 	nanosecs_abs_t current_time = rtdm_clock_read();
@@ -281,6 +341,28 @@ static inline void pcan_gettimeofday(struct timeval *tv)
 	pcan_gettimeofday_ex(tv, NULL);
 }
 
+/* coarse host time: the time cached by the kernel at the last tick, which is
+ * read without accessing any clocksource. It might be late by up to
+ * PCAN_COARSE_TIME_SLACK_US. */
+#if defined(NO_RT) && !defined(USES_MONOTONIC_CLOCK)
+#define PCAN_COARSE_TIME_SLACK_US	jiffies_to_usecs(1)
+
+static inline void pcan_gettimeofday_coarse(struct timeval *tv)
+{
+	struct timespec ts = current_kernel_time();
+
+	tv->tv_usec = ts.tv_nsec / NSEC_PER_USEC;
+	tv->tv_sec = ts.tv_sec;
+}
+#else
+#define PCAN_COARSE_TIME_SLACK_US	0
+
+static inline void pcan_gettimeofday_coarse(struct timeval *tv)
+{
+	pcan_gettimeofday(tv);
+}
+#endif
+
 /* support for PARPORT_SUBSYSTEM */
 #if !defined(CONFIG_PARPORT_MODULE) && !defined(CONFIG_PARPORT) && defined(PARPORT_SUBSYSTEM)
 #undef PARPORT_SUBSYSTEM
@@ -430,6 +512,23 @@ typedef wait_queue_head_t	pcan_event_t;
 	err;								\
 })
 
+/* same as above with a (non null) timeout in ns */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+#define pcan_event_wait_timeout_ns(e, c, ns)				\
+({									\
+	int err = wait_event_interruptible_hrtimeout(e, c,		\
+						ns_to_ktime(ns));	\
+	(err == -ETIME) ? -ETIMEDOUT : err;				\
+})
+#else
+#define pcan_event_wait_timeout_ns(e, c, ns)				\
+({									\
+	int err = wait_event_interruptible_timeout(e, c,		\
+				nsecs_to_jiffies(ns) + 1);		\
+	(!err) ? -ETIMEDOUT : (err > 0) ? 0 : err;			\
+})
+#endif
+
 #define pcan_event_wait(e, c)	wait_event_interruptible(e, c)
 #else
 typedef rtdm_event_t		pcan_event_t;
@@ -454,6 +553,19 @@ typedef rtdm_event_t		pcan_event_t;
 	}								\
 	err;								\
 })
+#define pcan_event_wait_timeout_ns(e, c, ns)				\
+({									\
+	rtdm_toseq_t ts;						\
+	int err = 0;							\
+									\
+	rtdm_toseq_init(&ts, ns);					\
+	while (!(c)) {							\
+		err = rtdm_event_timedwait(&e, ns, &ts);		\
+		if (err < 0)						\
+			break;						\
+	}								\
+	err;								\
+})
 #define pcan_event_wait(e, c)	pcan_event_wait_timeout(e, c, 0)
 #endif
 
@@ -50,18 +50,20 @@
 
 int pcan_fifo_reset(FIFO_MANAGER *anchor)
 {
-	pcan_lock_irqsave_ctxt lck_ctx;
+	pcan_lock_irqsave_ctxt w_ctx, r_ctx;
 
-	pcan_lock_get_irqsave(&anchor->lock, lck_ctx);
+	pcan_lock_get_irqsave(&anchor->w.lock, w_ctx);
+	pcan_lock_get_irqsave(&anchor->r.lock, r_ctx);
 
-	anchor->dwTotal = 0;
-	anchor->nStored = 0;
-	anchor->r = anchor->w = anchor->bufferBegin;
+	anchor->w.dwTotal = 0;
+	anchor->w.head = anchor->r.tail = 0;
 
-	pcan_lock_put_irqrestore(&anchor->lock, lck_ctx);
+	pcan_lock_put_irqrestore(&anchor->r.lock, r_ctx);
+	pcan_lock_put_irqrestore(&anchor->w.lock, w_ctx);
 
-	DPRINTK(KERN_DEBUG "%s: %s() %d %p %p\n",
-		DEVICE_NAME, __func__, anchor->nStored, anchor->r, anchor->w);
+	DPRINTK(KERN_DEBUG "%s: %s() %d %u %u\n",
+		DEVICE_NAME, __func__, pcan_fifo_status(anchor),
+		anchor->r.tail, anchor->w.head);
 
 	return 0;
 }
@@ -69,113 +71,268 @@ int pcan_fifo_reset(FIFO_MANAGER *anchor)
 int pcan_fifo_init(FIFO_MANAGER *anchor, void *bufferBegin,
 		   void *bufferEnd, int nCount, u16 wCopySize)
 {
-	anchor->wStepSize = (bufferBegin == bufferEnd) ? 0 : \
-			    ((bufferEnd - bufferBegin) / (nCount - 1));
+	u32 nSlots;
 
 	/* check for fatal program errors */
-	if ((anchor->wStepSize < wCopySize) ||
-				(bufferBegin > bufferEnd) || (nCount <= 1))
+	if ((bufferBegin > bufferEnd) || (nCount <= 1))
+		return -EINVAL;
+
+	/* the buffer MUST be able to store pcan_fifo_slots(nCount) items */
+	nSlots = pcan_fifo_slots(nCount);
+
+	anchor->wStepSize = (bufferBegin == bufferEnd) ? 0 : \
+			    ((bufferEnd - bufferBegin) / (nSlots - 1));
+
+	if (anchor->wStepSize < wCopySize)
 		return -EINVAL;
 
 	anchor->wCopySize = wCopySize;
 	anchor->nCount = nCount;
+	anchor->nMask = nSlots - 1;
 
 	anchor->bufferBegin = bufferBegin;
 	anchor->bufferEnd = bufferEnd;
 
-	pcan_lock_init(&anchor->lock);
+	pcan_lock_init(&anchor->w.lock);
+	pcan_lock_init(&anchor->r.lock);
 
 	return pcan_fifo_reset(anchor);
 }
 
-int pcan_fifo_put(FIFO_MANAGER *anchor, void *pvPutData)
+/* Lockless versions: the caller MUST be the only producer (resp. consumer)
+ * of the fifo at that time. The producer publishes the items it wrote with
+ * a store-release of "head", and the consumer gives back the slots it read
+ * with a store-release of "tail". */
+int __pcan_fifo_put(FIFO_MANAGER *anchor, void *pvPutData)
 {
-	pcan_lock_irqsave_ctxt lck_ctx;
-	int err;
+	u32 head = anchor->w.head;
+	u32 stored = head - smp_load_acquire(&anchor->r.tail);
+
+#ifdef DEBUG
+	printk(KERN_DEBUG "%s: %s() %u %u %u\n",
+		DEVICE_NAME, __func__, stored, head - stored, head);
+#endif
+
+	if (stored >= anchor->nCount)
+		return -ENOSPC;
+
+	memcpy(pcan_fifo_slot(anchor, head), pvPutData, anchor->wCopySize);
+	anchor->w.dwTotal++;
+
+	smp_store_release(&anchor->w.head, head + 1);
+
+	return stored;
+}
+
+int __pcan_fifo_get(FIFO_MANAGER *anchor, void *pvGetData)
+{
+	u32 tail = anchor->r.tail;
 
 #ifdef DEBUG
-	printk(KERN_DEBUG "%s: %s() %d %p %p\n",
-		DEVICE_NAME, __func__, anchor->nStored, anchor->r, anchor->w);
+	printk(KERN_DEBUG "%s: %s() %d %u %u\n",
+		DEVICE_NAME, __func__, pcan_fifo_status(anchor),
+		tail, anchor->w.head);
 #endif
 
-	pcan_lock_get_irqsave(&anchor->lock, lck_ctx);
+	if (smp_load_acquire(&anchor->w.head) == tail)
+		return -ENODATA;
+
+	if (pvGetData)
+		memcpy(pvGetData, pcan_fifo_slot(anchor, tail),
+		       anchor->wCopySize);
 
-	if (anchor->nStored < anchor->nCount) {
-		memcpy(anchor->w, pvPutData, anchor->wCopySize);
+	smp_store_release(&anchor->r.tail, tail + 1);
 
-		err = anchor->nStored++;
-		anchor->dwTotal++;
+	return 0;
+}
 
-		if (anchor->w < anchor->bufferEnd)
-			anchor->w += anchor->wStepSize;
-		else
-			anchor->w = anchor->bufferBegin;
-	} else
-		err = -ENOSPC;
+/* Locked versions: several producers (ISR, timers, error handlers...) or
+ * several consumers (tasks sharing the same path) are serialized between
+ * themselves. A producer and a consumer never share a lock. */
+int pcan_fifo_put(FIFO_MANAGER *anchor, void *pvPutData)
+{
+	pcan_lock_irqsave_ctxt lck_ctx;
+	int err;
 
-	pcan_lock_put_irqrestore(&anchor->lock, lck_ctx);
+	pcan_lock_get_irqsave(&anchor->w.lock, lck_ctx);
+	err = __pcan_fifo_put(anchor, pvPutData);
+	pcan_lock_put_irqrestore(&anchor->w.lock, lck_ctx);
 
 	return err;
 }
 
 int pcan_fifo_get(FIFO_MANAGER *anchor, void *pvGetData)
 {
-	int err = 0;
 	pcan_lock_irqsave_ctxt lck_ctx;
+	int err;
+
+	/* don't bother taking the lock for nothing */
+	if (pcan_fifo_empty(anchor))
+		return -ENODATA;
+
+	pcan_lock_get_irqsave(&anchor->r.lock, lck_ctx);
+	err = __pcan_fifo_get(anchor, pvGetData);
+	pcan_lock_put_irqrestore(&anchor->r.lock, lck_ctx);
+
+	return err;
+}
+
+/* copy n items from/to the ring, starting at index idx, in at most two
+ * memcpy() calls (one before and one after the wrap) */
+static void pcan_fifo_copy_n(FIFO_MANAGER *anchor, u32 idx, void *pv, u32 n,
+			     int to_fifo)
+{
+	u32 i = idx & anchor->nMask;
+	u32 n1 = anchor->nMask + 1 - i;
+
+	/* items are not contiguous: copy them one by one */
+	if (anchor->wStepSize != anchor->wCopySize) {
+		for ( ; n; n--, idx++, pv += anchor->wCopySize)
+			if (to_fifo)
+				memcpy(pcan_fifo_slot(anchor, idx), pv,
+				       anchor->wCopySize);
+			else
+				memcpy(pv, pcan_fifo_slot(anchor, idx),
+				       anchor->wCopySize);
+		return;
+	}
+
+	if (n1 > n)
+		n1 = n;
+
+	if (to_fifo)
+		memcpy(pcan_fifo_slot(anchor, i), pv, n1 * anchor->wCopySize);
+	else
+		memcpy(pv, pcan_fifo_slot(anchor, i), n1 * anchor->wCopySize);
+
+	n -= n1;
+	if (!n)
+		return;
+
+	pv += n1 * anchor->wCopySize;
+	if (to_fifo)
+		memcpy(anchor->bufferBegin, pv, n * anchor->wCopySize);
+	else
+		memcpy(pv, anchor->bufferBegin, n * anchor->wCopySize);
+}
+
+/* put up to n items at once (lockless, see __pcan_fifo_put()).
+ * returns the count of items put, or -ENOSPC if the fifo was full */
+int __pcan_fifo_put_n(FIFO_MANAGER *anchor, void *pvPutData, int n)
+{
+	u32 head = anchor->w.head;
+	u32 room = anchor->nCount - (head - smp_load_acquire(&anchor->r.tail));
 
 #ifdef DEBUG
-	printk(KERN_DEBUG "%s: %s() %d %p %p\n",
-		DEVICE_NAME, __func__, anchor->nStored, anchor->r, anchor->w);
+	printk(KERN_DEBUG "%s: %s(%d) %u %u\n",
+		DEVICE_NAME, __func__, n, room, head);
 #endif
 
-	pcan_lock_get_irqsave(&anchor->lock, lck_ctx);
+	if (n <= 0)
+		return 0;
 
-	if (anchor->nStored > 0) {
-		if (pvGetData)
-			memcpy(pvGetData, anchor->r, anchor->wCopySize);
+	if (!room)
+		return -ENOSPC;
 
-		anchor->nStored--;
-		if (anchor->r < anchor->bufferEnd)
-			anchor->r += anchor->wStepSize;
-		else
-			anchor->r = anchor->bufferBegin;
-	} else
-		err = -ENODATA;
+	if (room > n)
+		room = n;
+
+	pcan_fifo_copy_n(anchor, head, pvPutData, room, 1);
+	anchor->w.dwTotal += room;
 
-	pcan_lock_put_irqrestore(&anchor->lock, lck_ctx);
+	smp_store_release(&anchor->w.head, head + room);
+
+	return room;
+}
+
+/* get up to n items at once (lockless, see __pcan_fifo_get()).
+ * returns the count of items got, or -ENODATA if the fifo was empty */
+int __pcan_fifo_get_n(FIFO_MANAGER *anchor, void *pvGetData, int n)
+{
+	u32 tail = anchor->r.tail;
+	u32 stored = smp_load_acquire(&anchor->w.head) - tail;
+
+#ifdef DEBUG
+	printk(KERN_DEBUG "%s: %s(%d) %u %u\n",
+		DEVICE_NAME, __func__, n, stored, tail);
+#endif
+
+	if (n <= 0)
+		return 0;
+
+	if (!stored)
+		return -ENODATA;
+
+	if (stored > n)
+		stored = n;
+
+	pcan_fifo_copy_n(anchor, tail, pvGetData, stored, 0);
+
+	smp_store_release(&anchor->r.tail, tail + stored);
+
+	return stored;
+}
+
+int pcan_fifo_put_n(FIFO_MANAGER *anchor, void *pvPutData, int n)
+{
+	pcan_lock_irqsave_ctxt lck_ctx;
+	int err;
+
+	if (n <= 0)
+		return 0;
+
+	pcan_lock_get_irqsave(&anchor->w.lock, lck_ctx);
+	err = __pcan_fifo_put_n(anchor, pvPutData, n);
+	pcan_lock_put_irqrestore(&anchor->w.lock, lck_ctx);
 
 	return err;
 }
 
+int pcan_fifo_get_n(FIFO_MANAGER *anchor, void *pvGetData, int n)
+{
+	pcan_lock_irqsave_ctxt lck_ctx;
+	int err;
+
+	if (n <= 0)
+		return 0;
+
+	/* don't bother taking the lock for nothing */
+	if (pcan_fifo_empty(anchor))
+		return -ENODATA;
+
+	pcan_lock_get_irqsave(&anchor->r.lock, lck_ctx);
+	err = __pcan_fifo_get_n(anchor, pvGetData, n);
+	pcan_lock_put_irqrestore(&anchor->r.lock, lck_ctx);
+
+	return err;
+}
+
+/* Note: walking the items back from the head modifies the content of the
+ * items that a consumer might be reading: both sides are locked here. */
 int pcan_fifo_foreach_back(FIFO_MANAGER *anchor,
 			int (*pf)(void *item, void *arg), void *arg)
 {
 	u32 i;
-	void *p;
 	int err = 0;
-	pcan_lock_irqsave_ctxt lck_ctx;
+	pcan_lock_irqsave_ctxt w_ctx, r_ctx;
 
 #ifdef DEBUG
-	printk(KERN_DEBUG "%s: %s() %d %p %p\n",
-		DEVICE_NAME, __func__, anchor->nStored, anchor->r, anchor->w);
+	printk(KERN_DEBUG "%s: %s() %d %u %u\n",
+		DEVICE_NAME, __func__, pcan_fifo_status(anchor),
+		anchor->r.tail, anchor->w.head);
 #endif
 
-	pcan_lock_get_irqsave(&anchor->lock, lck_ctx);
-
-	p = anchor->w;
-	for (i = 0; i < anchor->nStored; i++) {
-
-		if (p == anchor->bufferBegin)
-			p = anchor->bufferEnd;
-		else
-			p -= anchor->wStepSize;
+	pcan_lock_get_irqsave(&anchor->w.lock, w_ctx);
+	pcan_lock_get_irqsave(&anchor->r.lock, r_ctx);
 
-		err = pf(p, arg);
+	for (i = anchor->w.head; i != anchor->r.tail; i--) {
+		err = pf(pcan_fifo_slot(anchor, i - 1), arg);
 		if (err)
 			break;
 	}
 
-	pcan_lock_put_irqrestore(&anchor->lock, lck_ctx);
+	pcan_lock_put_irqrestore(&anchor->r.lock, r_ctx);
+	pcan_lock_put_irqrestore(&anchor->w.lock, w_ctx);
 
 	return err;
 }
@@ -184,51 +341,31 @@ int pcan_fifo_peek(FIFO_MANAGER *anchor, void *pvGetData)
 {
 	int err = 0;
 	pcan_lock_irqsave_ctxt lck_ctx;
+	u32 tail;
 
 #ifdef DEBUG
-	printk(KERN_DEBUG "%s: %s()) %d %p %p\n",
-		DEVICE_NAME, __func__, anchor->nStored, anchor->r, anchor->w);
+	printk(KERN_DEBUG "%s: %s()) %d %u %u\n",
+		DEVICE_NAME, __func__, pcan_fifo_status(anchor),
+		anchor->r.tail, anchor->w.head);
 #endif
 
-	pcan_lock_get_irqsave(&anchor->lock, lck_ctx);
+	pcan_lock_get_irqsave(&anchor->r.lock, lck_ctx);
 
-	if (anchor->nStored > 0)
-		memcpy(pvGetData, anchor->r, anchor->wCopySize);
+	tail = anchor->r.tail;
+
+	if (smp_load_acquire(&anchor->w.head) != tail)
+		memcpy(pvGetData, pcan_fifo_slot(anchor, tail),
+		       anchor->wCopySize);
 	else
 		err = -ENODATA;
 
-	pcan_lock_put_irqrestore(&anchor->lock, lck_ctx);
+	pcan_lock_put_irqrestore(&anchor->r.lock, lck_ctx);
 
 	return err;
 }
 
 u32 pcan_fifo_ratio(FIFO_MANAGER *anchor)
 {
-	return anchor->nCount ? (anchor->nStored * 10000) / anchor->nCount : 0;
+	return anchor->nCount ?
+		(pcan_fifo_status(anchor) * 10000) / anchor->nCount : 0;
 }
-
-#if 0
-int pcan_fifo_not_full(FIFO_MANAGER *anchor)
-{
-#ifdef PCAN_FIX_NOT_FULL_TEST_LOCK_USAGE
-	int r;
-	pcan_lock_irqsave_ctxt lck_ctx;
-
-	pcan_lock_get_irqsave(&anchor->lock, lck_ctx);
-
-	r = (anchor->nStored < anchor->nCount);
-
-	pcan_lock_put_irqrestore(&anchor->lock, lck_ctx);
-
-	return r;
-#else
-	return (anchor->nStored < (anchor->nCount - 1));
-#endif
-}
-
-/* returns true if fifo is empty */
-int pcan_fifo_empty(FIFO_MANAGER *anchor)
-{
-	return !anchor->nStored;
-}
-#endif
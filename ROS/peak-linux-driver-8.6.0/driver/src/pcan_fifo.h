@@ -39,40 +39,88 @@
 
 #include "src/pcan_common.h"
 
+#include <linux/cache.h>
+#include <linux/log2.h>
+
+/* The fifo is a single-producer/single-consumer ring: the producer only
+ * writes "head", the consumer only writes "tail". Both are free running
+ * 32-bit indexes, so that the count of stored items is always (head - tail)
+ * and the slot of an index is given by masking it with (slots - 1).
+ *
+ * Each side owns its own cache line. The __pcan_fifo_put/get() functions
+ * are lockless and only rely on acquire/release accesses to the indexes:
+ * they can be used by a producer (resp. consumer) that is known to be the
+ * only one. The pcan_fifo_put/get() functions take the lock of their side
+ * to serialize several producers (ISR, timers, error handlers...) or
+ * several consumers (tasks sharing the same path) between themselves: a
+ * producer and a consumer never share a lock.
+ */
 typedef struct {
 	u16	wStepSize;	/* size of bytes to step to next entry */
 	u16	wCopySize;	/* size of bytes to copy */
 	void *	bufferBegin;	/* points to first element */
 	void *	bufferEnd;	/* points to the last element */
 	u32	nCount;		/* max count of elements in fifo */
-	u32	nStored;	/* count of currently rcvd stored msgs */
-	u32	dwTotal;	/* received messages */
-	void *	r;		/* next Msg to read from the read buffer */
-	void *	w;		/* next Msg to write into read buffer */
-	pcan_lock_t lock;	/* mutual exclusion lock (if not NULL) */
+	u32	nMask;		/* count of slots - 1 (slots is a power of 2) */
+
+	struct {
+		u32	head;	/* next Msg to write into read buffer */
+		u32	dwTotal;	/* received messages */
+		pcan_lock_t lock;	/* mutual exclusion between producers */
+	} ____cacheline_aligned_in_smp w;
+
+	struct {
+		u32	tail;	/* next Msg to read from the read buffer */
+		pcan_lock_t lock;	/* mutual exclusion between consumers */
+	} ____cacheline_aligned_in_smp r;
 } FIFO_MANAGER;
 
+/* read an index owned by the other side of the fifo */
+#define pcan_fifo_idx(i)	(*(volatile u32 *)&(i))
+
+/* return the count of slots to allocate to store nCount elements */
+static inline u32 pcan_fifo_slots(u32 nCount)
+{
+	return roundup_pow_of_two(nCount);
+}
+
+static inline void *pcan_fifo_slot(FIFO_MANAGER *anchor, u32 idx)
+{
+	return anchor->bufferBegin + (idx & anchor->nMask) * anchor->wStepSize;
+}
+
+static inline int pcan_fifo_status(FIFO_MANAGER *anchor)
+{
+	return pcan_fifo_idx(anchor->w.head) - pcan_fifo_idx(anchor->r.tail);
+}
+
 static inline int pcan_fifo_empty(FIFO_MANAGER *anchor)
 {
-	return !anchor->nStored;
+	return !pcan_fifo_status(anchor);
 }
 
 static inline int pcan_fifo_full(FIFO_MANAGER *anchor)
 {
-	return anchor->nStored >= anchor->nCount;
+	return pcan_fifo_status(anchor) >= anchor->nCount;
 }
 
-static inline int pcan_fifo_status(FIFO_MANAGER *anchor)
+static inline u32 pcan_fifo_total(FIFO_MANAGER *anchor)
 {
-	return anchor->nStored;
+	return anchor->w.dwTotal;
 }
 
 int pcan_fifo_reset(FIFO_MANAGER *anchor);
 int pcan_fifo_init(FIFO_MANAGER *anchor, void *bufferBegin,
 		void *bufferEnd, int nCount, u16 wCopySize);
+int __pcan_fifo_put(FIFO_MANAGER *anchor, void *pvPutData);
+int __pcan_fifo_get(FIFO_MANAGER *anchor, void *pvGetData);
+int __pcan_fifo_put_n(FIFO_MANAGER *anchor, void *pvPutData, int n);
+int __pcan_fifo_get_n(FIFO_MANAGER *anchor, void *pvGetData, int n);
 int pcan_fifo_put(FIFO_MANAGER *anchor, void *pvPutData);
 int pcan_fifo_get(FIFO_MANAGER *anchor, void *pvPutData);
 int pcan_fifo_peek(FIFO_MANAGER *anchor, void *pvGetData);
+int pcan_fifo_put_n(FIFO_MANAGER *anchor, void *pvPutData, int n);
+int pcan_fifo_get_n(FIFO_MANAGER *anchor, void *pvGetData, int n);
 
 int pcan_fifo_foreach_back(FIFO_MANAGER *anchor,
 		int (*pf)(void *item, void *arg), void *arg);
@@ -39,9 +39,23 @@
 #include <linux/list.h>
 #include <linux/errno.h>
 #include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/sort.h>
+#include <linux/log2.h>
+#include <linux/jhash.h>
+#ifdef NO_RT
+#include <linux/rcupdate.h>
+#endif
+
+#define PCAN_MAX_FILTER_PER_CHAIN	512
 
+/* 11-bit IDs are filtered with a bitmap */
+#define PCAN_FILTER_STD_IDS		2048
 
-#define PCAN_MAX_FILTER_PER_CHAIN	8
+/* kinds of msgs a filter might accept: EXT and RTR bits of the msg flags */
+#define PCAN_FILTER_KIND_RTR		0x01
+#define PCAN_FILTER_KIND_EXT		0x02
+#define PCAN_FILTER_KINDS		4
 
 struct filter_element {
 	struct list_head list;
@@ -49,14 +63,67 @@ struct filter_element {
 	u32 ToID;		/* all msgs higher than ToID are rejected */
 	u32 flags;		/* STANDARD flags excludes EXTENDED flag while
 				   RTR flags excludes all-non RTR msgs */
+				/* PCANFD_FILTER_MASK: FromID is the code and
+				   ToID the mask */
+};
+
+struct filter_range {
+	u32 from;
+	u32 to;
+};
+
+/* (mask, code) pair of a PCANFD_FILTER_MASK or PCANFD_FILTER_ID filter */
+struct filter_code {
+	u32 mask;
+	u32 code;
+	u32 kind;		/* kind of msgs + 1 (0 if the slot is free) */
+};
+
+/* compiled representation of the filters list, used by the Rx path:
+ * for each kind of msg,
+ * - an array of sorted and merged [from..to] ranges,
+ * - the distinct masks of the mask/code filters, whose (mask, code) pairs
+ *   are stored in a hash set,
+ * as well as a bitmap of the accepted IDs for 11-bit IDs msgs.
+ * Checking an 11-bit ID costs one bit test, while checking any other ID costs
+ * a binary search in the ranges, plus one hash probe per distinct mask: exact
+ * ID filters all share the same mask, while mask/code filters only cost as
+ * many probes as they use different masks. */
+struct filter_table {
+	unsigned long std_ids[2][BITS_TO_LONGS(PCAN_FILTER_STD_IDS)];
+
+	int first[PCAN_FILTER_KINDS];
+	int count[PCAN_FILTER_KINDS];
+	struct filter_range *ranges;
+
+	int masks_first[PCAN_FILTER_KINDS];
+	int masks_count[PCAN_FILTER_KINDS];
+	u32 *masks;
+
+	u32 codes_mask;		/* count of slots - 1 */
+	struct filter_code *codes;
 };
 
 struct filter_chain {
 	struct list_head anchor;
 	int count;		/* counts the number of filters in this chain */
-	pcan_lock_t lock;	/* mutex lock for this filter chain */
+	pcan_mutex_t mutex;	/* serializes the changes of this chain */
+	pcan_lock_t lock;	/* protects "table" from the Rx path (RT) */
+	struct filter_table *table;	/* NULL if all msgs are accepted */
 };
 
+#ifdef NO_RT
+/* the Rx path reads the compiled filters without any lock */
+#define pcan_filter_read_lock(c, f)	rcu_read_lock()
+#define pcan_filter_read_unlock(c, f)	rcu_read_unlock()
+#define pcan_filter_table(c)		rcu_dereference((c)->table)
+#else
+/* the RT Rx path can't run RCU read-side critical sections */
+#define pcan_filter_read_lock(c, f)	pcan_lock_get_irqsave(&(c)->lock, f)
+#define pcan_filter_read_unlock(c, f)	pcan_lock_put_irqrestore(&(c)->lock, f)
+#define pcan_filter_table(c)		((c)->table)
+#endif
+
 /* create the base for a list of filters - returns a handle */
 void *pcan_create_filter_chain(void)
 {
@@ -76,21 +143,280 @@ void *pcan_create_filter_chain(void)
 
 		/* initial no blocking of messages to provide compatibilty */
 		chain->count = -1;
+		chain->table = NULL;
+		pcan_mutex_init(&chain->mutex);
 		pcan_lock_init(&chain->lock);
 	}
 
 	return (void *)chain;
 }
 
+/* return != 0 if a filter with flags "_flags" is able to accept the msgs of
+ * kind "k"
+ *
+ * truth table for throw
+ *
+ *             RTR_FILTER | /RTR_FILTER
+ *            ------------|------------
+ *  EXT_FILTER|  1  |  0  |  0  |  0  |/EXT_IN
+ *            |-----------|--------------
+ *            |  1  |  0  |  0  |  0  |
+ *         ---------------------------| EXT_IN
+ *            |  1  |  1  |  1  |  1  |
+ *            |-----------|--------------
+ * /EXT_FILTER|  1  |  0  |  0  |  0  |/EXT_IN
+ *            |-----|-----------|------
+ *           /RTR_IN|  RTR_IN   |/RTR_IN
+ */
+static int pcan_filter_accepts_kind(u32 _flags, int k)
+{
+	if ((_flags & PCANFD_MSG_RTR) && !(k & PCAN_FILTER_KIND_RTR))
+		return 0;
+
+	if (!(_flags & PCANFD_MSG_EXT) && (k & PCAN_FILTER_KIND_EXT))
+		return 0;
+
+	return 1;
+}
+
+static int pcan_filter_kind(u32 msg_flags)
+{
+	return ((msg_flags & PCANFD_MSG_RTR) ? PCAN_FILTER_KIND_RTR : 0) |
+		((msg_flags & PCANFD_MSG_EXT) ? PCAN_FILTER_KIND_EXT : 0);
+}
+
+static int pcan_filter_cmp_range(const void *a, const void *b)
+{
+	const struct filter_range *ra = a, *rb = b;
+
+	if (ra->from < rb->from)
+		return -1;
+
+	return (ra->from > rb->from);
+}
+
+static u32 pcan_filter_hash(u32 mask, u32 code, int k)
+{
+	return jhash_3words(mask, code, k, 0);
+}
+
+/* add a (mask, code) pair to the hash set of the table */
+static void pcan_filter_add_code(struct filter_table *t, int k,
+				 u32 mask, u32 code)
+{
+	u32 *masks = t->masks + t->masks_first[k];
+	struct filter_code *c;
+	u32 h;
+	int i;
+
+	for (h = pcan_filter_hash(mask, code, k) & t->codes_mask; ;
+	     h = (h + 1) & t->codes_mask) {
+		c = t->codes + h;
+		if (!c->kind)
+			break;
+
+		/* already in the set */
+		if (c->kind == k + 1 && c->mask == mask && c->code == code)
+			return;
+	}
+
+	c->mask = mask;
+	c->code = code;
+	c->kind = k + 1;
+
+	for (i = 0; i < t->masks_count[k]; i++)
+		if (masks[i] == mask)
+			return;
+
+	masks[t->masks_count[k]++] = mask;
+}
+
+/* set the bits of the 11-bit IDs that match a (mask, code) pair */
+static void pcan_filter_set_std_ids(struct filter_table *t, int k,
+				    u32 mask, u32 code)
+{
+	u32 id;
+
+	if (mask == 0xffffffff) {
+		if (code < PCAN_FILTER_STD_IDS)
+			__set_bit(code, t->std_ids[k]);
+		return;
+	}
+
+	for (id = 0; id < PCAN_FILTER_STD_IDS; id++)
+		if ((id & mask) == code)
+			__set_bit(id, t->std_ids[k]);
+}
+
+/* build the compiled representation of the filters list of a chain
+ * (*pt is set to NULL if all the msgs are accepted) */
+static int pcan_compile_filters(struct filter_chain *chain,
+				struct filter_table **pt)
+{
+	struct filter_element *pfilter;
+	struct filter_range *r;
+	struct filter_table *t;
+	int k, i, m, n, codes = 0, slots = 0;
+	u32 mask, code;
+
+	/* pass always when no filter reset has been done before */
+	if (chain->count <= 0) {
+		*pt = NULL;
+		return 0;
+	}
+
+	/* each mask/code filter might give one pair per kind of msg */
+	list_for_each_entry(pfilter, &chain->anchor, list)
+		if (pfilter->flags & PCANFD_FILTER_KIND)
+			codes += PCAN_FILTER_KINDS;
+
+	/* keep the hash set half empty */
+	if (codes)
+		slots = roundup_pow_of_two(2 * codes);
+
+	n = PCAN_FILTER_KINDS * chain->count;
+	t = pcan_malloc(sizeof(*t) + n * sizeof(*t->ranges) +
+			codes * sizeof(*t->masks) +
+			slots * sizeof(*t->codes), GFP_KERNEL);
+	if (!t) {
+		pr_err(DEVICE_NAME ": %s(): failed to alloc filter table\n",
+			__func__);
+		return -ENOMEM;
+	}
+
+	memset(t, '\0', sizeof(*t));
+
+	t->ranges = (struct filter_range *)(t + 1);
+	t->masks = (u32 *)(t->ranges + n);
+	t->codes = (struct filter_code *)(t->masks + codes);
+	t->codes_mask = slots - 1;
+	memset(t->codes, '\0', slots * sizeof(*t->codes));
+
+	for (r = t->ranges, k = 0; k < PCAN_FILTER_KINDS; k++) {
+
+		t->masks_first[k] = k ? t->masks_first[k-1] +
+						t->masks_count[k-1] : 0;
+		n = 0;
+		list_for_each_entry(pfilter, &chain->anchor, list) {
+
+			if (!pcan_filter_accepts_kind(pfilter->flags, k))
+				continue;
+
+			switch (pfilter->flags & PCANFD_FILTER_KIND) {
+			case PCANFD_FILTER_ID:
+				mask = 0xffffffff;
+				code = pfilter->FromID;
+				break;
+
+			case PCANFD_FILTER_MASK:
+				mask = pfilter->ToID;
+				code = pfilter->FromID;
+				break;
+
+			default:
+				if (pfilter->FromID <= pfilter->ToID) {
+					r[n].from = pfilter->FromID;
+					r[n].to = pfilter->ToID;
+					n++;
+				}
+				continue;
+			}
+
+			/* such a filter never matches */
+			if (code & ~mask)
+				continue;
+
+			/* 11-bit IDs: directly set the matching IDs */
+			if (!(k & PCAN_FILTER_KIND_EXT))
+				pcan_filter_set_std_ids(t, k, mask, code);
+
+			/* null mask: all the IDs match */
+			if (!mask) {
+				r[n].from = 0;
+				r[n].to = 0xffffffff;
+				n++;
+				continue;
+			}
+
+			pcan_filter_add_code(t, k, mask, code);
+		}
+
+		/* sort the ranges, then merge those that overlap */
+		sort(r, n, sizeof(*r), pcan_filter_cmp_range, NULL);
+
+		for (m = 0, i = 1; i < n; i++) {
+			if (r[i].from <= r[m].to || r[i].from - 1 == r[m].to) {
+				if (r[i].to > r[m].to)
+					r[m].to = r[i].to;
+			} else {
+				r[++m] = r[i];
+			}
+		}
+
+		t->first[k] = r - t->ranges;
+		t->count[k] = n ? m + 1 : 0;
+
+		/* fill the bitmap of the 11-bit IDs */
+		if (!(k & PCAN_FILTER_KIND_EXT))
+			for (i = 0; i < t->count[k]; i++) {
+				u32 id;
+
+				for (id = r[i].from;
+				     id <= r[i].to && id < PCAN_FILTER_STD_IDS;
+				     id++)
+					__set_bit(id, t->std_ids[k]);
+			}
+
+		r += t->count[k];
+	}
+
+	*pt = t;
+	return 0;
+}
+
+/* replace the compiled filters of a chain with the ones of its list */
+static int pcan_update_filter_table(struct filter_chain *chain)
+{
+	struct filter_table *old, *new;
+	int err;
+
+	err = pcan_compile_filters(chain, &new);
+	if (err)
+		return err;
+
+#ifdef NO_RT
+	old = chain->table;
+	rcu_assign_pointer(chain->table, new);
+
+	/* wait for the Rx path to not use the old table anymore */
+	if (old)
+		synchronize_rcu();
+#else
+	{
+		pcan_lock_irqsave_ctxt lck_ctx;
+
+		pcan_lock_get_irqsave(&chain->lock, lck_ctx);
+		old = chain->table;
+		chain->table = new;
+		pcan_lock_put_irqrestore(&chain->lock, lck_ctx);
+	}
+#endif
+	pcan_free(old);
+
+	return 0;
+}
+
 static int __pcan_add_filter(struct filter_chain *chain,
 				u32 FromID, u32 ToID, u32 _flags)
 {
-	struct list_head *ptr, *tmp;
 	struct filter_element *pfilter;
 
+	/* id_to is not used by ID filters */
+	if ((_flags & PCANFD_FILTER_KIND) == PCANFD_FILTER_ID)
+		ToID = FromID;
+
 	/* test for doubly set entries */
-	list_for_each_safe(ptr, tmp, &chain->anchor) {
-		pfilter = list_entry(ptr, struct filter_element, list);
+	list_for_each_entry(pfilter, &chain->anchor, list) {
 		if ((pfilter->FromID == FromID) &&
 		    (pfilter->ToID == ToID) &&
 		    (pfilter->flags == _flags))
@@ -126,12 +452,56 @@ static int __pcan_add_filter(struct filter_chain *chain,
 	return 0;
 }
 
+/* remove the last filters added to the chain to restore its previous count */
+static void __pcan_del_last_filters(struct filter_chain *chain, int count)
+{
+	struct filter_element *pfilter;
+
+	while (chain->count > 0 && chain->count > count) {
+		pfilter = list_entry(chain->anchor.prev,
+				     struct filter_element, list);
+		list_del(&pfilter->list);
+		pcan_free(pfilter);
+		chain->count--;
+	}
+
+	/* might be back to compatibility mode */
+	chain->count = count;
+}
+
+/* add filters to the chain then update its compiled representation. If any
+ * error occurs, the chain is left unchanged */
+static int __pcan_add_filters(struct filter_chain *chain,
+			      struct pcanfd_msg_filter *pf, int count)
+{
+	int i, err = 0, prev_count = chain->count;
+
+	for (i = 0; i < count; i++, pf++) {
+		err = __pcan_add_filter(chain,
+					pf->id_from, pf->id_to, pf->msg_flags);
+		if (err)
+			break;
+	}
+
+	if (!err && chain->count != prev_count)
+		err = pcan_update_filter_table(chain);
+
+	if (err)
+		__pcan_del_last_filters(chain, prev_count);
+
+	return err;
+}
+
 /* add a filter element to the filter chain pointed by handle
  * return 0 if it is OK, else return error */
 int pcan_add_filter(void *handle, u32 FromID, u32 ToID, u32 _flags)
 {
 	struct filter_chain *chain = (struct filter_chain *)handle;
-	pcan_lock_irqsave_ctxt lck_ctx;
+	struct pcanfd_msg_filter mf = {
+		.id_from = FromID,
+		.id_to = ToID,
+		.msg_flags = _flags,
+	};
 	int err;
 
 	DPRINTK(KERN_DEBUG "%s: %s(0x%p, 0x%08x, 0x%08x, 0x%08x)\n",
@@ -142,11 +512,11 @@ int pcan_add_filter(void *handle, u32 FromID, u32 ToID, u32 _flags)
 		return 0;
 
 	/* add this entry to chain */
-	pcan_lock_get_irqsave(&chain->lock, lck_ctx);
+	pcan_mutex_lock(&chain->mutex);
 
-	err = __pcan_add_filter(chain, FromID, ToID, _flags);
+	err = __pcan_add_filters(chain, &mf, 1);
 
-	pcan_lock_put_irqrestore(&chain->lock, lck_ctx);
+	pcan_mutex_unlock(&chain->mutex);
 
 	return err;
 }
@@ -155,42 +525,84 @@ int pcan_add_filter(void *handle, u32 FromID, u32 ToID, u32 _flags)
 void pcan_delete_filter_all(void *handle)
 {
 	struct filter_chain *chain = (struct filter_chain *)handle;
-	struct filter_element *pfilter;
-	struct list_head *ptr, *tmp;
-	pcan_lock_irqsave_ctxt lck_ctx;
+	struct filter_element *pfilter, *tmp;
 
 	DPRINTK(KERN_DEBUG "%s: %s(0x%p)\n", DEVICE_NAME, __func__, handle);
 
 	if (!chain)
 		return;
 
-	pcan_lock_get_irqsave(&chain->lock, lck_ctx);
-	list_for_each_safe(ptr, tmp, &chain->anchor) {
-		pfilter = list_entry(ptr, struct filter_element, list);
-		list_del(ptr);
+	pcan_mutex_lock(&chain->mutex);
+
+	list_for_each_entry_safe(pfilter, tmp, &chain->anchor, list) {
+		list_del(&pfilter->list);
 		pcan_free(pfilter);
 	}
 
 	chain->count = 0;
 
-	pcan_lock_put_irqrestore(&chain->lock, lck_ctx);
+	/* can't fail since all msgs are now accepted */
+	pcan_update_filter_table(chain);
+
+	pcan_mutex_unlock(&chain->mutex);
 }
 
-#define RTR_FILTER	(pfilter->flags & PCANFD_MSG_RTR)
-#define EXT_FILTER	(pfilter->flags & PCANFD_MSG_EXT)
-#define RTR_IN		(rtr_message)
-#define EXT_IN		(ext_message)
+/* return != 0 if id is in one of the n sorted ranges r[] */
+static int pcan_filter_find_range(const struct filter_range *r, int n, u32 id)
+{
+	int lo = 0, hi = n;
+
+	/* look for the 1st range that starts after id */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (r[mid].from <= id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo > 0 && id <= r[lo-1].to;
+}
+
+/* return != 0 if id matches one of the mask/code filters of kind k. This is
+ * O(count of distinct masks of kind k), not O(1), whatever the count of codes
+ * per mask. */
+static int pcan_filter_find_code(const struct filter_table *t, int k, u32 id)
+{
+	const u32 *masks = t->masks + t->masks_first[k];
+	const struct filter_code *c;
+	u32 h, code;
+	int i;
+
+	for (i = 0; i < t->masks_count[k]; i++) {
+		code = id & masks[i];
+
+		for (h = pcan_filter_hash(masks[i], code, k) & t->codes_mask; ;
+		     h = (h + 1) & t->codes_mask) {
+			c = t->codes + h;
+			if (!c->kind)
+				break;
+
+			if (c->kind == k + 1 && c->mask == masks[i] &&
+			    c->code == code)
+				return 1;
+		}
+	}
+
+	return 0;
+}
 
 /* do the filtering with all filter elements pointed by handle
  * returns 0 when the message should be passed */
 int pcan_do_filter(void *handle, struct pcanfd_rxmsg *pe)
 {
 	struct filter_chain *chain = (struct filter_chain *)handle;
-	struct filter_element *pfilter;
-	struct list_head *ptr, *tmp;
-	u32 rtr_message, ext_message;
+	const struct filter_table *t;
+#ifndef NO_RT
 	pcan_lock_irqsave_ctxt lck_ctx;
-	int throw;
+#endif
+	int k, throw = 0;
 
 #if 0
 	DPRINTK(KERN_DEBUG "%s: %s(0x%p, 0x%08x)\n",
@@ -217,49 +629,25 @@ int pcan_do_filter(void *handle, struct pcanfd_rxmsg *pe)
 		return 1;
 	}
 
-	pcan_lock_get_irqsave(&chain->lock, lck_ctx);
-
-	/* pass always when no filter reset has been done before */
-	if (chain->count <= 0)
-		goto lbl_accept;
-
-	rtr_message = pe->msg.flags & PCANFD_MSG_RTR;
-	ext_message = pe->msg.flags & PCANFD_MSG_EXT;
-
-	list_for_each_safe(ptr, tmp, &chain->anchor) {
-		pfilter = list_entry(ptr, struct filter_element, list);
-
-		/* truth table for throw
-		 *
-		 *             RTR_FILTER | /RTR_FILTER
-		 *            ------------|------------
-		 *  EXT_FILTER|  1  |  0  |  0  |  0  |/EXT_IN
-		 *            |-----------|--------------
-		 *            |  1  |  0  |  0  |  0  |
-		 *         ---------------------------| EXT_IN
-		 *            |  1  |  1  |  1  |  1  |
-		 *            |-----------|--------------
-		 * /EXT_FILTER|  1  |  0  |  0  |  0  |/EXT_IN
-		 *            |-----|-----------|------
-		 *           /RTR_IN|  RTR_IN   |/RTR_IN
-		 */
-		throw = ((RTR_FILTER && !RTR_IN) ||
-					(!EXT_FILTER && EXT_IN));
-
-		if ((!throw) && (pe->msg.id >= pfilter->FromID) &&
-				(pe->msg.id <= pfilter->ToID))
-			goto lbl_accept;
-	}
+	pcan_filter_read_lock(chain, lck_ctx);
 
-	pcan_lock_put_irqrestore(&chain->lock, lck_ctx);
+	t = pcan_filter_table(chain);
+	if (t) {
+		k = pcan_filter_kind(pe->msg.flags);
 
-	/* no pass criteria was found */
-	return 1;
+		if (!(k & PCAN_FILTER_KIND_EXT) &&
+		    pe->msg.id < PCAN_FILTER_STD_IDS)
+			throw = !test_bit(pe->msg.id, t->std_ids[k]);
+		else
+			throw = !pcan_filter_find_range(t->ranges + t->first[k],
+						       t->count[k],
+						       pe->msg.id) &&
+				!pcan_filter_find_code(t, k, pe->msg.id);
+	}
 
-lbl_accept:
-	pcan_lock_put_irqrestore(&chain->lock, lck_ctx);
+	pcan_filter_read_unlock(chain, lck_ctx);
 
-	return 0;
+	return throw;
 }
 
 /* remove the whole filter chain (and potential filter elements) pointed by
@@ -269,7 +657,10 @@ void *pcan_delete_filter_chain(void *handle)
 	DPRINTK(KERN_DEBUG "%s: %s(0x%p)\n", DEVICE_NAME, __func__, handle);
 
 	if (handle) {
+		struct filter_chain *chain = (struct filter_chain *)handle;
+
 		pcan_delete_filter_all(handle);
+		pcan_mutex_destroy(&chain->mutex);
 		pcan_free(handle);
 	}
 
@@ -280,28 +671,26 @@ void *pcan_delete_filter_chain(void *handle)
 int pcan_get_filters_count(void *handle)
 {
 	struct filter_chain *chain = (struct filter_chain *)handle;
+
+	if (!chain)
+		return 0;
+
 	return (chain->count < 0) ? 0 : chain->count;
 }
 
 int pcan_add_filters(void *handle, struct pcanfd_msg_filter *pf, int count)
 {
 	struct filter_chain *chain = (struct filter_chain *)handle;
-	pcan_lock_irqsave_ctxt lck_ctx;
-	int i, err;
+	int err;
 
 	if (!chain)
 		return 0;
 
-	pcan_lock_get_irqsave(&chain->lock, lck_ctx);
+	pcan_mutex_lock(&chain->mutex);
 
-	for (i = err = 0; i < count; i++, pf++) {
-		int err = __pcan_add_filter(chain,
-					pf->id_from, pf->id_to, pf->msg_flags);
-		if (err)
-			break;
-	}
+	err = __pcan_add_filters(chain, pf, count);
 
-	pcan_lock_put_irqrestore(&chain->lock, lck_ctx);
+	pcan_mutex_unlock(&chain->mutex);
 
 	return err;
 }
@@ -310,17 +699,14 @@ int pcan_get_filters(void *handle, struct pcanfd_msg_filter *pf, int count)
 {
 	struct filter_chain *chain = (struct filter_chain *)handle;
 	struct filter_element *pfilter;
-	struct list_head *ptr, *tmp;
-	pcan_lock_irqsave_ctxt lck_ctx;
 	int i = 0;
 
 	if (!chain)
 		return 0;
 
-	pcan_lock_get_irqsave(&chain->lock, lck_ctx);
+	pcan_mutex_lock(&chain->mutex);
 
-	list_for_each_safe(ptr, tmp, &chain->anchor) {
-		pfilter = list_entry(ptr, struct filter_element, list);
+	list_for_each_entry(pfilter, &chain->anchor, list) {
 
 		if (pf) {
 			pf->id_from = pfilter->FromID;
@@ -333,7 +719,7 @@ int pcan_get_filters(void *handle, struct pcanfd_msg_filter *pf, int count)
 			break;
 	}
 
-	pcan_lock_put_irqrestore(&chain->lock, lck_ctx);
+	pcan_mutex_unlock(&chain->mutex);
 
 	return i;
 }
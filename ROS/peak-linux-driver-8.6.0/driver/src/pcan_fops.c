@@ -59,6 +59,8 @@
 #include <asm/uaccess.h>    // copy_...
 #include <linux/delay.h>    // mdelay()
 #include <linux/poll.h>     // poll() and select()
+#include <linux/bitops.h>   // test_and_set_bit()
+#include <linux/vmalloc.h>  // vmalloc_user()
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,13)
 #include <linux/moduleparam.h>
@@ -74,6 +76,7 @@
 #include "src/pcan_parse.h"
 #include "src/pcan_usb.h"
 #include "src/pcan_filter.h"
+#include "src/pcan_bpf.h"
 
 #include "src/pcanfd_core.h"
 
@@ -114,6 +117,7 @@ extern char *assign;
 
 ushort rxqsize = READ_MESSAGE_COUNT;
 ushort txqsize = WRITE_MESSAGE_COUNT;
+ushort pathfilters = 0;
 
 module_param_array(type, charp, NULL, 0444);
 module_param_array(io, ushort, NULL, 0444);
@@ -124,6 +128,7 @@ module_param(dbitrate, charp, 0444);
 module_param(assign, charp, 0444);
 module_param(rxqsize, ushort, 0444);
 module_param(txqsize, ushort, 0444);
+module_param(pathfilters, ushort, 0644);
 #else
 MODULE_PARM(type, "0-8s");
 MODULE_PARM(io, "0-8h");
@@ -134,6 +139,7 @@ MODULE_PARM(dbitrate, "s");
 MODULE_PARM(assign, "s");
 MODULE_PARM(rxqsize, "h");
 MODULE_PARM(txqsize, "h");
+MODULE_PARM(pathfilters, "h");
 #endif
 
 MODULE_PARM_DESC(type, "type of PCAN interface (isa, sp, epp)");
@@ -148,6 +154,9 @@ MODULE_PARM_DESC(rxqsize, " size of the Rx FIFO of a channel (def="
 				__stringify(READ_MESSAGE_COUNT) ")");
 MODULE_PARM_DESC(txqsize, " size of the Tx FIFO of a channel (def="
 				__stringify(WRITE_MESSAGE_COUNT) ")");
+MODULE_PARM_DESC(pathfilters, " if not 0, msgs filters are set for each open "
+				"path rather than for the whole channel by "
+				"default (def=0)");
 
 #if defined(LINUX_24)
 EXPORT_NO_SYMBOLS;
@@ -272,9 +281,13 @@ TPCANRdMsg *pcan_fd_to_msg(TPCANRdMsg *msg, const struct pcanfd_msg *pf)
 
 	/* TODO: should check whether PCANFD_TIMESTAMP is always set */
 	if (pf->flags & PCANFD_TIMESTAMP) {
-		msg->dwTime = pf->timestamp.tv_sec * 1000;
-		msg->dwTime += pf->timestamp.tv_usec / 1000;
-		msg->wUsec = pf->timestamp.tv_usec % 1000;
+		struct timeval tv;
+
+		pcan_msg_timeval(pf, &tv);
+
+		msg->dwTime = tv.tv_sec * 1000;
+		msg->dwTime += tv.tv_usec / 1000;
+		msg->wUsec = tv.tv_usec % 1000;
 	}
 
 	return msg;
@@ -302,14 +315,16 @@ int pcan_open_path(struct pcandev *dev, struct pcan_udata *irq_arg)
 		goto lbl_unlock_exit;
 	}
 
-	dev->wMsg = pcan_malloc(sizeof(dev->wMsg[0]) * txqsize, GFP_KERNEL);
+	dev->wMsg = pcan_malloc(sizeof(dev->wMsg[0]) * pcan_fifo_slots(txqsize),
+				GFP_KERNEL);
 	if (!dev->wMsg) {
 		err = -ENOMEM;
 		goto lbl_unlock_exit;
 	}
 
 	/* init Tx fifo even in NETDEV mode (writing is always possible) */
-	pcan_fifo_init(&dev->writeFifo, dev->wMsg, dev->wMsg + txqsize - 1,
+	pcan_fifo_init(&dev->writeFifo, dev->wMsg,
+			dev->wMsg + pcan_fifo_slots(txqsize) - 1,
 			txqsize, sizeof(dev->wMsg[0]));
 #ifdef DEBUG_ALLOC_FIFOS
 	pr_info(DEVICE_NAME ": %s CAN%u: %u items Tx FIFO allocated\n",
@@ -320,14 +335,16 @@ int pcan_open_path(struct pcandev *dev, struct pcan_udata *irq_arg)
 	/* in NETDEV, Rx FIFO is useless, since events are routed towards the
 	 * socket buffer */
 #else
-	dev->rMsg = pcan_malloc(sizeof(dev->rMsg[0]) * rxqsize, GFP_KERNEL);
+	dev->rMsg = pcan_malloc(sizeof(dev->rMsg[0]) * pcan_fifo_slots(rxqsize),
+				GFP_KERNEL);
 	if (!dev->rMsg) {
 		err = -ENOMEM;
 		goto lbl_unlock_free_w;
 	}
 
 	/* init Rx fifos */
-	pcan_fifo_init(&dev->readFifo, dev->rMsg, dev->rMsg + rxqsize - 1,
+	pcan_fifo_init(&dev->readFifo, dev->rMsg,
+			dev->rMsg + pcan_fifo_slots(rxqsize) - 1,
 			rxqsize, sizeof(dev->rMsg[0]));
 #ifdef DEBUG_ALLOC_FIFOS
 	pr_info(DEVICE_NAME ": %s CAN%u: %u items Rx FIFO allocated\n",
@@ -607,13 +624,13 @@ int pcan_ioctl_extended_status_common(struct pcandev *dev,
 {
 	local->wErrorFlag = dev->wCANStatus;
 
-	local->nPendingReads = dev->readFifo.nStored;
+	local->nPendingReads = pcan_fifo_status(&dev->readFifo);
 
 	/* get infos for friends of polling operation */
 	if (pcan_fifo_empty(&dev->readFifo))
 		local->wErrorFlag |= CAN_ERR_QRCVEMPTY;
 
-	local->nPendingWrites = dev->writeFifo.nStored;
+	local->nPendingWrites = pcan_fifo_status(&dev->writeFifo);
 
 	if (pcan_fifo_full(&dev->writeFifo))
 		local->wErrorFlag |= CAN_ERR_QXMTFULL;
@@ -645,8 +662,8 @@ int pcan_ioctl_diag_common(struct pcandev *dev, TPDIAG *local)
 		break;
 	}
 
-	local->dwReadCounter = dev->readFifo.dwTotal;
-	local->dwWriteCounter = dev->writeFifo.dwTotal;
+	local->dwReadCounter = pcan_fifo_total(&dev->readFifo);
+	local->dwWriteCounter = pcan_fifo_total(&dev->writeFifo);
 	local->dwIRQcounter = dev->dwInterruptCounter;
 	local->dwErrorCounter = dev->dwErrorCounter;
 	local->wErrorFlag = dev->wCANStatus;
@@ -666,65 +683,229 @@ int pcan_ioctl_diag_common(struct pcandev *dev, TPDIAG *local)
 	return 0;
 }
 
-static int handle_pcanfd_send_msgs(struct pcandev *dev, void __user *up,
-					struct pcan_udata *dev_priv, void *c)
+/*
+ * per-open staging buffers of the lists of msgs
+ */
+static void pcan_init_msgs_bufs(struct pcan_udata *ctx)
 {
-	struct pcanfd_msgs_0 __user *plu = (struct pcanfd_msgs_0 *)up;
-	struct pcanfd_txmsgs txs, *pl;
-	int i, l, err;
+	memset(&ctx->rx_msgs, '\0', sizeof(ctx->rx_msgs));
+	memset(&ctx->tx_msgs, '\0', sizeof(ctx->tx_msgs));
+}
 
-	l = sizeof(*plu);
-	err = pcan_copy_from_user(&txs, up, l, c);
-	if (err) {
-		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
-			__func__);
-		return -EFAULT;
+static void pcan_free_msgs_bufs(struct pcan_udata *ctx)
+{
+	ctx->rx_msgs.buf = pcan_free(ctx->rx_msgs.buf);
+	ctx->tx_msgs.buf = pcan_free(ctx->tx_msgs.buf);
+	ctx->rx_msgs.size = ctx->tx_msgs.size = 0;
+}
+
+/* get a buffer of (at least) size bytes. The per-open buffer is reused (and
+ * grown if needed) so that no allocation occurs in steady state. If another
+ * task sharing the same path is already using it, a temporary buffer is
+ * allocated instead. */
+static void *pcan_get_msgs_buf(struct pcan_msgs_buf *pb, int size)
+{
+	if (test_and_set_bit(0, &pb->busy))
+		return pcan_malloc(size, GFP_KERNEL);
+
+	if (size > pb->size) {
+		pcan_free(pb->buf);
+		pb->buf = pcan_malloc(size, GFP_KERNEL);
+		if (!pb->buf) {
+			pb->size = 0;
+			smp_mb();
+			clear_bit(0, &pb->busy);
+			return NULL;
+		}
+
+		pb->size = size;
+	}
+
+	return pb->buf;
+}
+
+static void pcan_put_msgs_buf(struct pcan_msgs_buf *pb, void *buf)
+{
+	if (buf != pb->buf) {
+		pcan_free(buf);
+		return;
 	}
 
+	smp_mb();
+	clear_bit(0, &pb->busy);
+}
+
+/* convert in place a list of n msg stored at the beginning of a list of
+ * txmsg (txmsg are larger than msg, thus start from the last one) */
+static void copy_from_msgs(struct pcanfd_txmsg *ptx, int n)
+{
+	const struct pcanfd_msg *pm = (const struct pcanfd_msg *)ptx;
+
+	while (--n > 0)
+		memmove(&ptx[n].msg, pm + n, sizeof(*pm));
+}
+
+/* convert in place a list of n rxmsg into a list of n msg stored at the
+ * beginning of it (msg are smaller than rxmsg, thus start from the 1st) */
+static struct pcanfd_msg *copy_to_msgs(struct pcanfd_rxmsg *prx, int n)
+{
+	struct pcanfd_msg *pm = (struct pcanfd_msg *)prx;
+	int i;
+
+	for (i = 1; i < n; i++)
+		memmove(pm + i, &prx[i].msg, sizeof(*pm));
+
+	return pm;
+}
+
+/* no need to handle more msgs at once than the fifos can store. This also
+ * bounds the size of the msgs buffers allocated on behalf of the
+ * application. */
+static u32 pcan_tx_msgs_max(struct pcandev *dev, u32 count)
+{
+	return min(count, dev->writeFifo.nCount);
+}
+
+static u32 pcan_rx_msgs_max(struct pcandev *dev, struct pcan_udata *ctx,
+			    u32 count)
+{
+	return min(count, pcan_rx_fifo(dev, ctx)->nCount);
+}
+
+/*
+ * send the *pcount msgs of the user list "ulist". *pcount is set to the count
+ * of msgs really sent.
+ */
+static int pcan_send_msgs_list(struct pcandev *dev,
+			       struct pcan_udata *dev_priv,
+			       const void __user *ulist, u32 *pcount, void *c)
+{
+	struct pcanfd_txmsgs *pl;
+	struct pcanfd_msg *pm;
+	int err;
+
 	/* ok. Nothing to send. So nothing done. Perfect. */
-	if (!txs.count)
+	if (!*pcount)
 		return 0;
 
-	l += txs.count * sizeof(txs.list[0]);
-	pl = pcan_malloc(l, GFP_KERNEL);
+	*pcount = pcan_tx_msgs_max(dev, *pcount);
+
+	pl = pcan_get_msgs_buf(&dev_priv->tx_msgs,
+			       sizeof(*pl) + *pcount * sizeof(pl->list[0]));
 	if (!pl) {
 		pr_err(DEVICE_NAME ": %s(): failed to alloc msgs list\n",
 			__func__);
 		return -ENOMEM;
 	}
 
-	/* copy count of items, then items */
-	for (i = 0; i < txs.count; i++) {
-		err = copy_from_user(&pl->list[i].msg, &plu->list[i],
-				     sizeof(pl->list[i].msg));
-		if (err) {
-			pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
-				__func__);
-			err = -EFAULT;
-			goto lbl_free;
-		}
-#if 0
-		pr_info(DEVICE_NAME ": id=%x len=%u\n",
-			pl->list[i].msg.id,
-			pl->list[i].msg.data_len);
-			
-		dump_mem("data", pl->list[i].msg.data,
-			 pl->list[i].msg.data_len);
-#endif
+	/* copy all the items at once at the beginning of the list... */
+	pm = (struct pcanfd_msg *)pl->list;
+	err = pcan_copy_from_user(pm, ulist, *pcount * sizeof(*pm), c);
+	if (err) {
+		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
+			__func__);
+		*pcount = 0;
+		err = -EFAULT;
+		goto lbl_free;
 	}
 
-	pl->count = i;
+	/* ...then spread them into the txmsgs */
+	copy_from_msgs(pl->list, *pcount);
+
+	pl->count = *pcount;
 	err = pcanfd_ioctl_send_msgs(dev, pl, dev_priv);
+	*pcount = pl->count;
+
+lbl_free:
+	pcan_put_msgs_buf(&dev_priv->tx_msgs, pl);
+
+	return err;
+}
+
+/*
+ * receive up to *pcount msgs into the user list "ulist". *pcount is set to
+ * the count of msgs really received. If "rxt" is not NULL, the task waits for
+ * rxt->min_count msgs until rxt->deadline_ns (see PCANFD_RECV_MSGS_TIMEOUT).
+ */
+static int pcan_recv_msgs_list(struct pcandev *dev,
+			       struct pcan_udata *dev_priv,
+			       void __user *ulist, u32 *pcount,
+			       const struct pcanfd_msgs_timeout *rxt, void *c)
+{
+	struct pcanfd_rxmsgs *pl;
+	struct pcanfd_msg *pm;
+	int err;
+
+	/* ok! no room for saving rcvd msgs!? Thus, nothing returned */
+	if (!*pcount)
+		return 0;
+
+	*pcount = pcan_rx_msgs_max(dev, dev_priv, *pcount);
+
+	pl = pcan_get_msgs_buf(&dev_priv->rx_msgs,
+			       sizeof(*pl) + *pcount * sizeof(pl->list[0]));
+	if (!pl) {
+		pr_err(DEVICE_NAME ": failed to alloc msgs list\n");
+		return -ENOMEM;
+	}
 
-	/* copy the count of msgs really sent (= pl->count) */
-	if (pcan_copy_to_user(plu, pl, sizeof(*plu), c)) {
+	pl->count = *pcount;
+	if (rxt) {
+		/* *pcount is already limited to the size of the Rx fifo */
+		u32 min_count = min(rxt->min_count, *pcount);
+
+		err = pcanfd_ioctl_recv_msgs_timeout(dev, pl, min_count,
+						     rxt->deadline_ns,
+						     dev_priv);
+	} else {
+		err = pcanfd_ioctl_recv_msgs(dev, pl, dev_priv);
+	}
+	*pcount = pl->count;
+
+	if (!pl->count)
+		goto lbl_free;
+
+	/* pack the msgs at the beginning of the list to copy them all at
+	 * once */
+	pm = copy_to_msgs(pl->list, pl->count);
+
+	if (pcan_copy_to_user(ulist, pm, pl->count * sizeof(*pm), c)) {
 		pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
 			__func__);
 		err = -EFAULT;
 	}
 
 lbl_free:
-	pcan_free(pl);
+	pcan_put_msgs_buf(&dev_priv->rx_msgs, pl);
+
+	return err;
+}
+
+static int handle_pcanfd_send_msgs(struct pcandev *dev, void __user *up,
+					struct pcan_udata *dev_priv, void *c)
+{
+	struct pcanfd_msgs_0 __user *plu = (struct pcanfd_msgs_0 *)up;
+	struct pcanfd_msgs_0 msgs;
+	int err;
+
+	err = pcan_copy_from_user(&msgs, up, sizeof(msgs), c);
+	if (err) {
+		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	if (!msgs.count)
+		return 0;
+
+	err = pcan_send_msgs_list(dev, dev_priv, plu->list, &msgs.count, c);
+
+	/* copy the count of msgs really sent */
+	if (pcan_copy_to_user(plu, &msgs, sizeof(*plu), c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
+			__func__);
+		err = -EFAULT;
+	}
 
 	return err;
 }
@@ -733,53 +914,114 @@ static int handle_pcanfd_recv_msgs(struct pcandev *dev, void __user *up,
 					struct pcan_udata *dev_priv, void *c)
 {
 	struct pcanfd_msgs_0 __user *plu = (struct pcanfd_msgs_0 *)up;
-	struct pcanfd_rxmsgs rxs, *pl;
-	int i, l, err;
+	struct pcanfd_msgs_0 msgs;
+	int err;
 
-	l = sizeof(*plu);
-	err = pcan_copy_from_user(&rxs, up, l, c);
+	err = pcan_copy_from_user(&msgs, up, sizeof(msgs), c);
 	if (err) {
 		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
 			__func__);
 		return -EFAULT;
 	}
 
-	/* ok! no room for saving rcvd msgs!? Thus, nothing returned */
-	if (!rxs.count)
+	if (!msgs.count)
 		return 0;
 
-	l += rxs.count * sizeof(rxs.list[0]);
-	pl = pcan_malloc(l, GFP_KERNEL);
-	if (!pl) {
-		pr_err(DEVICE_NAME ": failed to alloc msgs list\n");
-		return -ENOMEM;
+	err = pcan_recv_msgs_list(dev, dev_priv, plu->list, &msgs.count, NULL,
+				  c);
+
+	/* copy the count of msgs received */
+	if (pcan_copy_to_user(plu, &msgs, sizeof(*plu), c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
+			__func__);
+		err = -EFAULT;
+	}
+
+	return err;
+}
+
+/* same as above with the user list given by its address */
+static int handle_pcanfd_send_msgs_list(struct pcandev *dev, void __user *up,
+					struct pcan_udata *dev_priv, void *c)
+{
+	struct pcanfd_msgs_list __user *plu = up;
+	struct pcanfd_msgs_list ml;
+	int err;
+
+	err = pcan_copy_from_user(&ml, up, sizeof(ml), c);
+	if (err) {
+		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
+			__func__);
+		return -EFAULT;
 	}
 
-	pl->count = rxs.count;
-	err = pcanfd_ioctl_recv_msgs(dev, pl, dev_priv);
+	err = pcan_send_msgs_list(dev, dev_priv,
+				  (void __user *)(unsigned long)ml.list,
+				  &ml.count, c);
 
-	/* copy the count then the msgs received */
-	if (pcan_copy_to_user(plu, pl, sizeof(*plu), c)) {
+	/* copy the count of msgs really sent */
+	if (pcan_copy_to_user(&plu->count, &ml.count, sizeof(ml.count), c)) {
 		pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
 			__func__);
 		err = -EFAULT;
-		goto lbl_free;
 	}
 
-	for (i = 0; i < pl->count; i++) {
-		err = pcan_copy_to_user(&plu->list[i], &pl->list[i],
-					sizeof(plu->list[i]), c);
-		if (err) {
-			pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
-				__func__);
-			err = -EFAULT;
-			break;
+	return err;
+}
 
-		}
+static int handle_pcanfd_recv_msgs_list(struct pcandev *dev, void __user *up,
+					struct pcan_udata *dev_priv, void *c)
+{
+	struct pcanfd_msgs_list __user *plu = up;
+	struct pcanfd_msgs_list ml;
+	int err;
+
+	err = pcan_copy_from_user(&ml, up, sizeof(ml), c);
+	if (err) {
+		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
+			__func__);
+		return -EFAULT;
 	}
 
-lbl_free:
-	pcan_free(pl);
+	err = pcan_recv_msgs_list(dev, dev_priv,
+				  (void __user *)(unsigned long)ml.list,
+				  &ml.count, NULL, c);
+
+	/* copy the count of msgs received */
+	if (pcan_copy_to_user(&plu->count, &ml.count, sizeof(ml.count), c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
+			__func__);
+		err = -EFAULT;
+	}
+
+	return err;
+}
+
+static int handle_pcanfd_recv_msgs_timeout(struct pcandev *dev,
+					   void __user *up,
+					   struct pcan_udata *dev_priv, void *c)
+{
+	struct pcanfd_msgs_timeout __user *plu = up;
+	struct pcanfd_msgs_timeout rxt;
+	int err;
+
+	err = pcan_copy_from_user(&rxt, up, sizeof(rxt), c);
+	if (err) {
+		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	err = pcan_recv_msgs_list(dev, dev_priv,
+				  (void __user *)(unsigned long)rxt.list,
+				  &rxt.count, &rxt, c);
+
+	/* copy the count of msgs received */
+	if (pcan_copy_to_user(&plu->count, &rxt.count, sizeof(rxt.count), c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
+			__func__);
+		err = -EFAULT;
+	}
 
 	return err;
 }
@@ -866,6 +1108,330 @@ static int handle_pcanfd_get_bittiming_ranges(struct pcandev *dev,
 	return err;
 }
 
+/*
+ * options that are specific to an open path
+ */
+#ifndef NETDEV_SUPPORT
+/*
+ * the msgs filters, the BPF program and the Rx wake-ups coalescing of a path
+ * run in the Rx fan-out: give the path its own Rx fifo, if it doesn't already
+ * own one (or an Rx ring).
+ */
+static int pcan_rx_fifo_attach_default(struct pcandev *dev,
+				       struct pcan_udata *ctx)
+{
+	int err = pcan_rx_fifo_attach(dev, ctx, rxqsize);
+
+	return (err == -EBUSY) ? 0 : err;
+}
+
+static int pcan_get_rx_fifo_size(struct pcandev *dev, struct pcan_udata *ctx,
+				 struct pcanfd_option *opt, void *c)
+{
+	u32 tmp32 = ctx->rx_fifo_msgs ? ctx->rx_fifo.nCount : 0;
+
+	opt->size = sizeof(tmp32);
+	if (pcan_copy_to_user(opt->value, &tmp32, opt->size, c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int pcan_set_rx_fifo_size(struct pcandev *dev, struct pcan_udata *ctx,
+				 struct pcanfd_option *opt, void *c)
+{
+	u32 tmp32;
+
+	if (pcan_copy_from_user(&tmp32, opt->value, sizeof(tmp32), c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	/* the private Rx fifo can't be changed once set */
+	if (!tmp32)
+		return ctx->rx_fifo_msgs ? -EBUSY : 0;
+
+	return pcan_rx_fifo_attach(dev, ctx, tmp32);
+}
+#endif
+
+static int pcan_get_rw_mode(struct pcandev *dev, struct pcan_udata *ctx,
+			    struct pcanfd_option *opt, void *c)
+{
+	u32 tmp32 = ctx->rw_mode;
+
+	opt->size = sizeof(tmp32);
+	if (pcan_copy_to_user(opt->value, &tmp32, opt->size, c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int pcan_set_rw_mode(struct pcandev *dev, struct pcan_udata *ctx,
+			    struct pcanfd_option *opt, void *c)
+{
+	u32 tmp32;
+
+	if (pcan_copy_from_user(&tmp32, opt->value, sizeof(tmp32), c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	if (tmp32 >= PCANFD_RW_MODE_MAX)
+		return -EINVAL;
+
+	/* forget any partially read or written text line */
+	ctx->nReadRest = 0;
+	ctx->pcReadPointer = ctx->pcReadBuffer;
+	ctx->pcWritePointer = ctx->pcWriteBuffer;
+
+	ctx->rw_mode = tmp32;
+
+	return 0;
+}
+
+static int pcan_get_filters_scope(struct pcandev *dev, struct pcan_udata *ctx,
+				  struct pcanfd_option *opt, void *c)
+{
+	u32 tmp32 = ctx->filters_scope;
+
+	opt->size = sizeof(tmp32);
+	if (pcan_copy_to_user(opt->value, &tmp32, opt->size, c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int pcan_set_filters_scope(struct pcandev *dev, struct pcan_udata *ctx,
+				  struct pcanfd_option *opt, void *c)
+{
+	u32 tmp32;
+
+	if (pcan_copy_from_user(&tmp32, opt->value, sizeof(tmp32), c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	if (tmp32 >= PCANFD_FILTERS_SCOPE_MAX)
+		return -EINVAL;
+
+	/* the filters of the path would remain active but out of reach */
+	if (tmp32 != ctx->filters_scope && pcan_get_filters_count(ctx->filter))
+		return -EBUSY;
+
+	ctx->filters_scope = tmp32;
+
+	return 0;
+}
+
+#if defined(NO_RT) && !defined(NETDEV_SUPPORT)
+static int pcan_get_rx_coalesce(struct pcandev *dev, struct pcan_udata *ctx,
+				struct pcanfd_option *opt, void *c)
+{
+	struct pcanfd_rx_coalesce rxc = ctx->rx_coalesce;
+
+	opt->size = sizeof(rxc);
+	if (pcan_copy_to_user(opt->value, &rxc, opt->size, c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_to_user() failure\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int pcan_set_rx_coalesce(struct pcandev *dev, struct pcan_udata *ctx,
+				struct pcanfd_option *opt, void *c)
+{
+	struct pcanfd_rx_coalesce rxc;
+	int err;
+
+	if (pcan_copy_from_user(&rxc, opt->value, sizeof(rxc), c)) {
+		pr_err(DEVICE_NAME ": %s(): copy_from_user() failure\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	if (rxc.min_count || rxc.max_latency_us) {
+		err = pcan_rx_fifo_attach_default(dev, ctx);
+		if (err)
+			return err;
+
+	/* nothing to disable */
+	} else if (!ctx->rx_fifo_msgs && !ctx->rx_ring) {
+		return 0;
+	}
+
+	return pcan_rx_coalesce_set(dev, ctx, &rxc);
+}
+#endif
+
+static const struct pcan_udata_options {
+	int req_size;
+	int (*get)(struct pcandev *dev, struct pcan_udata *ctx,
+		   struct pcanfd_option *opt, void *c);
+	int (*set)(struct pcandev *dev, struct pcan_udata *ctx,
+		   struct pcanfd_option *opt, void *c);
+} pcan_udata_opts[PCANFD_OPT_MAX] = {
+#ifndef NETDEV_SUPPORT
+	[PCANFD_OPT_RX_FIFO_SIZE] = {
+		.req_size = sizeof(u32),
+		.get = pcan_get_rx_fifo_size,
+		.set = pcan_set_rx_fifo_size,
+	},
+#endif
+	[PCANFD_OPT_RW_MODE] = {
+		.req_size = sizeof(u32),
+		.get = pcan_get_rw_mode,
+		.set = pcan_set_rw_mode,
+	},
+	[PCANFD_OPT_FILTERS_SCOPE] = {
+		.req_size = sizeof(u32),
+		.get = pcan_get_filters_scope,
+		.set = pcan_set_filters_scope,
+	},
+#if defined(NO_RT) && !defined(NETDEV_SUPPORT)
+	[PCANFD_OPT_RX_COALESCE] = {
+		.req_size = sizeof(struct pcanfd_rx_coalesce),
+		.get = pcan_get_rx_coalesce,
+		.set = pcan_set_rx_coalesce,
+	},
+#endif
+};
+
+/*
+ * get the chain of msgs filters the PCANFD_xxx_FILTERS ioctl() of an open path
+ * act on. If "create" is not 0, the chain of the path is created on first use.
+ */
+static int pcan_get_filter_chain(struct pcandev *dev, struct pcan_udata *ctx,
+				 int create, void **pchain)
+{
+#ifndef NETDEV_SUPPORT
+	pcan_lock_irqsave_ctxt flags;
+	void *chain;
+	int err;
+
+	if (ctx->filters_scope == PCANFD_FILTERS_SCOPE_PATH) {
+
+		if (!ctx->filter && create) {
+			err = pcan_rx_fifo_attach_default(dev, ctx);
+			if (err)
+				return err;
+
+			chain = pcan_create_filter_chain();
+			if (!chain)
+				return -ENOMEM;
+
+			/* another task sharing the same path might have been
+			 * faster */
+			pcan_lock_get_irqsave(&dev->rx_users_lock, flags);
+			if (!ctx->filter) {
+				ctx->filter = chain;
+				chain = NULL;
+			}
+			pcan_lock_put_irqrestore(&dev->rx_users_lock, flags);
+
+			pcan_delete_filter_chain(chain);
+		}
+
+		*pchain = ctx->filter;
+		return 0;
+	}
+#endif
+	*pchain = dev->filter;
+	return 0;
+}
+
+/*
+ * attach a BPF program to an open path, or detach the current one if "count"
+ * is 0.
+ */
+static int pcan_set_bpf(struct pcandev *dev, struct pcan_udata *ctx,
+			const struct pcanfd_bpf_insn *insns, u32 count)
+{
+#ifndef NETDEV_SUPPORT
+	struct pcan_bpf_prog *prog = NULL, *prev;
+	pcan_lock_irqsave_ctxt flags;
+	int err;
+
+	if (count) {
+		err = pcan_bpf_create(&prog, insns, count);
+		if (err)
+			return err;
+
+		err = pcan_rx_fifo_attach_default(dev, ctx);
+		if (err) {
+			pcan_bpf_free(prog);
+			return err;
+		}
+	}
+
+	/* the fan-out runs the program with this lock held */
+	pcan_lock_get_irqsave(&dev->rx_users_lock, flags);
+	prev = ctx->bpf;
+	ctx->bpf = prog;
+	pcan_lock_put_irqrestore(&dev->rx_users_lock, flags);
+
+	pcan_bpf_free(prev);
+
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+/* get an option of the open path, or of the device */
+static int pcan_get_option(struct pcandev *dev, struct pcan_udata *ctx,
+			   struct pcanfd_option *opt, void *c)
+{
+	const struct pcan_udata_options *puo = pcan_udata_opts + opt->name;
+	const struct pcanfd_options *pdo = dev->option + opt->name;
+	const int req_size = puo->get ? puo->req_size : pdo->req_size;
+
+	if (!puo->get && !pdo->get)
+		return -EOPNOTSUPP;
+
+	/* if user option buffer size is too small, return the 
+	 * requested size with -ENOSPC */
+	if (req_size > 0 && opt->size < req_size) {
+		pr_warn(DEVICE_NAME
+			": invalid option size %d < %d for option %d\n",
+			opt->size, req_size, opt->name);
+		opt->size = req_size;
+		return -ENOSPC;
+	}
+
+	return puo->get ? puo->get(dev, ctx, opt, c) : pdo->get(dev, opt, c);
+}
+
+/* set an option of the open path, or of the device */
+static int pcan_set_option(struct pcandev *dev, struct pcan_udata *ctx,
+			   struct pcanfd_option *opt, void *c)
+{
+	const struct pcan_udata_options *puo = pcan_udata_opts + opt->name;
+	const struct pcanfd_options *pdo = dev->option + opt->name;
+
+	if (puo->set)
+		return puo->set(dev, ctx, opt, c);
+
+	if (!pdo->set)
+		return -EOPNOTSUPP;
+
+	return pdo->set(dev, opt, c);
+}
+
 static int handle_pcanfd_get_option(struct pcandev *dev, void __user *up,
 					struct pcan_udata *dev_priv, void *c)
 {
@@ -885,29 +1451,10 @@ static int handle_pcanfd_get_option(struct pcandev *dev, void __user *up,
 		return -EINVAL;
 	}
 
-	if (!dev->option[opt.name].get) {
-		return -EOPNOTSUPP;
-	}
-
-	if (dev->option[opt.name].req_size > 0)
-
-		/* if user option buffer size is too small, return the 
-		 * requested size with -ENOSPC */
-		if (opt.size < dev->option[opt.name].req_size) {
-			pr_warn(DEVICE_NAME
-				": invalid option size %d < %d for option %d\n",
-				opt.size, dev->option[opt.name].req_size,
-				opt.name);
-			opt.size = dev->option[opt.name].req_size;
-			err = -ENOSPC;
-			goto lbl_cpy_size;
-		}
-
-	err = dev->option[opt.name].get(dev, &opt, c);
+	err = pcan_get_option(dev, dev_priv, &opt, c);
 	if (err && err != -ENOSPC)
 		return err;
 
-lbl_cpy_size:
 	/* update 'size' field */
 	if (pcan_copy_to_user(up+offsetof(struct pcanfd_option, size),
 			 &opt.size, sizeof(opt.size), c)) {
@@ -938,11 +1485,7 @@ static int handle_pcanfd_set_option(struct pcandev *dev, void __user *up,
 		return -EINVAL;
 	}
 
-	if (!dev->option[opt.name].set) {
-		return -EOPNOTSUPP;
-	}
-
-	return dev->option[opt.name].set(dev, &opt, c);
+	return pcan_set_option(dev, dev_priv, &opt, c);
 }
 
 /*
@@ -82,6 +82,17 @@ static int pcan_open(struct inode *inode, struct file *filep)
 		dev_priv->pcWritePointer = dev_priv->pcWriteBuffer;
 	}
 
+	pcan_init_msgs_bufs(dev_priv);
+	dev_priv->rx_fifo_msgs = NULL;
+	dev_priv->rx_ring = NULL;
+	dev_priv->rx_ring_mem = NULL;
+	dev_priv->rw_mode = PCANFD_RW_MODE_TEXT;
+	dev_priv->filter = NULL;
+	dev_priv->bpf = NULL;
+	dev_priv->filters_scope = pathfilters ? PCANFD_FILTERS_SCOPE_PATH :
+						PCANFD_FILTERS_SCOPE_DEVICE;
+	pcan_rx_coalesce_init(dev_priv);
+
 	filep->private_data = (void *)dev_priv;
 
 	err = pcan_open_path(dev, dev_priv);
@@ -99,9 +110,18 @@ static int pcan_release(struct inode *inode, struct file *filep)
 	DPRINTK(KERN_DEBUG "%s: %s(dev=%p)\n", DEVICE_NAME, __func__, dev);
 
 	/* free the associated irq and allocated memory */
+#ifndef NETDEV_SUPPORT
+	/* stop receiving msgs into the private Rx fifo (if any) */
+	pcan_rx_fifo_detach(dev, dev_priv);
+	pcan_rx_coalesce_stop(dev_priv);
+	dev_priv->filter = pcan_delete_filter_chain(dev_priv->filter);
+	dev_priv->bpf = pcan_bpf_free(dev_priv->bpf);
+#endif
+
 	if (dev)
 		pcan_release_path(dev, dev_priv);
 
+	pcan_free_msgs_bufs(dev_priv);
 	filep->private_data = pcan_free(dev_priv);
 
 	return 0;
@@ -410,6 +430,7 @@ static long __pcan_ioctl(struct file *filep, unsigned int cmd, void __user *up)
 	struct pcanfd_state fds;
 	struct pcanfd_rxmsg rx;
 	struct pcanfd_txmsg tx;
+	void *filter;
 	int err, l;
 
 	struct pcandev *dev = pcan_get_dev(dev_priv);
@@ -505,9 +526,12 @@ static long __pcan_ioctl(struct file *filep, unsigned int cmd, void __user *up)
 					__func__, __LINE__);
 				return -EFAULT;
 			}
-			err = pcanfd_ioctl_add_filter(dev, &mf);
+			err = pcan_get_filter_chain(dev, dev_priv, 1, &filter);
+			if (!err)
+				err = pcanfd_ioctl_add_filter(dev, filter, &mf);
 		} else {
-			err = pcanfd_ioctl_add_filter(dev, NULL);
+			pcan_get_filter_chain(dev, dev_priv, 0, &filter);
+			err = pcanfd_ioctl_add_filter(dev, filter, NULL);
 		}
 		break;
 #endif
@@ -544,11 +568,15 @@ static long __pcan_ioctl(struct file *filep, unsigned int cmd, void __user *up)
 				return -EFAULT;
 			}
 
-			err = pcanfd_ioctl_add_filters(dev, pfl);
+			err = pcan_get_filter_chain(dev, dev_priv, 1, &filter);
+			if (!err)
+				err = pcanfd_ioctl_add_filters(dev, filter,
+							       pfl);
 
 			pcan_free(pfl);
 		} else {
-			err = pcanfd_ioctl_add_filters(dev, NULL);
+			pcan_get_filter_chain(dev, dev_priv, 0, &filter);
+			err = pcanfd_ioctl_add_filters(dev, filter, NULL);
 		}
 		break;
 
@@ -577,7 +605,8 @@ static long __pcan_ioctl(struct file *filep, unsigned int cmd, void __user *up)
 			}
 
 			pfl->count = mfl.count;
-			err = pcanfd_ioctl_get_filters(dev, pfl);
+			pcan_get_filter_chain(dev, dev_priv, 0, &filter);
+			err = pcanfd_ioctl_get_filters(dev, filter, pfl);
 
 			/* copy the count and the filter received */
 			l = sizeof(struct pcanfd_msg_filters_0) +
@@ -592,7 +621,51 @@ static long __pcan_ioctl(struct file *filep, unsigned int cmd, void __user *up)
 
 			pcan_free(pfl);
 		} else {
-			err = pcanfd_ioctl_get_filters(dev, NULL);
+			pcan_get_filter_chain(dev, dev_priv, 0, &filter);
+			err = pcanfd_ioctl_get_filters(dev, filter, NULL);
+		}
+		break;
+
+	case PCANFD_SET_BPF:
+		if (up) {
+			struct pcanfd_bpf_insns bi, *pbi;
+
+			l = sizeof(struct pcanfd_bpf_insns_0);
+			err = copy_from_user(&bi, up, l);
+			if (err) {
+				pr_err(DEVICE_NAME
+					": %s(%u): copy_from_user() failure\n",
+					__func__, __LINE__);
+				return -EFAULT;
+			}
+
+			if (!bi.count)
+				return pcan_set_bpf(dev, dev_priv, NULL, 0);
+
+			if (bi.count > PCANFD_BPF_MAXINSNS)
+				return -EINVAL;
+
+			l += bi.count * sizeof(struct pcanfd_bpf_insn);
+			pbi = pcan_malloc(l, GFP_KERNEL);
+			if (!pbi) {
+				pr_err("%s: failed to alloc BPF program\n",
+						DEVICE_NAME);
+				return -ENOMEM;
+			}
+
+			if (copy_from_user(pbi, up, l)) {
+				pcan_free(pbi);
+				pr_err(DEVICE_NAME
+					": %s(%u): copy_from_user() failure\n",
+					__func__, __LINE__);
+				return -EFAULT;
+			}
+
+			err = pcan_set_bpf(dev, dev_priv, pbi->list, bi.count);
+
+			pcan_free(pbi);
+		} else {
+			err = pcan_set_bpf(dev, dev_priv, NULL, 0);
 		}
 		break;
 
@@ -629,6 +702,18 @@ static long __pcan_ioctl(struct file *filep, unsigned int cmd, void __user *up)
 		err = handle_pcanfd_recv_msgs(dev, up, dev_priv, NULL);
 		break;
 
+	case PCANFD_RECV_MSGS_TIMEOUT:
+		err = handle_pcanfd_recv_msgs_timeout(dev, up, dev_priv, NULL);
+		break;
+
+	case PCANFD_SEND_MSGS_LIST:
+		err = handle_pcanfd_send_msgs_list(dev, up, dev_priv, NULL);
+		break;
+
+	case PCANFD_RECV_MSGS_LIST:
+		err = handle_pcanfd_recv_msgs_list(dev, up, dev_priv, NULL);
+		break;
+
 	case PCANFD_GET_AVAILABLE_CLOCKS:
 		err = handle_pcanfd_get_av_clocks(dev, up, dev_priv, NULL);
 		break;
@@ -692,7 +777,10 @@ struct pcanfd_msg32 {
 	__u16	data_len;
 	__u32	id;
 	__u32	flags;
-	struct compat_timeval	timestamp;
+	union {
+		struct compat_timeval	timestamp;
+		__u64	timestamp_ns __attribute__((packed, aligned(4)));
+	};
 	__u8	ctrlr_data[PCANFD_MAXCTRLRDATALEN];
 	__u8	data[PCANFD_MAXDATALEN] __attribute__((aligned(8)));
 } __aligned(4);
@@ -760,6 +848,12 @@ struct pcanfd_option32 {
 #define PCANFD_SET_OPTION32	_IOW(PCAN_MAGIC_NUMBER, PCANFD_SEQ_SET_OPTION,\
 					struct pcanfd_option32)
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,6,0)
+#define pcan_is_compat_task()	is_compat_task()
+#else
+#define pcan_is_compat_task()	in_compat_syscall()
+#endif
+
 /* because of the struct timeval different size, we must
  * do some manual copy... */
 static void copy_from_msg32(struct pcanfd_msg *msgfd,
@@ -782,77 +876,167 @@ static void copy_to_msg32(struct pcanfd_msg32 *msgfd32,
 	msgfd32->id = msgfd->id;
 	msgfd32->flags = msgfd->flags;
 
-	msgfd32->timestamp.tv_sec = msgfd->timestamp.tv_sec;
-	msgfd32->timestamp.tv_usec = msgfd->timestamp.tv_usec;
+	if (msgfd->flags & PCANFD_TIMESTAMP_NS) {
+		msgfd32->timestamp_ns = msgfd->timestamp_ns;
+	} else {
+		msgfd32->timestamp.tv_sec = msgfd->timestamp.tv_sec;
+		msgfd32->timestamp.tv_usec = msgfd->timestamp.tv_usec;
+	}
 
 	memcpy(msgfd32->ctrlr_data, msgfd->ctrlr_data, PCANFD_MAXCTRLRDATALEN);
 	memcpy(msgfd32->data, msgfd->data, PCANFD_MAXDATALEN);
 }
 
-static int handle_pcanfd_send_msgs32(struct pcandev *dev, void __user *up,
-						struct pcan_udata *dev_priv)
+/* convert in place a list of n msg32 stored at the beginning of a list of
+ * txmsg (txmsg are larger than msg32, thus start from the last one) */
+static void copy_from_msgs32(struct pcanfd_txmsg *ptx, int n)
 {
-	struct pcanfd_msg32s_0 __user *pl32 = (struct pcanfd_msg32s_0 *)up;
-	struct pcanfd_txmsgs txs, *pl;
-	int i, l, err;
+	const struct pcanfd_msg32 *pm32 = (const struct pcanfd_msg32 *)ptx;
+	struct pcanfd_msg32 m32;
 
-	l = sizeof(*pl32);
-	err = copy_from_user(&txs, up, l);
-	if (err) {
-		pr_err(DEVICE_NAME ": %s(%u): copy_from_user() failure\n",
-			__func__, __LINE__);
-		return -EFAULT;
+	while (n-- > 0) {
+		memcpy(&m32, pm32 + n, sizeof(m32));
+		copy_from_msg32(&ptx[n].msg, &m32);
+	}
+}
+
+/* convert in place a list of n rxmsg into a list of n msg32 stored at the
+ * beginning of it (msg32 are smaller than rxmsg, thus start from the 1st) */
+static void copy_to_msgs32(struct pcanfd_rxmsg *prx, int n)
+{
+	struct pcanfd_msg32 *pm32 = (struct pcanfd_msg32 *)prx;
+	struct pcanfd_msg32 m32;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		copy_to_msg32(&m32, &prx[i].msg);
+		memcpy(pm32 + i, &m32, sizeof(m32));
 	}
+}
+
+/* send the *pcount msgs32 of the user list "ulist32" */
+static int pcan_send_msgs_list32(struct pcandev *dev,
+				 struct pcan_udata *dev_priv,
+				 const void __user *ulist32, u32 *pcount)
+{
+	struct pcanfd_txmsgs *pl;
+	int err;
 
 	/* ok. Nothing to send. So nothing done. Perfect. */
-	if (!txs.count)
+	if (!*pcount)
 		return 0;
 
-	l += txs.count * sizeof(txs.list[0]);
-	pl = pcan_malloc(l, GFP_KERNEL);
+	*pcount = pcan_tx_msgs_max(dev, *pcount);
+
+	pl = pcan_get_msgs_buf(&dev_priv->tx_msgs,
+			       sizeof(*pl) + *pcount * sizeof(pl->list[0]));
 	if (!pl) {
 		pr_err(DEVICE_NAME ": %s(): failed to alloc msgs list\n",
 			__func__);
 		return -ENOMEM;
 	}
 
-	for (i = 0; i < txs.count; i++) {
-		struct pcanfd_msg32 m32;
+	/* copy all the items at once then convert them */
+	err = copy_from_user(pl->list, ulist32,
+			     *pcount * sizeof(struct pcanfd_msg32));
+	if (err) {
+		pr_err(DEVICE_NAME
+			": %s(%u): copy_from_user() failure\n",
+			__func__, __LINE__);
+		*pcount = 0;
+		err = -EFAULT;
+		goto lbl_free;
+	}
 
-		err = copy_from_user(&m32, &pl32->list[i], sizeof(m32));
-		if (err) {
-			pr_err(DEVICE_NAME
-				": %s(%u): copy_from_user() failure\n",
-				__func__, __LINE__);
-			err = -EFAULT;
-			goto lbl_free;
-		}
+	copy_from_msgs32(pl->list, *pcount);
 
-		copy_from_msg32(&pl->list[i].msg, &m32);
+	pl->count = *pcount;
+	err = pcanfd_ioctl_send_msgs(dev, pl, dev_priv);
+	*pcount = pl->count;
 
-#if 0
-		pr_info(DEVICE_NAME ": id=%x len=%u\n",
-			pl->list[i].msg.id,
-			pl->list[i].msg.data_len);
-			
-		dump_mem("data", pl->list[i].msg.data,
-			 pl->list[i].msg.data_len);
-#endif
+lbl_free:
+	pcan_put_msgs_buf(&dev_priv->tx_msgs, pl);
+
+	return err;
+}
+
+/* receive up to *pcount msgs32 into the user list "ulist32" */
+static int pcan_recv_msgs_list32(struct pcandev *dev,
+				 struct pcan_udata *dev_priv,
+				 void __user *ulist32, u32 *pcount,
+				 const struct pcanfd_msgs_timeout *rxt)
+{
+	struct pcanfd_rxmsgs *pl;
+	int err;
+
+	/* ok! no room for saving rcvd msgs!? Thus, nothing returned */
+	if (!*pcount)
+		return 0;
+
+	*pcount = pcan_rx_msgs_max(dev, dev_priv, *pcount);
+
+	pl = pcan_get_msgs_buf(&dev_priv->rx_msgs,
+			       sizeof(*pl) + *pcount * sizeof(pl->list[0]));
+	if (!pl) {
+		pr_err(DEVICE_NAME ": failed to alloc msgs list\n");
+		return -ENOMEM;
 	}
 
-	pl->count = i;
-	err = pcanfd_ioctl_send_msgs(dev, pl, dev_priv);
+	pl->count = *pcount;
+	if (rxt) {
+		/* *pcount is already limited to the size of the Rx fifo */
+		u32 min_count = min(rxt->min_count, *pcount);
+
+		err = pcanfd_ioctl_recv_msgs_timeout(dev, pl, min_count,
+						     rxt->deadline_ns,
+						     dev_priv);
+	} else {
+		err = pcanfd_ioctl_recv_msgs(dev, pl, dev_priv);
+	}
+	*pcount = pl->count;
+
+	/* convert then copy all the msgs received at once */
+	copy_to_msgs32(pl->list, pl->count);
 
-	/* copy the count of msgs really sent (= pl->count) */
-	if (copy_to_user(pl32, pl, sizeof(*pl32))) {
+	if (copy_to_user(ulist32, pl->list,
+			 pl->count * sizeof(struct pcanfd_msg32))) {
 		pr_err(DEVICE_NAME
 			": %s(%u): copy_to_user() failure\n",
 			__func__, __LINE__);
 		err = -EFAULT;
 	}
 
-lbl_free:
-	pcan_free(pl);
+	pcan_put_msgs_buf(&dev_priv->rx_msgs, pl);
+
+	return err;
+}
+
+static int handle_pcanfd_send_msgs32(struct pcandev *dev, void __user *up,
+						struct pcan_udata *dev_priv)
+{
+	struct pcanfd_msg32s_0 __user *pl32 = (struct pcanfd_msg32s_0 *)up;
+	struct pcanfd_msg32s_0 msgs32;
+	int err;
+
+	err = copy_from_user(&msgs32, up, sizeof(msgs32));
+	if (err) {
+		pr_err(DEVICE_NAME ": %s(%u): copy_from_user() failure\n",
+			__func__, __LINE__);
+		return -EFAULT;
+	}
+
+	if (!msgs32.count)
+		return 0;
+
+	err = pcan_send_msgs_list32(dev, dev_priv, pl32->list, &msgs32.count);
+
+	/* copy the count of msgs really sent */
+	if (copy_to_user(pl32, &msgs32, sizeof(*pl32))) {
+		pr_err(DEVICE_NAME
+			": %s(%u): copy_to_user() failure\n",
+			__func__, __LINE__);
+		err = -EFAULT;
+	}
 
 	return err;
 }
@@ -861,11 +1045,10 @@ static int handle_pcanfd_recv_msgs32(struct pcandev *dev, void __user *up,
 						struct pcan_udata *dev_priv)
 {
 	struct pcanfd_msg32s_0 __user *pl32 = (struct pcanfd_msg32s_0 *)up;
-	struct pcanfd_rxmsgs rxs, *pl;
-	int i, l, err;
+	struct pcanfd_msg32s_0 msgs32;
+	int err;
 
-	l = sizeof(*pl32);
-	err = copy_from_user(&rxs, up, l);
+	err = copy_from_user(&msgs32, up, sizeof(msgs32));
 	if (err) {
 		pr_err(DEVICE_NAME
 			": %s(%u): copy_from_user() failure\n",
@@ -873,46 +1056,104 @@ static int handle_pcanfd_recv_msgs32(struct pcandev *dev, void __user *up,
 		return -EFAULT;
 	}
 
-	/* ok! no room for saving rcvd msgs!? Thus, nothing returned */
-	if (!rxs.count)
+	if (!msgs32.count)
 		return 0;
 
-	l += rxs.count * sizeof(rxs.list[0]);
-	pl = pcan_malloc(l, GFP_KERNEL);
-	if (!pl) {
-		pr_err(DEVICE_NAME ": failed to alloc msgs list\n");
-		return -ENOMEM;
-	}
-
-	pl->count = rxs.count;
-	err = pcanfd_ioctl_recv_msgs(dev, pl, dev_priv);
+	err = pcan_recv_msgs_list32(dev, dev_priv, pl32->list, &msgs32.count,
+				    NULL);
 
 	/* copy the count of msgs received */
-	if (copy_to_user(pl32, pl, sizeof(*pl32))) {
+	if (copy_to_user(pl32, &msgs32, sizeof(*pl32))) {
 		pr_err(DEVICE_NAME
 			": %s(%u): copy_to_user() failure\n",
 			__func__, __LINE__);
 		err = -EFAULT;
-		goto lbl_free;
 	}
 
-	/* copy the msgs received */
-	for (i = 0; i < pl->count; i++) {
-		struct pcanfd_msg32 m32;
+	return err;
+}
 
-		copy_to_msg32(&m32, &pl->list[i].msg);
+/* same as above with the user list given by its address */
+static int handle_pcanfd_send_msgs_list32(struct pcandev *dev,
+					  void __user *up,
+					  struct pcan_udata *dev_priv)
+{
+	struct pcanfd_msgs_list __user *plu = up;
+	struct pcanfd_msgs_list ml;
+	int err;
 
-		if (copy_to_user(&pl32->list[i], &m32, sizeof(m32))) {
-			pr_err(DEVICE_NAME
-				": %s(%u): copy_to_user() failure\n",
-				__func__, __LINE__);
-			err = -EFAULT;
-			break;
-		}
+	if (copy_from_user(&ml, up, sizeof(ml))) {
+		pr_err(DEVICE_NAME ": %s(%u): copy_from_user() failure\n",
+			__func__, __LINE__);
+		return -EFAULT;
 	}
 
-lbl_free:
-	pcan_free(pl);
+	err = pcan_send_msgs_list32(dev, dev_priv,
+				    compat_ptr((compat_uptr_t )ml.list),
+				    &ml.count, NULL);
+
+	/* copy the count of msgs really sent */
+	if (copy_to_user(&plu->count, &ml.count, sizeof(ml.count))) {
+		pr_err(DEVICE_NAME ": %s(%u): copy_to_user() failure\n",
+			__func__, __LINE__);
+		err = -EFAULT;
+	}
+
+	return err;
+}
+
+static int handle_pcanfd_recv_msgs_list32(struct pcandev *dev,
+					  void __user *up,
+					  struct pcan_udata *dev_priv)
+{
+	struct pcanfd_msgs_list __user *plu = up;
+	struct pcanfd_msgs_list ml;
+	int err;
+
+	if (copy_from_user(&ml, up, sizeof(ml))) {
+		pr_err(DEVICE_NAME ": %s(%u): copy_from_user() failure\n",
+			__func__, __LINE__);
+		return -EFAULT;
+	}
+
+	err = pcan_recv_msgs_list32(dev, dev_priv,
+				    compat_ptr((compat_uptr_t )ml.list),
+				    &ml.count, NULL);
+
+	/* copy the count of msgs received */
+	if (copy_to_user(&plu->count, &ml.count, sizeof(ml.count))) {
+		pr_err(DEVICE_NAME ": %s(%u): copy_to_user() failure\n",
+			__func__, __LINE__);
+		err = -EFAULT;
+	}
+
+	return err;
+}
+
+static int handle_pcanfd_recv_msgs_timeout32(struct pcandev *dev,
+					     void __user *up,
+					     struct pcan_udata *dev_priv)
+{
+	struct pcanfd_msgs_timeout __user *plu = up;
+	struct pcanfd_msgs_timeout rxt;
+	int err;
+
+	if (copy_from_user(&rxt, up, sizeof(rxt))) {
+		pr_err(DEVICE_NAME ": %s(%u): copy_from_user() failure\n",
+			__func__, __LINE__);
+		return -EFAULT;
+	}
+
+	err = pcan_recv_msgs_list32(dev, dev_priv,
+				    compat_ptr((compat_uptr_t )rxt.list),
+				    &rxt.count, &rxt);
+
+	/* copy the count of msgs received */
+	if (copy_to_user(&plu->count, &rxt.count, sizeof(rxt.count))) {
+		pr_err(DEVICE_NAME ": %s(%u): copy_to_user() failure\n",
+			__func__, __LINE__);
+		err = -EFAULT;
+	}
 
 	return err;
 }
@@ -938,33 +1179,14 @@ static int handle_pcanfd_get_option32(struct pcandev *dev, void __user *up,
 		return -EINVAL;
 	}
 
-	if (!dev->option[opt32.name].get) {
-		return -EOPNOTSUPP;
-	}
-
-	if (dev->option[opt32.name].req_size > 0)
-
-		/* if user option buffer size is too small, return the 
-		 * requested size with -ENOSPC */
-		if (opt32.size < dev->option[opt32.name].req_size) {
-			pr_warn(DEVICE_NAME
-				": invalid option size %d < %d for option %d\n",
-				opt32.size, dev->option[opt32.name].req_size,
-				opt32.name);
-			opt.size = dev->option[opt32.name].req_size;
-			err = -ENOSPC;
-			goto lbl_cpy_size;
-		}
-
 	opt.name = opt32.name;
 	opt.size = opt32.size;
 	opt.value = compat_ptr(opt32.value);
 
-	err = dev->option[opt32.name].get(dev, &opt, c);
+	err = pcan_get_option(dev, dev_priv, &opt, c);
 	if (err && err != -ENOSPC)
 		return err;
 
-lbl_cpy_size:
 	/* update 'size' field */
 	if (pcan_copy_to_user(up+offsetof(struct pcanfd_option32, size),
 			 &opt.size, sizeof(opt.size), c)) {
@@ -998,15 +1220,11 @@ static int handle_pcanfd_set_option32(struct pcandev *dev, void __user *up,
 		return -EINVAL;
 	}
 
-	if (!dev->option[opt32.name].set) {
-		return -EOPNOTSUPP;
-	}
-
 	opt.name = opt32.name;
 	opt.size = opt32.size;
 	opt.value = compat_ptr(opt32.value);
 
-	return dev->option[opt.name].set(dev, &opt, c);
+	return pcan_set_option(dev, dev_priv, &opt, c);
 }
 
 static long pcan_compat_ioctl(struct file *filep, unsigned int cmd,
@@ -1102,6 +1320,18 @@ static long pcan_compat_ioctl(struct file *filep, unsigned int cmd,
 		err = handle_pcanfd_recv_msgs32(dev, argp, dev_priv);
 		break;
 
+	case PCANFD_RECV_MSGS_TIMEOUT:
+		err = handle_pcanfd_recv_msgs_timeout32(dev, argp, dev_priv);
+		break;
+
+	case PCANFD_SEND_MSGS_LIST:
+		err = handle_pcanfd_send_msgs_list32(dev, argp, dev_priv);
+		break;
+
+	case PCANFD_RECV_MSGS_LIST:
+		err = handle_pcanfd_recv_msgs_list32(dev, argp, dev_priv);
+		break;
+
 	case PCANFD_GET_OPTION32:
 		err = handle_pcanfd_get_option32(dev, argp, dev_priv, NULL);
 		break;
@@ -1121,6 +1351,68 @@ static long pcan_compat_ioctl(struct file *filep, unsigned int cmd,
 /*
  * is called when read from the path
  */
+#ifndef NETDEV_SUPPORT
+/*
+ * PCANFD_RW_MODE_RECORDS read(): read as many msgs as can be stored in the
+ * user buffer, without waiting anymore once one at least has been read.
+ */
+static ssize_t pcan_read_records(struct pcandev *dev,
+				 struct pcan_udata *dev_priv,
+				 char __user *buf, size_t count)
+{
+	int n, l, err, rec_size = sizeof(struct pcanfd_msg);
+	struct pcanfd_rxmsgs *pl;
+	void *pm;
+
+#ifdef PCAN_CONFIG_COMPAT
+	if (pcan_is_compat_task())
+		rec_size = sizeof(struct pcanfd_msg32);
+#endif
+	if (count < rec_size)
+		return -EINVAL;
+
+	/* no need to read more msgs than the Rx fifo can store */
+	n = count / rec_size;
+	if (!dev_priv->rx_ring && n > pcan_rx_fifo(dev, dev_priv)->nCount)
+		n = pcan_rx_fifo(dev, dev_priv)->nCount;
+
+	l = sizeof(*pl) + n * sizeof(pl->list[0]);
+	pl = pcan_get_msgs_buf(&dev_priv->rx_msgs, l);
+	if (!pl) {
+		pr_err(DEVICE_NAME ": %s(): failed to alloc msgs list\n",
+			__func__);
+		return -ENOMEM;
+	}
+
+	pl->count = n;
+	err = pcanfd_ioctl_recv_msgs(dev, pl, dev_priv);
+	if (!pl->count)
+		goto lbl_free;
+
+#ifdef PCAN_CONFIG_COMPAT
+	if (rec_size != sizeof(struct pcanfd_msg)) {
+		copy_to_msgs32(pl->list, pl->count);
+		pm = pl->list;
+	} else
+#endif
+		pm = copy_to_msgs(pl->list, pl->count);
+
+	l = pl->count * rec_size;
+	if (copy_to_user(buf, pm, l)) {
+		pr_err(DEVICE_NAME ": %s(%u): copy_to_user() failure\n",
+			__func__, __LINE__);
+		err = -EFAULT;
+	} else {
+		err = l;
+	}
+
+lbl_free:
+	pcan_put_msgs_buf(&dev_priv->rx_msgs, pl);
+
+	return err;
+}
+#endif
+
 static ssize_t pcan_read(struct file *filep, char *buf, size_t count,
 								loff_t *f_pos)
 {
@@ -1135,6 +1427,16 @@ static ssize_t pcan_read(struct file *filep, char *buf, size_t count,
 	pr_info(DEVICE_NAME ": %s(CAN%u)\n", __func__, dev->nChannel+1);
 #endif
 
+#ifndef NETDEV_SUPPORT
+	if (dev_priv->rw_mode == PCANFD_RW_MODE_RECORDS) {
+		len = pcan_read_records(dev, dev_priv, buf, count);
+		if (len > 0)
+			*f_pos += len;
+
+		return pcan_put_dev(dev, len);
+	}
+#endif
+
 	if (dev_priv->nReadRest <= 0) {
 		err = pcanfd_ioctl_recv_msg(dev, &rx, dev_priv);
 		if (err)
@@ -1248,6 +1550,64 @@ lbl_err:
 	return pcan_put_dev(dev, err);
 }
 
+/*
+ * PCANFD_RW_MODE_RECORDS write(): write as many msgs as the user buffer
+ * contains (incomplete trailing record is ignored).
+ */
+static ssize_t pcan_write_records(struct pcandev *dev,
+				  struct pcan_udata *dev_priv,
+				  const char __user *buf, size_t count)
+{
+	int n, l, err, rec_size = sizeof(struct pcanfd_msg);
+	struct pcanfd_txmsgs *pl;
+
+#ifdef PCAN_CONFIG_COMPAT
+	if (pcan_is_compat_task())
+		rec_size = sizeof(struct pcanfd_msg32);
+#endif
+	if (count < rec_size)
+		return -EINVAL;
+
+	/* no need to write more msgs than the Tx fifo can store */
+	n = count / rec_size;
+	if (n > dev->writeFifo.nCount)
+		n = dev->writeFifo.nCount;
+
+	l = sizeof(*pl) + n * sizeof(pl->list[0]);
+	pl = pcan_get_msgs_buf(&dev_priv->tx_msgs, l);
+	if (!pl) {
+		pr_err(DEVICE_NAME ": %s(): failed to alloc msgs list\n",
+			__func__);
+		return -ENOMEM;
+	}
+
+	/* copy all the records at once at the beginning of the list... */
+	if (copy_from_user(pl->list, buf, n * rec_size)) {
+		pr_err(DEVICE_NAME ": %s(%u): copy_from_user() failure\n",
+			__func__, __LINE__);
+		err = -EFAULT;
+		goto lbl_free;
+	}
+
+	/* ...then spread them into the txmsgs */
+#ifdef PCAN_CONFIG_COMPAT
+	if (rec_size != sizeof(struct pcanfd_msg))
+		copy_from_msgs32(pl->list, n);
+	else
+#endif
+		copy_from_msgs(pl->list, n);
+
+	pl->count = n;
+	err = pcanfd_ioctl_send_msgs(dev, pl, dev_priv);
+	if (pl->count)
+		err = pl->count * rec_size;
+
+lbl_free:
+	pcan_put_msgs_buf(&dev_priv->tx_msgs, pl);
+
+	return err;
+}
+
 static ssize_t pcan_write(struct file *filep, const char *buf, size_t count,
 								loff_t *f_pos)
 {
@@ -1264,6 +1624,14 @@ static ssize_t pcan_write(struct file *filep, const char *buf, size_t count,
 	pr_info(DEVICE_NAME ": %s(CAN%u)\n", __func__, dev->nChannel+1);
 #endif
 
+	if (dev_priv->rw_mode == PCANFD_RW_MODE_RECORDS) {
+		err = pcan_write_records(dev, dev_priv, buf, count);
+		if (err > 0)
+			*f_pos += err;
+
+		return pcan_put_dev(dev, err);
+	}
+
 	/* calculate remaining buffer space */
 	dwRest = WRITEBUFFER_SIZE -
 		(dev_priv->pcWritePointer - dev_priv->pcWriteBuffer); /* nRest > 0! */
@@ -1312,7 +1680,8 @@ static unsigned int pcan_poll(struct file *filep, poll_table *wait)
 {
 	unsigned int mask = 0;
 
-	struct pcandev *dev = pcan_get_dev(filep->private_data);
+	struct pcan_udata *dev_priv = filep->private_data;
+	struct pcandev *dev = pcan_get_dev(dev_priv);
 	if (!dev)
 		return POLLERR;
 
@@ -1323,15 +1692,26 @@ static unsigned int pcan_poll(struct file *filep, poll_table *wait)
 	pcan_mutex_lock(&dev->mutex);
 
 #ifndef NETDEV_SUPPORT
-	poll_wait(filep, &dev->in_event, wait);
+	/* a path that coalesces its Rx wake-ups is woken up on its own */
+	if (dev_priv->rx_coalesced)
+		poll_wait(filep, &dev_priv->rx_event, wait);
+	else
+		poll_wait(filep, &dev->in_event, wait);
 #endif
 	poll_wait(filep, &dev->out_event, wait);
 
 	/* return on ops that could be performed without
 	 * blocking */
 #ifndef NETDEV_SUPPORT
-	if (!pcan_fifo_empty(&dev->readFifo))
+	if (dev_priv->rx_coalesced) {
+		if (pcan_rx_coalesce_ready(dev_priv))
+			mask |= POLLIN | POLLRDNORM;
+	} else if (dev_priv->rx_ring) {
+		if (!pcan_rx_ring_empty(dev_priv))
+			mask |= POLLIN | POLLRDNORM;
+	} else if (!pcan_fifo_empty(pcan_rx_fifo(dev, dev_priv))) {
 		mask |= POLLIN | POLLRDNORM;
+	}
 #endif
 	if (!pcan_fifo_full(&dev->writeFifo))
 		mask |= POLLOUT | POLLWRNORM;
@@ -1341,6 +1721,102 @@ static unsigned int pcan_poll(struct file *filep, poll_table *wait)
 	return pcan_put_dev(dev, mask);
 }
 
+#ifndef NETDEV_SUPPORT
+/* max count of msgs in the mmap() Rx ring of an open path */
+#define PCAN_RX_RING_MAX	65536
+
+/* each mapping of the Rx ring holds a reference on its memory, so that it
+ * can't be released before being unmapped */
+static void pcan_rx_ring_vm_open(struct vm_area_struct *vma)
+{
+	pcan_rx_ring_mem_get(vma->vm_private_data);
+}
+
+static void pcan_rx_ring_vm_close(struct vm_area_struct *vma)
+{
+	pcan_rx_ring_mem_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct pcan_rx_ring_vm_ops = {
+	.open = pcan_rx_ring_vm_open,
+	.close = pcan_rx_ring_vm_close,
+};
+
+/*
+ * is called at user mmap(): give the open path its own Rx ring, shared with
+ * the application (see struct pcanfd_rx_ring in pcanfd.h). The count of msgs
+ * of the ring is deduced from the length of the mapping.
+ */
+static int pcan_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	struct pcan_udata *dev_priv = filep->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct pcan_rx_ring_mem *rm;
+	struct pcanfd_rx_ring *ring;
+	struct pcandev *dev;
+	u32 count;
+	int err;
+
+	/* the ring is written by both the driver and the application */
+	if (vma->vm_pgoff || !(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	/* struct pcanfd_msg layout differs for 32-bit tasks on 64-bit hosts */
+#ifdef PCAN_CONFIG_COMPAT
+	if (pcan_is_compat_task())
+		return -EOPNOTSUPP;
+#endif
+
+	if (size <= PAGE_SIZE)
+		return -EINVAL;
+
+	count = (size - PAGE_SIZE) / sizeof(struct pcanfd_msg);
+	if (count < 2 || count > PCAN_RX_RING_MAX)
+		return -EINVAL;
+
+	count = rounddown_pow_of_two(count);
+
+	dev = pcan_get_dev(dev_priv);
+	if (!dev)
+		return -ENODEV;
+
+	rm = pcan_rx_ring_mem_alloc(size);
+	if (!rm) {
+		pr_err(DEVICE_NAME ": %s(): memory allocation failed!\n",
+			__func__);
+		return pcan_put_dev(dev, -ENOMEM);
+	}
+
+	ring = rm->ring;
+	ring->magic = PCANFD_RX_RING_MAGIC;
+	ring->msg_count = count;
+	ring->msg_size = sizeof(struct pcanfd_msg);
+	ring->msgs_offset = PAGE_SIZE;
+
+	/* from now, the driver writes received msgs into the ring. This is
+	 * done before mapping it, so that nothing has to be unmapped if the
+	 * path already has its own Rx fifo or ring */
+	err = pcan_rx_ring_attach(dev, dev_priv, rm, count);
+	if (err) {
+		pcan_rx_ring_mem_put(rm);
+		return pcan_put_dev(dev, err);
+	}
+
+	err = remap_vmalloc_range(vma, ring, 0);
+	if (err) {
+		pcan_rx_fifo_detach(dev, dev_priv);
+		return pcan_put_dev(dev, err);
+	}
+
+	/* vm_ops->open() isn't called for the first mapping */
+	pcan_rx_ring_mem_get(rm);
+	vma->vm_private_data = rm;
+	vma->vm_ops = &pcan_rx_ring_vm_ops;
+
+	return pcan_put_dev(dev, 0);
+}
+#endif
+
 /*
  * this structure is used in init_module(void)
  */
@@ -1364,4 +1840,7 @@ struct file_operations pcan_fops = {
 	compat_ioctl: pcan_compat_ioctl,
 #endif
 	poll:       pcan_poll,
+#ifndef NETDEV_SUPPORT
+	mmap:       pcan_mmap,
+#endif
 };
@@ -123,6 +123,15 @@ static int pcan_open_nrt(struct rtdm_dev_context *context,
 	ctx->nWriteCount = 0;
 	ctx->pcWritePointer = ctx->pcWriteBuffer;
 
+	pcan_init_msgs_bufs(ctx);
+	ctx->rx_fifo_msgs = NULL;
+	ctx->rx_ring = NULL;
+	ctx->rw_mode = PCANFD_RW_MODE_TEXT;
+	ctx->filter = NULL;
+	ctx->bpf = NULL;
+	ctx->filters_scope = pathfilters ? PCANFD_FILTERS_SCOPE_PATH :
+					   PCANFD_FILTERS_SCOPE_DEVICE;
+
 	return pcan_open_path(dev, ctx);
 }
 
@@ -155,6 +164,13 @@ static int pcan_close_nrt(struct rtdm_dev_context *context,
 			rtdm_in_rt_context());
 #endif
 
+#ifndef NETDEV_SUPPORT
+	/* stop receiving msgs into the private Rx fifo (if any) */
+	pcan_rx_fifo_detach(dev, ctx);
+	ctx->filter = pcan_delete_filter_chain(ctx->filter);
+	ctx->bpf = pcan_bpf_free(ctx->bpf);
+#endif
+
 	if (dev) {
 		pcan_release_path(dev, ctx);
 		ctx->dev = NULL;
@@ -163,6 +179,8 @@ static int pcan_close_nrt(struct rtdm_dev_context *context,
 #endif
 	}
 
+	pcan_free_msgs_bufs(ctx);
+
 #ifndef XENOMAI3
 	return 0;
 #endif
@@ -454,6 +472,7 @@ static int pcan_ioctl_rt(struct rtdm_dev_context *context,
 	struct pcanfd_state fds;
 	struct pcanfd_rxmsg rx;
 	struct pcanfd_txmsg tx;
+	void *filter;
 	int l, err;
 
 	struct pcandev *dev = pcan_get_dev(ctx);
@@ -542,9 +561,12 @@ static int pcan_ioctl_rt(struct rtdm_dev_context *context,
 			if (err)
 				return -EFAULT;
 
-			err = pcanfd_ioctl_add_filter(dev, &mf);
+			err = pcan_get_filter_chain(dev, ctx, 1, &filter);
+			if (!err)
+				err = pcanfd_ioctl_add_filter(dev, filter, &mf);
 		} else {
-			err = pcanfd_ioctl_add_filter(dev, NULL);
+			pcan_get_filter_chain(dev, ctx, 0, &filter);
+			err = pcanfd_ioctl_add_filter(dev, filter, NULL);
 		}
 		break;
 #endif
@@ -573,11 +595,15 @@ static int pcan_ioctl_rt(struct rtdm_dev_context *context,
 				return -EFAULT;
 			}
 
-			err = pcanfd_ioctl_add_filters(dev, pfl);
+			err = pcan_get_filter_chain(dev, ctx, 1, &filter);
+			if (!err)
+				err = pcanfd_ioctl_add_filters(dev, filter,
+							       pfl);
 
 			pcan_free(pfl);
 		} else {
-			err = pcanfd_ioctl_add_filters(dev, NULL);
+			pcan_get_filter_chain(dev, ctx, 0, &filter);
+			err = pcanfd_ioctl_add_filters(dev, filter, NULL);
 		}
 		break;
 
@@ -603,7 +629,8 @@ static int pcan_ioctl_rt(struct rtdm_dev_context *context,
 			}
 
 			pfl->count = mfl.count;
-			err = pcanfd_ioctl_get_filters(dev, pfl);
+			pcan_get_filter_chain(dev, ctx, 0, &filter);
+			err = pcanfd_ioctl_get_filters(dev, filter, pfl);
 
 			/* copy the count and the filter received */
 			l = sizeof(struct pcanfd_msg_filters_0) +
@@ -617,7 +644,44 @@ static int pcan_ioctl_rt(struct rtdm_dev_context *context,
 
 			pcan_free(pfl);
 		} else {
-			err = pcanfd_ioctl_get_filters(dev, NULL);
+			pcan_get_filter_chain(dev, ctx, 0, &filter);
+			err = pcanfd_ioctl_get_filters(dev, filter, NULL);
+		}
+		break;
+
+	case PCANFD_SET_BPF:
+		if (arg) {
+			struct pcanfd_bpf_insns bi, *pbi;
+
+			l = sizeof(struct pcanfd_bpf_insns_0);
+			err = copy_from_user_rt(user_info, &bi, up, l);
+			if (err)
+				return -EFAULT;
+
+			if (!bi.count)
+				return pcan_set_bpf(dev, ctx, NULL, 0);
+
+			if (bi.count > PCANFD_BPF_MAXINSNS)
+				return -EINVAL;
+
+			l += bi.count * sizeof(struct pcanfd_bpf_insn);
+			pbi = pcan_malloc(l, GFP_KERNEL);
+			if (!pbi) {
+				pr_err("%s: failed to alloc BPF program\n",
+						DEVICE_NAME);
+				return -ENOMEM;
+			}
+
+			if (copy_from_user_rt(user_info, pbi, up, l)) {
+				pcan_free(pbi);
+				return -EFAULT;
+			}
+
+			err = pcan_set_bpf(dev, ctx, pbi->list, bi.count);
+
+			pcan_free(pbi);
+		} else {
+			err = pcan_set_bpf(dev, ctx, NULL, 0);
 		}
 		break;
 
@@ -647,6 +711,18 @@ static int pcan_ioctl_rt(struct rtdm_dev_context *context,
 		err = handle_pcanfd_recv_msgs(dev, up, ctx, user_info);
 		break;
 
+	case PCANFD_RECV_MSGS_TIMEOUT:
+		err = handle_pcanfd_recv_msgs_timeout(dev, up, ctx, user_info);
+		break;
+
+	case PCANFD_SEND_MSGS_LIST:
+		err = handle_pcanfd_send_msgs_list(dev, up, ctx, user_info);
+		break;
+
+	case PCANFD_RECV_MSGS_LIST:
+		err = handle_pcanfd_recv_msgs_list(dev, up, ctx, user_info);
+		break;
+
 	case PCANFD_GET_AVAILABLE_CLOCKS:
 		err = handle_pcanfd_get_av_clocks(dev, up, ctx, user_info);
 		break;
@@ -685,9 +761,12 @@ static int pcan_ioctl_nrt(struct rtdm_dev_context *context,
 	case PCAN_WRITE_MSG:
 	case PCANFD_SEND_MSG:
 	case PCANFD_SEND_MSGS:
+	case PCANFD_SEND_MSGS_LIST:
 	case PCAN_READ_MSG:
 	case PCANFD_RECV_MSG:
 	case PCANFD_RECV_MSGS:
+	case PCANFD_RECV_MSGS_TIMEOUT:
+	case PCANFD_RECV_MSGS_LIST:
 		pr_warn(DEVICE_NAME
 			": WARNING[%p] ioctl(%x) called from non RT context!\n",
 			rtdm_task_current(), _IOC_NR(cmd));
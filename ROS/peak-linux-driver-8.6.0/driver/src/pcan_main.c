@@ -48,6 +48,7 @@
 /* #define KBUILD_MODNAME pcan */
 
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/fs.h>
 #include <linux/errno.h>
 #include <linux/proc_fs.h>
@@ -115,10 +116,15 @@
 #ifdef NETDEV_SUPPORT
 #include "src/pcan_netdev.h"
 #endif
+#ifdef VIRTUAL_SUPPORT
+#include "src/pcan_virtual.h"
+#endif
 
 #include "src/pcanfd_core.h"
 #include "src/pcan_fifo.h"
 #include "src/pcan_filter.h"
+#include "src/pcan_bpf.h"
+#include "src/pcan_ptp.h"
 #include "src/pcan_sja1000.h"
 
 /* if defined, timestamp in Rx event ISNOT hardware based 
@@ -141,6 +147,19 @@
 #define PCAN_CLOCK_DRIFT_SCALE_SHIFT	17
 #define PCAN_CLOCK_DRIFT_SCALE		(1<<(PCAN_CLOCK_DRIFT_SCALE_SHIFT))
 
+/* clock estimator:
+ * - a new sample is an outlier if it is farther from the current model than
+ *   4 x the rms residual, and than PCAN_CLK_EST_OUTLIER_US,
+ * - outliers are rejected once the model is made of at least
+ *   PCAN_CLK_EST_MIN_SAMPLES samples,
+ * - after PCAN_CLK_EST_MAX_OUTLIERS consecutive outliers, one of the clocks
+ *   is considered as having jumped: the model restarts from the last sample,
+ * - skews greater than PCAN_CLK_EST_SKEW_MAX (~0.8%) are ignored. */
+#define PCAN_CLK_EST_OUTLIER_US		250
+#define PCAN_CLK_EST_MIN_SAMPLES	4
+#define PCAN_CLK_EST_MAX_OUTLIERS	3
+#define PCAN_CLK_EST_SKEW_MAX		(1LL<<(PCAN_CLOCK_MULT_SHIFT-7))
+
 #endif /* PCAN_HANDLE_CLOCK_DRIFT */
 
 #define DEFAULT_BTR0BTR1	CAN_BAUD_500K	/* defaults to 500 kbit/sec */
@@ -198,6 +217,9 @@ const char current_config[] = " "
 #ifdef NETDEV_SUPPORT
 "[net] "
 #endif
+#ifdef VIRTUAL_SUPPORT
+"[vir] "
+#endif
 #ifndef NO_RT
 "[rt] "
 #endif
@@ -209,6 +231,10 @@ const char current_config[] = " "
 #define PCAN_DEV_TXQSIZE_MIN	50
 #define PCAN_DEV_TXQSIZE_MAX	999
 
+/* private Rx fifo of an open path (see PCANFD_OPT_RX_FIFO_SIZE) */
+#define PCAN_PRIV_RXQSIZE_MIN	PCAN_DEV_RXQSIZE_MIN
+#define PCAN_PRIV_RXQSIZE_MAX	65535
+
 extern ushort rxqsize;
 extern ushort txqsize;
 
@@ -532,6 +558,12 @@ static ssize_t show_clk_drift(struct device *dev,
 	return show_u32(buf, to_pcandev(dev)->time_sync.clock_drift);
 }
 
+static ssize_t show_clk_residual(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return show_u32(buf, to_pcandev(dev)->time_sync.residual_us);
+}
+
 static ssize_t show_pcan_irq(struct device *dev,
 				struct device_attribute *attr, char *buf)
 {
@@ -558,7 +590,7 @@ static ssize_t show_pcan_read(struct device *dev,
 	u32 dev_read = (stats) ? stats->rx_packets : 0;
 
 #else
-	u32 dev_read = pdev->readFifo.dwTotal;
+	u32 dev_read = pcan_fifo_total(&pdev->readFifo);
 #endif
 	return show_u32(buf, dev_read);
 }
@@ -573,7 +605,7 @@ static ssize_t show_pcan_write(struct device *dev,
 	u32 dev_write = (stats) ? stats->tx_packets : 0;
 
 #else
-	u32 dev_write = pdev->writeFifo.dwTotal;
+	u32 dev_write = pcan_fifo_total(&pdev->writeFifo);
 #endif
 	return show_u32(buf, dev_write);
 }
@@ -628,6 +660,7 @@ static PCAN_DEVICE_ATTR(status, status, show_pcan_status);
 static PCAN_DEVICE_ATTR(rx_fifo_ratio, rx_fifo_ratio, show_rx_fifo_ratio);
 static PCAN_DEVICE_ATTR(tx_fifo_ratio, tx_fifo_ratio, show_tx_fifo_ratio);
 static PCAN_DEVICE_ATTR(clk_drift, clk_drift, show_clk_drift);
+static PCAN_DEVICE_ATTR(clk_residual, clk_residual, show_clk_residual);
 
 static struct attribute *pcan_dev_sysfs_attrs[] = {
 	//&pcan_dev_attr_devid.attr,
@@ -660,6 +693,7 @@ static struct attribute *pcan_dev_sysfs_attrs[] = {
 	&pcan_dev_attr_rx_fifo_ratio.attr,
 	&pcan_dev_attr_tx_fifo_ratio.attr,
 	&pcan_dev_attr_clk_drift.attr,
+	&pcan_dev_attr_clk_residual.attr,
 	NULL
 };
 
@@ -867,11 +901,15 @@ void pcan_sysfs_dev_node_create_ex(struct pcandev *dev, struct device *parent)
 #else
 	dev->sysfs_dev = NULL;
 #endif
+
+	pcan_ptp_register(dev);
 }
 
 /* destroy a UDEV allocated device node */
 void pcan_sysfs_dev_node_destroy(struct pcandev *dev)
 {
+	pcan_ptp_unregister(dev);
+
 #ifdef SYSFS_SUPPORT
 #ifdef DEBUG
 	pr_info(DEVICE_NAME ": %s(%p=\"%s\")\n",
@@ -950,11 +988,174 @@ static int pcan_do_count_msgs_type(void *item, void *arg)
 }
 #endif
 
+/* timestamp an event with the host time (no hw timestamp) */
+static void pcan_sync_host_time(struct pcandev *dev, struct pcan_timeval *hwtv)
+{
+	hwtv->ts_mode = PCANFD_OPT_HWTIMESTAMP_OFF;
+	pcan_gettimeofday(&hwtv->tv);
+
+	/* don't read another clock if not needed */
+	if (pcan_ts_mono_ns(dev))
+		hwtv->tv_mono_ns = pcan_getmono_ns();
+}
+
 void pcan_sync_init(struct pcandev *dev)
 {
 	memset(&dev->time_sync, '\0', sizeof(dev->time_sync));
+	memset(&dev->clock_est, '\0', sizeof(dev->clock_est));
+}
+
+#ifdef PCAN_HANDLE_CLOCK_DRIFT
+/*
+ * The clock estimator fits tv_us = a + ts_us * (1 + skew) by least squares
+ * over the last PCAN_CLK_EST_SAMPLES (ts_us, tv_us) sync samples, so that
+ * the latency jitter of each sample (USB...) is averaged rather than being
+ * copied into the timestamps of all the msgs until the next sync.
+ *
+ * Computations are made relatively to the oldest sample: x = device µs, and
+ * y = host µs - x, that is, the deviation between both clocks, which remains
+ * small enough to be handled with 64-bit integers.
+ */
+static void pcan_clock_est_reset(struct pcan_clock_est *est,
+				 u64 ts_us, u64 tv_us)
+{
+	/* a clock jump doesn't change the skew */
+	s64 skew = est->skew;
+
+	memset(est, '\0', sizeof(*est));
+
+	est->ts_us[0] = est->est_ts_us = ts_us;
+	est->tv_us[0] = est->est_tv_us = tv_us;
+	est->count = 1;
+	est->skew = skew;
+}
+
+/* host time given by the model for the device time ts_us */
+static u64 pcan_clock_est_tv(struct pcan_clock_est *est, u64 ts_us)
+{
+	s64 dx = ts_us - est->est_ts_us;
+
+	return est->est_tv_us + dx +
+			((dx * est->skew) >> PCAN_CLOCK_MULT_SHIFT);
+}
+
+static void pcan_clock_est_fit(struct pcan_clock_est *est)
+{
+	const u64 ts0 = est->ts_us[est->head];
+	const u64 tv0 = est->tv_us[est->head];
+	s64 sx = 0, sy = 0, sxx = 0, sxy = 0;
+	s64 x, y, xm, ym;
+	u64 sr2 = 0;
+	int i, k;
+
+#define for_each_sample(est, i, k)					\
+	for (k = 0, i = (est)->head; k < (est)->count;			\
+	     k++, i = (i + 1) % PCAN_CLK_EST_SAMPLES)
+
+#define sample_xy(est, i)						\
+	do {								\
+		x = (est)->ts_us[i] - ts0;				\
+		y = (est)->tv_us[i] - tv0 - x;				\
+	} while (0)
+
+	for_each_sample(est, i, k) {
+		sample_xy(est, i);
+		sx += x;
+		sy += y;
+	}
+
+	xm = div_s64(sx, est->count);
+	ym = div_s64(sy, est->count);
+
+	for_each_sample(est, i, k) {
+		sample_xy(est, i);
+		sxx += (x - xm) * (x - xm);
+		sxy += (x - xm) * (y - ym);
+	}
+
+	/* skew = sxy / sxx << PCAN_CLOCK_MULT_SHIFT. Keep the previous one if
+	 * the samples are too few, don't span enough time or are
+	 * meaningless. */
+	if (est->count >= PCAN_CLK_EST_MIN_SAMPLES && (sxx >> 16) &&
+	    (sxy < 0 ? -sxy : sxy) < (1LL << 47)) {
+		s64 skew = div64_s64(sxy * (1LL << 15), sxx >> 16);
+
+		if ((skew < 0 ? -skew : skew) <= PCAN_CLK_EST_SKEW_MAX)
+			est->skew = skew;
+	}
+
+	for_each_sample(est, i, k) {
+		s64 r;
+
+		sample_xy(est, i);
+		r = y - ym - (((x - xm) * est->skew) >> PCAN_CLOCK_MULT_SHIFT);
+		if (r < 0)
+			r = -r;
+		if (r > 0xffff)
+			r = 0xffff;
+
+		sr2 += r * r;
+	}
+
+	est->residual_us = int_sqrt((unsigned long )div_u64(sr2, est->count));
+
+	/* the new sync point is the model of the most recent sample */
+	i = (est->head + est->count - 1) % PCAN_CLK_EST_SAMPLES;
+	sample_xy(est, i);
+
+	est->est_ts_us = est->ts_us[i];
+	est->est_tv_us = tv0 + x + ym +
+			(((x - xm) * est->skew) >> PCAN_CLOCK_MULT_SHIFT);
+
+#undef sample_xy
+#undef for_each_sample
 }
 
+/* return 0 if the sample (ts_us, tv_us) is rejected as an outlier */
+static int pcan_clock_est_add(struct pcan_clock_est *est,
+			      u64 ts_us, u64 tv_us)
+{
+	int i;
+
+	/* after an outlier, wait for the next sync period too (syncs are
+	 * requested every second, but sampled with jitter) */
+	if (est->rejected && tv_us - est->last_tv_us < USEC_PER_SEC / 2)
+		return 0;
+
+	est->last_tv_us = tv_us;
+
+	if (est->count >= PCAN_CLK_EST_MIN_SAMPLES) {
+		s64 r = tv_us - pcan_clock_est_tv(est, ts_us);
+		s64 r_max = max_t(s64, 4 * est->residual_us,
+				  PCAN_CLK_EST_OUTLIER_US);
+
+		if ((r < 0 ? -r : r) > r_max) {
+			if (++est->rejected < PCAN_CLK_EST_MAX_OUTLIERS)
+				return 0;
+
+			pcan_clock_est_reset(est, ts_us, tv_us);
+			return 1;
+		}
+	}
+
+	est->rejected = 0;
+
+	/* oldest sample is overwritten when the window is full */
+	i = (est->head + est->count) % PCAN_CLK_EST_SAMPLES;
+	if (est->count < PCAN_CLK_EST_SAMPLES)
+		est->count++;
+	else
+		est->head = (est->head + 1) % PCAN_CLK_EST_SAMPLES;
+
+	est->ts_us[i] = ts_us;
+	est->tv_us[i] = tv_us;
+
+	pcan_clock_est_fit(est);
+
+	return 1;
+}
+#endif /* PCAN_HANDLE_CLOCK_DRIFT */
+
 /*
  * fill the pqm->msg.timestamp field from pqm->hwtv to give to user.
  */
@@ -962,19 +1163,31 @@ struct pcanfd_msg *pcan_sync_timestamps(struct pcandev *dev,
 					struct pcanfd_rxmsg *pqm)
 {
 	struct pcanfd_msg *pm = &pqm->msg;
+	const int mono_ns = pcan_ts_mono_ns(dev);
 	int s = 1;
 	u64 dus;
 
 	/* fix hw timestamp */
 	pm->flags |= PCANFD_TIMESTAMP|PCANFD_HWTIMESTAMP;
+	if (mono_ns)
+		pm->flags |= PCANFD_TIMESTAMP_NS;
 
 	if (pqm->hwtv.ts_mode == PCANFD_OPT_HWTIMESTAMP_RAW) {
+		if (mono_ns) {
+			pm->timestamp_ns = pqm->hwtv.ts_us * NSEC_PER_USEC;
+			return pm;
+		}
+
 		pm->timestamp.tv_usec = do_div(pqm->hwtv.ts_us, USEC_PER_SEC);
 		pm->timestamp.tv_sec = (__kernel_time_t )pqm->hwtv.ts_us;
 		return pm;
 	}
 
-	pm->timestamp = pqm->hwtv.tv;
+	/* Note: timestamp and timestamp_ns share the same storage */
+	if (mono_ns)
+		pm->timestamp_ns = pqm->hwtv.tv_mono_ns;
+	else
+		pm->timestamp = pqm->hwtv.tv;
 
 	if (pqm->hwtv.ts_mode == PCANFD_OPT_HWTIMESTAMP_OFF) {
 		pm->flags &= ~PCANFD_HWTIMESTAMP;
@@ -998,19 +1211,20 @@ struct pcanfd_msg *pcan_sync_timestamps(struct pcandev *dev,
 
 #ifdef PCAN_HANDLE_CLOCK_DRIFT
 	if (pqm->hwtv.ts_mode == PCANFD_OPT_HWTIMESTAMP_COOKED &&
-		pqm->hwtv.clock_drift && 
-		pqm->hwtv.clock_drift != PCAN_CLOCK_DRIFT_SCALE) {
+		pqm->hwtv.clock_mult &&
+		pqm->hwtv.clock_mult != PCAN_CLOCK_MULT_ONE)
+		dus = mul_u64_u32_shr(dus, pqm->hwtv.clock_mult,
+				      PCAN_CLOCK_MULT_SHIFT);
+#endif
 
-		dus <<= PCAN_CLOCK_DRIFT_SCALE_SHIFT;
+	if (mono_ns) {
+		if (s > 0)
+			pm->timestamp_ns += dus * NSEC_PER_USEC;
+		else
+			pm->timestamp_ns -= dus * NSEC_PER_USEC;
 
-#ifdef CONFIG_64BITS
-		//dus = DIV_ROUND_UP(dus, pqm->hwtv.clock_drift);
-		dus /= pqm->hwtv.clock_drift;
-#else
-		do_div(dus, pqm->hwtv.clock_drift);
-#endif
+		return pm;
 	}
-#endif
 
 	timeval_add_us(&pm->timestamp, s*dus);
 
@@ -1019,10 +1233,11 @@ struct pcanfd_msg *pcan_sync_timestamps(struct pcandev *dev,
 		struct timeval now;
 		signed long dtv;
 
-		pcan_gettimeofday(&now);
+		/* no need of a precise time here */
+		pcan_gettimeofday_coarse(&now);
 
 		dtv = timeval_diff(&now, &pm->timestamp);
-		if (dtv < 0) {
+		if (dtv + (signed long )PCAN_COARSE_TIME_SLACK_US < 0) {
 		//if (timeval_is_older(&now, &pm->timestamp)) {
 #ifdef DEBUG_TS_FROM_THE_FUTURE
 #ifdef DEBUG_TS_HWTYPE
@@ -1065,14 +1280,14 @@ int pcan_sync_decode(struct pcandev *dev, u32 ts_low, u32 ts_high,
 		hwtv->ts_mode = dev->ts_mode;
 		hwtv->ts_us = ((u64 )ts_high << 32) | ts_low;
 		hwtv->tv = dev->time_sync.tv;
+		hwtv->tv_mono_ns = dev->time_sync.mono_ns;
 		hwtv->tv_us = dev->time_sync.ts_us;
-		hwtv->clock_drift = dev->time_sync.clock_drift;
+		hwtv->clock_mult = dev->time_sync.clock_mult;
 
 		return 1;
 	}
 #endif
-	hwtv->ts_mode = PCANFD_OPT_HWTIMESTAMP_OFF;
-	pcan_gettimeofday(&hwtv->tv);
+	pcan_sync_host_time(dev, hwtv);
 
 	return 0;
 }
@@ -1085,11 +1300,15 @@ int pcan_sync_times(struct pcandev *dev, u32 ts_low, u32 ts_high, int tv_off)
 {
 #ifndef PCAN_DONT_USE_HWTS
 	long dts_us, dtv_us;
+#ifdef PCAN_HANDLE_CLOCK_DRIFT
+	u64 mono_us;
+#endif
 	struct pcan_time_sync now = {
 		.ts_us = ((u64 )ts_high << 32) + ts_low,
 	};
 
 	pcan_gettimeofday_ex(&now.tv, &now.tv_ns);
+	now.mono_ns = pcan_getmono_ns();
 
 	if (!dev->time_sync.ts_us) {
 
@@ -1097,8 +1316,16 @@ int pcan_sync_times(struct pcandev *dev, u32 ts_low, u32 ts_high, int tv_off)
 
 		/* get host time between substract any host time offset */
 		dev->time_sync = now;
-		if (unlikely(tv_off < 0))
+		if (unlikely(tv_off < 0)) {
 			timeval_add_us(&dev->time_sync.tv, tv_off);
+			dev->time_sync.mono_ns += (s64 )tv_off * NSEC_PER_USEC;
+		}
+
+#ifdef PCAN_HANDLE_CLOCK_DRIFT
+		pcan_clock_est_reset(&dev->clock_est, now.ts_us,
+			div_u64(dev->time_sync.mono_ns, NSEC_PER_USEC));
+		pcan_ptp_sync(dev, &dev->clock_est);
+#endif
 
 #if defined(DEBUG_TS_DECODE) || defined(DEBUG_TS_SYNC)
 #ifdef DEBUG_TS_HWTYPE
@@ -1115,8 +1342,9 @@ int pcan_sync_times(struct pcandev *dev, u32 ts_low, u32 ts_high, int tv_off)
 		return 1;
 	}
 
-	/* doing sync only every s. is enough and saves CPU time */
-	dtv_us = timeval_to_us(&now.tv) - timeval_to_us(&dev->time_sync.tv);
+	/* doing sync only every s. is enough and saves CPU time.
+	 * Note: the monotonic clock isn't disturbed by time of day steps */
+	dtv_us = div_s64(now.mono_ns - dev->time_sync.mono_ns, NSEC_PER_USEC);
 	if (dtv_us < USEC_PER_SEC)
 		return 0;
 
@@ -1141,6 +1369,7 @@ int pcan_sync_times(struct pcandev *dev, u32 ts_low, u32 ts_high, int tv_off)
 	/* get host time between each sync and substract any host time offset */
 	if (unlikely(tv_off < 0)) {
 		timeval_add_us(&now.tv, tv_off);
+		now.mono_ns += (s64 )tv_off * NSEC_PER_USEC;
 		dtv_us += tv_off;
 	}
 
@@ -1157,31 +1386,35 @@ int pcan_sync_times(struct pcandev *dev, u32 ts_low, u32 ts_high, int tv_off)
 	}
 
 #ifdef PCAN_HANDLE_CLOCK_DRIFT
-	/* Now, calculate clock drift by comparing count of µs in both
-	 * times: */
 	/* ttv_us = count of host µs since start of sync */
 	now.ttv_us = dev->time_sync.ttv_us + dtv_us;
 
 	/* tts_us = count of hw µs since start of sync */
 	now.tts_us = dev->time_sync.tts_us + dts_us;
-	now.clock_drift = dev->time_sync.clock_drift;
 
-	/* just because of div64 and 32-bit archs */
-	if (now.ttv_us && now.ttv_us <= 0xffffffff) {
-		u64 d = now.tts_us << PCAN_CLOCK_DRIFT_SCALE_SHIFT;
+	/* feed the clock estimator with this new sample. If it is an outlier
+	 * (the host time has been read with a too large latency) keep the
+	 * current sync. The estimator runs on the monotonic clock so that
+	 * time of day steps aren't seen as outliers. */
+	mono_us = div_u64(now.mono_ns, NSEC_PER_USEC);
+	if (!pcan_clock_est_add(&dev->clock_est, now.ts_us, mono_us))
+		return 0;
 
-#ifdef CONFIG_64BITS
-		//now.clock_drift = DIV_ROUND_UP(d, now.ttv_us);
-		now.clock_drift = d / now.ttv_us;
-#else
-		do_div(d, (u32 )now.ttv_us);
-		now.clock_drift = (u32 )d;
+	/* the host time of the sync is now given by the model rather than
+	 * by the (jittery) host time read above. The time of day is deduced
+	 * from the current offset between both host clocks. */
+	now.ts_us = dev->clock_est.est_ts_us;
+	now.mono_ns = dev->clock_est.est_tv_us * NSEC_PER_USEC;
+	us_to_timeval(timeval_to_us(&now.tv) - mono_us +
+					dev->clock_est.est_tv_us, &now.tv);
+	now.residual_us = dev->clock_est.residual_us;
 
-		/* because of integer division, increment clock_drift
-		 * to prevent from timestamps from the future */
-		now.clock_drift++;
-#endif
-	}
+	pcan_ptp_sync(dev, &dev->clock_est);
+
+	now.clock_mult = PCAN_CLOCK_MULT_ONE + dev->clock_est.skew;
+	now.clock_drift = div_u64(1ULL << (PCAN_CLOCK_MULT_SHIFT +
+					   PCAN_CLOCK_DRIFT_SCALE_SHIFT),
+				  now.clock_mult);
 
 #endif /* PCAN_HANDLE_CLOCK_DRIFT */
 
@@ -1192,7 +1425,8 @@ int pcan_sync_times(struct pcandev *dev, u32 ts_low, u32 ts_high, int tv_off)
 		pr_info(DEVICE_NAME
 			": %s now=%ld.%06ld ts_us=%llu dtv=%lu dts=%lu "
 #ifdef PCAN_HANDLE_CLOCK_DRIFT
-			"ttv_us=%llu tts_us=%llu => clk_drift=%ld"
+			"ttv_us=%llu tts_us=%llu => clk_drift=%ld "
+			"clk_mult=%u residual=%uus"
 #endif
 			"\n",
 			dev->adapter->name,
@@ -1200,7 +1434,8 @@ int pcan_sync_times(struct pcandev *dev, u32 ts_low, u32 ts_high, int tv_off)
 			(unsigned long long)now.ts_us,
 			dtv_us, dts_us
 #ifdef PCAN_HANDLE_CLOCK_DRIFT
-			, now.ttv_us, now.tts_us, now.clock_drift
+			, now.ttv_us, now.tts_us, now.clock_drift,
+			now.clock_mult, now.residual_us
 #endif
 			);
 #endif /* DEBUG_TS_SYNC */
@@ -1265,7 +1500,9 @@ static void pcan_push_bus_load_ind(struct timer_list *t)
 			rx.msg.flags |= PCANFD_ERRCNT;
 		}
 
-		pcan_fifo_put(&dev->readFifo, &rx);
+		pcan_chardev_rx_fanout(dev, &rx);
+		if (pcan_rx_fifo_is_shared(dev))
+			pcan_fifo_put(&dev->readFifo, &rx);
 	}
 
 	mod_timer(&dev->bus_load_timer, jiffies + dev->bus_load_ind_period);
@@ -1351,6 +1588,23 @@ static void to_dev_rel_time(struct pcandev *dev, struct timeval *tv)
 	}
 }
 
+/* this function patches the last msg pushed into the fifo with *arg */
+static int pcan_do_patch_last(void *item, void *arg)
+{
+	struct pcanfd_rxmsg *fifo_msg = (struct pcanfd_rxmsg *)item;
+	struct pcanfd_rxmsg *new_msg = (struct pcanfd_rxmsg *)arg;
+
+	*fifo_msg = *new_msg;
+
+#ifdef DEBUG_PATCH
+	pr_info(DEVICE_NAME ": %s(): event[%d] changed into event[%d]\n",
+			__func__, fifo_msg->msg.type, new_msg->msg.type);
+#endif
+
+	/* MUST return != 0 to only process last item */
+	return -EEXIST;
+}
+
 #ifdef PCAN_LIMIT_STATUS_FLOODING
 /* this function is used to prevent from flooding rx fifo with STATUS msgs 
  * given by the hardware, especially when this hw is able to give rx and tx
@@ -1387,23 +1641,6 @@ static int pcan_do_patch_rxmsg(void *item, void *arg)
 	return -ENOENT;
 }
 
-/* this function patches the last msg pushed into the fifo with *arg */
-static int pcan_do_patch_last(void *item, void *arg)
-{
-	struct pcanfd_rxmsg *fifo_msg = (struct pcanfd_rxmsg *)item;
-	struct pcanfd_rxmsg *new_msg = (struct pcanfd_rxmsg *)arg;
-
-	*fifo_msg = *new_msg;
-
-#ifdef DEBUG_PATCH
-	pr_info(DEVICE_NAME ": %s(): event[%d] changed into event[%d]\n",
-			__func__, fifo_msg->msg.type, new_msg->msg.type);
-#endif
-
-	/* MUST return != 0 to only process last item */
-	return -EEXIST;
-}
-
 static int pcan_status_error_rx(struct pcandev *dev,
 				struct pcanfd_rxmsg *pf)
 {
@@ -1504,6 +1741,464 @@ static void pcan_status_normalize_rx(struct pcandev *dev,
 	}
 }
 
+/*
+ * Private Rx fifos: an open path may own its own Rx fifo, into which every
+ * msg posted to the device is copied (fan-out). Such a path doesn't compete
+ * with the others for the msgs of the device Rx fifo anymore, and a slow
+ * reader only loses its own msgs.
+ */
+int pcan_rx_fifo_attach(struct pcandev *dev, struct pcan_udata *ctx, u32 size)
+{
+	pcan_lock_irqsave_ctxt flags;
+	struct pcanfd_rxmsg *msgs;
+	FIFO_MANAGER fifo;
+	u32 slots;
+	int err = 0;
+
+	if (ctx->rx_fifo_msgs || ctx->rx_ring)
+		return -EBUSY;
+
+	if (size < PCAN_PRIV_RXQSIZE_MIN || size > PCAN_PRIV_RXQSIZE_MAX)
+		return -EINVAL;
+
+	slots = pcan_fifo_slots(size);
+	msgs = pcan_malloc(sizeof(*msgs) * slots, GFP_KERNEL);
+	if (!msgs)
+		return -ENOMEM;
+
+	/* setup the fifo aside: ctx->rx_fifo might already be in use by
+	 * another task sharing the same path */
+	err = pcan_fifo_init(&fifo, msgs, msgs + slots - 1, size,
+			     sizeof(*msgs));
+	if (err) {
+		pcan_free(msgs);
+		return err;
+	}
+
+	pcan_lock_get_irqsave(&dev->rx_users_lock, flags);
+
+	/* another task sharing the same path might have been faster */
+	if (!ctx->rx_fifo_msgs && !ctx->rx_ring) {
+		ctx->rx_fifo = fifo;
+		ctx->rx_fifo_overflow = 0;
+
+		/* readers test rx_fifo_msgs before using rx_fifo */
+		smp_wmb();
+		ctx->rx_fifo_msgs = msgs;
+		list_add_tail(&ctx->rx_fifo_link, &dev->rx_users);
+		dev->rx_users_count++;
+	} else {
+		err = -EBUSY;
+	}
+
+	pcan_lock_put_irqrestore(&dev->rx_users_lock, flags);
+
+	if (err)
+		pcan_free(msgs);
+
+#ifdef DEBUG_ALLOC_FIFOS
+	else
+		pr_info(DEVICE_NAME ": %s CAN%u: %u items private Rx FIFO "
+			"allocated\n",
+			dev->adapter->name, dev->nChannel+1, size);
+#endif
+	return err;
+}
+
+/*
+ * allocate the memory of a mmap() Rx ring. The caller owns the returned
+ * reference.
+ */
+struct pcan_rx_ring_mem *pcan_rx_ring_mem_alloc(unsigned long size)
+{
+	struct pcan_rx_ring_mem *rm;
+
+	rm = pcan_malloc(sizeof(*rm), GFP_KERNEL);
+	if (!rm)
+		return NULL;
+
+	/* vmalloc_user() zeroes the area it allocates */
+	rm->ring = vmalloc_user(size);
+	if (!rm->ring)
+		return pcan_free(rm);
+
+	atomic_set(&rm->refs, 1);
+
+	return rm;
+}
+
+void pcan_rx_ring_mem_get(struct pcan_rx_ring_mem *rm)
+{
+	atomic_inc(&rm->refs);
+}
+
+void pcan_rx_ring_mem_put(struct pcan_rx_ring_mem *rm)
+{
+	if (!atomic_dec_and_test(&rm->refs))
+		return;
+
+	vfree(rm->ring);
+	pcan_free(rm);
+}
+
+/*
+ * same as above with the Rx ring the open path shares with the application
+ * through mmap(). On success, the reference the caller holds on the memory of
+ * the ring is given to the path, and is dropped by pcan_rx_fifo_detach().
+ */
+int pcan_rx_ring_attach(struct pcandev *dev, struct pcan_udata *ctx,
+			struct pcan_rx_ring_mem *rm, u32 count)
+{
+	pcan_lock_irqsave_ctxt flags;
+	int err = 0;
+
+	pcan_lock_get_irqsave(&dev->rx_users_lock, flags);
+
+	if (!ctx->rx_fifo_msgs && !ctx->rx_ring) {
+		ctx->rx_ring_count = count;
+		ctx->rx_ring_head = 0;
+		ctx->rx_ring_mem = rm;
+		ctx->rx_ring = rm->ring;
+		list_add_tail(&ctx->rx_fifo_link, &dev->rx_users);
+		dev->rx_users_count++;
+	} else {
+		err = -EBUSY;
+	}
+
+	pcan_lock_put_irqrestore(&dev->rx_users_lock, flags);
+
+#ifdef DEBUG_ALLOC_FIFOS
+	if (!err)
+		pr_info(DEVICE_NAME ": %s CAN%u: %u items Rx ring mapped\n",
+			dev->adapter->name, dev->nChannel+1, count);
+#endif
+	return err;
+}
+
+/* Note: dev might be NULL if the device has been removed */
+void pcan_rx_fifo_detach(struct pcandev *dev, struct pcan_udata *ctx)
+{
+	pcan_lock_irqsave_ctxt flags;
+
+	if (!ctx->rx_fifo_msgs && !ctx->rx_ring)
+		return;
+
+	if (dev) {
+		pcan_lock_get_irqsave(&dev->rx_users_lock, flags);
+
+		list_del(&ctx->rx_fifo_link);
+		dev->rx_users_count--;
+
+		pcan_lock_put_irqrestore(&dev->rx_users_lock, flags);
+	}
+
+	/* the application might still map the ring */
+	if (ctx->rx_ring) {
+		pcan_rx_ring_mem_put(ctx->rx_ring_mem);
+		ctx->rx_ring_mem = NULL;
+		ctx->rx_ring = NULL;
+	}
+
+	ctx->rx_fifo_msgs = pcan_free(ctx->rx_fifo_msgs);
+}
+
+/* reset the private Rx fifos of all the paths opened on the device */
+void pcan_rx_fifo_reset_all(struct pcandev *dev)
+{
+	pcan_lock_irqsave_ctxt flags;
+	struct pcan_udata *ctx;
+
+	pcan_lock_get_irqsave(&dev->rx_users_lock, flags);
+
+	list_for_each_entry(ctx, &dev->rx_users, rx_fifo_link) {
+
+		/* the application owns the tail of its Rx ring */
+		if (ctx->rx_ring)
+			continue;
+
+		pcan_fifo_reset(&ctx->rx_fifo);
+		ctx->rx_fifo_overflow = 0;
+	}
+
+	pcan_lock_put_irqrestore(&dev->rx_users_lock, flags);
+}
+
+/*
+ * write a msg into the mmap() Rx ring of an open path. The timestamp is
+ * converted here since the msg is directly read by the application.
+ */
+static int pcan_rx_ring_put(struct pcandev *dev, struct pcan_udata *ctx,
+			    struct pcanfd_rxmsg *rx)
+{
+	struct pcanfd_rx_ring *ring = ctx->rx_ring;
+	struct pcanfd_msg *msgs = (void *)ring + PAGE_SIZE;
+	struct pcanfd_rxmsg tmp = *rx;
+	u32 head = ctx->rx_ring_head;
+
+	/* Note: "tail" is written by the application: don't trust it more
+	 * than to compute the count of free slots */
+	if (head - pcan_fifo_idx(ring->tail) >= ctx->rx_ring_count) {
+		ring->lost_count++;
+		return -ENOSPC;
+	}
+
+	/* the slot MUST have been read before being written again */
+	smp_mb();
+
+	msgs[head & (ctx->rx_ring_count - 1)] =
+					*pcan_sync_timestamps(dev, &tmp);
+
+	/* msg content MUST be visible before the new head */
+	smp_wmb();
+	ctx->rx_ring_head = ++head;
+	pcan_fifo_idx(ring->head) = head;
+
+	return 0;
+}
+
+#ifdef NO_RT
+/* return the count of msgs pending in the private Rx fifo (or Rx ring) */
+static u32 pcan_rx_pending(struct pcan_udata *ctx, u32 *size)
+{
+	if (ctx->rx_ring) {
+		*size = ctx->rx_ring_count;
+		return ctx->rx_ring_head - pcan_fifo_idx(ctx->rx_ring->tail);
+	}
+
+	*size = ctx->rx_fifo.nCount;
+	return pcan_fifo_status(&ctx->rx_fifo);
+}
+
+/* wake up the readers of an open path whose Rx wake-ups are coalesced */
+static void pcan_rx_coalesce_wake_up(struct pcan_udata *ctx)
+{
+	ctx->rx_ready = 1;
+	ctx->rx_wait_min = 0;
+	pcan_event_signal(&ctx->rx_event);
+}
+
+static enum hrtimer_restart pcan_rx_coalesce_timeout(struct hrtimer *t)
+{
+	struct pcan_udata *ctx = container_of(t, struct pcan_udata, rx_timer);
+
+	pcan_rx_coalesce_wake_up(ctx);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * called (with rx_users_lock held) once a msg has been posted (or not, if
+ * "full") into the private Rx fifo of a path that coalesces its Rx wake-ups,
+ * or that a task waits for rx_wait_min msgs: wake up its readers if enough
+ * msgs are pending, or make sure they will be woken up max_latency_us later.
+ */
+static void pcan_rx_coalesce_post(struct pcan_udata *ctx, int full)
+{
+	u32 size, pending, min_count;
+
+	/* the new head MUST be visible before checking rx_ready (see
+	 * pcan_rx_coalesce_ready()) */
+	smp_mb();
+
+	if (ctx->rx_ready)
+		return;
+
+	pending = pcan_rx_pending(ctx, &size);
+
+	/* a task waiting for a given count of msgs takes precedence */
+	min_count = ctx->rx_wait_min ? ctx->rx_wait_min :
+				       ctx->rx_coalesce.min_count;
+
+	if (full || pending >= size || (min_count && pending >= min_count)) {
+		hrtimer_try_to_cancel(&ctx->rx_timer);
+		pcan_rx_coalesce_wake_up(ctx);
+		return;
+	}
+
+	if (ctx->rx_coalesce.max_latency_us && !hrtimer_active(&ctx->rx_timer))
+		hrtimer_start(&ctx->rx_timer,
+			ns_to_ktime((u64 )ctx->rx_coalesce.max_latency_us *
+								NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+}
+
+/* setup Rx wake-ups coalescing of an open path: disabled by default */
+void pcan_rx_coalesce_init(struct pcan_udata *ctx)
+{
+	memset(&ctx->rx_coalesce, '\0', sizeof(ctx->rx_coalesce));
+	ctx->rx_coalesced = 0;
+	ctx->rx_ready = 0;
+	ctx->rx_wait_min = 0;
+	pcan_event_init(&ctx->rx_event, 0);
+	hrtimer_init(&ctx->rx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ctx->rx_timer.function = pcan_rx_coalesce_timeout;
+}
+
+/*
+ * change Rx wake-ups coalescing thresholds of an open path. The path MUST own
+ * a private Rx fifo (or Rx ring). Readers waiting for the previous thresholds
+ * are woken up so that they wait again with the new ones.
+ */
+int pcan_rx_coalesce_set(struct pcandev *dev, struct pcan_udata *ctx,
+			 struct pcanfd_rx_coalesce *rxc)
+{
+	pcan_lock_irqsave_ctxt flags;
+
+	if (!ctx->rx_fifo_msgs && !ctx->rx_ring)
+		return -EINVAL;
+
+	pcan_lock_get_irqsave(&dev->rx_users_lock, flags);
+
+	ctx->rx_coalesce = *rxc;
+	ctx->rx_coalesced = rxc->min_count > 1 || rxc->max_latency_us;
+
+	pcan_lock_put_irqrestore(&dev->rx_users_lock, flags);
+
+	hrtimer_cancel(&ctx->rx_timer);
+	pcan_rx_coalesce_wake_up(ctx);
+
+	return 0;
+}
+
+/* stop Rx wake-ups coalescing of an open path: called once it is detached */
+void pcan_rx_coalesce_stop(struct pcan_udata *ctx)
+{
+	ctx->rx_coalesced = 0;
+	hrtimer_cancel(&ctx->rx_timer);
+}
+
+/*
+ * return !0 if the readers of an open path whose Rx wake-ups are coalesced
+ * should not wait: this is the case when msgs are still pending in its Rx fifo
+ * (or Rx ring) once the readers are done. Otherwise, the readers will be woken
+ * up by pcan_rx_coalesce_post().
+ */
+int pcan_rx_coalesce_ready(struct pcan_udata *ctx)
+{
+	u32 size;
+
+	ctx->rx_ready = 0;
+
+	/* rx_ready MUST be cleared before checking for pending msgs, so that
+	 * pcan_rx_coalesce_post() can't miss a reader going to sleep */
+	smp_mb();
+
+	if (pcan_rx_pending(ctx, &size))
+		ctx->rx_ready = 1;
+
+	return ctx->rx_ready;
+}
+
+/*
+ * called before waiting on rx_event for at least "min" msgs in the private Rx
+ * fifo of a path (see PCANFD_RECV_MSGS_TIMEOUT): the Rx fan-out will wake up
+ * the task once they are pending, instead of on each msg. If several tasks
+ * wait on the same path, the smallest count wins and the others wait again.
+ */
+void pcan_rx_coalesce_wait_min(struct pcandev *dev, struct pcan_udata *ctx,
+			       u32 min)
+{
+	pcan_lock_irqsave_ctxt flags;
+
+	pcan_lock_get_irqsave(&dev->rx_users_lock, flags);
+
+	if (!ctx->rx_wait_min || min < ctx->rx_wait_min)
+		ctx->rx_wait_min = min;
+	ctx->rx_ready = 0;
+
+	pcan_lock_put_irqrestore(&dev->rx_users_lock, flags);
+}
+
+/* wake up all the readers of the device whose Rx wake-ups are coalesced, or
+ * that wait for some msgs (for example, when the device is unplugged) */
+void pcan_rx_coalesce_wake_all(struct pcandev *dev)
+{
+	pcan_lock_irqsave_ctxt flags;
+	struct pcan_udata *ctx;
+
+	pcan_lock_get_irqsave(&dev->rx_users_lock, flags);
+
+	list_for_each_entry(ctx, &dev->rx_users, rx_fifo_link)
+		if (ctx->rx_coalesced || ctx->rx_wait_min)
+			pcan_rx_coalesce_wake_up(ctx);
+
+	pcan_lock_put_irqrestore(&dev->rx_users_lock, flags);
+}
+#endif
+
+/*
+ * copy a msg into the private Rx fifo (or Rx ring) of each path that owns one,
+ * and whose msgs filters and BPF program pass it.
+ *
+ * returns the count of fifos the msg has been copied into.
+ */
+int pcan_chardev_rx_fanout(struct pcandev *dev, struct pcanfd_rxmsg *rx)
+{
+	struct pcanfd_rxmsg tmp, *px;
+	pcan_lock_irqsave_ctxt flags;
+	struct pcan_udata *ctx;
+	int err, posted = 0;
+
+	if (!dev->rx_users_count)
+		return 0;
+
+	pcan_lock_get_irqsave(&dev->rx_users_lock, flags);
+
+	list_for_each_entry(ctx, &dev->rx_users, rx_fifo_link) {
+
+		/* the msgs filters of the path apply to its own copy only */
+		if (pcan_do_filter(ctx->filter, rx))
+			continue;
+
+		/* so does its BPF program, that might also truncate it */
+		px = pcan_bpf_filter(ctx->bpf, rx, &tmp);
+		if (!px)
+			continue;
+
+		if (ctx->rx_ring)
+			err = pcan_rx_ring_put(dev, ctx, px);
+		else
+			/* producers are serialized by rx_users_lock */
+			err = __pcan_fifo_put(&ctx->rx_fifo, px);
+
+#ifdef NO_RT
+		if (ctx->rx_coalesced || ctx->rx_wait_min)
+			pcan_rx_coalesce_post(ctx, err < 0);
+#endif
+		if (err >= 0) {
+			posted++;
+			continue;
+		}
+
+		/* the application is in charge of its Rx ring */
+		if (ctx->rx_ring)
+			continue;
+
+		/* this reader is too slow: change the last msg of its fifo
+		 * into a STATUS[PCANFD_RX_OVERFLOW] (once) to inform it */
+		if (!ctx->rx_fifo_overflow) {
+			struct pcanfd_rxmsg full_msg = {
+				.msg = {
+					.type = PCANFD_TYPE_STATUS,
+					.id = PCANFD_RX_OVERFLOW,
+					.flags = PCANFD_ERROR_INTERNAL |
+						(rx->msg.flags &
+							PCANFD_TIMESTAMP),
+				},
+				.hwtv = rx->hwtv,
+			};
+
+			pcan_fifo_foreach_back(&ctx->rx_fifo,
+					       pcan_do_patch_last, &full_msg);
+			ctx->rx_fifo_overflow = 1;
+		}
+	}
+
+	pcan_lock_put_irqrestore(&dev->rx_users_lock, flags);
+
+	return posted;
+}
+
 /*
  * put received CAN frame into chardev receive FIFO
  * maybe this goes to a new file pcan_chardev.c some day.
@@ -1514,7 +2209,7 @@ static void pcan_status_normalize_rx(struct pcandev *dev,
  */
 int pcan_chardev_rx(struct pcandev *dev, struct pcanfd_rxmsg *rx)
 {
-	int err;
+	int err, posted, shared;
 
 #ifdef DEBUG
 	pr_info(DEVICE_NAME ": %s(CAN%u): nOpenPaths=%d bExtended=%d "
@@ -1664,12 +2359,14 @@ extern int pcanfd_ioctl_send_msgs_nolock(struct pcandev *dev,
 	if (dev->nOpenPaths <= 0)
 		return 0;
 
+	/* is there any path reading the device Rx fifo? */
+	shared = pcan_rx_fifo_is_shared(dev);
+
 	/* if no timestamp in this message, put current time in it */
 	if (!(rx->msg.flags & PCANFD_TIMESTAMP)) {
 
 		/* this hw does not provide any hw timestamp: use time of day */
-		rx->hwtv.ts_mode = PCANFD_OPT_HWTIMESTAMP_OFF;
-		pcan_gettimeofday(&rx->hwtv.tv);
+		pcan_sync_host_time(dev, &rx->hwtv);
 	}
 
 	/* default pcan gives timestamp relative to
@@ -1688,6 +2385,7 @@ extern int pcanfd_ioctl_send_msgs_nolock(struct pcandev *dev,
 			break;
 
 		case PCANFD_INIT_TS_HOST_REL:
+		case PCANFD_INIT_TS_MONO_NS:
 			break;
 		}
 	}
@@ -1699,7 +2397,7 @@ extern int pcanfd_ioctl_send_msgs_nolock(struct pcandev *dev,
 #endif
 
 #ifdef PCAN_LIMIT_STATUS_FLOODING
-	if (dev->wCANStatus & CAN_ERR_OVERRUN) {
+	if (shared && (dev->wCANStatus & CAN_ERR_OVERRUN)) {
 
 		/* rx fifo full: msg *rx will be lost.
 		 * change last msg into a STATUS[PCANFD_RX_OVERFLOW] to
@@ -1711,11 +2409,17 @@ extern int pcanfd_ioctl_send_msgs_nolock(struct pcandev *dev,
 		if (rx->msg.flags & PCANFD_TIMESTAMP) {
 			full_msg.msg.flags |= PCANFD_TIMESTAMP;
 			full_msg.hwtv.tv = rx->hwtv.tv;
+			full_msg.hwtv.tv_mono_ns = rx->hwtv.tv_mono_ns;
 		}
 
 		pcan_fifo_foreach_back(&dev->readFifo, pcan_do_patch_last,
 				       &full_msg);
-		return 0;
+
+		/* the private Rx fifos are not concerned */
+		if (!dev->rx_users_count)
+			return 0;
+
+		shared = 0;
 	}
 #endif
 
@@ -1812,15 +2516,22 @@ extern int pcanfd_ioctl_send_msgs_nolock(struct pcandev *dev,
 
 #ifdef PCAN_LIMIT_STATUS_FLOODING
 		/* try to patch last posted msg if it was the same msg */
-		err = pcan_fifo_foreach_back(&dev->readFifo,
+		if (shared) {
+			err = pcan_fifo_foreach_back(&dev->readFifo,
 						pcan_do_patch_rxmsg, rx);
-		if (err == -EEXIST)
-			/* msg patched. don't post the msg */
-			return 0;
+			if (err == -EEXIST)
+				/* msg patched. don't post the msg */
+				shared = 0;
+		}
 #endif
 		break;
 	}
 
+	/* first, give the msg to the paths that own a private Rx fifo */
+	posted = pcan_chardev_rx_fanout(dev, rx);
+	if (!shared)
+		return posted;
+
 	/* step forward in fifo */
 	err = pcan_fifo_put(&dev->readFifo, rx);
 	if (err >= 0)
@@ -1849,7 +2560,7 @@ extern int pcanfd_ioctl_send_msgs_nolock(struct pcandev *dev,
 	}
 #endif
 
-	return err;
+	return posted ? posted : err;
 }
 #endif
 
@@ -2198,6 +2909,21 @@ void pcan_add_dev_in_list_ex(struct pcandev *dev, u32 flags)
 #ifdef DEBUG
 	pr_info(DEVICE_NAME ": %s(%p)\n", __func__, dev);
 #endif
+	/* solve the standard bitrates for the clocks of the device now, so
+	 * that they won't be computed on each open */
+	if (dev->clocks_list) {
+		int i;
+
+		for (i = 0; i < dev->clocks_list->count; i++)
+			pcan_bittiming_cache_fill(dev->bittiming_caps,
+					dev->dbittiming_caps,
+					dev->clocks_list->list[i].clock_Hz);
+	} else {
+		pcan_bittiming_cache_fill(dev->bittiming_caps,
+					dev->dbittiming_caps,
+					dev->sysclock_Hz);
+	}
+
 #ifdef HANDLE_HOTPLUG
 	pcan_mutex_lock(&pcan_drv.devices_lock);
 #endif
@@ -2429,11 +3155,11 @@ static int pcan_read_procmem(char *page, char **start, off_t offset, int count,
 			dev_btr0btr1,
 #ifdef NETDEV_SUPPORT
 			(stats) ? stats->rx_packets : 0,
-			dev->writeFifo.dwTotal +
+			pcan_fifo_total(&dev->writeFifo) +
 					((stats) ? stats->tx_packets : 0),
 #else
-			(unsigned long)dev->readFifo.dwTotal,
-			(unsigned long)dev->writeFifo.dwTotal,
+			(unsigned long)pcan_fifo_total(&dev->readFifo),
+			(unsigned long)pcan_fifo_total(&dev->writeFifo),
 #endif
 			dev->dwInterruptCounter,
 			dev->dwErrorCounter,
@@ -3219,6 +3945,11 @@ void pcan_soft_init_ex(struct pcandev *dev,
 		flags |= PCAN_DEV_ERRCNT_RDY;
 		break;
 
+	case HW_VIRTUAL:
+		/* no hardware, no hw timestamps */
+		dev->ts_mode = PCANFD_OPT_HWTIMESTAMP_OFF;
+		break;
+
 	default:
 		/* all of these devices have hw timestamps that can be cooked */
 		flags |= PCAN_DEV_HWTS_RDY|PCAN_DEV_HWTSC_RDY;
@@ -3330,6 +4061,10 @@ void pcan_soft_init_ex(struct pcandev *dev,
 	memset(&dev->readFifo, '\0', sizeof(dev->readFifo));
 	memset(&dev->writeFifo, '\0', sizeof(dev->readFifo));
 
+	INIT_LIST_HEAD(&dev->rx_users);
+	pcan_lock_init(&dev->rx_users_lock);
+	dev->rx_users_count = 0;
+
 #ifdef NETDEV_SUPPORT
 	dev->netdev = NULL;
 #endif
@@ -3481,6 +4216,8 @@ int init_module(void)
 	INIT_LIST_HEAD(&pcan_drv.devices);
 	pcan_drv.wDeviceCount = 0;
 
+	pcan_timing_init();
+
 #ifdef HANDLE_HOTPLUG
 	/* initialize mutex used to access pcan devices list */
 	pcan_mutex_init(&pcan_drv.devices_lock);
@@ -3530,6 +4267,10 @@ int init_module(void)
 	/* create isa and dongle devices */
 	make_legacy_devices();
 
+#ifdef VIRTUAL_SUPPORT
+	pcan_create_virtual_devices();
+#endif
+
 #ifdef USB_SUPPORT
 	/* register usb devices only */
 	pcan_usb_register_devices();
@@ -50,6 +50,9 @@
 #include <linux/wait.h>
 #include <linux/interrupt.h>
 #include <linux/time.h>
+#ifdef NO_RT
+#include <linux/hrtimer.h>
+#endif
 
 #ifdef LINUX_26
 #include <linux/device.h>
@@ -73,6 +76,7 @@
  * 24	31	DNG EPP
  * 32	39	USB
  * 40	47	PC-CARD
+ * 48	63	VIRTUAL
  */
 #ifdef ISA_SUPPORT
 #define ISA_MINOR_BASE		8
@@ -83,6 +87,10 @@
 #define PCAN_DNG_EPP_MINOR_BASE	24	/* EPP devs minors starting point */
 #endif
 
+#ifdef VIRTUAL_SUPPORT
+#define PCAN_VIRTUAL_MINOR_BASE	48	/* virtual devs minors starting point */
+#endif
+
 #else
 /* now:
  * 0	31	PCI/PCIe
@@ -91,6 +99,7 @@
  * 72	79	ISA/PC104
  * 80	87	DNG SP
  * 88	95	DNG EPP
+ * 96	111	VIRTUAL
  */ 
 #ifdef ISA_SUPPORT
 #define ISA_MINOR_BASE		72
@@ -100,6 +109,10 @@
 #define PCAN_DNG_SP_MINOR_BASE	80	/* SP devs minors starting point */
 #define PCAN_DNG_EPP_MINOR_BASE	88	/* EPP devs minors starting point */
 #endif
+
+#ifdef VIRTUAL_SUPPORT
+#define PCAN_VIRTUAL_MINOR_BASE	96	/* virtual devs minors starting point */
+#endif
 #endif
 
 #include <asm/atomic.h>
@@ -159,6 +172,8 @@ typedef struct urb urb_t, *purb_t;
 
 #elif defined(DONGLE_SUPPORT)
 #define PCAN_USB_MINOR_END	(PCAN_DNG_SP_MINOR_BASE-1)
+#elif defined(VIRTUAL_SUPPORT)
+#define PCAN_USB_MINOR_END	(PCAN_VIRTUAL_MINOR_BASE-1)
 #else
 #define PCAN_USB_MINOR_END	-1
 #endif
@@ -332,16 +347,47 @@ struct ucan_pci_page {
 	u32		size;
 };
 
+/* the clock drift is applied to each timestamp by multiplying the count of hw
+ * µs by clock_mult = (host µs / hw µs) << PCAN_CLOCK_MULT_SHIFT. clock_mult
+ * is computed once per sync, which saves one 64-bit division per msg. With a
+ * 31-bit shift, a u32 clock_mult handles host/hw ratios up to 2 with a
+ * precision better than 1 ns/s. */
+#define PCAN_CLOCK_MULT_SHIFT		31
+#define PCAN_CLOCK_MULT_ONE		(1U<<(PCAN_CLOCK_MULT_SHIFT))
+
 /* timestamp sync in µs */
 struct pcan_time_sync {
 	struct timeval	tv;		/* host time at sync time */
 	u64		tv_ns;		/* (used for PCIe FD) */
+	u64		mono_ns;	/* host CLOCK_MONOTONIC at sync time */
 	u64		ts_us;		/* last sync'ed device timestamp */
 
 	u64		ttv_us;		/* count of host_us */
 	u64		tts_us;		/* count of device_us */
 
 	long		clock_drift;
+	u32		clock_mult;	/* host_us/device_us << _MULT_SHIFT */
+	u32		residual_us;	/* rms error of the clock estimator */
+};
+
+/* count of (device, host) time samples the clock estimator works on */
+#define PCAN_CLK_EST_SAMPLES	16
+
+/* least-squares estimation of host time from device time over the last
+ * PCAN_CLK_EST_SAMPLES syncs (see pcan_sync_times()) */
+struct pcan_clock_est {
+	u64		ts_us[PCAN_CLK_EST_SAMPLES];	/* device µs */
+	u64		tv_us[PCAN_CLK_EST_SAMPLES];	/* host mono µs */
+	int		head;		/* index of the oldest sample */
+	int		count;		/* count of samples */
+	int		rejected;	/* count of consecutive outliers */
+	u64		last_tv_us;	/* host µs of the last sample */
+
+	/* last fit: tv_us = est_tv_us + (ts_us - est_ts_us) * (1 + skew) */
+	u64		est_ts_us;
+	u64		est_tv_us;
+	s64		skew;		/* << PCAN_CLOCK_MULT_SHIFT */
+	u32		residual_us;
 };
 
 /* 32-bits area describing the content of the beginning of Rx DMA area of the
@@ -516,10 +562,11 @@ struct pcanfd_options {
  * is read by user. */
 struct pcan_timeval {
 	struct timeval	tv;	/* base time */
+	u64 tv_mono_ns;		/* base time (CLOCK_MONOTONIC, in ns) */
 	u64 tv_us;		/* base time (in us) */
 	u64 ts_us;		/* delta us (hw time) */
 	u32 ts_mode;		/* cooking mode */
-	long clock_drift;	/* clock drift */
+	u32 clock_mult;		/* clock drift (see pcan_time_sync) */
 };
 
 struct pcanfd_rxmsg {
@@ -564,6 +611,19 @@ struct __array_of_struct(pcanfd_txmsg, 0);
 #define TX_ENGINE_STOPPED	3
 #define TX_ENGINE_BUSY		4
 
+#ifdef VIRTUAL_SUPPORT
+typedef struct {
+	pcan_lock_t	lock;		/* bus_on vs. frames given by the peers */
+	int		bus_on;		/* the channel is on the virtual bus */
+
+	struct hrtimer	tx_timer;	/* end of the frame on the bus */
+	struct pcanfd_txmsg tx_msg;	/* frame being transmitted... */
+	int		tx_pending;	/* ...until it is successfully */
+	u32		tx_count;	/* Tx attempts (for errors injection) */
+	u32		tec;		/* Tx error counter (> 255: bus-off) */
+} VIRTUAL_PORT;
+#endif
+
 typedef struct pcandev {
 	struct list_head	list;	/* link anchor for list of devices */
 
@@ -604,6 +664,10 @@ typedef struct pcandev {
 
 	const struct pcanfd_options *	option;
 	struct pcan_time_sync	time_sync;	/* used to sync clocks */
+	struct pcan_clock_est	clock_est;	/* host/device clocks model */
+#ifdef PCAN_PTP_SUPPORT
+	struct pcan_ptp *	ptp;		/* PTP hw clock of the adapter */
+#endif
 
 	struct device *		sysfs_dev;
 	struct attribute **	sysfs_attrs;
@@ -638,6 +702,9 @@ typedef struct pcandev {
 #endif
 #ifdef USB_SUPPORT
 		USB_PORT	usb;
+#endif
+#ifdef VIRTUAL_SUPPORT
+		VIRTUAL_PORT	virt;
 #endif
 	} port;
 
@@ -716,6 +783,10 @@ typedef struct pcandev {
 	struct pcanfd_rxmsg *rMsg;
 	struct pcanfd_txmsg *wMsg;
 
+	struct list_head	rx_users;	/* paths owning a private Rx fifo */
+	pcan_lock_t		rx_users_lock;
+	int			rx_users_count;
+
 	void *		filter;	/* ID filter - currently associated to device */
 
 	u16	wCANStatus;	/* status of CAN chip */
@@ -838,6 +909,21 @@ struct pcan_usb_interface {
 
 #endif
 
+/* per-open reusable buffer used to stage the lists of msgs exchanged with
+ * the application */
+struct pcan_msgs_buf {
+	void *		buf;
+	int		size;		/* allocated size in bytes */
+	unsigned long	busy;		/* bit 0 set while in use */
+};
+
+/* memory of a mmap() Rx ring. It is released once both the open path and all
+ * the mappings of the application are done with it */
+struct pcan_rx_ring_mem {
+	atomic_t		refs;
+	struct pcanfd_rx_ring *	ring;
+};
+
 struct pcan_udata {
 
 #ifdef NETDEV_SUPPORT
@@ -868,6 +954,37 @@ struct pcan_udata {
 	u8 *	pcWritePointer;	/* work pointer into buffer */
 	int	nWriteCount;	/* count of written data bytes */
 
+	struct pcan_msgs_buf	rx_msgs;	/* used in PCANFD_RECV_MSGS */
+	struct pcan_msgs_buf	tx_msgs;	/* used in PCANFD_SEND_MSGS */
+	int			rw_mode;	/* PCANFD_RW_MODE_xxx */
+
+	/* private Rx fifo (see PCANFD_OPT_RX_FIFO_SIZE) */
+	FIFO_MANAGER		rx_fifo;
+	struct pcanfd_rxmsg *	rx_fifo_msgs;	/* NULL if not used */
+	struct list_head	rx_fifo_link;	/* in dev->rx_users list */
+	int			rx_fifo_overflow;
+
+	/* mmap() Rx ring (see struct pcanfd_rx_ring) */
+	struct pcanfd_rx_ring *	rx_ring;	/* NULL if not mapped */
+	struct pcan_rx_ring_mem *rx_ring_mem;	/* ref held by the path */
+	u32			rx_ring_count;
+	u32			rx_ring_head;	/* private copy of rx_ring->head */
+
+	/* msgs filters of the path (see PCANFD_OPT_FILTERS_SCOPE) */
+	void *			filter;		/* NULL until 1st filter added */
+	int			filters_scope;	/* PCANFD_FILTERS_SCOPE_xxx */
+	struct pcan_bpf_prog *	bpf;		/* see PCANFD_SET_BPF */
+
+#ifdef NO_RT
+	/* Rx wake-ups coalescing (see PCANFD_OPT_RX_COALESCE) */
+	struct pcanfd_rx_coalesce rx_coalesce;
+	int			rx_coalesced;	/* !0 if thresholds are set */
+	int			rx_ready;	/* !0 when readers can run */
+	pcan_event_t		rx_event;	/* readers wait here */
+	struct hrtimer		rx_timer;	/* max_latency_us bound */
+	u32			rx_wait_min;	/* see PCANFD_RECV_MSGS_TIMEOUT */
+#endif
+
 #ifdef NO_RT
 	struct file *			filep;		/* back linkage */
 #elif !defined(XENOMAI3)
@@ -1128,6 +1245,27 @@ static inline u32 pcan_get_bps(u32 clk_Hz, struct pcan_bittiming *pbt)
 	return clk_Hz / (pbt->brp * (1 + pbt->tseg1 + pbt->tseg2));
 }
 
+/* are timestamps given in CLOCK_MONOTONIC ns? */
+static inline int pcan_ts_mono_ns(struct pcandev *dev)
+{
+	return (dev->init_settings.flags & PCANFD_INIT_TS_FMT_MASK) ==
+						PCANFD_INIT_TS_MONO_NS;
+}
+
+/* get the timestamp of a msg as a struct timeval, whatever its format is */
+static inline void pcan_msg_timeval(const struct pcanfd_msg *pf,
+				    struct timeval *tv)
+{
+	if (pf->flags & PCANFD_TIMESTAMP_NS) {
+		u32 rem;
+
+		tv->tv_sec = div_u64_rem(pf->timestamp_ns, NSEC_PER_SEC, &rem);
+		tv->tv_usec = rem / NSEC_PER_USEC;
+	} else {
+		*tv = pf->timestamp;
+	}
+}
+
 static inline ssize_t show_u32(char *buf, u32 v)
 {
 	return snprintf(buf, PAGE_SIZE, "%u\n", v);
@@ -1146,6 +1284,58 @@ static inline ssize_t show_str(char *buf, char *str)
 int pcan_chardev_rx(struct pcandev *dev, struct pcanfd_rxmsg *cf);
 int pcan_chardev_msg_rx(struct pcandev *dev, TPCANRdMsg *rdm);
 
+int pcan_rx_fifo_attach(struct pcandev *dev, struct pcan_udata *ctx, u32 size);
+void pcan_rx_fifo_detach(struct pcandev *dev, struct pcan_udata *ctx);
+struct pcan_rx_ring_mem *pcan_rx_ring_mem_alloc(unsigned long size);
+void pcan_rx_ring_mem_get(struct pcan_rx_ring_mem *rm);
+void pcan_rx_ring_mem_put(struct pcan_rx_ring_mem *rm);
+int pcan_rx_ring_attach(struct pcandev *dev, struct pcan_udata *ctx,
+			struct pcan_rx_ring_mem *rm, u32 count);
+void pcan_rx_fifo_reset_all(struct pcandev *dev);
+int pcan_chardev_rx_fanout(struct pcandev *dev, struct pcanfd_rxmsg *rx);
+
+#ifdef NO_RT
+void pcan_rx_coalesce_init(struct pcan_udata *ctx);
+int pcan_rx_coalesce_set(struct pcandev *dev, struct pcan_udata *ctx,
+			 struct pcanfd_rx_coalesce *rxc);
+void pcan_rx_coalesce_stop(struct pcan_udata *ctx);
+int pcan_rx_coalesce_ready(struct pcan_udata *ctx);
+void pcan_rx_coalesce_wait_min(struct pcandev *dev, struct pcan_udata *ctx,
+			       u32 min);
+void pcan_rx_coalesce_wake_all(struct pcandev *dev);
+
+/* true once a task waiting for rx_wait_min msgs has been woken up */
+static inline int pcan_rx_coalesce_woken(struct pcan_udata *ctx)
+{
+	return !ctx->rx_wait_min;
+}
+#else
+static inline void pcan_rx_coalesce_wake_all(struct pcandev *dev) {}
+static inline int pcan_rx_coalesce_woken(struct pcan_udata *ctx)
+{
+	return 0;
+}
+#endif
+
+/* true if at least one opened path reads the device Rx fifo */
+static inline int pcan_rx_fifo_is_shared(struct pcandev *dev)
+{
+	return dev->nOpenPaths > dev->rx_users_count;
+}
+
+/* return the Rx fifo an opened path reads from */
+static inline FIFO_MANAGER *pcan_rx_fifo(struct pcandev *dev,
+					 struct pcan_udata *ctx)
+{
+	return (ctx && ctx->rx_fifo_msgs) ? &ctx->rx_fifo : &dev->readFifo;
+}
+
+/* true if the mmap() Rx ring of the opened path is empty */
+static inline int pcan_rx_ring_empty(struct pcan_udata *ctx)
+{
+	return ctx->rx_ring_head == *(volatile u32 *)&ctx->rx_ring->tail;
+}
+
 void dev_unregister(void);
 #ifdef NO_RT
 void pcan_sysfs_dev_node_create_ex(struct pcandev *dev, struct device *parent);
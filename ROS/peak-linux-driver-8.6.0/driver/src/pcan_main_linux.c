@@ -57,6 +57,7 @@ static int pcan_is_hotplug(struct pcandev *dev)
 	case HW_ISA_SJA:
 	case HW_DONGLE_SJA:
 	case HW_DONGLE_SJA_EPP:
+	case HW_VIRTUAL:
 		return 0;
 	default:
 		break;
@@ -510,7 +510,11 @@ int pcan_netdev_rx(struct pcandev *dev, struct pcanfd_rxmsg *pqm)
 			/* cook the hw timestamp according to ts_mode */
 			pcan_sync_timestamps(dev, pqm);
 
-			hwts->hwtstamp = timeval_to_ktime(pf->timestamp);
+			if (pf->flags & PCANFD_TIMESTAMP_NS)
+				hwts->hwtstamp = ns_to_ktime(pf->timestamp_ns);
+			else
+				hwts->hwtstamp =
+					timeval_to_ktime(pf->timestamp);
 
 			skb->tstamp = hwts->hwtstamp;
 		}
@@ -108,11 +108,14 @@ int pcan_make_output(char *buffer, struct pcanfd_msg *pf)
 	}
 
 	if (pf->flags & PCANFD_TIMESTAMP) {
+		struct timeval tv;
 		u32 ms, us;
 
-		ms = pf->timestamp.tv_usec / 1000;
-		us = pf->timestamp.tv_usec - (ms * 1000);
-		ms += pf->timestamp.tv_sec * 1000;
+		pcan_msg_timeval(pf, &tv);
+
+		ms = tv.tv_usec / 1000;
+		us = tv.tv_usec - (ms * 1000);
+		ms += tv.tv_sec * 1000;
 
 		/* print timestamp */
 		ptr += sprintf(ptr, " %11u %03u", ms, us);
@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * PTP hardware clocks giving the time of the CAN-FD adapters.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * The time of the clock is the one of the device timestamps counter, that is,
+ * the time base of the PCANFD_OPT_HWTIMESTAMP_RAW timestamps. The counter
+ * isn't readable at any time, so it is extrapolated from the host
+ * CLOCK_MONOTONIC, through the clock estimator model of the last sync (see
+ * pcan_sync_times()). The adapters counters can't be adjusted: these clocks
+ * are read-only.
+ */
+#include "src/pcan_common.h"
+#include "src/pcan_ptp.h"
+
+#ifdef PCAN_PTP_SUPPORT
+
+#include <linux/ptp_clock_kernel.h>
+#include <linux/seqlock.h>
+
+struct pcan_ptp {
+	struct ptp_clock_info	info;
+	struct ptp_clock *	clock;
+	struct pcandev *	dev;
+
+	/* copy of the clock estimator model, updated on each sync */
+	seqcount_t		seq;
+	int			synced;
+	u64			ts_us;		/* device µs ... */
+	u64			tv_us;		/* ... at host mono µs */
+	u32			inv_mult;	/* hw_ns/host_ns << _MULT_SHIFT */
+};
+
+/* called by pcan_sync_times() each time the model has changed */
+void pcan_ptp_sync(struct pcandev *dev, const struct pcan_clock_est *est)
+{
+	struct pcan_ptp *ptp = dev->ptp;
+
+	if (!ptp)
+		return;
+
+	write_seqcount_begin(&ptp->seq);
+
+	ptp->ts_us = est->est_ts_us;
+	ptp->tv_us = est->est_tv_us;
+	ptp->inv_mult = div_u64(1ULL << (2 * PCAN_CLOCK_MULT_SHIFT),
+				PCAN_CLOCK_MULT_ONE + est->skew);
+	ptp->synced = 1;
+
+	write_seqcount_end(&ptp->seq);
+}
+
+static int pcan_ptp_get_ns(struct pcan_ptp *ptp, u64 *hw_ns)
+{
+	u64 ts_us, tv_us, dt_hw;
+	unsigned int seq;
+	u32 inv_mult;
+	int synced;
+	s64 dt;
+
+	do {
+		seq = read_seqcount_begin(&ptp->seq);
+
+		synced = ptp->synced;
+		ts_us = ptp->ts_us;
+		tv_us = ptp->tv_us;
+		inv_mult = ptp->inv_mult;
+
+	} while (read_seqcount_retry(&ptp->seq, seq));
+
+	/* device has never been sync'ed */
+	if (!synced)
+		return -EAGAIN;
+
+	dt = pcan_getmono_ns() - tv_us * NSEC_PER_USEC;
+	dt_hw = mul_u64_u32_shr(dt < 0 ? -dt : dt, inv_mult,
+				PCAN_CLOCK_MULT_SHIFT);
+
+	*hw_ns = ts_us * NSEC_PER_USEC;
+	if (dt < 0)
+		*hw_ns -= dt_hw;
+	else
+		*hw_ns += dt_hw;
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+static int pcan_ptp_gettime(struct ptp_clock_info *info, struct timespec *ts)
+{
+	struct pcan_ptp *ptp = container_of(info, struct pcan_ptp, info);
+	u64 hw_ns;
+	int err;
+
+	err = pcan_ptp_get_ns(ptp, &hw_ns);
+	if (!err)
+		*ts = ns_to_timespec(hw_ns);
+
+	return err;
+}
+
+static int pcan_ptp_settime(struct ptp_clock_info *info,
+			    const struct timespec *ts)
+{
+	return -EOPNOTSUPP;
+}
+#else
+static int pcan_ptp_gettime64(struct ptp_clock_info *info,
+			      struct timespec64 *ts)
+{
+	struct pcan_ptp *ptp = container_of(info, struct pcan_ptp, info);
+	u64 hw_ns;
+	int err;
+
+	err = pcan_ptp_get_ns(ptp, &hw_ns);
+	if (!err)
+		*ts = ns_to_timespec64(hw_ns);
+
+	return err;
+}
+
+static int pcan_ptp_settime64(struct ptp_clock_info *info,
+			      const struct timespec64 *ts)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+static int pcan_ptp_adjfreq(struct ptp_clock_info *info, s32 ppb)
+{
+	return -EOPNOTSUPP;
+}
+
+static int pcan_ptp_adjtime(struct ptp_clock_info *info, s64 delta)
+{
+	return -EOPNOTSUPP;
+}
+
+static int pcan_ptp_enable(struct ptp_clock_info *info,
+			   struct ptp_clock_request *rq, int on)
+{
+	return -EOPNOTSUPP;
+}
+
+static const struct ptp_clock_info pcan_ptp_info = {
+	.owner		= THIS_MODULE,
+	.max_adj	= 0,
+	.adjfreq	= pcan_ptp_adjfreq,
+	.adjtime	= pcan_ptp_adjtime,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+	.gettime	= pcan_ptp_gettime,
+	.settime	= pcan_ptp_settime,
+#else
+	.gettime64	= pcan_ptp_gettime64,
+	.settime64	= pcan_ptp_settime64,
+#endif
+	.enable		= pcan_ptp_enable,
+};
+
+/* register a PTP clock for the CAN-FD adapter the device belongs to.
+ * Note: all the channels of an adapter share the same clock, which is sync'ed
+ * through the 1st one. */
+void pcan_ptp_register(struct pcandev *dev)
+{
+	struct pcan_ptp *ptp;
+
+	if (!dev->device_open_fd || !(dev->flags & PCAN_DEV_HWTS_RDY) ||
+	    dev->nChannel)
+		return;
+
+	ptp = pcan_malloc(sizeof(*ptp), GFP_KERNEL);
+	if (!ptp) {
+		pr_err(DEVICE_NAME ": failed to allocate PTP clock of %s\n",
+		       dev->adapter->name);
+		return;
+	}
+
+	memset(ptp, '\0', sizeof(*ptp));
+
+	ptp->info = pcan_ptp_info;
+	snprintf(ptp->info.name, sizeof(ptp->info.name),
+		 DEVICE_NAME "%s%u", dev->type, dev->nMinor);
+	ptp->dev = dev;
+	seqcount_init(&ptp->seq);
+
+	ptp->clock = ptp_clock_register(&ptp->info, dev->sysfs_dev);
+	if (IS_ERR_OR_NULL(ptp->clock)) {
+		pr_err(DEVICE_NAME ": failed to register PTP clock of %s "
+		       "(err %ld)\n", dev->adapter->name, PTR_ERR(ptp->clock));
+		pcan_free(ptp);
+		return;
+	}
+
+	dev->ptp = ptp;
+
+	pr_info(DEVICE_NAME ": %s clock registered as ptp%d\n",
+		dev->adapter->name, ptp_clock_index(ptp->clock));
+}
+
+void pcan_ptp_unregister(struct pcandev *dev)
+{
+	struct pcan_ptp *ptp = dev->ptp;
+
+	if (!ptp)
+		return;
+
+	dev->ptp = NULL;
+
+	ptp_clock_unregister(ptp->clock);
+	pcan_free(ptp);
+}
+
+#endif /* PCAN_PTP_SUPPORT */
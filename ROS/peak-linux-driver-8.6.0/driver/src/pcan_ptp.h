@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * PTP hardware clocks giving the time of the CAN-FD adapters.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+#ifndef __PCAN_PTP_H__
+#define __PCAN_PTP_H__
+
+#include "src/pcan_common.h"
+#include "src/pcan_main.h"
+
+#ifdef PCAN_PTP_SUPPORT
+void pcan_ptp_register(struct pcandev *dev);
+void pcan_ptp_unregister(struct pcandev *dev);
+void pcan_ptp_sync(struct pcandev *dev, const struct pcan_clock_est *est);
+#else
+static inline void pcan_ptp_register(struct pcandev *dev) {}
+static inline void pcan_ptp_unregister(struct pcandev *dev) {}
+static inline void pcan_ptp_sync(struct pcandev *dev,
+				 const struct pcan_clock_est *est) {}
+#endif
+
+#endif
@@ -749,7 +749,7 @@ int sja1000_write(struct pcandev *dev, struct pcan_udata *ctx)
 
 #if 0
 	DPRINTK(KERN_DEBUG "%s: %s(%u) %d\n",
-		DEVICE_NAME, __func__, dev->nMinor, dev->writeFifo.nStored);
+		DEVICE_NAME, __func__, dev->nMinor, pcan_fifo_status(&dev->writeFifo));
 #endif
 	/* Check (and wait for) the SJA1000 Tx buffer to be empty before
 	 * writing in */
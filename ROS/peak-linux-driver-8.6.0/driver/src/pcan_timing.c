@@ -44,6 +44,7 @@
 #include "src/pcan_common.h"
 
 #include <linux/string.h>
+#include <linux/jhash.h>
 #include <asm/div64.h>
 
 #include "src/pcan_timing.h"
@@ -503,6 +504,22 @@ int pcan_abstract_to_bittiming(struct pcan_bittiming *pbt,
 #define PCAN_CALC_MAX_ERROR	50 /* in one-tenth of a percent */
 #define PCAN_CALC_SYNC_SEG	1
 
+/* sanitize sjw user settings against the tseg2 computed for the bitrate */
+static void pcan_sanitize_sjw(struct pcan_bittiming *bt,
+			      const struct pcanfd_bittiming_range *btc)
+{
+	if (!bt->sjw || !btc->sjw_max)
+		bt->sjw = 1;
+	else {
+		/* bt->sjw is at least 1 -> sanitize upper bound to sjw_max */
+		if (bt->sjw > btc->sjw_max)
+			bt->sjw = btc->sjw_max;
+		/* bt->sjw must not be higher than tseg2 */
+		if (bt->tseg2 < bt->sjw)
+			bt->sjw = bt->tseg2;
+	}
+}
+
 #ifdef USES_LINUX_4_8_RC_CAN_BITTIMINGS_CALCULATION
 /*
  * Bit-timing calculation derived from:
@@ -578,10 +595,12 @@ static int pcan_update_sample_point(const struct pcanfd_bittiming_range *btc,
 /*
  * Greatly inspired from "can_calc_bittiming()" function 
  * (see drivers/net/can/dev.c)
+ *
+ * *perr is set to the bitrate error, in one-tenth of a percent.
  */
-int pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
+static int pcan_calc_bittiming(struct pcan_bittiming *bt,
 			const struct pcanfd_bittiming_range *btc,
-			u32 sysclock_Hz)
+			u32 sysclock_Hz, unsigned int *perr)
 {
 	u32 clk_freq;
 	unsigned int tseg_min;
@@ -597,9 +616,6 @@ int pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
 	unsigned int brp, tsegall, tseg, tseg1 = 0, tseg2 = 0;
 	u64 v64;
 
-	if (!btc) // || !btc->intern_prescaler)
-		return -EINVAL;
-
 	tseg_min = (btc->tseg1_min + btc->tseg2_min) * 2;
 	clk_freq = sysclock_Hz; // / btc->intern_prescaler;
 
@@ -699,21 +715,15 @@ int pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
 			break;
 	}
 
+	*perr = 0;
 	if (best_bitrate_error) {
 
 		/* Error in one-tenth of a percent */
 		v64 = (u64 )best_bitrate_error * PCAN_SAMPT_SCALE;
 		do_div(v64, bt->bitrate);
-		bitrate_error = (unsigned int )v64;
-		if (bitrate_error > PCAN_CALC_MAX_ERROR) {
-			pr_err(DEVICE_NAME
-				": bitrate error %u.%u%% too high\n",
-				bitrate_error / 10, bitrate_error % 10);
+		*perr = (unsigned int )v64;
+		if (*perr > PCAN_CALC_MAX_ERROR)
 			return -EDOM;
-		}
-
-		pr_warn(DEVICE_NAME ": bitrate error %u.%u%%\n",
-			bitrate_error / 10, bitrate_error % 10);
 	}
 
 	/* real sample point */
@@ -729,18 +739,6 @@ int pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
 	bt->tseg2 = tseg2;
 	bt->brp = best_brp;
 
-	/* check for sjw user settings */
-	if (!bt->sjw || !btc->sjw_max)
-		bt->sjw = 1;
-	else {
-		/* bt->sjw is at least 1 -> sanitize upper bound to sjw_max */
-		if (bt->sjw > btc->sjw_max)
-			bt->sjw = btc->sjw_max;
-		/* bt->sjw must not be higher than tseg2 */
-		if (tseg2 < bt->sjw)
-			bt->sjw = tseg2;
-	}
-
 #ifdef DEBUG
 	pr_info(DEVICE_NAME
 		": %s(%u): tq=%u brp=%u tseg1=%u tseg2=%u sp=%u sjw=%u\n",
@@ -792,10 +790,12 @@ static int pcan_update_spt(const struct pcanfd_bittiming_range *btc,
 /*
  * Greatly inspired from "can_calc_bittiming()" function 
  * (see drivers/net/can/dev.c)
+ *
+ * *perr is set to the bitrate error, in one-tenth of a percent.
  */
-int pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
+static int pcan_calc_bittiming(struct pcan_bittiming *bt,
 			const struct pcanfd_bittiming_range *btc,
-			u32 sysclock_Hz)
+			u32 sysclock_Hz, unsigned int *perr)
 {
 	long best_error = 1000000*PCAN_SAMPT_SCALE, error = 0;
 	int best_tseg = 0, best_brp = 0, brp = 0;
@@ -805,9 +805,6 @@ int pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
 	long rate;
 	u64 v64;
 
-	if (!btc) // || !btc->intern_prescaler)
-		return -EINVAL;
-
 	clk_freq = sysclock_Hz; // / btc->intern_prescaler;
 
 	/* Use CiA recommended sample points
@@ -896,18 +893,13 @@ int pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
 			break;
 	}
 
+	*perr = 0;
 	if (best_error) {
 
 		/* Error in one-tenth of a percent */
-		error = (best_error * PCAN_SAMPT_SCALE) / bt->bitrate;
-		if (error > PCAN_CALC_MAX_ERROR) {
-			pr_err("%s: bitrate error %ld.%ld%% too high\n",
-				DEVICE_NAME, error / 10, error % 10);
+		*perr = (best_error * PCAN_SAMPT_SCALE) / bt->bitrate;
+		if (*perr > PCAN_CALC_MAX_ERROR)
 			return -EDOM;
-		}
-
-		pr_warn("%s: bitrate error %ld.%ld%%\n",
-			DEVICE_NAME, error / 10, error % 10);
 	}
 
 	/* real sample point */
@@ -921,18 +913,6 @@ int pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
 	bt->tseg2 = tseg2;
 	bt->brp = best_brp;
 
-	/* check for sjw user settings */
-	if (!bt->sjw || !btc->sjw_max)
-		bt->sjw = 1;
-	else {
-		/* bt->sjw is at least 1 -> sanitize upper bound to sjw_max */
-		if (bt->sjw > btc->sjw_max)
-			bt->sjw = btc->sjw_max;
-		/* bt->sjw must not be higher than tseg2 */
-		if (tseg2 < bt->sjw)
-			bt->sjw = tseg2;
-	}
-
 #ifdef DEBUG
 	pr_info("%s: %s(%u): tq=%u brp=%u tseg1=%u tseg2=%u sam=%u sjw=%u\n",
 			DEVICE_NAME, __func__, bt->bitrate,
@@ -943,3 +923,302 @@ int pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
 	return 0;
 }
 #endif
+
+/* results of pcan_calc_bittiming() for non-standard bitrates are cached into a
+ * direct-mapped table indexed by a hash of (clock, bitrate, sample point,
+ * bittiming range), so that (re-)initializing a channel doesn't run the solver
+ * again. */
+#define PCAN_BT_CACHE_BITS	7
+#define PCAN_BT_CACHE_SIZE	(1 << PCAN_BT_CACHE_BITS)
+
+struct pcan_bt_cache_key {
+	struct pcanfd_bittiming_range	range;
+	u32				clock_Hz;
+	u32				bitrate;
+	u32				sample_point;
+};
+
+struct pcan_bt_result {
+	int				err;
+	unsigned int			bitrate_error;
+
+	u32				brp;
+	u32				tseg1;
+	u32				tseg2;
+	u32				sample_point;
+	u32				tq;
+};
+
+struct pcan_bt_cache_entry {
+	struct pcan_bt_cache_key	key;
+	int				valid;
+	struct pcan_bt_result		res;
+};
+
+static struct pcan_bt_cache_entry pcan_bt_cache[PCAN_BT_CACHE_SIZE];
+static pcan_lock_t pcan_bt_cache_lock;
+
+/* CiA 301 and CiA 601-1 bitrates solved for each device clock when the
+ * device is registered (see pcan_bittiming_cache_fill()) */
+static const u32 pcan_cia_bitrates[] = {
+	10000, 20000, 50000, 100000, 125000, 250000, 500000, 800000, 1000000,
+};
+
+static const u32 pcan_cia_dbitrates[] = {
+	1000000, 2000000, 4000000, 5000000, 8000000, 10000000,
+};
+
+/* the CiA bitrates (with the default sample point) don't go into the hash
+ * cache, where other bitrates could evict them, but into a table of their
+ * own, that holds one record per (bittiming range, clock) of the registered
+ * devices. Devices of the same kind share the same records. */
+#define PCAN_BT_STD_MAX		32
+#define PCAN_BT_STD_RATES	ARRAY_SIZE(pcan_cia_bitrates)
+
+struct pcan_bt_std {
+	struct pcanfd_bittiming_range	range;
+	u32				clock_Hz;
+	const u32 *			rates;
+	int				count;
+	u32				bitrate[PCAN_BT_STD_RATES];
+	struct pcan_bt_result		res[PCAN_BT_STD_RATES];
+};
+
+static struct pcan_bt_std pcan_bt_std[PCAN_BT_STD_MAX];
+static int pcan_bt_std_count;
+
+void pcan_timing_init(void)
+{
+	pcan_lock_init(&pcan_bt_cache_lock);
+}
+
+static u32 pcan_bt_cache_hash(const struct pcan_bt_cache_key *key)
+{
+	return jhash2((const u32 *)key, sizeof(*key) / sizeof(u32), 0) &
+					(PCAN_BT_CACHE_SIZE - 1);
+}
+
+static void pcan_bt_result_save(struct pcan_bt_result *pr,
+				const struct pcan_bittiming *bt,
+				int err, unsigned int bitrate_error)
+{
+	pr->err = err;
+	pr->bitrate_error = bitrate_error;
+	pr->brp = bt->brp;
+	pr->tseg1 = bt->tseg1;
+	pr->tseg2 = bt->tseg2;
+	pr->sample_point = bt->sample_point;
+	pr->tq = bt->tq;
+}
+
+static int pcan_bt_result_load(const struct pcan_bt_result *pr,
+			       struct pcan_bittiming *bt, unsigned int *perr)
+{
+	*perr = pr->bitrate_error;
+	if (!pr->err) {
+		bt->brp = pr->brp;
+		bt->tseg1 = pr->tseg1;
+		bt->tseg2 = pr->tseg2;
+		bt->sample_point = pr->sample_point;
+		bt->tq = pr->tq;
+	}
+
+	return pr->err;
+}
+
+/* return the record of the CiA bitrates "rates" solved for (btc, clock_Hz),
+ * if any. If "rates" is NULL, the records of both the nominal and data
+ * bitrates match. pcan_bt_cache_lock MUST be held. */
+static struct pcan_bt_std *pcan_bt_std_find(struct pcan_bt_std *from,
+			const struct pcanfd_bittiming_range *btc, u32 clock_Hz,
+			const u32 *rates)
+{
+	for ( ; from < pcan_bt_std + pcan_bt_std_count; from++)
+		if (from->clock_Hz == clock_Hz &&
+		    (!rates || from->rates == rates) &&
+		    !memcmp(&from->range, btc, sizeof(*btc)))
+			return from;
+
+	return NULL;
+}
+
+/* return !0 if "bitrate" is one of the CiA bitrates */
+static int pcan_is_cia_bitrate(u32 bitrate)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(pcan_cia_bitrates); i++)
+		if (pcan_cia_bitrates[i] == bitrate)
+			return 1;
+
+	for (i = 0; i < ARRAY_SIZE(pcan_cia_dbitrates); i++)
+		if (pcan_cia_dbitrates[i] == bitrate)
+			return 1;
+
+	return 0;
+}
+
+/* return the result of solving the CiA "bitrate" for (btc, clock_Hz) at probe
+ * time, if any. pcan_bt_cache_lock MUST be held. */
+static const struct pcan_bt_result *pcan_bt_std_get(
+			const struct pcanfd_bittiming_range *btc, u32 clock_Hz,
+			u32 bitrate)
+{
+	struct pcan_bt_std *ps = pcan_bt_std;
+	int i;
+
+	while ((ps = pcan_bt_std_find(ps, btc, clock_Hz, NULL))) {
+		for (i = 0; i < ps->count; i++)
+			if (ps->bitrate[i] == bitrate)
+				return ps->res + i;
+		ps++;
+	}
+
+	return NULL;
+}
+
+static int __pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
+			const struct pcanfd_bittiming_range *btc,
+			u32 sysclock_Hz, unsigned int *perr)
+{
+	const struct pcan_bt_result *pr = NULL;
+	struct pcan_bt_cache_key key;
+	struct pcan_bt_cache_entry *pe;
+	pcan_lock_irqsave_ctxt flags;
+	int err, hit;
+
+	/* CiA bitrates with the default sample point first */
+	if (!bt->sample_point && pcan_is_cia_bitrate(bt->bitrate)) {
+		pcan_lock_get_irqsave(&pcan_bt_cache_lock, flags);
+
+		pr = pcan_bt_std_get(btc, sysclock_Hz, bt->bitrate);
+		if (pr)
+			err = pcan_bt_result_load(pr, bt, perr);
+
+		pcan_lock_put_irqrestore(&pcan_bt_cache_lock, flags);
+
+		if (pr)
+			return err;
+	}
+
+	memset(&key, '\0', sizeof(key));
+	key.range = *btc;
+	key.clock_Hz = sysclock_Hz;
+	key.bitrate = bt->bitrate;
+	key.sample_point = bt->sample_point;
+
+	pe = pcan_bt_cache + pcan_bt_cache_hash(&key);
+
+	pcan_lock_get_irqsave(&pcan_bt_cache_lock, flags);
+
+	hit = pe->valid && !memcmp(&pe->key, &key, sizeof(key));
+	if (hit)
+		err = pcan_bt_result_load(&pe->res, bt, perr);
+
+	pcan_lock_put_irqrestore(&pcan_bt_cache_lock, flags);
+
+	if (hit)
+		return err;
+
+	*perr = 0;
+	err = pcan_calc_bittiming(bt, btc, sysclock_Hz, perr);
+
+	pcan_lock_get_irqsave(&pcan_bt_cache_lock, flags);
+
+	pe->key = key;
+	pe->valid = 1;
+	pcan_bt_result_save(&pe->res, bt, err, *perr);
+
+	pcan_lock_put_irqrestore(&pcan_bt_cache_lock, flags);
+
+	return err;
+}
+
+int pcan_bitrate_to_bittiming(struct pcan_bittiming *bt,
+			const struct pcanfd_bittiming_range *btc,
+			u32 sysclock_Hz)
+{
+	unsigned int bitrate_error;
+	int err;
+
+	if (!btc) // || !btc->intern_prescaler)
+		return -EINVAL;
+
+	err = __pcan_bitrate_to_bittiming(bt, btc, sysclock_Hz,
+					  &bitrate_error);
+	if (err == -EDOM) {
+		pr_err(DEVICE_NAME ": bitrate error %u.%u%% too high\n",
+			bitrate_error / 10, bitrate_error % 10);
+		return err;
+	}
+
+	if (err)
+		return err;
+
+	if (bitrate_error)
+		pr_warn(DEVICE_NAME ": bitrate error %u.%u%%\n",
+			bitrate_error / 10, bitrate_error % 10);
+
+	pcan_sanitize_sjw(bt, btc);
+
+	return 0;
+}
+
+/* solve the "count" CiA bitrates "rates" with btc, for a clock of clock_Hz,
+ * into a new record of the CiA bitrates table, if not already done */
+static void pcan_bt_std_fill(const struct pcanfd_bittiming_range *btc,
+			     u32 clock_Hz, const u32 *rates, int count)
+{
+	struct pcan_bittiming bt;
+	struct pcan_bt_std std;
+	pcan_lock_irqsave_ctxt flags;
+	unsigned int bitrate_error;
+	int i, err, found;
+
+	pcan_lock_get_irqsave(&pcan_bt_cache_lock, flags);
+	found = !!pcan_bt_std_find(pcan_bt_std, btc, clock_Hz, rates);
+	pcan_lock_put_irqrestore(&pcan_bt_cache_lock, flags);
+
+	if (found)
+		return;
+
+	memset(&std, '\0', sizeof(std));
+	std.range = *btc;
+	std.clock_Hz = clock_Hz;
+	std.rates = rates;
+	std.count = count;
+
+	for (i = 0; i < count; i++) {
+		memset(&bt, '\0', sizeof(bt));
+		bt.bitrate = rates[i];
+		bitrate_error = 0;
+		err = pcan_calc_bittiming(&bt, btc, clock_Hz, &bitrate_error);
+
+		std.bitrate[i] = rates[i];
+		pcan_bt_result_save(std.res + i, &bt, err, bitrate_error);
+	}
+
+	pcan_lock_get_irqsave(&pcan_bt_cache_lock, flags);
+
+	/* if the table is full, these bitrates will go into the hash cache */
+	if (!pcan_bt_std_find(pcan_bt_std, btc, clock_Hz, rates) &&
+	    pcan_bt_std_count < PCAN_BT_STD_MAX)
+		pcan_bt_std[pcan_bt_std_count++] = std;
+
+	pcan_lock_put_irqrestore(&pcan_bt_cache_lock, flags);
+}
+
+/* solve the CiA nominal bitrates with caps, and the CiA data bitrates with
+ * dcaps, for a clock of sysclock_Hz */
+void pcan_bittiming_cache_fill(const struct pcanfd_bittiming_range *caps,
+			const struct pcanfd_bittiming_range *dcaps,
+			u32 sysclock_Hz)
+{
+	if (caps)
+		pcan_bt_std_fill(caps, sysclock_Hz, pcan_cia_bitrates,
+				 ARRAY_SIZE(pcan_cia_bitrates));
+
+	if (dcaps)
+		pcan_bt_std_fill(dcaps, sysclock_Hz, pcan_cia_dbitrates,
+				 ARRAY_SIZE(pcan_cia_dbitrates));
+}
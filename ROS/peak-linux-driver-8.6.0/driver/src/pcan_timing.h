@@ -73,10 +73,16 @@ int pcan_convert_abstract(struct pcan_bittiming_abs *pba,
 				const struct pcanfd_bittiming_range *caps,
 				u32 sysclock_Hz);
 
+void pcan_timing_init(void);
+
 int pcan_bitrate_to_bittiming(struct pcan_bittiming *pbt,
 			const struct pcanfd_bittiming_range *caps,
 			u32 sysclock_Hz);
 
+void pcan_bittiming_cache_fill(const struct pcanfd_bittiming_range *caps,
+			const struct pcanfd_bittiming_range *dcaps,
+			u32 sysclock_Hz);
+
 static inline int pcan_is_bittiming_valid(struct pcan_bittiming *pbt)
 {
 	return pbt->brp || pbt->bitrate;
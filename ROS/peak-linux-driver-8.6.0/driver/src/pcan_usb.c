@@ -1142,7 +1142,7 @@ static int pcan_usb_EncodeMessage(struct pcandev *dev, u8 *ucMsgPtr,
 				DPRINTK(KERN_DEBUG
 					"%s: can't get data out of writeFifo, "
 					"avail data: %d, err: %d\n",
-					DEVICE_NAME, dev->writeFifo.nStored,
+					DEVICE_NAME, pcan_fifo_status(&dev->writeFifo),
 					err);
 			}
 
@@ -209,6 +209,7 @@ static void pcan_usb_write_notify(struct urb *purb, struct pt_regs *pregs)
 			pcan_event_signal(&dev->out_event);
 #ifndef NETDEV_SUPPORT
 			pcan_event_signal(&dev->in_event);
+			pcan_rx_coalesce_wake_all(dev);
 #endif
 #ifdef PCAN_USER_FREE_DEV
 			/* unlink the dev from usb_if: it will be
@@ -297,6 +298,7 @@ static void pcan_usb_read_notify(struct urb *purb, struct pt_regs *pregs)
 				pcan_event_signal(&dev->out_event);
 #ifndef NETDEV_SUPPORT
 				pcan_event_signal(&dev->in_event);
+				pcan_rx_coalesce_wake_all(dev);
 #endif
 #ifdef PCAN_USER_FREE_DEV
 				/* unlink the dev from usb_if: it will be
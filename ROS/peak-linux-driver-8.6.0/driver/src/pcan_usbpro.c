@@ -2140,7 +2140,7 @@ static int pcan_usbpro_msg_encode(struct pcandev *dev,
 	DPRINTK(KERN_DEBUG "%s: %s(buffer_size=%d) rec_max_size=%d "
 	        "msg_in_fifo=%d fifo_empty=%d\n", DEVICE_NAME, __func__,
 	        *buffer_size, rec_max_len,
-	        dev->writeFifo.nStored, pcan_fifo_empty(&dev->writeFifo));
+	        pcan_fifo_status(&dev->writeFifo), pcan_fifo_empty(&dev->writeFifo));
 #endif
 
 	/* In order to accelerate things... */
@@ -2176,7 +2176,7 @@ static int pcan_usbpro_msg_encode(struct pcandev *dev,
 				pr_err(DEVICE_NAME
 					": %s(): can't get data out of "
 					"writeFifo, available data=%d err=%d\n",
-				       __func__, dev->writeFifo.nStored, err);
+				       __func__, pcan_fifo_status(&dev->writeFifo), err);
 			}
 
 			break;
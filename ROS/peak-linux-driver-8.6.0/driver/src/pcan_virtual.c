@@ -0,0 +1,514 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Virtual CAN-FD adapter, looping back the frames written on any of its
+ * channels to the others, without any hardware.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * "virtcount" channels are created at load time. All of them are connected to
+ * the same virtual bus: a frame written on a channel is received by all of the
+ * other channels that are on the bus with the same bitrates. With "virtpace"
+ * set, a frame stays on the bus for the time it would take at the nominal
+ * (and data) bitrates of the writer, without bit stuffing. Note that each
+ * channel paces its own frames only: there's no arbitration between channels
+ * writing at the same time. With "virtpace" cleared, frames are given to the
+ * other channels from the context of the writer, which gives the pure software
+ * overhead of the driver. There are no hardware timestamps: frames are
+ * timestamped by the host, at the end of their transmission.
+ *
+ * With "virterr" set, one Tx attempt out of "virterr" fails with a bit error:
+ * the writer receives an error frame, its Tx error counter is incremented by
+ * 8 and the frame is sent again, up to the BUS-OFF state.
+ */
+#include "src/pcan_common.h"
+#include "src/pcan_virtual.h"
+
+#ifdef VIRTUAL_SUPPORT
+
+#include "src/pcanfd_core.h"
+#include "src/pcan_fifo.h"
+#include "src/pcan_filter.h"
+#ifdef NETDEV_SUPPORT
+#include "src/pcan_netdev.h"
+#endif
+
+#define PCAN_VIRTUAL_COUNT_MAX	16
+
+/* bits count of the frames, from SOF to the end of the interframe space */
+#define PCAN_VIRTUAL_STD_BITS	47	/* CAN 2.0 11-bit ID frame, no data */
+#define PCAN_VIRTUAL_EXT_BITS	67	/* CAN 2.0 29-bit ID frame, no data */
+#define PCAN_VIRTUAL_FD_STD_BITS 17	/* CAN-FD 11-bit ID arbitration */
+#define PCAN_VIRTUAL_FD_EXT_BITS 36	/* CAN-FD 29-bit ID arbitration */
+#define PCAN_VIRTUAL_FD_EOF_BITS 12	/* CAN-FD ACK + EOF + IFS */
+#define PCAN_VIRTUAL_FD_CTL_BITS 10	/* CAN-FD ESI + DLC + SBC + CRC del */
+
+/* SJA1000 ECC value: bit error in the data field, during transmission */
+#define PCAN_VIRTUAL_ECC_BIT	0x0a
+
+static ushort virtcount;
+module_param(virtcount, ushort, 0444);
+MODULE_PARM_DESC(virtcount, " count of virtual CAN channels (def=0, max="
+			__stringify(PCAN_VIRTUAL_COUNT_MAX) ")");
+
+static ushort virtpace = 1;
+module_param(virtpace, ushort, 0644);
+MODULE_PARM_DESC(virtpace, " emulate the duration of the frames on the "
+			"virtual bus (def=1)");
+
+static uint virterr;
+module_param(virterr, uint, 0644);
+MODULE_PARM_DESC(virterr, " fail one Tx attempt out of virterr on the "
+			"virtual bus (def=0=never)");
+
+static const struct pcanfd_bittiming_range pcan_virtual_capabilities = {
+	.brp_min = 1,
+	.brp_max = 1024,
+	.brp_inc = 1,
+
+	.tseg1_min = 1,
+	.tseg1_max = 256,
+	.tseg2_min = 1,
+	.tseg2_max = 128,
+	.sjw_min = 1,
+	.sjw_max = 128,
+};
+
+static const struct pcanfd_bittiming_range pcan_virtual_dcapabilities = {
+	.brp_min = 1,
+	.brp_max = 1024,
+	.brp_inc = 1,
+
+	.tseg1_min = 1,
+	.tseg1_max = 32,
+	.tseg2_min = 1,
+	.tseg2_max = 16,
+	.sjw_min = 1,
+	.sjw_max = 16,
+};
+
+static const pcanfd_mono_clock_device pcan_virtual_clocks = {
+	.count = 1,
+	.list = {
+		[0] = { .clock_Hz = 80*MHz, .clock_src = 80*MHz, },
+	}
+};
+
+/* count of virtual devices not cleaned up yet: the last one frees the
+ * adapter */
+static int pcan_virtual_devs;
+
+static void pcan_virtual_post(struct pcandev *dev, struct pcanfd_rxmsg *rx)
+{
+#ifdef NETDEV_SUPPORT
+	pcan_netdev_rx(dev, rx);
+#else
+	if (pcan_chardev_rx(dev, rx) > 0)
+		pcan_event_signal(&dev->in_event);
+#endif
+}
+
+/* wake up any task waiting for some room in the Tx queue */
+static void pcan_virtual_tx_wake_up(struct pcandev *dev)
+{
+#ifdef NETDEV_SUPPORT
+	if (dev->netdev)
+		netif_wake_queue(dev->netdev);
+#else
+	pcan_event_signal(&dev->out_event);
+#endif
+}
+
+/* the bus state of a channel follows its Tx error counter. A STATUS msg is
+ * posted on each state change only. */
+static void pcan_virtual_set_tec(struct pcandev *dev, u32 tec)
+{
+	struct pcanfd_rxmsg rx = {};
+	enum pcanfd_status bus_state;
+
+	dev->port.virt.tec = tec;
+	dev->tx_error_counter = (tec > 255) ? 255 : tec;
+
+	if (tec > 255)
+		bus_state = PCANFD_ERROR_BUSOFF;
+	else if (tec >= 128)
+		bus_state = PCANFD_ERROR_PASSIVE;
+	else if (tec >= 96)
+		bus_state = PCANFD_ERROR_WARNING;
+	else
+		bus_state = PCANFD_ERROR_ACTIVE;
+
+	if (bus_state == dev->bus_state)
+		return;
+
+	switch (bus_state) {
+	case PCANFD_ERROR_BUSOFF:
+		pcan_handle_busoff(dev, &rx);
+		break;
+	case PCANFD_ERROR_ACTIVE:
+		pcan_handle_error_active(dev, &rx);
+
+		/* entering ERROR_ACTIVE has reset the error counters */
+		dev->tx_error_counter = tec;
+		break;
+	default:
+		pcan_handle_error_status(dev, &rx,
+					 bus_state == PCANFD_ERROR_WARNING,
+					 bus_state == PCANFD_ERROR_PASSIVE);
+		break;
+	}
+
+	pcan_virtual_post(dev, &rx);
+}
+
+/* time the frame takes on the bus at the bitrates of the writer */
+static u64 pcan_virtual_frame_ns(struct pcandev *dev, struct pcanfd_msg *pm)
+{
+	const struct pcanfd_init *pfdi = &dev->init_settings;
+	u64 ns = (u64 )dev->tx_iframe_delay_us * NSEC_PER_USEC;
+	u32 nbits, dbits = 0;
+
+	if (!virtpace)
+		return ns;
+
+	if (pm->type == PCANFD_TYPE_CANFD_MSG) {
+		nbits = (pm->flags & PCANFD_MSG_EXT) ?
+				PCAN_VIRTUAL_FD_EXT_BITS :
+				PCAN_VIRTUAL_FD_STD_BITS;
+		nbits += PCAN_VIRTUAL_FD_EOF_BITS;
+
+		/* data phase, with a 17-bit or 21-bit CRC */
+		dbits = PCAN_VIRTUAL_FD_CTL_BITS + 8 * pm->data_len +
+				((pm->data_len > 16) ? 21 : 17);
+
+		if (!(pm->flags & PCANFD_MSG_BRS) || !pfdi->data.bitrate) {
+			nbits += dbits;
+			dbits = 0;
+		}
+	} else {
+		nbits = (pm->flags & PCANFD_MSG_EXT) ?
+				PCAN_VIRTUAL_EXT_BITS : PCAN_VIRTUAL_STD_BITS;
+		if (!(pm->flags & PCANFD_MSG_RTR))
+			nbits += 8 * pm->data_len;
+	}
+
+	if (pfdi->nominal.bitrate)
+		ns += div_u64((u64 )nbits * NSEC_PER_SEC,
+			      pfdi->nominal.bitrate);
+	if (dbits)
+		ns += div_u64((u64 )dbits * NSEC_PER_SEC, pfdi->data.bitrate);
+
+	return ns;
+}
+
+/* give a frame from the bus to a channel, if it's on the bus with the same
+ * bitrates than the writer. */
+static void pcan_virtual_rx(struct pcandev *dev, struct pcandev *src,
+			    const struct pcanfd_rxmsg *rx)
+{
+	const struct pcanfd_init *pfdi = &dev->init_settings;
+	struct pcanfd_rxmsg f;
+	pcan_lock_irqsave_ctxt flags;
+
+	/* the virt lock of the receiver is always taken last, so that
+	 * channels can write to each other at the same time */
+	pcan_lock_get_irqsave(&dev->port.virt.lock, flags);
+
+	if (!dev->port.virt.bus_on)
+		goto unlock;
+
+	switch (dev->bus_state) {
+	case PCANFD_UNKNOWN:
+	case PCANFD_ERROR_BUSOFF:
+		goto unlock;
+	default:
+		break;
+	}
+
+	if (pfdi->nominal.bitrate != src->init_settings.nominal.bitrate)
+		goto unlock;
+
+	if (rx->msg.type == PCANFD_TYPE_CANFD_MSG) {
+		if (!(pfdi->flags & PCANFD_INIT_FD))
+			goto unlock;
+
+		if ((rx->msg.flags & PCANFD_MSG_BRS) &&
+		    pfdi->data.bitrate != src->init_settings.data.bitrate)
+			goto unlock;
+	}
+
+	/* pcan_chardev_rx() updates the msg it is given */
+	f = *rx;
+	pcan_virtual_post(dev, &f);
+
+unlock:
+	pcan_lock_put_irqrestore(&dev->port.virt.lock, flags);
+}
+
+/* the frame being transmitted by dev has reached the end of the bus. */
+static void pcan_virtual_tx_done(struct pcandev *dev)
+{
+	VIRTUAL_PORT *pv = &dev->port.virt;
+	struct pcanfd_msg *pm = &pv->tx_msg.msg;
+	struct pcan_adapter *pa = dev->adapter;
+	struct pcanfd_rxmsg rx = {};
+	int i;
+
+	/* a controller in listen-only mode never transmits anything */
+	if (dev->init_settings.flags & PCANFD_INIT_LISTEN_ONLY) {
+		pv->tx_pending = 0;
+		return;
+	}
+
+	/* errors injection: this Tx attempt is lost and the frame will be
+	 * sent again */
+	if (!(pm->flags & PCANFD_MSG_SLF) && virterr &&
+	    !(++pv->tx_count % virterr)) {
+		pcan_handle_error_msg(dev, &rx, PCANFD_ERRMSG_BIT,
+				      PCAN_VIRTUAL_ECC_BIT, 0, 1);
+		pcan_virtual_post(dev, &rx);
+		pcan_virtual_set_tec(dev, pv->tec + 8);
+		return;
+	}
+
+	pv->tx_pending = 0;
+	dev->tx_frames_counter++;
+
+	if (pv->tec)
+		pcan_virtual_set_tec(dev, pv->tec - 1);
+
+	rx.msg.type = pm->type;
+	rx.msg.id = pm->id;
+	rx.msg.flags = pm->flags &
+			(PCANFD_MSG_EXT|PCANFD_MSG_RTR|
+			 PCANFD_MSG_BRS|PCANFD_MSG_ESI);
+	rx.msg.data_len = pm->data_len;
+	if (!(pm->flags & PCANFD_MSG_RTR))
+		memcpy(rx.msg.data, pm->data, pm->data_len);
+
+	/* self-received frames don't go on the bus */
+	if (!(pm->flags & PCANFD_MSG_SLF))
+		for (i = 0; i < pa->can_count; i++)
+			if (pa->devs[i] != dev)
+				pcan_virtual_rx(pa->devs[i], dev, &rx);
+
+	if (pm->flags & (PCANFD_MSG_SLF|PCANFD_MSG_ECHO)) {
+		rx.msg.flags |= pm->flags & (PCANFD_MSG_SLF|PCANFD_MSG_ECHO);
+		pcan_virtual_rx(dev, dev, &rx);
+	}
+}
+
+/* start writing the frames of the Tx fifo on the bus (isr_lock held) */
+static int pcan_virtual_device_write(struct pcandev *dev,
+				     struct pcan_udata *ctx)
+{
+	VIRTUAL_PORT *pv = &dev->port.virt;
+	int err = 0, wake_up = 0;
+	u64 ns;
+
+	while (dev->bus_state != PCANFD_ERROR_BUSOFF) {
+
+		if (!pv->tx_pending) {
+			err = pcan_fifo_get(&dev->writeFifo, &pv->tx_msg);
+			if (err)
+				break;
+
+			pv->tx_pending = 1;
+			wake_up = 1;
+		}
+
+		ns = pcan_virtual_frame_ns(dev, &pv->tx_msg.msg);
+		if (ns) {
+			/* the timer will end the transmission */
+			pcan_set_tx_engine(dev, TX_ENGINE_STARTED);
+			hrtimer_start(&pv->tx_timer, ns_to_ktime(ns),
+				      HRTIMER_MODE_REL);
+			goto exit;
+		}
+
+		pcan_virtual_tx_done(dev);
+	}
+
+	/* in BUS-OFF, the frame being transmitted is lost */
+	pv->tx_pending = 0;
+	pcan_set_tx_engine(dev, TX_ENGINE_STOPPED);
+
+exit:
+	if (wake_up)
+		pcan_virtual_tx_wake_up(dev);
+
+	return err;
+}
+
+static enum hrtimer_restart pcan_virtual_tx_timeout(struct hrtimer *t)
+{
+	struct pcandev *dev = container_of(t, struct pcandev,
+					   port.virt.tx_timer);
+	pcan_lock_irqsave_ctxt flags;
+
+	pcan_lock_get_irqsave(&dev->isr_lock, flags);
+
+	/* the Tx engine is closed before the device is released */
+	if (dev->locked_tx_engine_state == TX_ENGINE_STARTED) {
+		pcan_virtual_tx_done(dev);
+		pcan_virtual_device_write(dev, NULL);
+	}
+
+	pcan_lock_put_irqrestore(&dev->isr_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static int pcan_virtual_device_open_fd(struct pcandev *dev,
+				       struct pcanfd_init *pfdi)
+{
+	VIRTUAL_PORT *pv = &dev->port.virt;
+	pcan_lock_irqsave_ctxt flags;
+
+	if (pfdi->flags & PCANFD_INIT_LISTEN_ONLY)
+		dev->flags |= PCAN_DEV_LISTEN_ONLY;
+	else
+		dev->flags &= ~PCAN_DEV_LISTEN_ONLY;
+
+	/* (re)starting the controller resets its error counters */
+	pv->tec = 0;
+	pv->tx_count = 0;
+	pv->tx_pending = 0;
+
+	pcan_lock_get_irqsave(&pv->lock, flags);
+	pv->bus_on = 1;
+	pcan_lock_put_irqrestore(&pv->lock, flags);
+
+	pcan_soft_error_active(dev);
+
+	return 0;
+}
+
+static void pcan_virtual_device_release(struct pcandev *dev)
+{
+	VIRTUAL_PORT *pv = &dev->port.virt;
+	pcan_lock_irqsave_ctxt flags;
+
+	/* leave the bus: the peers don't give any frame to dev anymore */
+	pcan_lock_get_irqsave(&pv->lock, flags);
+	pv->bus_on = 0;
+	pcan_lock_put_irqrestore(&pv->lock, flags);
+
+	/* abort the frame being transmitted, if any */
+	hrtimer_cancel(&pv->tx_timer);
+	pv->tx_pending = 0;
+}
+
+static int pcan_virtual_cleanup(struct pcandev *dev)
+{
+	struct pcan_adapter *pa = dev->adapter;
+
+	hrtimer_cancel(&dev->port.virt.tx_timer);
+	dev->filter = pcan_delete_filter_chain(dev->filter);
+
+	if (!--pcan_virtual_devs)
+		pcan_free_adapter(pa);
+
+	return 0;
+}
+
+static void pcan_virtual_soft_init(struct pcandev *dev,
+				   struct pcan_adapter *pa)
+{
+	pcan_soft_init_ex(dev,
+		(const struct pcanfd_available_clocks *)&pcan_virtual_clocks,
+		&pcan_virtual_capabilities,
+		PCAN_DEV_TXPAUSE_RDY|PCAN_DEV_ERRCNT_RDY|
+		PCAN_DEV_SLF_RDY|PCAN_DEV_ECHO_RDY);
+
+	dev->adapter = pa;
+	dev->nMajor = pcan_drv.nMajor;
+
+	dev->def_init_settings.flags |= PCANFD_INIT_FD;
+	dev->dbittiming_caps = &pcan_virtual_dcapabilities;
+
+	pcan_bittiming_normalize(&dev->def_init_settings.data,
+				 dev->sysclock_Hz, dev->dbittiming_caps);
+
+	/* reset default init settings with new data bitrate specs */
+	pcanfd_copy_init(&dev->init_settings, &dev->def_init_settings);
+
+	dev->device_open_fd = pcan_virtual_device_open_fd;
+	dev->device_write = pcan_virtual_device_write;
+	dev->device_release = pcan_virtual_device_release;
+	dev->cleanup = pcan_virtual_cleanup;
+	dev->filter = pcan_create_filter_chain();
+
+	pcan_lock_init(&dev->port.virt.lock);
+	hrtimer_init(&dev->port.virt.tx_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	dev->port.virt.tx_timer.function = pcan_virtual_tx_timeout;
+}
+
+/* create the channels of the virtual adapter */
+int pcan_create_virtual_devices(void)
+{
+	struct pcan_adapter *pa;
+	struct pcandev *dev;
+	int i, err;
+
+	if (!virtcount)
+		return 0;
+
+	if (virtcount > PCAN_VIRTUAL_COUNT_MAX)
+		virtcount = PCAN_VIRTUAL_COUNT_MAX;
+
+	pa = pcan_alloc_adapter("PCAN-Virtual", 0, virtcount);
+	if (!pa) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < virtcount; i++) {
+		dev = pcan_alloc_dev("virt", HW_VIRTUAL, i);
+		if (!dev) {
+			err = -ENOMEM;
+			goto fail_free;
+		}
+
+		pcan_virtual_soft_init(dev, pa);
+
+		dev->nMinor = PCAN_VIRTUAL_MINOR_BASE + i;
+		pa->devs[i] = dev;
+	}
+
+	/* a channel gives its frames to all of the others: link them only
+	 * once all of them exist */
+	pcan_virtual_devs = virtcount;
+	for (i = 0; i < virtcount; i++)
+		pcan_add_dev_in_list(pa->devs[i]);
+
+	pr_info(DEVICE_NAME ": %u virtual CAN channels created (minor %u..%u)\n",
+		virtcount, PCAN_VIRTUAL_MINOR_BASE,
+		PCAN_VIRTUAL_MINOR_BASE + virtcount - 1);
+
+	return 0;
+
+fail_free:
+	while (i-- > 0) {
+		dev = pa->devs[i];
+		dev->filter = pcan_delete_filter_chain(dev->filter);
+		pcan_free_dev(dev);
+	}
+
+	pcan_free_adapter(pa);
+
+fail:
+	pr_err(DEVICE_NAME ": virtual CAN devices creation failed (err %d)\n",
+	       err);
+
+	return err;
+}
+
+#endif /* VIRTUAL_SUPPORT */
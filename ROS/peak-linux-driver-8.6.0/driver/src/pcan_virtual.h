@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Virtual CAN-FD adapter, looping back the frames written on any of its
+ * channels to the others, without any hardware.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+#ifndef __PCAN_VIRTUAL_H__
+#define __PCAN_VIRTUAL_H__
+
+#include "src/pcan_common.h"
+#include "src/pcan_main.h"
+
+int pcan_create_virtual_devices(void);
+
+#endif
@@ -40,6 +40,7 @@
 //#define PCAN_USE_DEFBT_ON_ERROR
 
 extern u16 btr0btr1;
+extern ushort rxqsize;
 extern u32 pcan_def_dbitrate;
 
 /*
@@ -273,6 +274,9 @@ int pcanfd_dev_reset(struct pcandev *dev)
 	if (err)
 		goto reset_fail;
 
+#ifndef NETDEV_SUPPORT
+	pcan_rx_fifo_reset_all(dev);
+#endif
 	dev->wCANStatus &= ~(CAN_ERR_OVERRUN|CAN_ERR_XMTFULL);
 
 reset_fail:
@@ -591,10 +595,11 @@ int pcanfd_ioctl_get_init(struct pcandev *dev, struct pcanfd_init *pfdi)
 	return 0;
 }
 
-/* add a message filter_element into the filter chain or delete all
+/* add a message filter_element into the filter chain "filter" or delete all
  * filter_elements
  */
-int pcanfd_ioctl_add_filter(struct pcandev *dev, struct pcanfd_msg_filter *pf)
+int pcanfd_ioctl_add_filter(struct pcandev *dev, void *filter,
+			    struct pcanfd_msg_filter *pf)
 {
 #ifdef DEBUG
 	pr_info("%s: %s(CAN%u)\n", DEVICE_NAME, __func__, dev->nChannel+1);
@@ -602,17 +607,17 @@ int pcanfd_ioctl_add_filter(struct pcandev *dev, struct pcanfd_msg_filter *pf)
 
 	/* filter == NULL -> delete the filter_elements in the chain */
 	if (!pf) {
-		pcan_delete_filter_all(dev->filter);
+		pcan_delete_filter_all(filter);
 		return 0;
 	}
 
-	return pcan_add_filter(dev->filter,
+	return pcan_add_filter(filter,
 		               pf->id_from, pf->id_to, pf->msg_flags);
 }
 
 /* add several message filter_element into the filter chain.
  */
-int pcanfd_ioctl_add_filters(struct pcandev *dev,
+int pcanfd_ioctl_add_filters(struct pcandev *dev, void *filter,
 						struct pcanfd_msg_filters *pfl)
 {
 #ifdef DEBUG
@@ -621,16 +626,16 @@ int pcanfd_ioctl_add_filters(struct pcandev *dev,
 
 	/* filter == NULL -> delete the filter_elements in the chain */
 	if (!pfl) {
-		pcan_delete_filter_all(dev->filter);
+		pcan_delete_filter_all(filter);
 		return 0;
 	}
 
-	return pcan_add_filters(dev->filter, pfl->list, pfl->count);
+	return pcan_add_filters(filter, pfl->list, pfl->count);
 }
 
 /* get several message filter_element from the filter chain.
  */
-int pcanfd_ioctl_get_filters(struct pcandev *dev,
+int pcanfd_ioctl_get_filters(struct pcandev *dev, void *filter,
 						struct pcanfd_msg_filters *pfl)
 {
 	int err;
@@ -641,9 +646,9 @@ int pcanfd_ioctl_get_filters(struct pcandev *dev,
 
 	/* filter == NULL -> return the current nb of filters in the chain */
 	if (!pfl)
-		return pcan_get_filters_count(dev->filter);
+		return pcan_get_filters_count(filter);
 
-	err = pcan_get_filters(dev->filter, pfl->list, pfl->count);
+	err = pcan_get_filters(filter, pfl->list, pfl->count);
 	if (err < 0) {
 		pfl->count = 0;
 		return err;
@@ -678,10 +683,10 @@ int pcanfd_ioctl_get_state(struct pcandev *dev, struct pcanfd_state *pfds)
 	pfds->bus_load = dev->bus_load;
 
 	pfds->tx_max_msgs = dev->writeFifo.nCount;
-	pfds->tx_pending_msgs = dev->writeFifo.nStored;
+	pfds->tx_pending_msgs = pcan_fifo_status(&dev->writeFifo);
 
 	pfds->rx_max_msgs = dev->readFifo.nCount;
-	pfds->rx_pending_msgs = dev->readFifo.nStored;
+	pfds->rx_pending_msgs = pcan_fifo_status(&dev->readFifo);
 	pfds->tx_error_counter = dev->tx_error_counter;
 	pfds->rx_error_counter = dev->rx_error_counter;
 	pfds->tx_frames_counter = dev->tx_frames_counter;
@@ -693,14 +698,58 @@ int pcanfd_ioctl_get_state(struct pcandev *dev, struct pcanfd_state *pfds)
 	return 0;
 }
 
-static int pcanfd_recv_msg(struct pcandev *dev, struct pcanfd_rxmsg *pf,
-		                                        struct pcan_udata *ctx)
+#ifndef NETDEV_SUPPORT
+/*
+ * get up to n msgs from the Rx fifo the open path reads from.
+ *
+ * returns the count of msgs read or -ENODATA if the fifo is empty.
+ */
+static int pcanfd_rx_fifo_get_n(struct pcandev *dev, FIFO_MANAGER *fifo,
+				struct pcanfd_rxmsg *pf, int n,
+				struct pcan_udata *ctx)
+{
+	int i, err = pcan_fifo_get_n(fifo, pf, n);
+
+	if (err <= 0)
+		return err;
+
+	/* a private Rx fifo has its own overflow state */
+	if (fifo == &dev->readFifo)
+		pcan_clear_status_bit(dev, CAN_ERR_OVERRUN);
+	else
+		ctx->rx_fifo_overflow = 0;
+
+	for (i = 0; i < err; i++)
+		pcan_sync_timestamps(dev, pf + i);
+
+#ifdef DEBUG_WAIT_RD
+	pr_info("%s: %s(%u): still %u items in Rx queue\n",
+		DEVICE_NAME, __func__, __LINE__, pcan_fifo_status(fifo));
+#endif
+	return err;
+}
+#endif
+
+/*
+ * get up to n msgs from the Rx fifo, waiting for the 1st one if the task is
+ * allowed to block. Once at least one msg is available, all the msgs that
+ * can be read are got at once, without waiting anymore.
+ *
+ * returns the count of msgs read or a negative error code.
+ */
+static int pcanfd_recv_msgs(struct pcandev *dev, struct pcanfd_rxmsg *pf,
+			    int n, struct pcan_udata *ctx)
 {
 #ifdef NETDEV_SUPPORT
 	return -EAGAIN;		/* be compatible with old behaviour */
 #else
+	FIFO_MANAGER *fifo = pcan_rx_fifo(dev, ctx);
 	int err;
 
+	/* msgs are directly read from the mmap() Rx ring by the application */
+	if (ctx->rx_ring)
+		return -EBUSY;
+
 	do {
 		/* if the device has been plugged out while waiting,
 		 * or if any task is closing it */
@@ -710,25 +759,9 @@ static int pcanfd_recv_msg(struct pcandev *dev, struct pcanfd_rxmsg *pf,
 		}
 
 		/* get data from fifo */
-		err = pcan_fifo_get(&dev->readFifo, pf);
-		if (err >= 0) {
-
-			pcan_clear_status_bit(dev, CAN_ERR_OVERRUN);
-
-			pcan_sync_timestamps(dev, pf);
-#if 0
-			if (pf->msg.type == PCANFD_TYPE_CAN20_MSG)
-				pr_info(DEVICE_NAME ": %s()\n", __func__);
-#endif
-
-#ifdef DEBUG_WAIT_RD
-			pr_info("%s: %s(%u): still %u items in Rx queue\n",
-				DEVICE_NAME, __func__, __LINE__,
-				dev->readFifo.nStored);
-#endif
-			err = 0;
+		err = pcanfd_rx_fifo_get_n(dev, fifo, pf, n, ctx);
+		if (err > 0)
 			break;
-		}
 
 		/* support nonblocking read if requested */
 		if (ctx->open_flags & O_NONBLOCK) {
@@ -762,9 +795,20 @@ static int pcanfd_recv_msg(struct pcandev *dev, struct pcanfd_rxmsg *pf,
 		 *   call fails with err=-EIDRM(43).
 		 * - if some other task deletes this wating task, this tasks
 		 *   is first unblocked, thus err=-EINTR(4).*/
+#ifdef NO_RT
+		/* if Rx wake-ups are coalesced, wait for the path to be ready */
+		if (ctx->rx_coalesced) {
+			if (!pcan_rx_coalesce_ready(ctx))
+				err = pcan_event_wait(ctx->rx_event,
+						!dev->is_plugged ||
+						!ctx->rx_coalesced ||
+						ctx->rx_ready);
+			continue;
+		}
+#endif
 		err = pcan_event_wait(dev->in_event,
 					!dev->is_plugged ||
-					!pcan_fifo_empty(&dev->readFifo));
+					!pcan_fifo_empty(fifo));
 
 #ifdef DEBUG_WAIT_RD
 		pr_info(DEVICE_NAME
@@ -779,6 +823,100 @@ static int pcanfd_recv_msg(struct pcandev *dev, struct pcanfd_rxmsg *pf,
 #endif
 }
 
+/*
+ * get up to n msgs from the Rx fifo, once at least min msgs can be read, or
+ * once the CLOCK_MONOTONIC deadline is reached, whichever comes first. A null
+ * deadline doesn't bound the wait. In non-RT, the path is given its own Rx
+ * fifo so that the Rx fan-out wakes up the task once only, when min msgs are
+ * pending, rather than each time a msg is received.
+ *
+ * returns the count of msgs read (0 if the deadline has been reached while the
+ * fifo was empty) or a negative error code.
+ */
+static int pcanfd_recv_msgs_timeout(struct pcandev *dev,
+				    struct pcanfd_rxmsg *pf, int n, u32 min,
+				    u64 deadline_ns, struct pcan_udata *ctx)
+{
+#ifdef NETDEV_SUPPORT
+	return -EAGAIN;		/* be compatible with old behaviour */
+#else
+	pcan_event_t *in_event = &dev->in_event;
+	FIFO_MANAGER *fifo;
+	int err;
+	u64 now;
+
+	/* msgs are directly read from the mmap() Rx ring by the application */
+	if (ctx->rx_ring)
+		return -EBUSY;
+
+#ifdef NO_RT
+	err = pcan_rx_fifo_attach(dev, ctx, rxqsize);
+	if (err && err != -EBUSY)
+		return err;
+
+	in_event = &ctx->rx_event;
+#endif
+	fifo = pcan_rx_fifo(dev, ctx);
+
+	/* the task can't wait for more msgs than the fifo can store */
+	if (min > (u32 )n)
+		min = n;
+	if (min > fifo->nCount)
+		min = fifo->nCount;
+
+	while (pcan_fifo_status(fifo) < min) {
+
+		if (!dev->is_plugged || !dev->nOpenPaths)
+			return -ENODEV;
+
+		if ((ctx->open_flags & O_NONBLOCK) || !pcan_task_can_wait())
+			break;
+
+#ifdef NO_RT
+		/* rx_wait_min is cleared each time the path is woken up: then,
+		 * wait again for this task own count */
+		pcan_rx_coalesce_wait_min(dev, ctx, min);
+#endif
+		if (!deadline_ns) {
+			err = pcan_event_wait(*in_event,
+					!dev->is_plugged ||
+					pcan_rx_coalesce_woken(ctx) ||
+					pcan_fifo_status(fifo) >= min);
+		} else {
+			now = pcan_getmono_ns();
+			if (now >= deadline_ns)
+				break;
+
+			err = pcan_event_wait_timeout_ns(*in_event,
+					!dev->is_plugged ||
+					pcan_rx_coalesce_woken(ctx) ||
+					pcan_fifo_status(fifo) >= min,
+					deadline_ns - now);
+			if (err == -ETIMEDOUT)
+				break;
+		}
+
+		if (err < 0)
+			return (err == -ERESTARTSYS) ? -EINTR : err;
+	}
+
+	if (!dev->is_plugged || !dev->nOpenPaths)
+		return -ENODEV;
+
+	err = pcanfd_rx_fifo_get_n(dev, fifo, pf, n, ctx);
+
+	return (err == -ENODATA) ? 0 : err;
+#endif
+}
+
+static int pcanfd_recv_msg(struct pcandev *dev, struct pcanfd_rxmsg *pf,
+			   struct pcan_udata *ctx)
+{
+	int err = pcanfd_recv_msgs(dev, pf, 1, ctx);
+
+	return (err < 0) ? err : 0;
+}
+
 int __pcan_dev_start_writing(struct pcandev *dev, struct pcan_udata *ctx)
 {
 	int err;
@@ -812,37 +950,33 @@ static int pcanfd_start_tx_engine(struct pcandev *dev, struct pcan_udata *ctx)
 	return err;
 }
 
-static int pcanfd_send_msg(struct pcandev *dev, struct pcanfd_txmsg *ptx,
-			   struct pcan_udata *ctx)
+/*
+ * check whether a msg can be written to the device
+ */
+static int pcanfd_check_tx_msg(struct pcandev *dev, struct pcanfd_msg *pm)
 {
-	int err;
-
-#ifdef DEBUG
-	pr_info(DEVICE_NAME ": %s()\n", __func__);
-#endif
-
-	switch (ptx->msg.type) {
+	switch (pm->type) {
 
 	case PCANFD_TYPE_CANFD_MSG:
 
 		/* accept such messages for CAN-FD capable devices only */
 		if ((dev->init_settings.flags & PCANFD_INIT_FD) &&
-				(ptx->msg.data_len <= PCANFD_MAXDATALEN))
+				(pm->data_len <= PCANFD_MAXDATALEN))
 			break;
 
 		pr_err(DEVICE_NAME
 			": trying to send invalid CAN FD msg (len=%d)\n",
-			ptx->msg.data_len);
+			pm->data_len);
 
 		return -EBADMSG;
 
 	case PCANFD_TYPE_CAN20_MSG:
-		if (ptx->msg.data_len <= PCAN_MAXDATALEN)
+		if (pm->data_len <= PCAN_MAXDATALEN)
 			break;
 	default:
 		pr_err(DEVICE_NAME
 			": trying to send invalid msg (type=%xh len=%d)\n",
-			ptx->msg.type, ptx->msg.data_len);
+			pm->type, pm->data_len);
 
 		return -EBADMSG;
 	}
@@ -850,14 +984,49 @@ static int pcanfd_send_msg(struct pcandev *dev, struct pcanfd_txmsg *ptx,
 	/* filter extended data if initialized to standard only
 	 * SGR note: no need to wait for doing such test... */
 	if ((dev->init_settings.flags & PCANFD_INIT_STD_MSG_ONLY)
-	   && ((ptx->msg.flags & PCANFD_MSG_EXT) || (ptx->msg.id > 2047))) {
+	   && ((pm->flags & PCANFD_MSG_EXT) || (pm->id > 2047))) {
 
 		pr_err(DEVICE_NAME
 			": trying to send ext msg %xh while not setup for\n",
-			ptx->msg.id);
+			pm->id);
 		return -EINVAL;
 	}
 
+	return 0;
+}
+
+/*
+ * put up to n msgs into the Tx fifo. Only the leading valid msgs of the list
+ * are queued, as many as possible at once. If the task is allowed to block,
+ * it waits for some free space until all of these msgs are queued.
+ *
+ * returns the count of msgs queued or a negative error code if none.
+ */
+static int pcanfd_send_msgs(struct pcandev *dev, struct pcanfd_txmsg *ptx,
+			    int n, struct pcan_udata *ctx)
+{
+	struct timeval tv;
+	int i, err, count = 0;
+
+#ifdef DEBUG
+	pr_info(DEVICE_NAME ": %s(%d)\n", __func__, n);
+#endif
+
+	if (n <= 0)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		err = pcanfd_check_tx_msg(dev, &ptx[i].msg);
+		if (err)
+			break;
+	}
+
+	/* first msg is invalid */
+	if (!i)
+		return err;
+
+	n = i;
+
 	do {
 		/* if the device has been plugged out while waiting,
 		 * or if any task is closing it */
@@ -872,12 +1041,14 @@ static int pcanfd_send_msg(struct pcandev *dev, struct pcanfd_txmsg *ptx,
 			break;
 		}
 
-		/* get the time when msg is queued */
-		pcan_gettimeofday(&ptx->tv);
+		/* get the time when msgs are queued */
+		pcan_gettimeofday(&tv);
+		for (i = count; i < n; i++)
+			ptx[i].tv = tv;
 
 		/* put data into fifo */
-		err = pcan_fifo_put(&dev->writeFifo, ptx);
-		if (err >= 0) {
+		err = pcan_fifo_put_n(&dev->writeFifo, ptx + count, n - count);
+		if (err > 0) {
 
 			/* if FIFO was full, build a STATUS msg to clear */
 			pcan_clear_status_bit(dev, CAN_ERR_XMTFULL);
@@ -885,10 +1056,14 @@ static int pcanfd_send_msg(struct pcandev *dev, struct pcanfd_txmsg *ptx,
 			pr_info(DEVICE_NAME
 				": %s(%u): still %u free items in Tx queue\n",
 				__func__, __LINE__,
-				dev->writeFifo.nCount - dev->writeFifo.nStored);
+				dev->writeFifo.nCount -
+					pcan_fifo_status(&dev->writeFifo));
 #endif
-			err = 0;
-			break;
+			count += err;
+			if (count >= n) {
+				err = 0;
+				break;
+			}
 		}
 
 		/* support nonblocking write if requested */
@@ -975,7 +1150,15 @@ static int pcanfd_send_msg(struct pcandev *dev, struct pcanfd_txmsg *ptx,
 		break;
 	}
 
-	return err;
+	return count ? count : err;
+}
+
+static int pcanfd_send_msg(struct pcandev *dev, struct pcanfd_txmsg *ptx,
+			   struct pcan_udata *ctx)
+{
+	int err = pcanfd_send_msgs(dev, ptx, 1, ctx);
+
+	return (err < 0) ? err : 0;
 }
 
 int pcanfd_ioctl_send_msg(struct pcandev *dev, struct pcanfd_txmsg *ptx,
@@ -991,22 +1174,15 @@ int pcanfd_ioctl_send_msg(struct pcandev *dev, struct pcanfd_txmsg *ptx,
 int pcanfd_ioctl_send_msgs(struct pcandev *dev, struct pcanfd_txmsgs *pl,
 			   struct pcan_udata *ctx)
 {
-	struct pcanfd_txmsg *ptx;
-	int err = 0, n = pl->count;
+	int err, n = pl->count;
 
 #ifdef DEBUG
 	pr_info(DEVICE_NAME ": %s(count=%u)\n", __func__, n);
 #endif
 
-	pl->count = 0;
-
-	ptx = pl->list;
-	for( ; pl->count < n; pl->count++) {
-		err = pcanfd_send_msg(dev, ptx, ctx);
-		if (err)
-			break;
-		ptx++;
-	}
+	/* queue all of the msgs at once */
+	err = pcanfd_send_msgs(dev, pl->list, n, ctx);
+	pl->count = (err > 0) ? err : 0;
 
 #ifdef DEBUG
 	pr_info(DEVICE_NAME ": %s(count=%u): sent %u msgs\n",
@@ -1028,22 +1204,15 @@ int pcanfd_ioctl_send_msgs(struct pcandev *dev, struct pcanfd_txmsgs *pl,
 int pcanfd_ioctl_send_msgs_nolock(struct pcandev *dev, struct pcanfd_txmsgs *pl,
 				  struct pcan_udata *ctx)
 {
-	struct pcanfd_txmsg *ptx;
-	int err = 0, n = pl->count;
+	int err, n = pl->count;
 
 #ifdef DEBUG
 	pr_info(DEVICE_NAME ": %s(count=%u)\n", __func__, n);
 #endif
 
-	pl->count = 0;
-
-	ptx = pl->list;
-	for( ; pl->count < n; pl->count++) {
-		err = pcanfd_send_msg(dev, ptx, ctx);
-		if (err)
-			break;
-		ptx++;
-	}
+	/* queue all of the msgs at once */
+	err = pcanfd_send_msgs(dev, pl->list, n, ctx);
+	pl->count = (err > 0) ? err : 0;
 
 #ifdef DEBUG
 	pr_info(DEVICE_NAME ": %s(count=%u): sent %u msgs\n",
@@ -1087,32 +1256,52 @@ int pcanfd_ioctl_recv_msg(struct pcandev *dev, struct pcanfd_rxmsg *prx,
 int pcanfd_ioctl_recv_msgs(struct pcandev *dev, struct pcanfd_rxmsgs *pl,
 			   struct pcan_udata *ctx)
 {
-	struct pcanfd_rxmsg *prx;
-	int err = 0, n = pl->count, saved_flags = ctx->open_flags;
+	int err = 0, n = pl->count;
 
 #ifdef DEBUG
 	pr_info(DEVICE_NAME ": %s(count=%u)\n", __func__, n);
 #endif
 
-	prx = pl->list;
-
-	for (pl->count = 0; pl->count < n; pl->count++) {
-		err = pcanfd_recv_msg(dev, prx, ctx);
-		if (err)
-			break;
+	pl->count = 0;
 
-		/* the task won't block anymore since at least one msg has been
-		 * read. */
-		ctx->open_flags |= O_NONBLOCK;
-		prx++;
+	/* drain the Rx queue at once: the task won't block anymore once at
+	 * least one msg has been read. */
+	if (n > 0) {
+		err = pcanfd_recv_msgs(dev, pl->list, n, ctx);
+		if (err > 0)
+			pl->count = err;
 	}
 
-	/* restore original flags asap */
-	ctx->open_flags = saved_flags;
-
 #ifdef DEBUG
 	pr_info(DEVICE_NAME ": %s(count=%u): got %u msgs (err %d)\n",
 			__func__, n, pl->count, err);
 #endif
 	return (pl->count > 0) ? 0 : err;
 }
+
+int pcanfd_ioctl_recv_msgs_timeout(struct pcandev *dev,
+				   struct pcanfd_rxmsgs *pl, u32 min_count,
+				   u64 deadline_ns, struct pcan_udata *ctx)
+{
+	int err = 0, n = pl->count;
+
+#ifdef DEBUG
+	pr_info(DEVICE_NAME ": %s(count=%u min_count=%u deadline=%llu)\n",
+		__func__, n, min_count, deadline_ns);
+#endif
+
+	pl->count = 0;
+
+	if (n > 0) {
+		err = pcanfd_recv_msgs_timeout(dev, pl->list, n, min_count,
+					       deadline_ns, ctx);
+		if (err > 0)
+			pl->count = err;
+	}
+
+#ifdef DEBUG
+	pr_info(DEVICE_NAME ": %s(count=%u): got %u msgs (err %d)\n",
+			__func__, n, pl->count, err);
+#endif
+	return (err < 0) ? err : 0;
+}
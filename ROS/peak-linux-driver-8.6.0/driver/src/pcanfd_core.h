@@ -36,10 +36,11 @@ int pcanfd_dev_open(struct pcandev *dev, struct pcanfd_init *pfdi);
 int pcanfd_ioctl_set_init(struct pcandev *dev, struct pcanfd_init *pfdi);
 int pcanfd_ioctl_get_init(struct pcandev *dev, struct pcanfd_init *pfdi);
 int pcanfd_ioctl_get_state(struct pcandev *dev, struct pcanfd_state *pfds);
-int pcanfd_ioctl_add_filter(struct pcandev *dev, struct pcanfd_msg_filter *pf);
-int pcanfd_ioctl_add_filters(struct pcandev *dev,
+int pcanfd_ioctl_add_filter(struct pcandev *dev, void *filter,
+			    struct pcanfd_msg_filter *pf);
+int pcanfd_ioctl_add_filters(struct pcandev *dev, void *filter,
 						struct pcanfd_msg_filters *pfl);
-int pcanfd_ioctl_get_filters(struct pcandev *dev,
+int pcanfd_ioctl_get_filters(struct pcandev *dev, void *filter,
 						struct pcanfd_msg_filters *pfl);
 int pcanfd_ioctl_send_msg(struct pcandev *dev, struct pcanfd_txmsg *pmsgfd,
 						struct pcan_udata *dev_priv);
@@ -49,4 +50,7 @@ int pcanfd_ioctl_recv_msg(struct pcandev *dev, struct pcanfd_rxmsg *pmsgfd,
 						struct pcan_udata *dev_priv);
 int pcanfd_ioctl_recv_msgs(struct pcandev *dev, struct pcanfd_rxmsgs *pl,
 						struct pcan_udata *dev_priv);
+int pcanfd_ioctl_recv_msgs_timeout(struct pcandev *dev,
+				   struct pcanfd_rxmsgs *pl, u32 min_count,
+				   u64 deadline_ns, struct pcan_udata *dev_priv);
 #endif
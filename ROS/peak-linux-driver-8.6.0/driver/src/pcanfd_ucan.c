@@ -131,7 +131,7 @@ static const u8 pcan_fd_dlc2len[] = {
 };
 
 /* get data length from can_dlc with sanitized can_dlc */
-static u8 pcan_dlc2len(u8 can_dlc)
+u8 pcan_dlc2len(u8 can_dlc)
 {
 	return pcan_fd_dlc2len[can_dlc & 0x0F];
 }
@@ -150,7 +150,7 @@ static const u8 pcan_fd_len2dlc[] = {
 };
 
 /* map the sanitized data length to an appropriate data length code */
-static u8 pcan_len2dlc(u8 len)
+u8 pcan_len2dlc(u8 len)
 {
 	if (len > 64)
 		return 0xF;
@@ -1403,7 +1403,7 @@ int ucan_encode_msg(struct pcandev *dev, u8 *buffer_addr, int buffer_size)
 				"can't get data out of writeFifo, "
 				"available data: %d, err: %d\n",
 				DEVICE_NAME, __func__,
-				dev->writeFifo.nStored, err);
+				pcan_fifo_status(&dev->writeFifo), err);
 		}
 		return err;
 	}
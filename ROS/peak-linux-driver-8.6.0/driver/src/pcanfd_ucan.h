@@ -333,6 +333,10 @@ int ucan_device_open_fd(struct pcandev *dev, struct pcanfd_init *pfdi);
 
 int ucan_reset_path(struct pcandev *dev);
 
+/* CAN FD data length <-> data length code */
+u8 pcan_dlc2len(u8 can_dlc);
+u8 pcan_len2dlc(u8 len);
+
 /* uCAN messages builder */
 int ucan_encode_msg(struct pcandev *dev, u8 *buffer_addr, int buffer_size);
 int ucan_encode_msgs_buffer(struct pcandev *dev, u8 *buffer_addr,
@@ -35,6 +35,7 @@
 #endif
 
 #include <pcanfd.h>
+#include <time.h>
 
 /* CANAPI4 error codes extension */
 #define CAN_ERR_ILLHW		0x1400	/* Hardware handle is invalid */
@@ -148,6 +149,23 @@ int pcanfd_add_filter(int fd, const struct pcanfd_msg_filter *pf);
 int pcanfd_add_filters_list(int fd, int count,
 					const struct pcanfd_msg_filter *pf);
 
+/*
+ * int pcanfd_add_filter_mask(int fd, __u32 code, __u32 mask, __u32 flags)
+ * int pcanfd_add_filter_id(int fd, __u32 id, __u32 flags)
+ *
+ *	Add a single mask/code (PCANFD_FILTER_MASK) or exact ID
+ *	(PCANFD_FILTER_ID) message filter into the device's message filters
+ *	list. Messages whose (ID & mask) == code, or ID == id, are passed.
+ *	'flags' might contain PCANFD_MSG_EXT and/or PCANFD_MSG_RTR.
+ *
+ * RETURN:
+ *
+ *	0 if the filter has been correctly added,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_add_filter_mask(int fd, __u32 code, __u32 mask, __u32 flags);
+int pcanfd_add_filter_id(int fd, __u32 id, __u32 flags);
+
 /*
  * int pcanfd_get_filters(int fd, struct pcanfd_msg_filters *pfl)
  * int pcanfd_get_filters_list(int fd, int count, struct pcanfd_msg_filter *pf)
@@ -176,6 +194,56 @@ int pcanfd_get_filters_list(int fd, int count, struct pcanfd_msg_filter *pf);
  */
 int pcanfd_del_filters(int fd);
 
+/*
+ * int pcanfd_set_bpf(int fd, int count, const struct pcanfd_bpf_insn *insns)
+ *
+ *	Attach the classic BPF program made of the 'count' instructions
+ *	'insns' to the open path, replacing the current one (if any). The
+ *	program is run on each received CAN/CAN-FD message (see PCANFD_SET_BPF
+ *	in pcanfd.h). 'count' = 0 detaches the current program.
+ *
+ * RETURN:
+ *
+ *	0 if the program has been attached (or detached),
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_set_bpf(int fd, int count, const struct pcanfd_bpf_insn *insns);
+
+/*
+ * int pcanfd_bpf_compile(const char *expr, struct pcanfd_bpf_insn *insns,
+ *			  int count)
+ *
+ *	Compile the boolean expression 'expr' into a BPF program of at most
+ *	'count' instructions, that accepts the messages for which 'expr' is
+ *	true. 'expr' follows a subset of the C syntax:
+ *
+ *	expr	:= term [ '||' term ]...
+ *	term	:= factor [ '&&' factor ]...
+ *	factor	:= '!' factor | '(' expr ')' | value [ op number ]
+ *	value	:= field [ '&' number ]
+ *	field	:= 'id' | 'flags' | 'type' | 'len' |
+ *		   'data[' number ']' | 'data16[' number ']' |
+ *		   'data32[' number ']'
+ *	op	:= '==' | '!=' | '<' | '<=' | '>' | '>='
+ *
+ *	'data16[n]' and 'data32[n]' are big endian values starting at data[n].
+ *	A value without any comparison is true when it is not 0. Numbers are
+ *	parsed by strtoul() (base 0). For example:
+ *
+ *	   "id == 0x183 && (data[0] & 0x04)"
+ *
+ * RETURN:
+ *
+ *	the count of instructions of the program,
+ *	a negative (errno) code otherwise:
+ *
+ *	-EINVAL		syntax error in 'expr'
+ *	-ENOSPC		'count' is too small
+ *	-E2BIG		'expr' is too long for BPF conditional jumps
+ */
+int pcanfd_bpf_compile(const char *expr, struct pcanfd_bpf_insn *insns,
+		       int count);
+
 /*
  * int pcanfd_send_msg(int fd, struct pcanfd_msg *pfdm)
  *
@@ -228,6 +296,8 @@ int pcanfd_send_msgs(int fd, struct pcanfd_msgs *pfdm);
  * int pcanfd_send_msgs_list(int fd, int count, struct pcanfd_msg *pfdm)
  *
  * 	Enables to send one or more CANFD messages to the output queue.
+ *	The driver directly reads the messages from 'pfdm' (no memory is
+ *	allocated nor copied by the library).
  *
  *	If no space is available in the device output queue, and if the
  *	device is opened in blocking mode, then the calling task goes to sleep,
@@ -290,7 +360,9 @@ int pcanfd_recv_msgs(int fd, struct pcanfd_msgs *pfdm);
  *
  *	Enables to read one or more CANFD messages from the input queue.
  *	'pm' MUST be an address of a memory buffer large enough to store at
- *	least 'count' consecutive 'struct pcanfd_msg' objects.
+ *	least 'count' consecutive 'struct pcanfd_msg' objects, into which the
+ *	driver directly writes the messages (no memory is allocated nor copied
+ *	by the library).
  *
  *	If no message are to be read from the device input queue, and if the
  *	device is opened in blocking mode, then the calling task goes to sleep,
@@ -307,6 +379,238 @@ int pcanfd_recv_msgs(int fd, struct pcanfd_msgs *pfdm);
  */
 int pcanfd_recv_msgs_list(int fd, int count, struct pcanfd_msg *pm);
 
+/*
+ * int pcanfd_recv_msgs_timeout(int fd, int count, struct pcanfd_msg *pm,
+ *				int min_count, const struct timespec *deadline)
+ *
+ *	Enables to read up to 'count' CANFD messages from the input queue, in
+ *	the spirit of recvmmsg(): the calling task waits until at least
+ *	'min_count' messages can be read, or until the CLOCK_MONOTONIC
+ *	absolute time 'deadline' is reached, whichever comes first. Then, all
+ *	the messages that can be read (up to 'count') are read at once.
+ *	'pm' MUST be an address of a memory buffer large enough to store at
+ *	least 'count' consecutive 'struct pcanfd_msg' objects.
+ *
+ *	If 'deadline' is NULL, the wait is not bounded. If the device is
+ *	opened in non-blocking mode, the task doesn't wait.
+ *
+ * RETURN:
+ *
+ *	a positive number indicates how many messages have been read from the
+ *	device input queue. 0 means that the deadline has been reached while
+ *	no message was received.
+ *
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_recv_msgs_timeout(int fd, int count, struct pcanfd_msg *pm,
+			     int min_count, const struct timespec *deadline);
+
+/*
+ * mmap() Rx ring of an opened channel (see struct pcanfd_rx_ring)
+ */
+struct pcanfd_mmap {
+	int	fd;
+	int	fd_flags;	/* O_NONBLOCK... */
+	size_t	len;		/* length of the mapping */
+	struct pcanfd_rx_ring *ring;
+	struct pcanfd_msg *msgs;
+	__u32	msg_count;
+	__u32	pending;	/* msgs given by last pcanfd_mmap_consume() */
+};
+
+/*
+ * int pcanfd_mmap_open(int fd, int count, struct pcanfd_mmap *pmm)
+ *
+ *	Map an Rx ring of at least 'count' messages, into which the driver
+ *	directly writes all the messages received by the channel. Once mapped,
+ *	the messages are read with pcanfd_mmap_consume() instead of
+ *	pcanfd_recv_msg[s][_list](), without any copy nor system call while
+ *	the ring is not empty.
+ *
+ * RETURN:
+ *
+ *	0 if the Rx ring has been mapped,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_mmap_open(int fd, int count, struct pcanfd_mmap *pmm);
+
+/*
+ * int pcanfd_mmap_consume(struct pcanfd_mmap *pmm, struct pcanfd_msg **ppm,
+ *			   int count)
+ *
+ *	Give back to the driver the messages got by the previous call, then
+ *	set *ppm to the address of the next message to read from the Rx ring.
+ *	The returned messages are consecutive in memory and remain valid until
+ *	the next call.
+ *	If the ring is empty and if the device is opened in blocking mode,
+ *	then the calling task waits in poll() for any incoming message.
+ *	If the device is opened in non-blocking mode, the task doesn't wait and
+ *	-EWOULDBLOCK is returned instead.
+ *
+ * RETURN:
+ *
+ *	a positive number (<= count if count > 0) of messages available at
+ *	*ppm,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_mmap_consume(struct pcanfd_mmap *pmm, struct pcanfd_msg **ppm,
+			int count);
+
+/*
+ * int pcanfd_mmap_close(struct pcanfd_mmap *pmm)
+ *
+ *	Unmap the Rx ring. The channel must still be closed with
+ *	pcanfd_close().
+ *
+ * RETURN:
+ *
+ *	0 if the Rx ring has been unmapped,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_mmap_close(struct pcanfd_mmap *pmm);
+
+/*
+ * epoll() event loop of several opened channels (and timers)
+ */
+struct pcanfd_loop;
+
+/* called with (up to "batch") msgs read from channel "fd". "count" is a
+ * negative (errno) code if the channel failed (e.g. -ENODEV if unplugged), in
+ * which case the channel is removed from the loop once the callback returns.
+ * The msgs remain valid until the callback returns. Returning a non-zero value
+ * stops pcanfd_loop_run() that then returns it. */
+typedef int (*pcanfd_loop_rx_cb)(struct pcanfd_loop *pl, int fd,
+				 struct pcanfd_msg *pm, int count, void *arg);
+
+/* called once the Tx queue of channel "fd" can accept msgs, once after each
+ * call to pcanfd_loop_want_tx() */
+typedef int (*pcanfd_loop_tx_cb)(struct pcanfd_loop *pl, int fd, void *arg);
+
+/* called each time the timer "id" expires. "expirations" is the count of
+ * periods elapsed since the previous call (> 1 if the loop was late) */
+typedef int (*pcanfd_loop_timer_cb)(struct pcanfd_loop *pl, int id,
+				    __u64 expirations, void *arg);
+
+#define PCANFD_LOOP_BATCH_DEF	64	/* default count of msgs per read */
+
+/*
+ * int pcanfd_loop_create(struct pcanfd_loop **ppl, int batch)
+ *
+ *	Create an event loop that reads the channels that are added to it by
+ *	lists of at most 'batch' messages (PCANFD_LOOP_BATCH_DEF if 'batch' is
+ *	0). The loop must be destroyed with pcanfd_loop_destroy().
+ *
+ * RETURN:
+ *
+ *	0 if *ppl has been set to the address of the new loop,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_create(struct pcanfd_loop **ppl, int batch);
+
+/*
+ * int pcanfd_loop_add(struct pcanfd_loop *pl, int fd, pcanfd_loop_rx_cb rx,
+ *		       pcanfd_loop_tx_cb tx, void *arg)
+ *
+ *	Add an opened channel to the loop. 'rx' is called with the messages
+ *	read from the channel, 'tx' (if not NULL) is called when the channel
+ *	can accept messages to write (see pcanfd_loop_want_tx()). Both are
+ *	given 'arg'. The channel is switched into non-blocking mode until it
+ *	is removed from the loop.
+ *
+ * RETURN:
+ *
+ *	0 if the channel has been added,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_add(struct pcanfd_loop *pl, int fd, pcanfd_loop_rx_cb rx,
+		    pcanfd_loop_tx_cb tx, void *arg);
+
+/*
+ * int pcanfd_loop_del(struct pcanfd_loop *pl, int fd)
+ *
+ *	Remove a channel from the loop. It MUST be called before closing the
+ *	channel.
+ *
+ * RETURN:
+ *
+ *	0 if the channel has been removed,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_del(struct pcanfd_loop *pl, int fd);
+
+/*
+ * int pcanfd_loop_want_tx(struct pcanfd_loop *pl, int fd)
+ *
+ *	Ask for the 'tx' callback of the channel to be called once its Tx
+ *	queue can accept messages.
+ *
+ * RETURN:
+ *
+ *	0 if success,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_want_tx(struct pcanfd_loop *pl, int fd);
+
+/*
+ * int pcanfd_loop_add_timer(struct pcanfd_loop *pl, __u32 first_us,
+ *			     __u32 period_us, pcanfd_loop_timer_cb cb,
+ *			     void *arg)
+ *
+ *	Add a (CLOCK_MONOTONIC) timer to the loop, that first expires
+ *	'first_us' microseconds later, then every 'period_us' microseconds
+ *	(if not 0).
+ *
+ * RETURN:
+ *
+ *	a positive (or null) timer id. to give to pcanfd_loop_del_timer(),
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_add_timer(struct pcanfd_loop *pl, __u32 first_us,
+			  __u32 period_us, pcanfd_loop_timer_cb cb, void *arg);
+
+/*
+ * int pcanfd_loop_del_timer(struct pcanfd_loop *pl, int id)
+ *
+ *	Remove a timer from the loop.
+ *
+ * RETURN:
+ *
+ *	0 if the timer has been removed,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_del_timer(struct pcanfd_loop *pl, int id);
+
+/*
+ * int pcanfd_loop_run(struct pcanfd_loop *pl, int timeout_ms)
+ *
+ *	Wait for events (at most 'timeout_ms' ms, or forever if < 0) and run
+ *	the callbacks of all the ready channels and timers, until one of them
+ *	returns a non-zero value, or until pcanfd_loop_stop() is called.
+ *	If 'timeout_ms' is >= 0, only one wait is done.
+ *
+ * RETURN:
+ *
+ *	0 if the loop has been stopped by pcanfd_loop_stop() or if the timeout
+ *	  expired,
+ *	the non-zero value returned by a callback,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_run(struct pcanfd_loop *pl, int timeout_ms);
+
+/*
+ * void pcanfd_loop_stop(struct pcanfd_loop *pl)
+ *
+ *	Make pcanfd_loop_run() return once the current callback returns.
+ */
+void pcanfd_loop_stop(struct pcanfd_loop *pl);
+
+/*
+ * void pcanfd_loop_destroy(struct pcanfd_loop *pl)
+ *
+ *	Remove all the channels and timers from the loop and release it.
+ */
+void pcanfd_loop_destroy(struct pcanfd_loop *pl);
+
 /*
  * int pcanfd_set_device_id(int fd, __u32 devid)
  *
@@ -570,6 +874,9 @@ int pcan_set_extra_params(int fd, const struct pcan_msg_filter *pe);
  *
  *			Note that opening a device with PCANFD_INIT_LISTEN_ONLY
  *			leads to open the system device in O_RDONLY mode too.
+ *			Opening a device with PCANFD_INIT_TS_MONO_NS makes the
+ *			timestamps of the msgs being given in CLOCK_MONOTONIC ns
+ *			in their "timestamp_ns" field (see pcanfd.h).
  *	...		If OFD_BITRATE flag is set, the 1st argument must be a
  *			numeric value used to specify the nominal bitrate,
  *			in bps. If OFD_BTR0BTR1 flag is set too, then this
@@ -0,0 +1,414 @@
+/*****************************************************************************
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *****************************************************************************/
+
+/*****************************************************************************
+ * libpcanfd.hpp
+ *
+ * header-only C++17 wrapper of the level-2 API of libpcanfd.
+ *
+ * Every call is a thin inline shim over the corresponding pcanfd_xxx()
+ * function: no memory is allocated and no CAN message is copied besides what
+ * the ioctl() itself does. Each function comes in two flavours:
+ *
+ * - one that takes a "std::error_code &" and never throws,
+ * - one that throws std::system_error on failure.
+ *
+ * Example:
+ *
+ *	pcanfd::channel ch = pcanfd::channel::open("/dev/pcan0",
+ *						   OFD_BITRATE, 500000);
+ *	struct pcanfd_msg rx[16];
+ *
+ *	ch.set<PCANFD_OPT_RX_FIFO_SIZE>(1024);
+ *	for (;;) {
+ *		std::size_t n = ch.recv(rx);
+ *		...
+ *		ch.send(pcanfd::span<const pcanfd_msg>(rx, n));
+ *	}
+ *****************************************************************************/
+
+#ifndef __LIBPCANFD_HPP__
+#define __LIBPCANFD_HPP__
+
+#if __cplusplus < 201703L
+#error "libpcanfd.hpp needs a C++17 compiler"
+#endif
+
+/* libpcanfd.h uses struct timeval without including its definition */
+#include <sys/time.h>
+#include <libpcanfd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus > 201703L && __has_include(<span>)
+#include <span>
+#endif
+
+namespace pcanfd {
+
+/* span<T>: std::span<T> when the library provides it, otherwise a minimal
+ * non-owning view of T[n] (only data() and size() are needed below). */
+#if defined(__cpp_lib_span)
+template <typename T>
+using span = std::span<T>;
+#else
+template <typename T>
+class span {
+public:
+	constexpr span() noexcept : p_(nullptr), n_(0) {}
+	constexpr span(T *p, std::size_t n) noexcept : p_(p), n_(n) {}
+
+	template <std::size_t N>
+	constexpr span(T (&a)[N]) noexcept : p_(a), n_(N) {}
+
+	/* any contiguous container (std::vector, std::array...) */
+	template <typename C,
+		  typename = std::enable_if_t<
+			!std::is_array_v<std::remove_reference_t<C>> &&
+			std::is_convertible_v<
+				std::remove_pointer_t<decltype(
+					std::declval<C &>().data())> (*)[],
+				T (*)[]>>>
+	constexpr span(C &c) noexcept : p_(c.data()), n_(c.size()) {}
+
+	/* span<T> -> span<const T> */
+	template <typename U,
+		  typename = std::enable_if_t<
+			std::is_convertible_v<U (*)[], T (*)[]>>>
+	constexpr span(const span<U> &s) noexcept
+		: p_(s.data()), n_(s.size()) {}
+
+	constexpr T *data() const noexcept { return p_; }
+	constexpr std::size_t size() const noexcept { return n_; }
+	constexpr bool empty() const noexcept { return !n_; }
+	constexpr T &operator[](std::size_t i) const noexcept { return p_[i]; }
+	constexpr T *begin() const noexcept { return p_; }
+	constexpr T *end() const noexcept { return p_ + n_; }
+
+private:
+	T *p_;
+	std::size_t n_;
+};
+#endif
+
+/* option_traits<PCANFD_OPT_xxx>::type is the type of the value of the option,
+ * as defined by the driver (see pcanfd.h). PCANFD_OPT_AVAILABLE_CLOCKS is a
+ * variable length list: use get_option() for it. */
+template <int Name>
+struct option_traits;
+
+#define PCANFD_CXX_OPTION(name, t)					\
+	template <> struct option_traits<name> { using type = t; }
+
+PCANFD_CXX_OPTION(PCANFD_OPT_CHANNEL_FEATURES, __u32);
+PCANFD_CXX_OPTION(PCANFD_OPT_DEVICE_ID, __u32);
+PCANFD_CXX_OPTION(PCANFD_OPT_BITTIMING_RANGES, struct pcanfd_bittiming_range);
+PCANFD_CXX_OPTION(PCANFD_OPT_DBITTIMING_RANGES, struct pcanfd_bittiming_range);
+PCANFD_CXX_OPTION(PCANFD_OPT_ALLOWED_MSGS, __u32);
+PCANFD_CXX_OPTION(PCANFD_OPT_ACC_FILTER_11B, __u64);
+PCANFD_CXX_OPTION(PCANFD_OPT_ACC_FILTER_29B, __u64);
+PCANFD_CXX_OPTION(PCANFD_OPT_IFRAME_DELAYUS, __u32);
+PCANFD_CXX_OPTION(PCANFD_OPT_HWTIMESTAMP_MODE, __u32);
+PCANFD_CXX_OPTION(PCANFD_OPT_DRV_VERSION, __u32);
+PCANFD_CXX_OPTION(PCANFD_OPT_FW_VERSION, __u32);
+PCANFD_CXX_OPTION(PCANFD_OPT_RX_FIFO_SIZE, __u32);
+PCANFD_CXX_OPTION(PCANFD_OPT_RW_MODE, __u32);
+PCANFD_CXX_OPTION(PCANFD_OPT_FILTERS_SCOPE, __u32);
+PCANFD_CXX_OPTION(PCANFD_OPT_RX_COALESCE, struct pcanfd_rx_coalesce);
+
+#undef PCANFD_CXX_OPTION
+
+namespace detail {
+
+/* libpcanfd functions return -errno on failure */
+inline std::error_code make_error(int err) noexcept
+{
+	return std::error_code(-err, std::generic_category());
+}
+
+inline void throw_if(const std::error_code &ec, const char *what)
+{
+	if (ec)
+		throw std::system_error(ec, what);
+}
+
+} /* namespace detail */
+
+/*
+ * class channel
+ *
+ *	Owns the file descriptor of an opened CAN channel and closes it when
+ *	destroyed. A channel can be moved but not copied.
+ */
+class channel {
+public:
+	channel() noexcept : fd_(-1) {}
+	explicit channel(int fd) noexcept : fd_(fd) {}
+
+	channel(const channel &) = delete;
+	channel &operator=(const channel &) = delete;
+
+	channel(channel &&o) noexcept : fd_(o.release()) {}
+
+	channel &operator=(channel &&o) noexcept
+	{
+		if (this != &o)
+			reset(o.release());
+		return *this;
+	}
+
+	~channel() { reset(); }
+
+	/* open a channel: args are those of pcanfd_open() */
+	template <typename... Args>
+	static channel open(std::error_code &ec, const char *dev_pcan,
+			    __u32 flags, Args... args) noexcept
+	{
+		int fd = pcanfd_open(dev_pcan, flags, args...);
+		if (fd < 0) {
+			ec = detail::make_error(fd);
+			return channel();
+		}
+
+		ec.clear();
+		return channel(fd);
+	}
+
+	template <typename... Args>
+	static channel open(const char *dev_pcan, __u32 flags, Args... args)
+	{
+		std::error_code ec;
+		channel ch = open(ec, dev_pcan, flags, args...);
+		detail::throw_if(ec, "pcanfd_open");
+		return ch;
+	}
+
+	int fd() const noexcept { return fd_; }
+	explicit operator bool() const noexcept { return fd_ >= 0; }
+
+	/* give up the ownership of the fd, without closing it */
+	int release() noexcept
+	{
+		return std::exchange(fd_, -1);
+	}
+
+	/* close the owned fd (if any) and take the ownership of fd */
+	void reset(int fd = -1) noexcept
+	{
+		if (fd_ >= 0)
+			pcanfd_close(fd_);
+		fd_ = fd;
+	}
+
+	/*
+	 * send()/recv() of lists of msgs.
+	 *
+	 *	Return the count of msgs actually sent/received. The msgs are
+	 *	read from/written into the caller's span: the kernel copies them
+	 *	directly (see pcanfd_send_msgs_list()/pcanfd_recv_msgs_list()).
+	 */
+	std::size_t send(span<const struct pcanfd_msg> msgs,
+			 std::error_code &ec) noexcept
+	{
+		int err = pcanfd_send_msgs_list(fd_, (int )msgs.size(),
+						msgs.data());
+		return result(err, ec);
+	}
+
+	std::size_t send(span<const struct pcanfd_msg> msgs)
+	{
+		std::error_code ec;
+		std::size_t n = send(msgs, ec);
+		detail::throw_if(ec, "pcanfd_send_msgs_list");
+		return n;
+	}
+
+	std::size_t recv(span<struct pcanfd_msg> msgs,
+			 std::error_code &ec) noexcept
+	{
+		int err = pcanfd_recv_msgs_list(fd_, (int )msgs.size(),
+						msgs.data());
+		return result(err, ec);
+	}
+
+	std::size_t recv(span<struct pcanfd_msg> msgs)
+	{
+		std::error_code ec;
+		std::size_t n = recv(msgs, ec);
+		detail::throw_if(ec, "pcanfd_recv_msgs_list");
+		return n;
+	}
+
+	/* single msg versions */
+	void send(const struct pcanfd_msg &msg, std::error_code &ec) noexcept
+	{
+		result(pcanfd_send_msg(fd_, &msg), ec);
+	}
+
+	void send(const struct pcanfd_msg &msg)
+	{
+		std::error_code ec;
+		send(msg, ec);
+		detail::throw_if(ec, "pcanfd_send_msg");
+	}
+
+	void recv(struct pcanfd_msg &msg, std::error_code &ec) noexcept
+	{
+		result(pcanfd_recv_msg(fd_, &msg), ec);
+	}
+
+	void recv(struct pcanfd_msg &msg)
+	{
+		std::error_code ec;
+		recv(msg, ec);
+		detail::throw_if(ec, "pcanfd_recv_msg");
+	}
+
+	/* channel init and state */
+	void set_init(const struct pcanfd_init &init,
+		      std::error_code &ec) noexcept
+	{
+		struct pcanfd_init tmp = init;
+
+		result(pcanfd_set_init(fd_, &tmp), ec);
+	}
+
+	void set_init(const struct pcanfd_init &init)
+	{
+		std::error_code ec;
+		set_init(init, ec);
+		detail::throw_if(ec, "pcanfd_set_init");
+	}
+
+	struct pcanfd_init get_init(std::error_code &ec) const noexcept
+	{
+		struct pcanfd_init init {};
+
+		result(pcanfd_get_init(fd_, &init), ec);
+		return init;
+	}
+
+	struct pcanfd_init get_init() const
+	{
+		std::error_code ec;
+		struct pcanfd_init init = get_init(ec);
+		detail::throw_if(ec, "pcanfd_get_init");
+		return init;
+	}
+
+	struct pcanfd_state get_state(std::error_code &ec) const noexcept
+	{
+		struct pcanfd_state st {};
+
+		result(pcanfd_get_state(fd_, &st), ec);
+		return st;
+	}
+
+	struct pcanfd_state get_state() const
+	{
+		std::error_code ec;
+		struct pcanfd_state st = get_state(ec);
+		detail::throw_if(ec, "pcanfd_get_state");
+		return st;
+	}
+
+	/*
+	 * Typed options accessors.
+	 *
+	 *	get<PCANFD_OPT_xxx>() returns the value of the option with the
+	 *	type given by option_traits<PCANFD_OPT_xxx>, set<>() checks the
+	 *	type of the value at compile time:
+	 *
+	 *	__u32 s = ch.get<PCANFD_OPT_RX_FIFO_SIZE>();
+	 *	ch.set<PCANFD_OPT_RX_COALESCE>(pcanfd_rx_coalesce { 16, 500 });
+	 */
+	template <int Name>
+	typename option_traits<Name>::type
+	get(std::error_code &ec) const noexcept
+	{
+		typename option_traits<Name>::type v {};
+
+		get_option(Name, &v, sizeof(v), ec);
+		return v;
+	}
+
+	template <int Name>
+	typename option_traits<Name>::type get() const
+	{
+		std::error_code ec;
+		typename option_traits<Name>::type v = get<Name>(ec);
+		detail::throw_if(ec, "pcanfd_get_option");
+		return v;
+	}
+
+	template <int Name>
+	void set(const typename option_traits<Name>::type &v,
+		 std::error_code &ec) noexcept
+	{
+		set_option(Name, &v, sizeof(v), ec);
+	}
+
+	template <int Name>
+	void set(const typename option_traits<Name>::type &v)
+	{
+		std::error_code ec;
+		set<Name>(v, ec);
+		detail::throw_if(ec, "pcanfd_set_option");
+	}
+
+	/* untyped options accessors, for options unknown to option_traits<> */
+	void get_option(int name, void *value, std::size_t size,
+			std::error_code &ec) const noexcept
+	{
+		int err = pcanfd_get_option(fd_, name, value, (int )size);
+
+		/* the option is bigger than the storage of the caller */
+		if (err > (int )size)
+			err = -EMSGSIZE;
+
+		result(err, ec);
+	}
+
+	void set_option(int name, const void *value, std::size_t size,
+			std::error_code &ec) noexcept
+	{
+		/* pcanfd_set_option() doesn't modify value */
+		result(pcanfd_set_option(fd_, name, const_cast<void *>(value),
+					 (int )size), ec);
+	}
+
+private:
+	static std::size_t result(int err, std::error_code &ec) noexcept
+	{
+		if (err < 0) {
+			ec = detail::make_error(err);
+			return 0;
+		}
+
+		ec.clear();
+		return (std::size_t )err;
+	}
+
+	int fd_;
+};
+
+} /* namespace pcanfd */
+
+#endif
@@ -32,9 +32,15 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <linux/filter.h>
 
 #include "libpcanfd.h"
 #include "src/libprivate.h"
@@ -137,7 +143,10 @@ TPCANRdMsg *pcanfd_to_msg(TPCANRdMsg *msg, const struct pcanfd_msg *pf)
 	}
 
 	/* TODO: should check whether PCANFD_TIMESTAMP is always set */
-	if (pf->flags & PCANFD_TIMESTAMP) {
+	if (pf->flags & PCANFD_TIMESTAMP_NS) {
+		msg->dwTime = pf->timestamp_ns / 1000000;
+		msg->wUsec = (pf->timestamp_ns / 1000) % 1000;
+	} else if (pf->flags & PCANFD_TIMESTAMP) {
 		msg->dwTime = pf->timestamp.tv_sec * 1000;
 		msg->dwTime += pf->timestamp.tv_usec / 1000;
 		msg->wUsec = pf->timestamp.tv_usec % 1000;
@@ -309,6 +318,28 @@ int pcanfd_add_filters_list(int fd, int count,
 	return err;
 }
 
+int pcanfd_add_filter_mask(int fd, __u32 code, __u32 mask, __u32 flags)
+{
+	struct pcanfd_msg_filter mf = {
+		.id_from = code,
+		.id_to = mask,
+		.msg_flags = (flags & ~PCANFD_FILTER_KIND) | PCANFD_FILTER_MASK,
+	};
+
+	return pcanfd_add_filter(fd, &mf);
+}
+
+int pcanfd_add_filter_id(int fd, __u32 id, __u32 flags)
+{
+	struct pcanfd_msg_filter mf = {
+		.id_from = id,
+		.id_to = id,
+		.msg_flags = (flags & ~PCANFD_FILTER_KIND) | PCANFD_FILTER_ID,
+	};
+
+	return pcanfd_add_filter(fd, &mf);
+}
+
 /*
  * int pcanfd_get_filters(int fd, struct pcanfd_msg_filters *pfl)
  *
@@ -394,6 +425,420 @@ int pcanfd_del_filters(int fd)
 	return -__errno_ioctl(fd, PCANFD_ADD_FILTERS, NULL);
 }
 
+/*
+ * int pcanfd_set_bpf(int fd, int count, const struct pcanfd_bpf_insn *insns)
+ *
+ *	Attach a classic BPF program to the open path ('count' = 0 detaches
+ *	the current one).
+ *
+ * RETURN:
+ *
+ *	0 if the program has been attached (or detached),
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_set_bpf(int fd, int count, const struct pcanfd_bpf_insn *insns)
+{
+	struct pcanfd_bpf_insns *pbi;
+	int err;
+
+#ifdef DEBUG
+	__fprintf(stddbg, "%s(fd=%d count=%d insns=%p)\n",
+			__func__, fd, count, insns);
+#endif
+	if (count < 0 || (count && !insns))
+		return -EINVAL;
+
+	pbi = malloc(sizeof(*pbi) + count * sizeof(*insns));
+	if (!pbi) {
+#ifdef DEBUG
+		__fprintf(stddbg, "%s(): malloc failed\n", __func__);
+#endif
+		return -ENOMEM;
+	}
+
+	pbi->count = count;
+	memcpy(pbi->list, insns, count * sizeof(*insns));
+
+	err = -__errno_ioctl(fd, PCANFD_SET_BPF, pbi);
+
+	free(pbi);
+
+	return err;
+}
+
+/* pcanfd_bpf_compile() expression tree */
+enum {
+	BPFX_OR,
+	BPFX_AND,
+	BPFX_NOT,
+	BPFX_CMP,
+};
+
+enum {
+	BPFX_TRUE,		/* value != 0 */
+	BPFX_EQ,
+	BPFX_NE,
+	BPFX_LT,
+	BPFX_LE,
+	BPFX_GT,
+	BPFX_GE,
+};
+
+struct bpfx_node {
+	int	op;		/* BPFX_OR ... BPFX_CMP */
+	int	l, r;		/* operands of OR, AND, NOT */
+	__u16	ld;		/* CMP: BPF_LD code and offset of the field */
+	__u32	off;
+	int	masked;
+	__u32	mask;
+	int	rel;		/* BPFX_TRUE ... BPFX_GE */
+	__u32	val;
+};
+
+struct bpfx {
+	const char		*p;	/* parse position */
+	struct bpfx_node	*nodes;
+	int			node_count;
+	int			node_max;
+
+	struct pcanfd_bpf_insn	*insns;
+	int			*jt, *jf;	/* jump labels of insns */
+	int			pc;
+	int			pc_max;
+	int			*labels;	/* pc of labels */
+	int			label_count;
+};
+
+/* labels 0 and 1 are the final accepting and dropping RET instructions */
+#define BPFX_ACCEPT		0
+#define BPFX_DROP		1
+
+static int bpfx_expr(struct bpfx *px);
+
+static void bpfx_skip(struct bpfx *px)
+{
+	while (isspace(*px->p))
+		px->p++;
+}
+
+/* consume "tok" if it is the next token */
+static int bpfx_accept(struct bpfx *px, const char *tok)
+{
+	size_t l = strlen(tok);
+
+	bpfx_skip(px);
+	if (strncmp(px->p, tok, l))
+		return 0;
+
+	/* don't take a '&&' for a '&' nor a '<=' for a '<' */
+	if (l == 1 && strchr("&<>!", tok[0]) &&
+	    (px->p[1] == tok[0] || px->p[1] == '='))
+		return 0;
+
+	px->p += l;
+	return 1;
+}
+
+static int bpfx_number(struct bpfx *px, __u32 *pv)
+{
+	char *end;
+
+	bpfx_skip(px);
+	if (!isdigit(*px->p))
+		return -EINVAL;
+
+	*pv = strtoul(px->p, &end, 0);
+	px->p = end;
+
+	return 0;
+}
+
+static int bpfx_node(struct bpfx *px, int op, int l, int r)
+{
+	struct bpfx_node *pn;
+
+	if (px->node_count >= px->node_max)
+		return -EINVAL;
+
+	pn = px->nodes + px->node_count;
+	memset(pn, 0, sizeof(*pn));
+	pn->op = op;
+	pn->l = l;
+	pn->r = r;
+
+	return px->node_count++;
+}
+
+static int bpfx_cmp(struct bpfx *px)
+{
+	static const struct {
+		const char	*name;
+		__u16		ld;
+		__u32		off;
+	} fields[] = {
+		{ "id", BPF_LD|BPF_W|BPF_ABS, PCANFD_BPF_OFF_ID },
+		{ "flags", BPF_LD|BPF_W|BPF_ABS, PCANFD_BPF_OFF_FLAGS },
+		{ "type", BPF_LD|BPF_H|BPF_ABS, PCANFD_BPF_OFF_TYPE },
+		{ "len", BPF_LD|BPF_H|BPF_ABS, PCANFD_BPF_OFF_DATA_LEN },
+		{ "data32[", BPF_LD|BPF_W|BPF_ABS, PCANFD_BPF_OFF_DATA },
+		{ "data16[", BPF_LD|BPF_H|BPF_ABS, PCANFD_BPF_OFF_DATA },
+		{ "data[", BPF_LD|BPF_B|BPF_ABS, PCANFD_BPF_OFF_DATA },
+	};
+	static const struct {
+		const char	*tok;
+		int		rel;
+	} rels[] = {
+		{ "==", BPFX_EQ }, { "!=", BPFX_NE },
+		{ "<=", BPFX_LE }, { ">=", BPFX_GE },
+		{ "<", BPFX_LT }, { ">", BPFX_GT },
+	};
+	struct bpfx_node *pn;
+	unsigned int i;
+	int n;
+
+	n = bpfx_node(px, BPFX_CMP, -1, -1);
+	if (n < 0)
+		return n;
+
+	pn = px->nodes + n;
+
+	bpfx_skip(px);
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		size_t l = strlen(fields[i].name);
+
+		if (!strncmp(px->p, fields[i].name, l) &&
+		    (fields[i].name[l-1] == '[' || !isalnum(px->p[l])))
+			break;
+	}
+
+	if (i >= sizeof(fields) / sizeof(fields[0]))
+		return -EINVAL;
+
+	px->p += strlen(fields[i].name);
+	pn->ld = fields[i].ld;
+	pn->off = fields[i].off;
+
+	if (fields[i].name[strlen(fields[i].name)-1] == '[') {
+		__u32 idx;
+
+		if (bpfx_number(px, &idx) || idx >= PCANFD_MAXDATALEN ||
+		    !bpfx_accept(px, "]"))
+			return -EINVAL;
+
+		pn->off += idx;
+	}
+
+	if (bpfx_accept(px, "&")) {
+		if (bpfx_number(px, &pn->mask))
+			return -EINVAL;
+		pn->masked = 1;
+	}
+
+	pn->rel = BPFX_TRUE;
+	for (i = 0; i < sizeof(rels) / sizeof(rels[0]); i++)
+		if (bpfx_accept(px, rels[i].tok)) {
+			if (bpfx_number(px, &pn->val))
+				return -EINVAL;
+			pn->rel = rels[i].rel;
+			break;
+		}
+
+	return n;
+}
+
+static int bpfx_factor(struct bpfx *px)
+{
+	int n;
+
+	if (bpfx_accept(px, "!")) {
+		n = bpfx_factor(px);
+		return (n < 0) ? n : bpfx_node(px, BPFX_NOT, n, -1);
+	}
+
+	if (bpfx_accept(px, "(")) {
+		n = bpfx_expr(px);
+		if (n >= 0 && !bpfx_accept(px, ")"))
+			return -EINVAL;
+		return n;
+	}
+
+	return bpfx_cmp(px);
+}
+
+static int bpfx_term(struct bpfx *px)
+{
+	int n, r;
+
+	n = bpfx_factor(px);
+	while (n >= 0 && bpfx_accept(px, "&&")) {
+		r = bpfx_factor(px);
+		n = (r < 0) ? r : bpfx_node(px, BPFX_AND, n, r);
+	}
+
+	return n;
+}
+
+static int bpfx_expr(struct bpfx *px)
+{
+	int n, r;
+
+	n = bpfx_term(px);
+	while (n >= 0 && bpfx_accept(px, "||")) {
+		r = bpfx_term(px);
+		n = (r < 0) ? r : bpfx_node(px, BPFX_OR, n, r);
+	}
+
+	return n;
+}
+
+static int bpfx_emit(struct bpfx *px, __u16 code, __u32 k, int jt, int jf)
+{
+	if (px->pc >= px->pc_max)
+		return -ENOSPC;
+
+	px->insns[px->pc].code = code;
+	px->insns[px->pc].k = k;
+	px->jt[px->pc] = jt;
+	px->jf[px->pc] = jf;
+	px->pc++;
+
+	return 0;
+}
+
+/* generate the code of node n, that jumps to label t if true, f otherwise */
+static int bpfx_gen(struct bpfx *px, int n, int t, int f)
+{
+	const struct bpfx_node *pn = px->nodes + n;
+	int err, l;
+
+	switch (pn->op) {
+	case BPFX_NOT:
+		return bpfx_gen(px, pn->l, f, t);
+
+	case BPFX_AND:
+	case BPFX_OR:
+		/* the right operand is evaluated at label l */
+		l = px->label_count++;
+		err = (pn->op == BPFX_AND) ? bpfx_gen(px, pn->l, l, f) :
+					     bpfx_gen(px, pn->l, t, l);
+		if (err)
+			return err;
+
+		px->labels[l] = px->pc;
+		return bpfx_gen(px, pn->r, t, f);
+	}
+
+	err = bpfx_emit(px, pn->ld, pn->off, -1, -1);
+	if (!err && pn->masked)
+		err = bpfx_emit(px, BPF_ALU|BPF_AND|BPF_K, pn->mask, -1, -1);
+	if (err)
+		return err;
+
+	switch (pn->rel) {
+	case BPFX_EQ:
+		return bpfx_emit(px, BPF_JMP|BPF_JEQ|BPF_K, pn->val, t, f);
+	case BPFX_NE:
+		return bpfx_emit(px, BPF_JMP|BPF_JEQ|BPF_K, pn->val, f, t);
+	case BPFX_LT:
+		return bpfx_emit(px, BPF_JMP|BPF_JGE|BPF_K, pn->val, f, t);
+	case BPFX_LE:
+		return bpfx_emit(px, BPF_JMP|BPF_JGT|BPF_K, pn->val, f, t);
+	case BPFX_GT:
+		return bpfx_emit(px, BPF_JMP|BPF_JGT|BPF_K, pn->val, t, f);
+	case BPFX_GE:
+		return bpfx_emit(px, BPF_JMP|BPF_JGE|BPF_K, pn->val, t, f);
+	}
+
+	return bpfx_emit(px, BPF_JMP|BPF_JEQ|BPF_K, 0, f, t);
+}
+
+/*
+ * int pcanfd_bpf_compile(const char *expr, struct pcanfd_bpf_insn *insns,
+ *			  int count)
+ *
+ *	Compile a boolean expression into a BPF program (see libpcanfd.h).
+ *
+ * RETURN:
+ *
+ *	the count of instructions of the program,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_bpf_compile(const char *expr, struct pcanfd_bpf_insn *insns,
+		       int count)
+{
+	struct bpfx x;
+	int n, pc, err = -ENOMEM;
+
+#ifdef DEBUG
+	__fprintf(stddbg, "%s(expr=\"%s\" count=%d)\n", __func__, expr, count);
+#endif
+	if (!expr || !insns || count <= 0)
+		return -EINVAL;
+
+	/* each node needs at least one char, and each insn at most one label */
+	memset(&x, 0, sizeof(x));
+	x.p = expr;
+	x.node_max = strlen(expr) + 1;
+	x.insns = insns;
+	x.pc_max = count;
+	x.nodes = malloc(x.node_max * sizeof(*x.nodes));
+	x.jt = malloc(count * sizeof(*x.jt));
+	x.jf = malloc(count * sizeof(*x.jf));
+	x.labels = malloc((x.node_max + 2) * sizeof(*x.labels));
+	if (!x.nodes || !x.jt || !x.jf || !x.labels)
+		goto lbl_free;
+
+	n = bpfx_expr(&x);
+	bpfx_skip(&x);
+	if (n < 0 || *x.p) {
+		err = -EINVAL;
+		goto lbl_free;
+	}
+
+	x.label_count = 2;
+	err = bpfx_gen(&x, n, BPFX_ACCEPT, BPFX_DROP);
+	if (err)
+		goto lbl_free;
+
+	x.labels[BPFX_ACCEPT] = x.pc;
+	err = bpfx_emit(&x, BPF_RET|BPF_K, 0xffffffff, -1, -1);
+	if (err)
+		goto lbl_free;
+
+	x.labels[BPFX_DROP] = x.pc;
+	err = bpfx_emit(&x, BPF_RET|BPF_K, 0, -1, -1);
+	if (err)
+		goto lbl_free;
+
+	/* resolve the labels into (forward) relative jumps */
+	for (pc = 0; pc < x.pc; pc++) {
+		int jt = 0, jf = 0;
+
+		if (x.jt[pc] >= 0)
+			jt = x.labels[x.jt[pc]] - pc - 1;
+		if (x.jf[pc] >= 0)
+			jf = x.labels[x.jf[pc]] - pc - 1;
+
+		if (jt > 255 || jf > 255) {
+			err = -E2BIG;
+			goto lbl_free;
+		}
+
+		insns[pc].jt = jt;
+		insns[pc].jf = jf;
+	}
+
+	err = x.pc;
+
+lbl_free:
+	free(x.labels);
+	free(x.jf);
+	free(x.jt);
+	free(x.nodes);
+
+	return err;
+}
+
 /*
  * int pcanfd_send_msg(int fd, struct pcanfd_msg *pfdm)
  *
@@ -483,8 +928,18 @@ int pcanfd_send_msgs_list(int fd, int count, const struct pcanfd_msg *pfdm)
 		return -EINVAL;
 
 	if (count > 0) {
+		struct pcanfd_msgs_list ml = {
+			.count = count,
+			.list = (__u64 )(unsigned long)pfdm,
+		};
 		struct pcanfd_msgs *pml;
 
+		/* the driver directly reads the msgs from pfdm[]... */
+		err = -__errno_ioctl(fd, PCANFD_SEND_MSGS_LIST, &ml);
+		if (err != -ENOTTY)
+			return err ? err : (int )ml.count;
+
+		/* ...unless it is too old to do so */
 		pml = malloc(sizeof(*pml) + count * sizeof(*pfdm));
 		if (!pml) {
 #ifdef DEBUG
@@ -596,8 +1051,18 @@ int pcanfd_recv_msgs_list(int fd, int count, struct pcanfd_msg *pm)
 		return -EINVAL;
 
 	if (count > 0) {
+		struct pcanfd_msgs_list ml = {
+			.count = count,
+			.list = (__u64 )(unsigned long)pm,
+		};
 		struct pcanfd_msgs *pml;
 
+		/* the driver directly writes the msgs into pm[]... */
+		err = -__errno_ioctl(fd, PCANFD_RECV_MSGS_LIST, &ml);
+		if (err != -ENOTTY)
+			return err ? err : (int )ml.count;
+
+		/* ...unless it is too old to do so */
 		pml = malloc(sizeof(*pml) + count * sizeof(*pm));
 		if (!pml) {
 #ifdef DEBUG
@@ -618,6 +1083,715 @@ int pcanfd_recv_msgs_list(int fd, int count, struct pcanfd_msg *pm)
 	return err;
 }
 
+/*
+ * int pcanfd_recv_msgs_timeout(int fd, int count, struct pcanfd_msg *pm,
+ *				int min_count, const struct timespec *deadline)
+ *
+ *	Enables to read up to 'count' CANFD messages from the input queue, in
+ *	the spirit of recvmmsg(): the calling task waits until at least
+ *	'min_count' messages can be read, or until the CLOCK_MONOTONIC
+ *	absolute time 'deadline' is reached, whichever comes first. Then, all
+ *	the messages that can be read (up to 'count') are read at once.
+ *	'pm' MUST be an address of a memory buffer large enough to store at
+ *	least 'count' consecutive 'struct pcanfd_msg' objects.
+ *
+ *	If 'deadline' is NULL, the wait is not bounded. If the device is
+ *	opened in non-blocking mode, the task doesn't wait.
+ *
+ * RETURN:
+ *
+ *	a positive number indicates how many messages have been read from the
+ *	device input queue. 0 means that the deadline has been reached while
+ *	no message was received.
+ *
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_recv_msgs_timeout(int fd, int count, struct pcanfd_msg *pm,
+			     int min_count, const struct timespec *deadline)
+{
+	struct pcanfd_msgs_timeout ml;
+	int err;
+
+#ifdef DEBUG
+	__fprintf(stddbg, "%s(fd=%d count=%d pm=%p min_count=%d)\n",
+			__func__, fd, count, pm, min_count);
+#endif
+	if (!pm || min_count < 0)
+		return -EINVAL;
+
+	if (count <= 0)
+		return 0;
+
+	/* Note: a null deadline_ns means "no deadline" for the driver */
+	ml.deadline_ns = 0;
+	if (deadline) {
+		ml.deadline_ns = deadline->tv_sec * 1000000000ULL +
+							deadline->tv_nsec;
+		if (!ml.deadline_ns)
+			ml.deadline_ns = 1;
+	}
+	ml.min_count = min_count;
+	ml.count = count;
+	ml.list = (__u64 )(unsigned long)pm;
+
+	/* msgs are directly copied by the driver into the user array */
+	err = -__errno_ioctl(fd, PCANFD_RECV_MSGS_TIMEOUT, &ml);
+	if (!err)
+		err = ml.count;
+
+	return err;
+}
+
+/*
+ * int pcanfd_mmap_open(int fd, int count, struct pcanfd_mmap *pmm)
+ *
+ *	Map an Rx ring of at least 'count' messages, into which the driver
+ *	directly writes all the messages received by the channel.
+ *
+ * RETURN:
+ *
+ *	0 if the Rx ring has been mapped,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_mmap_open(int fd, int count, struct pcanfd_mmap *pmm)
+{
+#if !defined(NO_RT) && !defined(__COBALT__)
+	/* RTDM devices can't be mapped */
+	return -EOPNOTSUPP;
+#else
+	long page_size = sysconf(_SC_PAGESIZE);
+	__u32 n = 2;
+
+#ifdef DEBUG
+	__fprintf(stddbg, "%s(fd=%d count=%d pmm=%p)\n",
+			__func__, fd, count, pmm);
+#endif
+	if (!pmm || count <= 0)
+		return -EINVAL;
+
+	/* the driver rounds the count of msgs down to a power of 2 */
+	while (n < (__u32 )count)
+		n <<= 1;
+
+	pmm->fd = fd;
+	pmm->fd_flags = fcntl(fd, F_GETFL);
+	if (pmm->fd_flags < 0)
+		return -errno;
+
+	pmm->len = page_size + n * sizeof(struct pcanfd_msg);
+	pmm->ring = mmap(NULL, pmm->len, PROT_READ|PROT_WRITE, MAP_SHARED,
+			 fd, 0);
+	if (pmm->ring == MAP_FAILED) {
+		pmm->ring = NULL;
+		return -errno;
+	}
+
+	if (pmm->ring->magic != PCANFD_RX_RING_MAGIC ||
+	    pmm->ring->msg_size != sizeof(struct pcanfd_msg)) {
+		munmap(pmm->ring, pmm->len);
+		pmm->ring = NULL;
+		return -EPROTO;
+	}
+
+	pmm->msgs = (struct pcanfd_msg *)((char *)pmm->ring +
+						pmm->ring->msgs_offset);
+	pmm->msg_count = pmm->ring->msg_count;
+	pmm->pending = 0;
+
+	return 0;
+#endif
+}
+
+/*
+ * int pcanfd_mmap_consume(struct pcanfd_mmap *pmm, struct pcanfd_msg **ppm,
+ *			   int count)
+ *
+ *	Give back to the driver the messages got by the previous call, then
+ *	set *ppm to the address of the next message to read from the Rx ring.
+ *
+ * RETURN:
+ *
+ *	a positive number (<= count if count > 0) of messages available at
+ *	*ppm,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_mmap_consume(struct pcanfd_mmap *pmm, struct pcanfd_msg **ppm,
+			int count)
+{
+	struct pcanfd_rx_ring *ring;
+	__u32 head, tail, i, n;
+
+	if (!pmm || !pmm->ring || !ppm)
+		return -EINVAL;
+
+	ring = pmm->ring;
+
+	/* "tail" is only written by us */
+	tail = ring->tail;
+	if (pmm->pending) {
+		tail += pmm->pending;
+		pmm->pending = 0;
+
+		/* msgs MUST have been read before giving their slots back */
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	/* msgs content MUST NOT be read before the head */
+	while ((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == tail) {
+		struct pollfd pfd = {
+			.fd = pmm->fd,
+			.events = POLLIN,
+		};
+
+		if (pmm->fd_flags & O_NONBLOCK)
+			return -EWOULDBLOCK;
+
+		if (poll(&pfd, 1, -1) < 0)
+			return -errno;
+
+		if (pfd.revents & (POLLERR|POLLHUP|POLLNVAL))
+			return -ENODEV;
+	}
+
+	/* only give consecutive msgs */
+	i = tail & (pmm->msg_count - 1);
+	n = head - tail;
+	if (n > pmm->msg_count - i)
+		n = pmm->msg_count - i;
+	if (count > 0 && n > (__u32 )count)
+		n = count;
+
+	*ppm = pmm->msgs + i;
+	pmm->pending = n;
+
+	return n;
+}
+
+/*
+ * int pcanfd_mmap_close(struct pcanfd_mmap *pmm)
+ *
+ *	Unmap the Rx ring.
+ *
+ * RETURN:
+ *
+ *	0 if the Rx ring has been unmapped,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_mmap_close(struct pcanfd_mmap *pmm)
+{
+	int err;
+
+	if (!pmm || !pmm->ring)
+		return -EINVAL;
+
+	err = munmap(pmm->ring, pmm->len) ? -errno : 0;
+	pmm->ring = NULL;
+
+	return err;
+}
+
+/*
+ * epoll() event loop of several opened channels (and timers)
+ */
+#define PCANFD_LOOP_EVENTS_MAX	64	/* events handled per epoll_wait() */
+#define PCANFD_LOOP_RX_ROUNDS	4	/* max batches read per Rx event */
+
+/* event source: an opened channel or a timer */
+struct pcanfd_loop_src {
+	int	fd;
+	int	fd_flags;	/* flags of the channel before being added */
+	__u32	events;		/* EPOLLxxx the loop waits for */
+
+	pcanfd_loop_rx_cb	rx;
+	pcanfd_loop_tx_cb	tx;
+	pcanfd_loop_timer_cb	timer;
+	void	*arg;
+};
+
+struct pcanfd_loop {
+	int	epfd;
+	int	stopped;
+	__u32	batch;
+
+	/* sources are indexed by their fd: events only give fds so that a
+	 * source removed by a callback is never used afterwards */
+	struct pcanfd_loop_src **srcs;
+	int	srcs_count;
+
+	struct pcanfd_msgs *msgs;	/* Rx batch given to the callbacks */
+	struct epoll_event events[PCANFD_LOOP_EVENTS_MAX];
+};
+
+static struct pcanfd_loop_src *pcanfd_loop_get(struct pcanfd_loop *pl,
+					       int fd)
+{
+	return (fd >= 0 && fd < pl->srcs_count) ? pl->srcs[fd] : NULL;
+}
+
+static int pcanfd_loop_ctl(struct pcanfd_loop *pl, int op,
+			   struct pcanfd_loop_src *ps)
+{
+	struct epoll_event ev = {
+		.events = ps->events,
+		.data.fd = ps->fd,
+	};
+
+	return epoll_ctl(pl->epfd, op, ps->fd, &ev) ? -errno : 0;
+}
+
+/* register a new source in the loop */
+static int pcanfd_loop_add_src(struct pcanfd_loop *pl,
+			       struct pcanfd_loop_src *ps)
+{
+	int err;
+
+	if (ps->fd >= pl->srcs_count) {
+		int n = (ps->fd + 16) & ~15;
+		struct pcanfd_loop_src **srcs;
+
+		srcs = realloc(pl->srcs, n * sizeof(*srcs));
+		if (!srcs)
+			return -ENOMEM;
+
+		memset(srcs + pl->srcs_count, '\0',
+		       (n - pl->srcs_count) * sizeof(*srcs));
+		pl->srcs = srcs;
+		pl->srcs_count = n;
+	}
+
+	if (pl->srcs[ps->fd])
+		return -EEXIST;
+
+	err = pcanfd_loop_ctl(pl, EPOLL_CTL_ADD, ps);
+	if (err)
+		return err;
+
+	pl->srcs[ps->fd] = ps;
+
+	return 0;
+}
+
+static void pcanfd_loop_del_src(struct pcanfd_loop *pl,
+				struct pcanfd_loop_src *ps)
+{
+	epoll_ctl(pl->epfd, EPOLL_CTL_DEL, ps->fd, NULL);
+	pl->srcs[ps->fd] = NULL;
+
+	if (ps->timer)
+		close(ps->fd);
+	else
+		fcntl(ps->fd, F_SETFL, ps->fd_flags);
+
+	free(ps);
+}
+
+/*
+ * int pcanfd_loop_create(struct pcanfd_loop **ppl, int batch)
+ *
+ *	Create an event loop that reads the channels by lists of at most
+ *	'batch' messages.
+ *
+ * RETURN:
+ *
+ *	0 if *ppl has been set to the address of the new loop,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_create(struct pcanfd_loop **ppl, int batch)
+{
+#if !defined(NO_RT) && !defined(__COBALT__)
+	/* RTDM devices can't be polled by epoll() */
+	return -EOPNOTSUPP;
+#else
+	struct pcanfd_loop *pl;
+
+#ifdef DEBUG
+	__fprintf(stddbg, "%s(batch=%d)\n", __func__, batch);
+#endif
+	if (!ppl || batch < 0)
+		return -EINVAL;
+
+	if (!batch)
+		batch = PCANFD_LOOP_BATCH_DEF;
+
+	pl = calloc(1, sizeof(*pl));
+	if (!pl)
+		return -ENOMEM;
+
+	pl->batch = batch;
+	pl->msgs = malloc(sizeof(*pl->msgs) + batch * sizeof(pl->msgs->list[0]));
+	if (!pl->msgs) {
+		free(pl);
+		return -ENOMEM;
+	}
+
+	pl->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (pl->epfd < 0) {
+		int err = -errno;
+
+		free(pl->msgs);
+		free(pl);
+		return err;
+	}
+
+	*ppl = pl;
+
+	return 0;
+#endif
+}
+
+/*
+ * int pcanfd_loop_add(struct pcanfd_loop *pl, int fd, pcanfd_loop_rx_cb rx,
+ *		       pcanfd_loop_tx_cb tx, void *arg)
+ *
+ *	Add an opened channel to the loop.
+ *
+ * RETURN:
+ *
+ *	0 if the channel has been added,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_add(struct pcanfd_loop *pl, int fd, pcanfd_loop_rx_cb rx,
+		    pcanfd_loop_tx_cb tx, void *arg)
+{
+	struct pcanfd_loop_src *ps;
+	int err;
+
+#ifdef DEBUG
+	__fprintf(stddbg, "%s(fd=%d)\n", __func__, fd);
+#endif
+	if (!pl || fd < 0 || !rx)
+		return -EINVAL;
+
+	ps = calloc(1, sizeof(*ps));
+	if (!ps)
+		return -ENOMEM;
+
+	ps->fd = fd;
+	ps->events = EPOLLIN;
+	ps->rx = rx;
+	ps->tx = tx;
+	ps->arg = arg;
+
+	/* a ready channel is read until it is empty: it must not block */
+	ps->fd_flags = fcntl(fd, F_GETFL);
+	if (ps->fd_flags < 0 ||
+	    fcntl(fd, F_SETFL, ps->fd_flags | O_NONBLOCK) < 0) {
+		err = -errno;
+		free(ps);
+		return err;
+	}
+
+	err = pcanfd_loop_add_src(pl, ps);
+	if (err) {
+		fcntl(fd, F_SETFL, ps->fd_flags);
+		free(ps);
+	}
+
+	return err;
+}
+
+/*
+ * int pcanfd_loop_del(struct pcanfd_loop *pl, int fd)
+ *
+ *	Remove a channel from the loop.
+ *
+ * RETURN:
+ *
+ *	0 if the channel has been removed,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_del(struct pcanfd_loop *pl, int fd)
+{
+	struct pcanfd_loop_src *ps;
+
+	if (!pl)
+		return -EINVAL;
+
+	ps = pcanfd_loop_get(pl, fd);
+	if (!ps || ps->timer)
+		return -ENOENT;
+
+	pcanfd_loop_del_src(pl, ps);
+
+	return 0;
+}
+
+/*
+ * int pcanfd_loop_want_tx(struct pcanfd_loop *pl, int fd)
+ *
+ *	Ask for the 'tx' callback of the channel to be called once.
+ *
+ * RETURN:
+ *
+ *	0 if success,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_want_tx(struct pcanfd_loop *pl, int fd)
+{
+	struct pcanfd_loop_src *ps;
+
+	if (!pl)
+		return -EINVAL;
+
+	ps = pcanfd_loop_get(pl, fd);
+	if (!ps || !ps->tx)
+		return -ENOENT;
+
+	if (ps->events & EPOLLOUT)
+		return 0;
+
+	ps->events |= EPOLLOUT;
+
+	return pcanfd_loop_ctl(pl, EPOLL_CTL_MOD, ps);
+}
+
+/*
+ * int pcanfd_loop_add_timer(struct pcanfd_loop *pl, __u32 first_us,
+ *			     __u32 period_us, pcanfd_loop_timer_cb cb,
+ *			     void *arg)
+ *
+ *	Add a (CLOCK_MONOTONIC) timer to the loop.
+ *
+ * RETURN:
+ *
+ *	a positive (or null) timer id.,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_add_timer(struct pcanfd_loop *pl, __u32 first_us,
+			  __u32 period_us, pcanfd_loop_timer_cb cb, void *arg)
+{
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = first_us / 1000000,
+			.tv_nsec = (first_us % 1000000) * 1000,
+		},
+		.it_interval = {
+			.tv_sec = period_us / 1000000,
+			.tv_nsec = (period_us % 1000000) * 1000,
+		},
+	};
+	struct pcanfd_loop_src *ps;
+	int err;
+
+#ifdef DEBUG
+	__fprintf(stddbg, "%s(first=%uus period=%uus)\n",
+			__func__, first_us, period_us);
+#endif
+	if (!pl || !cb)
+		return -EINVAL;
+
+	/* a null it_value would disarm the timer */
+	if (!first_us)
+		its.it_value.tv_nsec = 1;
+
+	ps = calloc(1, sizeof(*ps));
+	if (!ps)
+		return -ENOMEM;
+
+	ps->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (ps->fd < 0) {
+		err = -errno;
+		free(ps);
+		return err;
+	}
+
+	ps->events = EPOLLIN;
+	ps->timer = cb;
+	ps->arg = arg;
+
+	if (timerfd_settime(ps->fd, 0, &its, NULL)) {
+		err = -errno;
+		goto lbl_free;
+	}
+
+	err = pcanfd_loop_add_src(pl, ps);
+	if (err)
+		goto lbl_free;
+
+	return ps->fd;
+
+lbl_free:
+	close(ps->fd);
+	free(ps);
+
+	return err;
+}
+
+/*
+ * int pcanfd_loop_del_timer(struct pcanfd_loop *pl, int id)
+ *
+ *	Remove a timer from the loop.
+ *
+ * RETURN:
+ *
+ *	0 if the timer has been removed,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_del_timer(struct pcanfd_loop *pl, int id)
+{
+	struct pcanfd_loop_src *ps;
+
+	if (!pl)
+		return -EINVAL;
+
+	ps = pcanfd_loop_get(pl, id);
+	if (!ps || !ps->timer)
+		return -ENOENT;
+
+	pcanfd_loop_del_src(pl, ps);
+
+	return 0;
+}
+
+/* read the msgs of a ready channel by batches */
+static int pcanfd_loop_rx(struct pcanfd_loop *pl, struct pcanfd_loop_src *ps)
+{
+	int i, err, fd = ps->fd;
+
+	for (i = 0; i < PCANFD_LOOP_RX_ROUNDS; i++) {
+		pl->msgs->count = pl->batch;
+
+		err = pcanfd_recv_msgs(fd, pl->msgs);
+		if (err == -EAGAIN || err == -EWOULDBLOCK)
+			return 0;
+
+		if (err) {
+
+			/* the channel is not usable anymore: remove it from
+			 * the loop (if the callback didn't) */
+			err = ps->rx(pl, fd, NULL, err, ps->arg);
+			if (pcanfd_loop_get(pl, fd) == ps)
+				pcanfd_loop_del_src(pl, ps);
+			return err;
+		}
+
+		err = ps->rx(pl, fd, pl->msgs->list, pl->msgs->count,
+			     ps->arg);
+		if (err || pl->stopped)
+			return err;
+
+		/* Rx queue is empty, or the callback removed the channel */
+		if (pl->msgs->count < pl->batch ||
+		    pcanfd_loop_get(pl, fd) != ps)
+			break;
+	}
+
+	/* other msgs (if any) will be read at the next epoll_wait() */
+	return 0;
+}
+
+static int pcanfd_loop_dispatch(struct pcanfd_loop *pl,
+				struct epoll_event *pev)
+{
+	struct pcanfd_loop_src *ps = pcanfd_loop_get(pl, pev->data.fd);
+	int err, fd = pev->data.fd;
+
+	/* removed by a previous callback */
+	if (!ps)
+		return 0;
+
+	if (ps->timer) {
+		__u64 expirations;
+
+		if (read(fd, &expirations, sizeof(expirations)) !=
+							sizeof(expirations))
+			return (errno == EAGAIN) ? 0 : -errno;
+
+		return ps->timer(pl, fd, expirations, ps->arg);
+	}
+
+	if (pev->events & (EPOLLIN|EPOLLERR|EPOLLHUP)) {
+		err = pcanfd_loop_rx(pl, ps);
+		if (err || pl->stopped || pcanfd_loop_get(pl, fd) != ps)
+			return err;
+	}
+
+	if ((pev->events & EPOLLOUT) && (ps->events & EPOLLOUT)) {
+
+		/* the callback is called once per pcanfd_loop_want_tx() */
+		ps->events &= ~EPOLLOUT;
+		err = pcanfd_loop_ctl(pl, EPOLL_CTL_MOD, ps);
+		if (err)
+			return err;
+
+		return ps->tx(pl, fd, ps->arg);
+	}
+
+	return 0;
+}
+
+/*
+ * int pcanfd_loop_run(struct pcanfd_loop *pl, int timeout_ms)
+ *
+ *	Wait for events and run the callbacks of all the ready channels and
+ *	timers.
+ *
+ * RETURN:
+ *
+ *	0 if the loop has been stopped or if the timeout expired,
+ *	the non-zero value returned by a callback,
+ *	a negative (errno) code otherwise.
+ */
+int pcanfd_loop_run(struct pcanfd_loop *pl, int timeout_ms)
+{
+	int i, n, err;
+
+	if (!pl)
+		return -EINVAL;
+
+	pl->stopped = 0;
+
+	do {
+		n = epoll_wait(pl->epfd, pl->events, PCANFD_LOOP_EVENTS_MAX,
+			       timeout_ms);
+		if (n < 0)
+			return -errno;
+
+		for (i = 0; i < n; i++) {
+			err = pcanfd_loop_dispatch(pl, pl->events + i);
+			if (err)
+				return err;
+
+			if (pl->stopped)
+				return 0;
+		}
+	} while (timeout_ms < 0);
+
+	return 0;
+}
+
+/*
+ * void pcanfd_loop_stop(struct pcanfd_loop *pl)
+ *
+ *	Make pcanfd_loop_run() return.
+ */
+void pcanfd_loop_stop(struct pcanfd_loop *pl)
+{
+	if (pl)
+		pl->stopped = 1;
+}
+
+/*
+ * void pcanfd_loop_destroy(struct pcanfd_loop *pl)
+ *
+ *	Remove all the channels and timers from the loop and release it.
+ */
+void pcanfd_loop_destroy(struct pcanfd_loop *pl)
+{
+	int fd;
+
+	if (!pl)
+		return;
+
+	for (fd = 0; fd < pl->srcs_count; fd++)
+		if (pl->srcs[fd])
+			pcanfd_loop_del_src(pl, pl->srcs[fd]);
+
+	close(pl->epfd);
+	free(pl->srcs);
+	free(pl->msgs);
+	free(pl);
+}
 
 /*
  * int pcanfd_set_device_id(int fd, __u32 devid)
@@ -1045,6 +2219,9 @@ int pcan_set_extra_params(int fd, const struct pcan_msg_filter *pe)
  *
  *			Note that opening a device with PCANFD_INIT_LISTEN_ONLY
  *			leads to open the system device in O_RDONLY mode too.
+ *			Opening a device with PCANFD_INIT_TS_MONO_NS makes the
+ *			timestamps of the msgs being given in CLOCK_MONOTONIC ns
+ *			in their "timestamp_ns" field (see pcanfd.h).
  *	...		If OFD_BITRATE flag is set, the 1st argument must be a
  *			numeric value used to specify the nominal bitrate,
  *			in bps. If OFD_BTR0BTR1 flag is set too, then this
@@ -0,0 +1,5 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * linux/cache.h - userspace shim: see src/pcan_common.h
+ */
+#include "src/pcan_common.h"
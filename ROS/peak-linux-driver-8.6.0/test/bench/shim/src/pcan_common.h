@@ -0,0 +1,474 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *****************************************************************************/
+
+/*
+ * src/pcan_common.h - userspace shim of the driver global defines
+ *
+ * This file replaces driver/src/pcan_common.h (and the few <linux/...>
+ * headers found in this directory) so that the driver files that only
+ * contain pure logic can be built unchanged into a userspace program.
+ *
+ * $Id$
+ */
+#ifndef __PCAN_COMMON_H__
+#define __PCAN_COMMON_H__
+
+/* these MUST be included before the macros below (e.g. abs(), min()...) */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <endian.h>
+#include <pthread.h>
+
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE	KERNEL_VERSION(4, 19, 0)
+
+typedef uint8_t		u8;
+typedef uint16_t	u16;
+typedef uint32_t	u32;
+typedef uint64_t	u64;
+typedef int8_t		s8;
+typedef int16_t		s16;
+typedef int32_t		s32;
+typedef int64_t		s64;
+
+typedef u64		dma_addr_t;
+typedef unsigned int	gfp_t;
+
+#define __packed		__attribute__((packed))
+#define __iomem
+#define __user
+#define __rcu
+#define __must_check
+#define __init
+#define __exit
+
+#define DEVICE_NAME	"pcan"
+
+/* same as the driver */
+#define PCAN_HANDLE_CLOCK_DRIFT
+
+#define kHz				1000
+#define MHz				(1000*kHz)
+#define GHz				(1000*MHz)
+
+#define PAGE_SIZE			4096
+
+#define MSEC_PER_SEC			1000L
+#define USEC_PER_MSEC			1000L
+#define NSEC_PER_USEC			1000L
+#define NSEC_PER_MSEC			1000000L
+#define USEC_PER_SEC			1000000L
+#define NSEC_PER_SEC			1000000000L
+
+#define KERN_DEBUG
+#define KERN_INFO
+#define KERN_WARNING
+#define KERN_ERR
+#define printk				printf
+#define pr_info				printf
+#define pr_warn				printf
+#define pr_err				printf
+
+#ifdef DEBUG
+#define DPRINTK				printk
+#else
+#define DPRINTK(stuff...)
+#endif
+
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
+#define ALIGN(x, a)		(((x) + (a) - 1) & ~((__typeof__(x))(a) - 1))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+
+#define container_of(p, t, m)	((t *)((char *)(p) - offsetof(t, m)))
+
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		min((t)(a), (t)(b))
+#define max_t(t, a, b)		max((t)(a), (t)(b))
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+#define abs(x)								\
+({									\
+	__typeof__(x) __x = (x);					\
+	(__x < 0) ? -__x : __x;						\
+})
+
+#ifndef SMP_CACHE_BYTES
+#define SMP_CACHE_BYTES		64
+#endif
+#define ____cacheline_aligned_in_smp	\
+			__attribute__((__aligned__(SMP_CACHE_BYTES)))
+
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_mb()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+
+static inline u32 roundup_pow_of_two(u32 n)
+{
+	return (n <= 1) ? 1 : 1U << (32 - __builtin_clz(n - 1));
+}
+
+#define simple_strtoul		strtoul
+
+/* byte order */
+#define cpu_to_le16(x)		htole16(x)
+#define cpu_to_le32(x)		htole32(x)
+#define cpu_to_le64(x)		htole64(x)
+#define le16_to_cpu(x)		le16toh(x)
+#define le32_to_cpu(x)		le32toh(x)
+#define le64_to_cpu(x)		le64toh(x)
+
+/* bitmaps */
+#define BITS_PER_LONG		(8 * sizeof(long))
+#define BIT_WORD(nr)		((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)		(1UL << ((nr) % BITS_PER_LONG))
+#define BITS_TO_LONGS(nr)	(((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline void __set_bit(int nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline int test_bit(int nr, const unsigned long *addr)
+{
+	return !!(addr[BIT_WORD(nr)] & BIT_MASK(nr));
+}
+
+/* 64-bit arithmetic */
+static inline u64 div_u64_rem(u64 a, u32 b, u32 *rem)
+{
+	*rem = a % b;
+	return a / b;
+}
+
+static inline u64 div_u64(u64 a, u32 b)
+{
+	return a / b;
+}
+
+static inline s64 div_s64(s64 a, s32 b)
+{
+	return a / b;
+}
+
+static inline s64 div64_s64(s64 a, s64 b)
+{
+	return a / b;
+}
+
+#define do_div(n, base)							\
+({									\
+	u32 __rem = (n) % (base);					\
+	(n) /= (base);							\
+	__rem;								\
+})
+
+static inline u64 mul_u64_u32_shr(u64 a, u32 mul, unsigned int shift)
+{
+	return (u64 )(((unsigned __int128 )a * mul) >> shift);
+}
+
+/* Bob Jenkins' lookup3 hash, as found in <linux/jhash.h> */
+#define __jhash_rol32(w, s)	(((w) << (s)) | ((w) >> (32 - (s))))
+
+#define __jhash_mix(a, b, c)						\
+{									\
+	a -= c;  a ^= __jhash_rol32(c, 4);  c += b;			\
+	b -= a;  b ^= __jhash_rol32(a, 6);  a += c;			\
+	c -= b;  c ^= __jhash_rol32(b, 8);  b += a;			\
+	a -= c;  a ^= __jhash_rol32(c, 16); c += b;			\
+	b -= a;  b ^= __jhash_rol32(a, 19); a += c;			\
+	c -= b;  c ^= __jhash_rol32(b, 4);  b += a;			\
+}
+
+#define __jhash_final(a, b, c)						\
+{									\
+	c ^= b; c -= __jhash_rol32(b, 14);				\
+	a ^= c; a -= __jhash_rol32(c, 11);				\
+	b ^= a; b -= __jhash_rol32(a, 25);				\
+	c ^= b; c -= __jhash_rol32(b, 16);				\
+	a ^= c; a -= __jhash_rol32(c, 4);				\
+	b ^= a; b -= __jhash_rol32(a, 14);				\
+	c ^= b; c -= __jhash_rol32(b, 24);				\
+}
+
+#define JHASH_INITVAL		0xdeadbeef
+
+static inline u32 jhash2(const u32 *k, u32 length, u32 initval)
+{
+	u32 a, b, c;
+
+	a = b = c = JHASH_INITVAL + (length << 2) + initval;
+
+	while (length > 3) {
+		a += k[0];
+		b += k[1];
+		c += k[2];
+		__jhash_mix(a, b, c);
+		length -= 3;
+		k += 3;
+	}
+
+	switch (length) {
+	case 3: c += k[2];	/* fall through */
+	case 2: b += k[1];	/* fall through */
+	case 1: a += k[0];
+		__jhash_final(a, b, c);
+	case 0:
+		break;
+	}
+
+	return c;
+}
+
+static inline u32 jhash_3words(u32 a, u32 b, u32 c, u32 initval)
+{
+	a += JHASH_INITVAL;
+	b += JHASH_INITVAL;
+	c += initval;
+
+	__jhash_final(a, b, c);
+
+	return c;
+}
+
+/* sort() without the swap function */
+static inline void sort(void *base, size_t num, size_t size,
+			int (*cmp)(const void *, const void *),
+			void (*swap)(void *, void *, int))
+{
+	qsort(base, num, size, cmp);
+}
+
+/* doubly linked lists */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list->prev = list;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+static inline void list_add_tail(struct list_head *item,
+				 struct list_head *head)
+{
+	item->prev = head->prev;
+	item->next = head;
+	head->prev->next = item;
+	head->prev = item;
+}
+
+static inline void list_del(struct list_head *item)
+{
+	item->prev->next = item->next;
+	item->next->prev = item->prev;
+}
+
+#define list_entry(p, t, m)		container_of(p, t, m)
+
+#define list_for_each_entry(pos, head, m)				\
+	for (pos = list_entry((head)->next, __typeof__(*pos), m);	\
+	     &pos->m != (head);						\
+	     pos = list_entry(pos->m.next, __typeof__(*pos), m))
+
+#define list_for_each_entry_safe(pos, n, head, m)			\
+	for (pos = list_entry((head)->next, __typeof__(*pos), m),	\
+	     n = list_entry(pos->m.next, __typeof__(*pos), m);		\
+	     &pos->m != (head);						\
+	     pos = n, n = list_entry(n->m.next, __typeof__(*n), m))
+
+/* RCU: the benchmarks don't update the data they read concurrently */
+#define rcu_read_lock()
+#define rcu_read_unlock()
+#define rcu_dereference(p)	__atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define synchronize_rcu()
+
+/* kernel objects found in the driver structs, but never used here */
+struct timer_list {
+	void (*function)(struct timer_list *);
+};
+
+typedef struct {
+	int counter;
+} atomic_t;
+
+struct hrtimer {
+	int (*function)(struct hrtimer *);
+};
+
+struct device;
+struct pci_dev;
+struct file;
+struct file_operations;
+
+void *dev_get_drvdata(const struct device *dev);
+void free_irq(unsigned int irq, void *dev_id);
+
+/* memory */
+#define GFP_KERNEL		0
+#define GFP_ATOMIC		1
+
+#define kmalloc(s, f)		malloc(s)
+#define kzalloc(s, f)		calloc(1, s)
+#define kfree(p)		free((void *)(p))
+
+#define pcan_malloc(a, b)	kmalloc(a, b)
+static inline void *pcan_free(void *p)
+{
+	kfree(p);
+	return NULL;
+}
+
+/* time */
+static inline u64 timeval_to_us(struct timeval *tv)
+{
+	return ((u64 )tv->tv_sec * USEC_PER_SEC) + tv->tv_usec;
+}
+
+static inline void timeval_add_us(struct timeval *tv, signed long us)
+{
+	tv->tv_usec += us;
+
+	tv->tv_sec += tv->tv_usec / USEC_PER_SEC;
+	tv->tv_usec %= USEC_PER_SEC;
+}
+
+static inline signed long timeval_diff(struct timeval *tv0, struct timeval *tv1)
+{
+	return (long )(timeval_to_us(tv0) - timeval_to_us(tv1));
+}
+
+static inline int timeval_cmp(struct timeval *tv0, struct timeval *tv1)
+{
+	return (tv0->tv_sec != tv1->tv_sec) ? tv0->tv_sec - tv1->tv_sec
+						: tv0->tv_usec - tv1->tv_usec;
+}
+
+#define timeval_is_older(t1, t2)		timeval_cmp(t1, t2) < 0
+
+static inline void us_to_timeval(u64 us, struct timeval *tv)
+{
+	u32 rem;
+
+	tv->tv_sec = div_u64_rem(us, USEC_PER_SEC, &rem);
+	tv->tv_usec = rem;
+}
+
+static inline u64 pcan_getnow_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (u64 )ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline u64 pcan_getmono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64 )ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline void pcan_gettimeofday_ex(struct timeval *tv, u64 *ptv_ns)
+{
+	gettimeofday(tv, NULL);
+	if (ptv_ns)
+		*ptv_ns = pcan_getnow_ns();
+}
+
+static inline void pcan_gettimeofday(struct timeval *tv)
+{
+	pcan_gettimeofday_ex(tv, NULL);
+}
+
+#define PCAN_COARSE_TIME_SLACK_US	0
+
+static inline void pcan_gettimeofday_coarse(struct timeval *tv)
+{
+	pcan_gettimeofday(tv);
+}
+
+#define msleep_interruptible(ms)	usleep((ms) * USEC_PER_MSEC)
+
+static inline int pcan_task_can_wait(void)
+{
+	return 1;
+}
+
+/* user buffers are plain buffers here */
+static inline int pcan_copy_from_user(void *to, const void __user *from,
+					int size, void *c)
+{
+	memcpy(to, from, size);
+	return 0;
+}
+
+static inline int pcan_copy_to_user(void __user *to, const void *from,
+					size_t size, void *c)
+{
+	memcpy(to, from, size);
+	return 0;
+}
+
+/* irq-safe spinlocks are pthread spinlocks here */
+typedef int			pcan_lock_irqsave_ctxt;
+typedef pthread_spinlock_t	pcan_lock_t;
+
+#define pcan_lock_init(l)	pthread_spin_init(l, PTHREAD_PROCESS_PRIVATE)
+#define pcan_lock_get_irqsave(l, f) \
+	do { (f) = 0; pthread_spin_lock(l); } while (0)
+#define pcan_lock_put_irqrestore(l, f) \
+	do { (void)(f); pthread_spin_unlock(l); } while (0)
+
+typedef pthread_mutex_t		pcan_mutex_t;
+
+#define pcan_mutex_init(m)	pthread_mutex_init(m, NULL)
+#define pcan_mutex_lock(m)	pthread_mutex_lock(m)
+#define pcan_mutex_unlock(m)	pthread_mutex_unlock(m)
+#define pcan_mutex_trylock(m)	(!pthread_mutex_trylock(m))
+#define pcan_mutex_destroy(m)	pthread_mutex_destroy(m)
+
+/* nobody waits for events here */
+typedef int			pcan_event_t;
+
+#define pcan_event_init(e, v)	(*(e) = 0)
+#define pcan_event_free(e)
+#define pcan_event_signal(e)	((*(e))++)
+
+#define pcan_xxxdev_rx(d, f)		pcan_chardev_rx(d, f)
+
+#endif
@@ -0,0 +1,127 @@
+/*****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ * bench.c - a tiny microbenchmark harness for the driver core files
+ *
+ * usage: bench [-t=min_time_ms] [-c] [filter]
+ *
+ * $Id$
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+#define BENCH_MAX_CASES		128
+#define BENCH_MIN_TIME_MS	200
+
+static struct bench_case {
+	const char *name;
+	bench_fn fn;
+	long arg;
+} bench_cases[BENCH_MAX_CASES];
+
+static int bench_count;
+
+void bench_register(const char *name, bench_fn fn, long arg)
+{
+	if (bench_count >= BENCH_MAX_CASES) {
+		fprintf(stderr, "bench: too many cases (max %u)\n",
+			BENCH_MAX_CASES);
+		exit(1);
+	}
+
+	bench_cases[bench_count].name = name;
+	bench_cases[bench_count].fn = fn;
+	bench_cases[bench_count].arg = arg;
+	bench_count++;
+}
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct bench_case *)a)->name,
+		      ((const struct bench_case *)b)->name);
+}
+
+static void bench_run(struct bench_case *pb, uint64_t min_ns, int csv)
+{
+	uint64_t frames = 1, done, t0, dt;
+
+	for ( ; ; frames *= 2) {
+		t0 = bench_now_ns();
+		done = pb->fn(frames, pb->arg);
+		dt = bench_now_ns() - t0;
+
+		if (dt >= min_ns || frames >= (1ULL << 40))
+			break;
+	}
+
+	if (!done)
+		done = 1;
+
+	if (csv)
+		printf("%s,%llu,%llu,%.2f\n", pb->name,
+			(unsigned long long )done, (unsigned long long )dt,
+			(double )dt / done);
+	else
+		printf("%-40s %12llu frames %10.2f ns/frame\n", pb->name,
+			(unsigned long long )done, (double )dt / done);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t min_ns = BENCH_MIN_TIME_MS * 1000000ULL;
+	const char *filter = NULL;
+	int i, csv = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "-t=", 3))
+			min_ns = strtoull(argv[i] + 3, NULL, 0) * 1000000ULL;
+		else if (!strcmp(argv[i], "-c"))
+			csv = 1;
+		else if (argv[i][0] == '-') {
+			printf("usage: %s [-t=min_time_ms] [-c] [filter]\n",
+				argv[0]);
+			return (strcmp(argv[i], "-h") &&
+				strcmp(argv[i], "--help")) ? 1 : 0;
+		} else
+			filter = argv[i];
+	}
+
+	qsort(bench_cases, bench_count, sizeof(bench_cases[0]), bench_cmp);
+
+	if (csv)
+		printf("name,frames,total_ns,ns_per_frame\n");
+
+	for (i = 0; i < bench_count; i++)
+		if (!filter || strstr(bench_cases[i].name, filter))
+			bench_run(bench_cases + i, min_ns, csv);
+
+	return 0;
+}
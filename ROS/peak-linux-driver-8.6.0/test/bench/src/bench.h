@@ -0,0 +1,48 @@
+/*****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ * bench.h - a tiny microbenchmark harness for the driver core files
+ *
+ * $Id$
+ *
+ *****************************************************************************/
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+
+/*
+ * A bench case runs "frames" times the operation to measure and returns the
+ * count of frames really processed. The harness calls it with an increasing
+ * count of frames until the run lasts long enough, then displays the average
+ * cost of one frame.
+ */
+typedef uint64_t (*bench_fn)(uint64_t frames, long arg);
+
+void bench_register(const char *name, bench_fn fn, long arg);
+
+/* keep the compiler from optimizing the measured code away */
+#define bench_do_not_optimize(v)	__asm__ __volatile__("" : : "g"(v) : "memory")
+
+#define BENCH_CASE(fn, arg)						\
+static void __attribute__((constructor)) bench_reg_##fn##_##arg(void)	\
+{									\
+	bench_register(#fn "/" #arg, fn, arg);				\
+}
+
+#endif
@@ -0,0 +1,185 @@
+/*****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ * bench_fifo.c - per frame cost of the driver fifo (pcan_fifo.c)
+ *
+ * Compares getting/putting frames one by one with getting/putting them by
+ * batches, as PCANFD_RECV_MSGS and PCANFD_SEND_MSGS do, and the locked
+ * functions with the lockless ones. The "spsc" case runs the producer and
+ * the consumer in two threads and checks that no frame is lost nor
+ * reordered.
+ *
+ * $Id$
+ *
+ *****************************************************************************/
+#include "src/pcan_common.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "src/pcan_fifo.h"
+#include "bench.h"
+
+/* same size as the items stored in the Rx fifo of a real device */
+struct bench_item {
+	u8 data[64 + 24 + 40];
+};
+
+#define BENCH_FIFO_SIZE		2048	/* default rxqsize */
+#define BENCH_BATCH_MAX		256
+
+static FIFO_MANAGER fifo;
+static struct bench_item *fifo_items;
+static struct bench_item batch[BENCH_BATCH_MAX];
+
+static void bench_fifo_init(void)
+{
+	u32 n = pcan_fifo_slots(BENCH_FIFO_SIZE);
+
+	if (!fifo_items) {
+		fifo_items = calloc(n, sizeof(*fifo_items));
+		if (!fifo_items) {
+			perror("bench_fifo");
+			exit(1);
+		}
+	}
+
+	pcan_fifo_init(&fifo, fifo_items, fifo_items + n - 1,
+		       BENCH_FIFO_SIZE, sizeof(*fifo_items));
+
+	/* not aligned on the fifo size, to exercise the wrap */
+	pcan_fifo_put_n(&fifo, batch, 7);
+	pcan_fifo_get_n(&fifo, batch, 7);
+}
+
+/* put then get "arg" frames, one by one */
+static uint64_t fifo_put_get_1by1(uint64_t frames, long arg)
+{
+	uint64_t done;
+	long i;
+
+	bench_fifo_init();
+
+	for (done = 0; done < frames; done += arg) {
+		for (i = 0; i < arg; i++)
+			pcan_fifo_put(&fifo, batch + i);
+		for (i = 0; i < arg; i++)
+			pcan_fifo_get(&fifo, batch + i);
+	}
+
+	bench_do_not_optimize(batch[0].data[0]);
+	return done;
+}
+
+/* put then get "arg" frames at once */
+static uint64_t fifo_put_get_n(uint64_t frames, long arg)
+{
+	uint64_t done;
+
+	bench_fifo_init();
+
+	for (done = 0; done < frames; done += arg) {
+		pcan_fifo_put_n(&fifo, batch, arg);
+		pcan_fifo_get_n(&fifo, batch, arg);
+	}
+
+	bench_do_not_optimize(batch[0].data[0]);
+	return done;
+}
+
+/* same as above, without taking the locks */
+static uint64_t fifo_put_get_1by1_lockless(uint64_t frames, long arg)
+{
+	uint64_t done;
+	long i;
+
+	bench_fifo_init();
+
+	for (done = 0; done < frames; done += arg) {
+		for (i = 0; i < arg; i++)
+			__pcan_fifo_put(&fifo, batch + i);
+		for (i = 0; i < arg; i++)
+			__pcan_fifo_get(&fifo, batch + i);
+	}
+
+	bench_do_not_optimize(batch[0].data[0]);
+	return done;
+}
+
+static void *fifo_spsc_producer(void *arg)
+{
+	uint64_t seq, frames = *(uint64_t *)arg;
+	struct bench_item item;
+
+	for (seq = 0; seq < frames; ) {
+		memcpy(item.data, &seq, sizeof(seq));
+		if (__pcan_fifo_put(&fifo, &item) >= 0)
+			seq++;
+		else
+			sched_yield();	/* let the consumer run */
+	}
+
+	return NULL;
+}
+
+/* one producer thread, one consumer thread (this one), lockless */
+static uint64_t fifo_spsc(uint64_t frames, long arg)
+{
+	struct bench_item item;
+	pthread_t producer;
+	uint64_t seq, got;
+
+	bench_fifo_init();
+
+	if (pthread_create(&producer, NULL, fifo_spsc_producer, &frames)) {
+		perror("bench_fifo");
+		exit(1);
+	}
+
+	for (seq = 0; seq < frames; ) {
+		if (__pcan_fifo_get(&fifo, &item)) {
+			sched_yield();	/* let the producer run */
+			continue;
+		}
+
+		memcpy(&got, item.data, sizeof(got));
+		if (got != seq) {
+			fprintf(stderr, "fifo_spsc: got frame %llu instead "
+				"of %llu\n", (unsigned long long)got,
+				(unsigned long long)seq);
+			exit(1);
+		}
+		seq++;
+	}
+
+	pthread_join(producer, NULL);
+	return seq;
+}
+
+BENCH_CASE(fifo_put_get_1by1, 1)
+BENCH_CASE(fifo_put_get_1by1, 32)
+BENCH_CASE(fifo_put_get_1by1, 256)
+BENCH_CASE(fifo_put_get_1by1_lockless, 1)
+BENCH_CASE(fifo_put_get_1by1_lockless, 32)
+BENCH_CASE(fifo_put_get_n, 1)
+BENCH_CASE(fifo_put_get_n, 8)
+BENCH_CASE(fifo_put_get_n, 32)
+BENCH_CASE(fifo_put_get_n, 256)
+BENCH_CASE(fifo_spsc, 0)
@@ -0,0 +1,82 @@
+/*****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ * bench_filter.c - per frame cost of the msgs filters (pcan_filter.c)
+ *
+ * Each case filters frames which IDs go through a chain made of "arg" ID
+ * ranges of 29-bit IDs, half of the frames being passed.
+ *
+ * $Id$
+ *
+ *****************************************************************************/
+#include "src/pcan_common.h"
+
+#include <stdlib.h>
+
+#include "src/pcan_filter.h"
+#include "bench.h"
+
+#define BENCH_FILTER_IDS	1024
+
+static struct pcanfd_rxmsg rx[BENCH_FILTER_IDS];
+
+static void *bench_filter_init(long count)
+{
+	void *chain = pcan_create_filter_chain();
+	long i;
+
+	if (!chain) {
+		fprintf(stderr, "bench_filter: no memory\n");
+		exit(1);
+	}
+
+	/* ranges of 8 IDs every 16 IDs */
+	for (i = 0; i < count; i++)
+		pcan_add_filter(chain, i * 16, i * 16 + 7, PCANFD_MSG_EXT);
+
+	/* IDs spread over all the ranges */
+	for (i = 0; i < BENCH_FILTER_IDS; i++) {
+		rx[i].msg.type = PCANFD_TYPE_CAN20_MSG;
+		rx[i].msg.flags = PCANFD_MSG_EXT;
+		rx[i].msg.id = (i * 7) % (count ? count * 16 : 1);
+	}
+
+	return chain;
+}
+
+/* filter frames through a chain of "arg" ranges */
+static uint64_t filter_ext_ranges(uint64_t frames, long arg)
+{
+	void *chain = bench_filter_init(arg);
+	uint64_t done;
+	int thrown = 0;
+
+	for (done = 0; done < frames; done++)
+		thrown += pcan_do_filter(chain,
+					 rx + (done % BENCH_FILTER_IDS));
+
+	pcan_delete_filter_chain(chain);
+
+	bench_do_not_optimize(thrown);
+	return done;
+}
+
+BENCH_CASE(filter_ext_ranges, 0)
+BENCH_CASE(filter_ext_ranges, 1)
+BENCH_CASE(filter_ext_ranges, 16)
+BENCH_CASE(filter_ext_ranges, 256)
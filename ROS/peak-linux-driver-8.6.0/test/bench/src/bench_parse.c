@@ -0,0 +1,62 @@
+/*****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ * bench_parse.c - per frame cost of the text output of the msgs read from
+ * /dev/pcanX (pcan_parse.c). "arg" is the count of data bytes.
+ *
+ * $Id$
+ *
+ *****************************************************************************/
+#include "src/pcan_common.h"
+
+#include "src/pcan_parse.h"
+#include "bench.h"
+
+static uint64_t make_output(uint64_t frames, long arg)
+{
+	struct pcanfd_msg msg = {
+		.type = PCANFD_TYPE_CAN20_MSG,
+		.flags = PCANFD_MSG_EXT|PCANFD_TIMESTAMP,
+		.id = 0x1234567,
+		.data_len = arg,
+	};
+	char buffer[512];	/* a CAN-FD frame doesn't fit in 80 bytes */
+	uint64_t done;
+	int len = 0;
+	long i;
+
+	if (arg > 8) {
+		msg.type = PCANFD_TYPE_CANFD_MSG;
+		msg.flags |= PCANFD_MSG_BRS;
+	}
+
+	for (i = 0; i < arg; i++)
+		msg.data[i] = i;
+
+	for (done = 0; done < frames; done++) {
+		msg.timestamp.tv_usec = done % USEC_PER_SEC;
+		len += pcan_make_output(buffer, &msg);
+	}
+
+	bench_do_not_optimize(len);
+	return done;
+}
+
+BENCH_CASE(make_output, 0)
+BENCH_CASE(make_output, 8)
+BENCH_CASE(make_output, 64)
@@ -0,0 +1,94 @@
+/*****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ * bench_stubs.c - driver functions called by the files of the library, but
+ * defined in files that are not built here (pcan_main.c, pcanfd_core.c...)
+ *
+ * Rx msgs given to pcan_chardev_rx() are only counted.
+ *
+ * $Id$
+ *
+ *****************************************************************************/
+#include "src/pcan_common.h"
+#include "src/pcan_main.h"
+#include "src/pcanfd_core.h"
+
+#include "bench.h"
+
+u64 bench_rx_count;
+
+int pcan_chardev_rx(struct pcandev *dev, struct pcanfd_rxmsg *rx)
+{
+	bench_rx_count++;
+	bench_do_not_optimize(rx->msg.id);
+
+	return 1;
+}
+
+void pcan_clear_status_bit(struct pcandev *dev, u16 bits)
+{
+	dev->wCANStatus &= ~bits;
+}
+
+int pcan_handle_busoff(struct pcandev *dev, struct pcanfd_rxmsg *pf)
+{
+	return 0;
+}
+
+void pcan_handle_error_active(struct pcandev *dev, struct pcanfd_rxmsg *pf)
+{
+}
+
+int pcan_handle_error_status(struct pcandev *dev, struct pcanfd_rxmsg *pf,
+				int err_warning, int err_passive)
+{
+	return 0;
+}
+
+void pcan_handle_error_msg(struct pcandev *dev, struct pcanfd_rxmsg *pf,
+			int err_type, u8 err_code, int err_rx, int err_gen)
+{
+}
+
+void pcan_soft_init_ex(struct pcandev *dev,
+			const struct pcanfd_available_clocks *clocks,
+			const struct pcanfd_bittiming_range *pc,
+			u32 flags)
+{
+}
+
+int pcan_bittiming_normalize(struct pcan_bittiming *pbt,
+			u32 clock_Hz, const struct pcanfd_bittiming_range *caps)
+{
+	return pcan_bitrate_to_bittiming(pbt, caps, clock_Hz);
+}
+
+struct pcan_bittiming *pcan_btr0btr1_to_bittiming(struct pcan_bittiming *pbt,
+						  u16 btr0btr1)
+{
+	return pbt;
+}
+
+void pcanfd_copy_init(struct pcanfd_init *pd, struct pcanfd_init *ps)
+{
+	*pd = *ps;
+}
+
+void dump_mem(char *prompt, void *p, int l)
+{
+}
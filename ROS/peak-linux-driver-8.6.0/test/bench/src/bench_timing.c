@@ -0,0 +1,103 @@
+/*****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ * bench_timing.c - cost of the bit-timings solver (pcan_timing.c)
+ *
+ * bitrate_to_bittiming_hit solves the same bitrate again and again: CiA
+ * bitrates are found in the table filled as if a uCAN device was registered,
+ * other ones in the hash cache. bitrate_to_bittiming_miss asks for a
+ * different sample point each time, so that the cache never gives the result.
+ * "arg" is the bitrate.
+ *
+ * $Id$
+ *
+ *****************************************************************************/
+#include "src/pcan_common.h"
+
+#include "src/pcan_timing.h"
+#include "bench.h"
+
+#define BENCH_TIMING_CLOCK	80000000
+
+/* nominal bit-timings ranges of the uCAN devices */
+static const struct pcanfd_bittiming_range bench_caps = {
+	.brp_min = 1,
+	.brp_max = 1 << 10,
+	.brp_inc = 1,
+	.tseg1_min = 1,
+	.tseg1_max = 1 << 8,
+	.tseg2_min = 1,
+	.tseg2_max = 1 << 7,
+	.sjw_min = 1,
+	.sjw_max = 1 << 7,
+};
+
+/* clocks of the uCAN devices */
+static const u32 bench_clocks[] = {
+	80000000, 60000000, 40000000, 30000000, 24000000, 20000000,
+};
+
+static void __attribute__((constructor)) bench_timing_init(void)
+{
+	int i;
+
+	pcan_timing_init();
+
+	for (i = 0; i < ARRAY_SIZE(bench_clocks); i++)
+		pcan_bittiming_cache_fill(&bench_caps, &bench_caps,
+					  bench_clocks[i]);
+}
+
+static uint64_t bitrate_to_bittiming_hit(uint64_t frames, long arg)
+{
+	struct pcan_bittiming bt;
+	uint64_t done;
+
+	for (done = 0; done < frames; done++) {
+		memset(&bt, '\0', sizeof(bt));
+		bt.bitrate = arg;
+		pcan_bitrate_to_bittiming(&bt, &bench_caps,
+					  BENCH_TIMING_CLOCK);
+	}
+
+	bench_do_not_optimize(bt.brp);
+	return done;
+}
+
+static uint64_t bitrate_to_bittiming_miss(uint64_t frames, long arg)
+{
+	struct pcan_bittiming bt;
+	uint64_t done;
+
+	for (done = 0; done < frames; done++) {
+		memset(&bt, '\0', sizeof(bt));
+		bt.bitrate = arg;
+		bt.sample_point = 5000 + done % 4096;
+		pcan_bitrate_to_bittiming(&bt, &bench_caps,
+					  BENCH_TIMING_CLOCK);
+	}
+
+	bench_do_not_optimize(bt.brp);
+	return done;
+}
+
+BENCH_CASE(bitrate_to_bittiming_hit, 500000)
+BENCH_CASE(bitrate_to_bittiming_hit, 83333)
+BENCH_CASE(bitrate_to_bittiming_miss, 125000)
+BENCH_CASE(bitrate_to_bittiming_miss, 500000)
+BENCH_CASE(bitrate_to_bittiming_miss, 1000000)
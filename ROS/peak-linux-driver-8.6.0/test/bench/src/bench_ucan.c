@@ -0,0 +1,116 @@
+/*****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ * bench_ucan.c - per frame cost of the decoding of the uCAN records received
+ * from the CAN-FD devices (pcanfd_ucan.c)
+ *
+ * Each call to ucan_handle_msgs_buffer() decodes a buffer made of "arg"
+ * CAN-FD rx records of 64 data bytes, as a USB-FD or PCIe-FD device gives.
+ *
+ * $Id$
+ *
+ *****************************************************************************/
+#include "src/pcan_common.h"
+#include "src/pcan_main.h"
+
+#include <stdlib.h>
+
+#include "src/pcanfd_ucan.h"
+#include "bench.h"
+
+#define BENCH_UCAN_DATA_LEN	64
+#define BENCH_UCAN_REC_SIZE	ALIGN(sizeof(struct ucan_rx_msg) + \
+				      BENCH_UCAN_DATA_LEN, 4)
+#define BENCH_UCAN_RECS_MAX	256
+
+extern u64 bench_rx_count;
+
+static struct pcandev bench_dev;
+static struct pcandev *bench_devs[] = { &bench_dev };
+static u8 ucan_buffer[BENCH_UCAN_REC_SIZE * BENCH_UCAN_RECS_MAX];
+
+/* no timestamp decoding: this needs the sync of pcan_main.c */
+static int bench_ucan_canrx(struct ucan_engine *ucan,
+			    struct ucan_msg *rx_msg, void *arg)
+{
+	return ucan_post_canrx_msg((struct pcandev *)arg,
+				   (struct ucan_rx_msg *)rx_msg, NULL);
+}
+
+static int (*bench_ucan_handlers[])(struct ucan_engine *, struct ucan_msg *,
+				    void *) = {
+	[UCAN_MSG_CAN_RX] = bench_ucan_canrx,
+};
+
+static struct ucan_ops bench_ucan_ops = {
+	.handle_msg_table = bench_ucan_handlers,
+	.handle_msg_size = ARRAY_SIZE(bench_ucan_handlers),
+};
+
+static struct ucan_engine bench_ucan = {
+	.ops = &bench_ucan_ops,
+	.devs = bench_devs,
+	.devs_count = ARRAY_SIZE(bench_devs),
+};
+
+static int bench_ucan_init(long count)
+{
+	long i;
+
+	bench_dev.bus_state = PCANFD_ERROR_ACTIVE;
+
+	memset(ucan_buffer, '\0', sizeof(ucan_buffer));
+	for (i = 0; i < count; i++) {
+		struct ucan_rx_msg *rm = (struct ucan_rx_msg *)
+				(ucan_buffer + i * BENCH_UCAN_REC_SIZE);
+
+		rm->size = cpu_to_le16(BENCH_UCAN_REC_SIZE);
+		rm->type = cpu_to_le16(UCAN_MSG_CAN_RX);
+		rm->ts_low = cpu_to_le32(i);
+		rm->channel_dlc = UCAN_MSG_CHANNEL_DLC(0, 15);
+		rm->flags = cpu_to_le16(UCAN_MSG_EXT_DATA_LEN|
+					UCAN_MSG_BITRATE_SWITCH|
+					UCAN_MSG_EXT_ID);
+		rm->can_id = cpu_to_le32(0x100 + i);
+	}
+
+	return count * BENCH_UCAN_REC_SIZE;
+}
+
+static uint64_t ucan_handle_msgs(uint64_t frames, long arg)
+{
+	int len = bench_ucan_init(arg);
+	uint64_t done;
+
+	bench_rx_count = 0;
+	for (done = 0; done < frames; done += arg)
+		ucan_handle_msgs_buffer(&bench_ucan, ucan_buffer, len);
+
+	if (bench_rx_count != done) {
+		fprintf(stderr, "bench_ucan: %llu frames posted, %llu "
+			"decoded\n", (unsigned long long )bench_rx_count,
+			(unsigned long long )done);
+		exit(1);
+	}
+
+	return done;
+}
+
+BENCH_CASE(ucan_handle_msgs, 1)
+BENCH_CASE(ucan_handle_msgs, 16)
+BENCH_CASE(ucan_handle_msgs, 256)
@@ -131,6 +131,8 @@ char *getNameOfInterface(int nType)
 	case HW_USB_PRO_FD:
 	case HW_USB_X6:
 		return "usbfd";
+	case HW_VIRTUAL:
+		return "virt";
 	}
 
 	return "unknown";
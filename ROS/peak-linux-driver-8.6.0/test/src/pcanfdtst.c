@@ -26,6 +26,10 @@
  *
  *****************************************************************************/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* CPU_SET(), pthread_setaffinity_np() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -95,6 +99,11 @@ static inline void rt_gettimeofday(struct timeval *tv)
 
 #define __gettimeofday(tv, x)	rt_gettimeofday(tv)
 
+#else
+#include <pthread.h>
+#include <sched.h>		/* CPU_SET() */
+#include <sys/mman.h>		/* mlockall() */
+
 #endif
 
 /* if defined BEFORE including libpcanfd.h, tests can be made with using
@@ -143,7 +152,8 @@ static enum {
 	TST_MODE_GETOPT,
 	TST_MODE_SETOPT,
 	TST_MODE_REC,
-	TST_MODE_NONE
+	TST_MODE_NONE,
+	TST_MODE_PING
 } tst_mode = TST_MODE_UNKNOWN;
 
 static enum log_level {
@@ -209,6 +219,8 @@ static __u32 tst_bitrate, tst_dbitrate, tst_clock_Hz;
 static __u32 tst_sample_pt = 0, tst_dsample_pt = 0;
 static __u32 tst_incr_bytes = 0;
 static __u32 tst_msgs_count = 1;
+static __u32 tst_tx_rate = 0;
+static __u32 tst_tx_load = 0;
 static int tst_fdmax = -1;
 static int tst_sig_caught= 0;
 static int pcan_device_count = 0;
@@ -238,6 +250,45 @@ static int tst_play_loops = 1;
 
 static int exit_status = 0;
 
+/* one thread per device mode (non-RT only) */
+static int tst_threads = 0;
+static volatile int tst_threads_stop = 0;
+#ifndef RT
+static int tst_thread_prio = 0;
+static __u32 tst_cpus[TST_DEV_PCAN_MAX];
+static int tst_cpus_count = 0;
+static int tst_threads_running = 0;
+static pthread_mutex_t tst_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tst_threads_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+/* ping mode: the 1st device sends the pings, the others echo them. Latencies
+ * are counted in a log-linear histogram: values < 2*TST_PING_SUB_COUNT ns are
+ * exact, greater values are stored with TST_PING_SUB_BITS significant bits. */
+#define TST_PING_ID		0x100
+#define TST_PING_SUB_BITS	7
+#define TST_PING_SUB_COUNT	(1 << TST_PING_SUB_BITS)
+#define TST_PING_HIST_SIZE	((32 - TST_PING_SUB_BITS + 1) * \
+							TST_PING_SUB_COUNT)
+
+static char *tst_csv_file = NULL;
+
+static struct {
+	__u32	id;		/* CAN Id of the pings */
+	__u32	echo_id;	/* CAN Id of the echoed pings */
+	__u32	len;
+	__u32	seq;		/* seq number of the last ping sent */
+	int	pending;	/* set until the last ping comes back */
+	__u32	lost;
+	__u32	late;
+	__u32	hwts;		/* count of replies timestamped by the hw */
+	__u32	count;
+	__u32	min_ns;
+	__u32	max_ns;
+	__u64	sum_ns;
+	__u32	hist[TST_PING_HIST_SIZE];
+} tst_ping;
+
 static struct pcan_device {
 	char *	name;
 #ifdef PCANFD_OLD_STYLE_API
@@ -248,6 +299,9 @@ static struct pcan_device {
 #elif defined(RTAI)
 	RT_TASK *rt_task;
 	pthread_t rt_thread;
+#else
+	pthread_t thread;
+	int	thread_running;
 #endif
 	int	fd;
 	__u32	flags;
@@ -270,6 +324,16 @@ static struct pcan_device {
 	__u32	ts_mode;
 	__u32	features;
 
+	/* paced Tx: target frames/s or bus load % */
+	__u32	tx_rate;
+	__u32	tx_load;
+	__u32	nom_bitrate;
+	__u32	data_bitrate;
+	__u64	tx_start_ns;
+	__u64	tx_next_ns;
+	__u64	tx_bus_ns;
+	__u64	tx_paced;
+
 	struct pcanfd_option opt;
 	struct timeval init_time;
 
@@ -362,6 +426,255 @@ static void exit_logs(void)
 	}
 }
 
+/* CLOCK_MONOTONIC ns, as given by the driver in PCANFD_INIT_TS_MONO_NS mode */
+static __u64 tst_mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Setup the Tx pacing of a device, once opened.
+ */
+static void init_tx_pace(struct pcan_device *pdev)
+{
+	struct pcanfd_init init;
+	int err;
+
+	pdev->tx_start_ns = 0;
+	pdev->tx_next_ns = 0;
+	pdev->tx_bus_ns = 0;
+	pdev->tx_paced = 0;
+	pdev->nom_bitrate = 0;
+	pdev->data_bitrate = 0;
+
+	if (tst_mode != TST_MODE_TX) {
+		pdev->tx_rate = pdev->tx_load = 0;
+		return;
+	}
+
+	/* the real bitrates are needed to compute the duration of the frames */
+	err = pcanfd_get_init(pdev->fd, &init);
+	if (err) {
+		lprintf(ALWAYS, "error %d while getting %s bitrates\n",
+			err, pdev->name);
+	} else {
+		pdev->nom_bitrate = init.nominal.bitrate;
+		if (init.flags & PCANFD_INIT_FD)
+			pdev->data_bitrate = init.data.bitrate;
+	}
+
+	if (pdev->tx_load && !pdev->nom_bitrate)
+		usage("Unable to get the bitrate needed to pace Tx with --tx-load");
+
+	/* pacing replaces the pause between each write */
+	pdev->pause_us = 0;
+
+	lprintf(VERBOSE, "%s: pacing Tx at %u %s (bitrates: %u/%u bps)\n",
+		pdev->name,
+		pdev->tx_rate ? pdev->tx_rate : pdev->tx_load,
+		pdev->tx_rate ? "frames/s" : "% of bus load",
+		pdev->nom_bitrate, pdev->data_bitrate);
+}
+
+/*
+ * Display the achieved vs. the requested Tx throughput of a paced device.
+ */
+static void exit_tx_pace(struct pcan_device *pdev)
+{
+	__u64 now_ns = tst_mono_ns();
+	double dt_ns, late_ns;
+
+	if (!pdev->tx_start_ns || now_ns <= pdev->tx_start_ns)
+		return;
+
+	dt_ns = now_ns - pdev->tx_start_ns;
+	late_ns = (now_ns > pdev->tx_next_ns) ? now_ns - pdev->tx_next_ns : 0;
+
+	if (pdev->tx_rate)
+		lprintf(ALWAYS, "%s < [requested=%u frames/s ", pdev->name,
+			pdev->tx_rate);
+	else
+		lprintf(ALWAYS, "%s < [requested=%u%% ", pdev->name,
+			pdev->tx_load);
+
+	lprintf(ALWAYS, "achieved=%.1f frames/s", pdev->tx_paced * 1e9 / dt_ns);
+	if (pdev->nom_bitrate)
+		lprintf(ALWAYS, " %.2f%%", pdev->tx_bus_ns * 100.0 / dt_ns);
+
+	lprintf(ALWAYS, " late=%.3f ms eagain=%u]\n",
+		late_ns / 1e6, pdev->tx_eagain);
+}
+
+/*
+ * Setup the ping test once all the devices are opened.
+ */
+static void init_ping(void)
+{
+	struct pcan_device *pdev = pcan_device;
+	__u32 id_mask = (pdev->msg_flags & PCANFD_MSG_EXT) ?
+				CAN_MAX_EXTENDED_ID : CAN_MAX_STANDARD_ID;
+	int i;
+
+	if (pdev->fd < 0)
+		usage("The pinging CAN interface is not opened");
+
+	memset(&tst_ping, '\0', sizeof(tst_ping));
+	tst_ping.min_ns = ~0;
+
+	tst_ping.id = (pdev->can_id_seq_mode == FIXD) ?
+			(__u32 )pdev->can_id : TST_PING_ID;
+	tst_ping.id &= id_mask;
+	tst_ping.echo_id = (tst_ping.id + 1) & id_mask;
+
+	/* pings carry the seq number and the send time in their 8 first data
+	 * bytes. CAN-FD pings can be longer. */
+	tst_ping.len = 8;
+	if ((pdev->flags & PCANFD_INIT_FD) && pdev->data_length > 8) {
+		i = pdev->data_length;
+		if (i > PCANFD_MAXDATALEN)
+			i = PCANFD_MAXDATALEN;
+		tst_ping.len = tst_dlc2len[tst_len2dlc[i]];
+	}
+
+	/* a single device gets its own pings back, once sent on the bus */
+	if (pcan_device_count == 1) {
+		if (!(pdev->msg_flags & PCANFD_MSG_ECHO))
+			pdev->msg_flags |= PCANFD_MSG_SLF;
+
+		if (!(pdev->features & (PCANFD_FEATURE_SELFRECEIVE|
+					PCANFD_FEATURE_ECHO)))
+			lprintf(ALWAYS, "WARNING: %s might not be able to "
+				"receive its own frames\n", pdev->name);
+	}
+
+	/* echoes must be sent back asap */
+	for (pdev = &pcan_device[i = 1]; i < pcan_device_count; i++, pdev++)
+		pdev->pause_us = 0;
+
+	if (pcan_device_count > 1)
+		lprintf(VERBOSE, "pinging with id=%xh len=%u, echo id=%xh\n",
+			tst_ping.id, tst_ping.len, tst_ping.echo_id);
+	else
+		lprintf(VERBOSE, "pinging with id=%xh len=%u, self-received\n",
+			tst_ping.id, tst_ping.len);
+}
+
+static int ping_hist_index(__u32 ns)
+{
+	int shift = 0;
+
+	while ((ns >> shift) >= 2 * TST_PING_SUB_COUNT)
+		shift++;
+
+	return shift * TST_PING_SUB_COUNT + (ns >> shift);
+}
+
+/* highest value counted in the given histogram bucket */
+static __u32 ping_hist_value(int idx)
+{
+	int shift = idx / TST_PING_SUB_COUNT - 1;
+
+	if (shift <= 0)
+		return idx;
+
+	idx -= shift * TST_PING_SUB_COUNT;
+	return (((__u64 )idx + 1) << shift) - 1;
+}
+
+static void ping_hist_add(__u32 ns)
+{
+	tst_ping.hist[ping_hist_index(ns)]++;
+	tst_ping.count++;
+	tst_ping.sum_ns += ns;
+
+	if (ns < tst_ping.min_ns)
+		tst_ping.min_ns = ns;
+	if (ns > tst_ping.max_ns)
+		tst_ping.max_ns = ns;
+}
+
+/* pct is given in 1/1000 of percent */
+static __u32 ping_hist_percentile(__u32 pct)
+{
+	__u64 target = ((__u64 )tst_ping.count * pct + 99999) / 100000;
+	__u64 n = 0;
+	int i;
+
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < TST_PING_HIST_SIZE; i++) {
+		n += tst_ping.hist[i];
+		if (n >= target)
+			break;
+	}
+
+	/* bucket upper value might be greater than the max really counted */
+	if (i >= TST_PING_HIST_SIZE || ping_hist_value(i) > tst_ping.max_ns)
+		return tst_ping.max_ns;
+
+	return ping_hist_value(i);
+}
+
+static void ping_put_us(char *name, __u32 ns)
+{
+	lprintf(ALWAYS, " %s=%u.%03u", name, ns / 1000, ns % 1000);
+}
+
+/*
+ * Display the results of the ping test and save the latencies distribution
+ * into the CSV file, if any.
+ */
+static void exit_ping(void)
+{
+	FILE *pcsv;
+	__u64 n = 0;
+	int i;
+
+	lprintf(ALWAYS, "pings: sent=%u replies=%u lost=%u late=%u "
+		"(hw timestamps=%u)\n",
+		tst_ping.seq, tst_ping.count, tst_ping.lost, tst_ping.late,
+		tst_ping.hwts);
+
+	if (!tst_ping.count)
+		return;
+
+	lprintf(ALWAYS, "latency (µs):");
+	ping_put_us("min", tst_ping.min_ns);
+	ping_put_us("avg", tst_ping.sum_ns / tst_ping.count);
+	ping_put_us("p50", ping_hist_percentile(50000));
+	ping_put_us("p99", ping_hist_percentile(99000));
+	ping_put_us("p99.9", ping_hist_percentile(99900));
+	ping_put_us("max", tst_ping.max_ns);
+	lprintf(ALWAYS, "\n");
+
+	if (!tst_csv_file)
+		return;
+
+	pcsv = fopen(tst_csv_file, "w");
+	if (!pcsv) {
+		lprintf(ALWAYS, "failed to create \"%s\" (errno %d)\n",
+			tst_csv_file, errno);
+		return;
+	}
+
+	fprintf(pcsv, "value_ns,count,cumulative,percentile\n");
+	for (i = 0; i < TST_PING_HIST_SIZE; i++) {
+		if (!tst_ping.hist[i])
+			continue;
+
+		n += tst_ping.hist[i];
+		fprintf(pcsv, "%u,%u,%llu,%.3f\n",
+			ping_hist_value(i), tst_ping.hist[i],
+			(unsigned long long )n, n * 100.0 / tst_ping.count);
+	}
+
+	fclose(pcsv);
+}
+
 /*
  * Initialize all what it should be for the application.
  * This function should taken into account that it can be called several times.
@@ -417,7 +730,7 @@ static void init_application(void)
 	/* if more than one pcan dev is being tested,
 	 * open all devices in non-blocking mode */
 	//if (pcan_device_count > 1 || tst_mode == TST_MODE_TX) {
-	if (pcan_device_count > 1) {
+	if (pcan_device_count > 1 && !tst_threads) {
 		non_blocking_mode_flag |= OFD_NONBLOCKING;
 	}
 #endif
@@ -457,6 +770,13 @@ static void init_application(void)
 
 		pdev->flags |= non_blocking_mode_flag;
 
+		/* latencies are computed from CLOCK_MONOTONIC timestamps, that
+		 * are derived from the hw ones when the device has some */
+		if (tst_mode == TST_MODE_PING) {
+			pdev->flags &= ~PCANFD_INIT_TS_FMT_MASK;
+			pdev->flags |= PCANFD_INIT_TS_MONO_NS;
+		}
+
 		switch (tst_mode) {
 		case TST_MODE_REC:
 			pdev->fd = open(pdev->name, O_WRONLY|O_CREAT, 00666);
@@ -640,6 +960,9 @@ static void init_application(void)
 				    "error %d while setting TS mode to %u\n",
 				    err, pdev->ts_mode);
 		}
+
+		if (pdev->tx_rate || pdev->tx_load)
+			init_tx_pace(pdev);
 	}
 
 	if (!pcan_device_opened)
@@ -647,6 +970,9 @@ static void init_application(void)
 
 	lprintf(DEBUG, "tst_fdmax=%d\n", tst_fdmax);
 
+	if (tst_mode == TST_MODE_PING)
+		init_ping();
+
 	tst_tx_count = 0;
 	tst_rx_count = 0;
 
@@ -711,6 +1037,9 @@ static void close_application(void)
 					pdev->tx_packets, pdev->send_calls,
 					pdev->tx_bytes,
 					pdev->tx_eagain);
+
+				if (pdev->tx_rate || pdev->tx_load)
+					exit_tx_pace(pdev);
 				break;
 			case TST_MODE_RX:
 				lprintf(ALWAYS,
@@ -721,6 +1050,12 @@ static void close_application(void)
 					pdev->rx_bytes,
 					pdev->rx_seq_chk_error);
 				break;
+			case TST_MODE_PING:
+				lprintf(ALWAYS,
+					"%s <> [tx_packets=%u rx_packets=%u]\n",
+					pdev->name,
+					pdev->tx_packets, pdev->rx_packets);
+				break;
 			case TST_MODE_GETOPT:
 			case TST_MODE_SETOPT:
 				if (pdev->opt.size >= 0) {
@@ -765,6 +1100,48 @@ static void close_application(void)
 	exit_logs();
 }
 
+/*
+ * Display the statistics of all the devices.
+ */
+static void put_totals(void)
+{
+	struct pcan_device *pdev;
+	__u32 packets = 0, calls = 0, bytes = 0, errors = 0;
+	struct timeval now, d;
+	double dt;
+	int i;
+
+	for (pdev = &pcan_device[i = 0]; i < pcan_device_count; i++, pdev++)
+		switch (tst_mode) {
+		case TST_MODE_TX:
+		case TST_MODE_REC:
+			packets += pdev->tx_packets;
+			calls += pdev->send_calls;
+			bytes += pdev->tx_bytes;
+			errors += pdev->tx_eagain;
+			break;
+		case TST_MODE_RX:
+			packets += pdev->rx_packets;
+			calls += pdev->recv_calls;
+			bytes += pdev->rx_bytes;
+			errors += pdev->rx_seq_chk_error;
+			break;
+		default:
+			return;
+		}
+
+	__gettimeofday(&now, NULL);
+	timersub(&now, &tst_start, &d);
+	dt = d.tv_sec + d.tv_usec / 1e6;
+
+	lprintf(ALWAYS, "total %c [packets=%u calls=%u bytes=%u %s=%u] "
+		"in %.3f s (%.1f frames/s)\n",
+		(tst_mode == TST_MODE_RX) ? '>' : '<',
+		packets, calls, bytes,
+		(tst_mode == TST_MODE_RX) ? "seq_err" : "eagain", errors,
+		dt, (dt > 0) ? packets / dt : 0);
+}
+
 /*
  * Do what must be done before exiting the application.
  */
@@ -774,6 +1151,9 @@ static int exit_application(int err)
 
 	if (pcan_device_opened > 0) {
 
+		if (pcan_device_count > 1)
+			put_totals();
+
 		switch (tst_mode) {
 
 		case TST_MODE_TX:
@@ -785,6 +1165,9 @@ static int exit_application(int err)
 		case TST_MODE_RX:
 			lprintf(ALWAYS, "received frames: %u\n", tst_rx_count);
 			break;
+		case TST_MODE_PING:
+			exit_ping();
+			break;
 		default:
 			break;
 		}
@@ -813,6 +1196,8 @@ static void usage(char *errmsg)
 	fprintf(stderr, "\tgetopt  get a specific option value from the given CAN interface(s)\n");
 	fprintf(stderr, "\tsetopt  set an option value to the given CAN interface(s)\n");
 	fprintf(stderr, "\trec     same as 'tx' but frames are recorded into the given file\n");
+	fprintf(stderr, "\tping    measure the latency of frames sent by the 1st CAN interface\n");
+	fprintf(stderr, "\t        and echoed back by the others (or self-received if alone)\n");
 	fprintf(stderr, "\nFILE\n");
 	fprintf(stderr, "\tFor all modes except 'rec' mode:\n\n");
 #ifdef RT
@@ -822,6 +1207,9 @@ static void usage(char *errmsg)
 #endif
 	fprintf(stderr, "\t              Several CAN interfaces can be specified. In that case,\n");
 	fprintf(stderr, "\t              each one is opened in non-blocking mode.\n");
+#ifndef RT
+	fprintf(stderr, "\t              (unless --threads is used)\n");
+#endif
 	fprintf(stderr, "\n\t'rec' mode only:\n\n");
 	fprintf(stderr, "\tfile_name     file path in which frames have to be recorded.\n");
 	fprintf(stderr, "\nOPTIONS\n");
@@ -834,6 +1222,7 @@ static void usage(char *errmsg)
 	fprintf(stderr, "\t-B | --brs           data bitrate used for sending CANFD msgs\n");
 	fprintf(stderr, "\t-c | --clock v       select clock frequency \"v\" Hz\n");
 #endif
+	fprintf(stderr, "\t     --csv file      save ping latencies distribution into \"file\"\n");
 	fprintf(stderr, "\t-D | --debug         (maybe too) lot of display\n");
 #ifndef PCANFD_OLD_STYLE_API
 	fprintf(stderr, "\t-d | --dbitrate v    set data bitrate to \"v\" bps\n");
@@ -861,10 +1250,18 @@ static void usage(char *errmsg)
 	fprintf(stderr, "\t     --opt-value v   specify the option value (getopt/setopt modes)\n");
 	fprintf(stderr, "\t     --opt-size v    specify the option size (getopt/setopt modes)\n");
 	fprintf(stderr, "\t-p | --pause-us v    \"v\" us. pause between sys calls (rx/tx def=0/%u)\n", tst_pause_us);
+	fprintf(stderr, "\t                     (ping mode: pause between pings)\n");
 	fprintf(stderr, "\t     --play file     play recorded frames from \"file\" according to MODE\n");
 	fprintf(stderr, "\t     --play-forever file same as --play but loop forever on \"file\"\n");
 	fprintf(stderr, "\t-P | --tx-pause-us v force a pause of \"v\" us. between each Tx frame\n");
 	fprintf(stderr, "\t                     (if hw supports it)\n");
+	fprintf(stderr, "\t     --tx-rate v     send \"v\" frames/s (tx mode, -m frames per write)\n");
+	fprintf(stderr, "\t     --tx-load v     send frames to load the bus at \"v\" %%\n");
+#ifndef RT
+	fprintf(stderr, "\t     --threads       run the test of each CAN interface in its own thread\n");
+	fprintf(stderr, "\t     --cpu c0,c1...  pin thread of i-th CAN interface on CPU ci (--threads)\n");
+	fprintf(stderr, "\t     --prio v        run threads with SCHED_FIFO priority \"v\" (--threads)\n");
+#endif
 	fprintf(stderr, "\t-q | --quiet         nothing is displayed\n");
 	fprintf(stderr, "\t-r | --rtr           set the RTR flag to msgs sent\n");
 	fprintf(stderr, "\t     --no-rtr        clear the RTR flag from msgs sent\n");
@@ -875,6 +1272,7 @@ static void usage(char *errmsg)
 #endif
 	fprintf(stderr, "\t-T | --check-ts      check host vs. driver timestatmps, stop if wrong\n");
 	fprintf(stderr, "\t     --ts-mode v     set hw timestamp mode to v (hw dependant)\n");
+	fprintf(stderr, "\t     --ts-mono       get timestamps in CLOCK_MONOTONIC ns\n");
 	fprintf(stderr, "\t-u | --bus-load      get bus load notifications from the driver\n");
 	fprintf(stderr, "\t-v | --verbose       things are (very much) explained\n");
 	fprintf(stderr, "\t-w | --with-ts       logs are prefixed with time of day (s.us)\n");
@@ -979,6 +1377,9 @@ static void signal_handler(int s)
 		/* -M option has been used: application must exit */
 		lprintf(ALWAYS, "\nTest timeout\n");
 
+		if (tst_threads)
+			tst_threads_stop = 1;
+
 		/* it's an error if test==RX and we're waiting for N msgs.
 		 * Otherwise, it's a normal exit */
 		if ((tst_mode == TST_MODE_RX) && (!tst_max_msgs)) {
@@ -1003,6 +1404,8 @@ static void signal_handler(int s)
 		/* end of loop and normal exit code */
 		tst_max_loop = 1;
 		tst_sig_caught = s;
+		if (tst_threads)
+			tst_threads_stop = 1;
 		break;
 
 #ifdef RT
@@ -1023,6 +1426,13 @@ static void signal_handler(int s)
 		tst_max_loop = 1;
 		tst_sig_caught = s;
 		break;
+#else
+	case SIGINT:
+	case SIGTERM:
+		/* the main thread stops the devices threads */
+		if (tst_threads)
+			tst_threads_stop = 1;
+		break;
 #endif
 	default:
 		break;
@@ -1037,7 +1447,7 @@ static enum tst_status handle_errno(int _errno, struct pcan_device *dev)
 	switch (_errno) {
 
 	case EINTR:
-		if (tst_sig_caught) {
+		if (tst_sig_caught || tst_threads_stop) {
 			tst_sig_caught = 0;
 			return OK;
 		}
@@ -1099,6 +1509,14 @@ static enum tst_status do_check_timestamps(struct pcanfd_msg *pcan_msg)
 	if (!(pcan_msg->flags & PCANFD_TIMESTAMP))
 		return OK;
 
+	if (pcan_msg->flags & PCANFD_TIMESTAMP_NS) {
+		__s64 d_ns = tst_mono_ns() - pcan_msg->timestamp_ns;
+
+		d.tv_sec = d_ns / 1000000000LL;
+		d.tv_usec = (d_ns % 1000000000LL) / 1000;
+		goto check_delta;
+	}
+
 	__gettimeofday(&now, NULL);
 
 	/* check if message timestamps is "correct", that is:
@@ -1107,6 +1525,7 @@ static enum tst_status do_check_timestamps(struct pcanfd_msg *pcan_msg)
 	 */
 	timersub(&now, &pcan_msg->timestamp, &d);
 
+check_delta:
 	if ((d.tv_sec < 0) || (!d.tv_sec && d.tv_usec < 0)) {
 		lprintf(ALWAYS,
 			"WARNING: message timestamp from the future!\n");
@@ -1131,6 +1550,23 @@ static int putmsg_ts(char *txt, int l, int lmax, struct pcan_device *dev,
 {
 	struct timeval now, *ptv;
 
+	/* CLOCK_MONOTONIC timestamps are displayed in s.ns format */
+	if (!(pcan_msg->flags & PCANFD_TIMESTAMP) &&
+	    (dev->flags & PCANFD_INIT_TS_FMT_MASK) == PCANFD_INIT_TS_MONO_NS) {
+		pcan_msg->timestamp_ns = tst_mono_ns();
+		pcan_msg->flags |= PCANFD_TIMESTAMP|PCANFD_TIMESTAMP_NS;
+		pcan_msg->flags &= ~PCANFD_HWTIMESTAMP;
+	}
+
+	if (pcan_msg->flags & PCANFD_TIMESTAMP_NS)
+		return snprintf(txt+l, lmax-l, "%*u%c%0*u",
+			(l1) ? l1 : 6,
+			(uint )(pcan_msg->timestamp_ns / 1000000000ULL),
+			(pcan_msg->flags & PCANFD_HWTIMESTAMP) ?
+				'.' : '~',
+			(l2) ? l2 : 9,
+			(uint )(pcan_msg->timestamp_ns % 1000000000ULL));
+
 	if (pcan_msg->flags & PCANFD_TIMESTAMP)
 		ptv = &pcan_msg->timestamp;
 	else {
@@ -1465,7 +1901,13 @@ static enum tst_status init_tx_msg(struct pcan_device *dev,
 {
 	int i;
 
-	__gettimeofday(&tx_msg->timestamp, NULL);
+	if ((dev->flags & PCANFD_INIT_TS_FMT_MASK) == PCANFD_INIT_TS_MONO_NS) {
+		tx_msg->timestamp_ns = tst_mono_ns();
+		tx_msg->flags |= PCANFD_TIMESTAMP_NS;
+	} else {
+		__gettimeofday(&tx_msg->timestamp, NULL);
+		tx_msg->flags &= ~PCANFD_TIMESTAMP_NS;
+	}
 
 	tx_msg->flags |= PCANFD_TIMESTAMP;
 	tx_msg->flags &= ~PCANFD_HWTIMESTAMP;
@@ -1566,6 +2008,178 @@ static enum tst_status init_tx_msg(struct pcan_device *dev,
 	return OK;
 }
 
+static int put_bits(__u8 *bits, int n, __u32 v, int count)
+{
+	while (count-- > 0)
+		bits[n++] = (v >> count) & 1;
+
+	return n;
+}
+
+/*
+ * Count the bits of a CAN[FD] frame on the bus, from SOF to the end of the
+ * intermission, stuff bits included. The bits sent at the data bitrate (BRS)
+ * are also counted in *data_bits.
+ */
+static int tst_frame_bits(struct pcanfd_msg *msg, int *data_bits)
+{
+	__u8 bits[64 + PCANFD_MAXDATALEN * 8];
+	int fd = (msg->type == PCANFD_TYPE_CANFD_MSG);
+	int ext = !!(msg->flags & PCANFD_MSG_EXT);
+	int n = 0, i, dlc, len, data_start = -1;
+	int run = 0, stuff = 0, data_stuff = 0, fixed = 0;
+	__u8 prev = 2;
+
+	if (fd) {
+		len = (msg->data_len > PCANFD_MAXDATALEN) ?
+				PCANFD_MAXDATALEN : msg->data_len;
+		dlc = tst_len2dlc[len];
+		len = tst_dlc2len[dlc];
+	} else {
+		dlc = (msg->data_len > PCAN_MAXDATALEN) ?
+				PCAN_MAXDATALEN : msg->data_len;
+		len = (msg->flags & PCANFD_MSG_RTR) ? 0 : dlc;
+	}
+
+	/* SOF and arbitration field */
+	n = put_bits(bits, n, 0, 1);
+	if (ext) {
+		n = put_bits(bits, n, msg->id >> 18, 11);
+		n = put_bits(bits, n, 3, 2);			/* SRR IDE */
+		n = put_bits(bits, n, msg->id, 18);
+	} else {
+		n = put_bits(bits, n, msg->id, 11);
+	}
+
+	/* control field */
+	if (fd) {
+		/* RRS [IDE] FDF res BRS ESI */
+		n = put_bits(bits, n, 0, ext ? 1 : 2);
+		n = put_bits(bits, n, 2, 2);
+		n = put_bits(bits, n, !!(msg->flags & PCANFD_MSG_BRS), 1);
+		if (msg->flags & PCANFD_MSG_BRS)
+			data_start = n;
+		n = put_bits(bits, n, !!(msg->flags & PCANFD_MSG_ESI), 1);
+	} else {
+		/* RTR [IDE] r0 or RTR r1 r0 */
+		n = put_bits(bits, n, !!(msg->flags & PCANFD_MSG_RTR), 1);
+		n = put_bits(bits, n, 0, 2);
+	}
+	n = put_bits(bits, n, dlc, 4);
+
+	for (i = 0; i < len; i++)
+		n = put_bits(bits, n, msg->data[i], 8);
+
+	if (fd) {
+		/* stuff count and CRC17/21 are fixed-stuffed, that is, a stuff
+		 * bit is inserted before and then every 4 bits */
+		fixed = 4 + ((len > 16) ? 21 : 17);
+		fixed += (fixed + 3) / 4;
+	} else {
+		__u32 crc = 0;
+
+		/* CRC15 is dynamically stuffed */
+		for (i = 0; i < n; i++) {
+			int nxt = bits[i] ^ ((crc >> 14) & 1);
+
+			crc = (crc << 1) & 0x7fff;
+			if (nxt)
+				crc ^= 0x4599;
+		}
+		n = put_bits(bits, n, crc, 15);
+	}
+
+	/* a stuff bit is inserted after 5 consecutive bits of same value */
+	for (i = 0; i < n; i++) {
+		if (bits[i] == prev) {
+			run++;
+		} else {
+			prev = bits[i];
+			run = 1;
+		}
+
+		if (run == 5) {
+			stuff++;
+			if (data_start >= 0 && i >= data_start)
+				data_stuff++;
+			prev = !bits[i];
+			run = 1;
+		}
+	}
+
+	/* CRC delimiter is the last bit sent at the data bitrate */
+	if (data_bits)
+		*data_bits = (data_start < 0) ? 0 :
+				n - data_start + data_stuff + fixed + 1;
+
+	/* CRC delimiter, ACK slot and delimiter, EOF, intermission */
+	return n + stuff + fixed + 1 + 2 + 7 + 3;
+}
+
+/*
+ * Paced Tx: check whether the next burst of frames is due. Blocking devices
+ * wait for it.
+ *
+ * Return 0 if the burst can be written, 1 if it is not due yet and a negative
+ * errno value on error.
+ */
+static int tx_pace_wait(struct pcan_device *dev)
+{
+	__u64 now_ns = tst_mono_ns();
+	struct timespec ts;
+
+	if (!dev->tx_start_ns) {
+		dev->tx_start_ns = dev->tx_next_ns = now_ns;
+		return 0;
+	}
+
+	if (now_ns >= dev->tx_next_ns)
+		return 0;
+
+	if (dev->flags & OFD_NONBLOCKING)
+		return 1;
+
+	ts.tv_sec = dev->tx_next_ns / 1000000000ULL;
+	ts.tv_nsec = dev->tx_next_ns % 1000000000ULL;
+
+	/* absolute deadlines don't drift, whatever the time spent elsewhere */
+	return -clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/*
+ * Paced Tx: schedule the next burst once "count" frames have been written.
+ */
+static void tx_pace_next(struct pcan_device *dev, struct pcanfd_msg *msg,
+			 int count)
+{
+	if (dev->nom_bitrate) {
+		int data_bits, bits = tst_frame_bits(msg, &data_bits);
+		__u64 frame_ns;
+
+		if (!dev->data_bitrate)
+			data_bits = 0;
+
+		frame_ns = (bits - data_bits) * 1000000000ULL /
+							dev->nom_bitrate;
+		if (data_bits)
+			frame_ns += data_bits * 1000000000ULL /
+							dev->data_bitrate;
+
+		dev->tx_bus_ns += count * frame_ns;
+	}
+
+	dev->tx_paced += count;
+
+	/* deadlines are computed from the start of the test to avoid
+	 * accumulating rounding errors */
+	if (dev->tx_rate)
+		dev->tx_next_ns = dev->tx_start_ns +
+			dev->tx_paced * 1000000000ULL / dev->tx_rate;
+	else
+		dev->tx_next_ns = dev->tx_start_ns +
+			dev->tx_bus_ns * 100 / dev->tx_load;
+}
+
 /*
  * This function handles TX test, according to arguments passed on command line
  */
@@ -1574,6 +2188,14 @@ static enum tst_status handle_tx_tst(struct pcan_device *dev)
 	struct pcanfd_msg *pcan_msg = dev->can_tx_msgs->list;
 	int i, err = 0, m;
 
+	if (dev->tx_rate || dev->tx_load) {
+		err = tx_pace_wait(dev);
+		if (err > 0)
+			return OK;
+		if (err < 0)
+			return handle_errno(-err, dev);
+	}
+
 	if (!dev->should_resend) {
 
 		if (init_tx_msg(dev, pcan_msg) != OK)
@@ -1678,12 +2300,20 @@ static enum tst_status handle_tx_tst(struct pcan_device *dev)
 	/* keep the count of msgs really sent */
 	m = dev->can_tx_msgs->count;
 
-	tst_tx_count += m;
+	__sync_add_and_fetch(&tst_tx_count, m);
 
 	dev->send_calls++;
 	dev->tx_packets += m;
 	dev->tx_bytes += m * pcan_msg->data_len;
 
+	if (dev->tx_rate || dev->tx_load) {
+		tx_pace_next(dev, pcan_msg, m);
+
+		/* loops don't match the count of frames sent when paced */
+		if (tst_max_msgs > 0 && tst_tx_count >= tst_max_msgs)
+			tst_max_loop = 1;
+	}
+
 	//if (tst_verbose >= NORMAL)
 		for (i = 0; i < dev->msgs_count; i++)
 			putmsg(dev, '<', pcan_msg);
@@ -1867,6 +2497,7 @@ static enum tst_status handle_rx_tst(struct pcan_device *dev)
 {
 	struct pcanfd_msg *pcan_msg = dev->can_rx_msgs->list;
 	enum tst_status tst_status = OK;
+	__u32 rx_count;
 	int m, err;
 
 	/* be sure to multi read *ONLY* when in RX mode (in TX mode, a single
@@ -1948,11 +2579,11 @@ static enum tst_status handle_rx_tst(struct pcan_device *dev)
 		if (tst_status != OK)
 			break;
 
-		/* incr count of of rx CAN msgs */
-		tst_rx_count++;
+		/* incr count of of rx CAN msgs (shared by the devices) */
+		rx_count = __sync_add_and_fetch(&tst_rx_count, 1);
 
 		if (tst_max_msgs > 0)
-			if (tst_rx_count >= tst_max_msgs) {
+			if (rx_count >= tst_max_msgs) {
 
 				/* properly stop the test */
 				tst_max_loop = 1;
@@ -2044,6 +2675,221 @@ static enum tst_status handle_rec_tst(struct pcan_device *dev)
 	return handle_tx_tst(dev);
 }
 
+/*
+ * Echo the pings received by a device back to the pinging one.
+ */
+static enum tst_status handle_ping_echo(struct pcan_device *dev)
+{
+	struct pcanfd_msg *pcan_msg = dev->can_rx_msgs->list;
+	int err;
+
+	err = pcanfd_recv_msg(dev->fd, pcan_msg);
+	lprintf(DEBUG, "pcanfd_recv_msg(%d) returns %d\n", dev->fd, err);
+	if (err)
+		return handle_errno(-err, dev);
+
+	dev->recv_calls++;
+
+	if (pcan_msg->type == PCANFD_TYPE_STATUS)
+		return handle_rx_tst_status(dev, pcan_msg);
+
+	dev->rx_packets++;
+	dev->rx_bytes += pcan_msg->data_len;
+
+	/* only pings are echoed, with a different CAN Id so that other echoing
+	 * devices don't echo them again */
+	if (pcan_msg->id != tst_ping.id ||
+	    (pcan_msg->flags & (PCANFD_MSG_SLF|PCANFD_MSG_ECHO)))
+		return OK;
+
+	pcan_msg->id = tst_ping.echo_id;
+	pcan_msg->flags &= PCANFD_MSG_EXT|PCANFD_MSG_BRS;
+
+	err = pcanfd_send_msg(dev->fd, pcan_msg);
+	lprintf(DEBUG, "pcanfd_send_msg(%d, msg id=%xh) returns %d\n",
+		dev->fd, pcan_msg->id, err);
+	if (err)
+		return handle_errno(-err, dev);
+
+	dev->send_calls++;
+	dev->tx_packets++;
+	dev->tx_bytes += pcan_msg->data_len;
+
+	return OK;
+}
+
+/*
+ * Read a frame from the pinging device and, if it is the reply to the pending
+ * ping, count its latency.
+ */
+static enum tst_status handle_ping_reply(struct pcan_device *dev)
+{
+	struct pcanfd_msg *pcan_msg = dev->can_rx_msgs->list;
+	__u32 seq, tx_ns, lat_ns;
+	__u64 rx_ns;
+	int err;
+
+	err = pcanfd_recv_msg(dev->fd, pcan_msg);
+
+	/* used only if the driver didn't timestamp the msg */
+	rx_ns = tst_mono_ns();
+
+	lprintf(DEBUG, "pcanfd_recv_msg(%d) returns %d\n", dev->fd, err);
+	if (err)
+		return handle_errno(-err, dev);
+
+	dev->recv_calls++;
+
+	if (pcan_msg->type == PCANFD_TYPE_STATUS)
+		return handle_rx_tst_status(dev, pcan_msg);
+
+	dev->rx_packets++;
+	dev->rx_bytes += pcan_msg->data_len;
+
+	if (pcan_device_count > 1) {
+		if (pcan_msg->id != tst_ping.echo_id)
+			return OK;
+
+	} else if (pcan_msg->id != tst_ping.id ||
+		   !(pcan_msg->flags & (PCANFD_MSG_SLF|PCANFD_MSG_ECHO))) {
+		return OK;
+	}
+
+	if (pcan_msg->data_len < 8)
+		return OK;
+
+	memcpy(&seq, pcan_msg->data, sizeof(seq));
+	memcpy(&tx_ns, pcan_msg->data + 4, sizeof(tx_ns));
+	seq = le32toh(seq);
+	tx_ns = le32toh(tx_ns);
+
+	/* reply to a ping that timed out, or echoed by several devices */
+	if (!tst_ping.pending || seq != tst_ping.seq) {
+		lprintf(VERBOSE, "%s > late reply to ping #%u\n",
+			dev->name, seq);
+		tst_ping.late++;
+		return OK;
+	}
+
+	tst_ping.pending = 0;
+
+	if (pcan_msg->flags & PCANFD_TIMESTAMP_NS) {
+		rx_ns = pcan_msg->timestamp_ns;
+		if (pcan_msg->flags & PCANFD_HWTIMESTAMP)
+			tst_ping.hwts++;
+	}
+
+	/* only the 32 LSB of the send time are carried by the ping. Note that
+	 * the hw timestamps of a frame might be slightly earlier than the host
+	 * time it has been written */
+	lat_ns = (__u32 )rx_ns - tx_ns;
+	if ((__s32 )lat_ns < 0)
+		lat_ns = 0;
+
+	ping_hist_add(lat_ns);
+	tst_rx_count++;
+
+	lprintf(NORMAL, "%s > ping #%u: %u.%03u µs%s\n",
+		dev->name, seq, lat_ns / 1000, lat_ns % 1000,
+		(pcan_msg->flags & PCANFD_HWTIMESTAMP) ? "" : " (host ts)");
+
+	return OK;
+}
+
+/*
+ * Ping test: the 1st device sends a ping and waits for its reply, that is,
+ * the ping echoed by any other device or, if alone, self-received. The other
+ * devices echo the pings.
+ */
+static enum tst_status handle_ping_tst(struct pcan_device *dev)
+{
+	struct pcanfd_msg *pcan_msg = dev->can_tx_msgs->list;
+	enum tst_status tst = OK;
+	__u32 tmp;
+	__u64 tx_ns;
+	int err;
+#ifndef ONE_TASK_PER_DEVICE
+	/* echoing devices might run their own thread */
+	int n = tst_threads ? 1 : pcan_device_count;
+	struct pcan_device *pdev;
+	__u64 deadline_ns;
+	struct timeval to;
+	fd_set fds;
+	int i;
+#endif
+
+	if (dev != pcan_device)
+		return handle_ping_echo(dev);
+
+	pcan_msg->id = tst_ping.id;
+	pcan_msg->flags = dev->msg_flags & ~PCANFD_MSG_RTR;
+	pcan_msg->data_len = tst_ping.len;
+	memset(pcan_msg->data, '\0', sizeof(pcan_msg->data));
+
+	tmp = htole32(++tst_ping.seq);
+	memcpy(pcan_msg->data, &tmp, sizeof(tmp));
+
+	tx_ns = tst_mono_ns();
+	tmp = htole32((__u32 )tx_ns);
+	memcpy(pcan_msg->data + 4, &tmp, sizeof(tmp));
+
+	err = pcanfd_send_msg(dev->fd, pcan_msg);
+	lprintf(DEBUG, "pcanfd_send_msg(%d, msg id=%xh seq=%u) returns %d\n",
+		dev->fd, pcan_msg->id, tst_ping.seq, err);
+	if (err)
+		return handle_errno(-err, dev);
+
+	tst_ping.pending = 1;
+	tst_tx_count++;
+
+	dev->send_calls++;
+	dev->tx_packets++;
+	dev->tx_bytes += pcan_msg->data_len;
+
+#ifdef ONE_TASK_PER_DEVICE
+	/* the echoing devices run their own task */
+	while (tst_ping.pending && tst == OK)
+		tst = handle_ping_reply(dev);
+#else
+	/* wait for the reply during timeout-ms, echoing the pings meanwhile */
+	deadline_ns = tx_ns + tst_select_to_ms * 1000000ULL;
+
+	while (tst_ping.pending && tst == OK) {
+		__s64 left_ns = deadline_ns - tst_mono_ns();
+
+		if (left_ns <= 0) {
+			lprintf(NORMAL, "%s > ping #%u: timeout\n",
+				dev->name, tst_ping.seq);
+			tst_ping.pending = 0;
+			tst_ping.lost++;
+			break;
+		}
+
+		FD_ZERO(&fds);
+		for (pdev = &pcan_device[i = 0]; i < n; i++, pdev++)
+			if (pdev->fd >= 0)
+				FD_SET(pdev->fd, &fds);
+
+		to.tv_sec = left_ns / 1000000000LL;
+		to.tv_usec = (left_ns % 1000000000LL) / 1000;
+
+		err = select(tst_fdmax+1, &fds, NULL, NULL, &to);
+		if (err < 0)
+			return handle_errno(errno, NULL);
+
+		for (pdev = &pcan_device[i = 1]; i < n && tst == OK;
+								i++, pdev++)
+			if (pdev->fd >= 0 && FD_ISSET(pdev->fd, &fds))
+				tst = handle_ping_echo(pdev);
+
+		if (tst == OK && FD_ISSET(dev->fd, &fds))
+			tst = handle_ping_reply(dev);
+	}
+#endif
+
+	return tst;
+}
+
 /*
  * This function handles read/write operations from one device.
  *
@@ -2111,6 +2957,10 @@ static enum tst_status handle_single_device(struct pcan_device *pdev)
 		tst = handle_rec_tst(pdev);
 		break;
 
+	case TST_MODE_PING:
+		tst = handle_ping_tst(pdev);
+		break;
+
 	default:
 		return tst_mode;
 	}
@@ -2142,6 +2992,11 @@ static enum tst_status handle_several_devices(void)
 
 	struct timeval sel_to;
 	struct timeval *sel_to_ptr = (tst_select_to_ms > 0) ?  &sel_to : NULL;
+	__u64 now_ns = tst_mono_ns(), wait_ns = ~0ULL;
+
+	/* in ping mode, the pinging device handles the others */
+	if (tst_mode == TST_MODE_PING)
+		return handle_single_device(pcan_device);
 
 	FD_ZERO(&fds_read);
 	FD_ZERO(&fds_write);
@@ -2157,7 +3012,13 @@ static enum tst_status handle_several_devices(void)
 		 * to be sure to read/write, even in blocking mode. */
 		switch (tst_mode) {
 		case TST_MODE_TX:
-			FD_SET(pdev->fd, &fds_write);
+			/* paced devices wait for their next burst to be due */
+			if (pdev->tx_next_ns > now_ns) {
+				if (pdev->tx_next_ns - now_ns < wait_ns)
+					wait_ns = pdev->tx_next_ns - now_ns;
+			} else {
+				FD_SET(pdev->fd, &fds_write);
+			}
 
 #if 1
 			/* Note: when writing, should also
@@ -2195,6 +3056,14 @@ static enum tst_status handle_several_devices(void)
 					"devices...\n", use_select);
 		}
 
+		if (wait_ns != ~0ULL && (!sel_to_ptr ||
+				wait_ns < tst_select_to_ms * 1000000ULL)) {
+			wait_ns = (wait_ns + 999) / 1000;
+			sel_to.tv_sec = wait_ns / 1000000;
+			sel_to.tv_usec = wait_ns % 1000000;
+			sel_to_ptr = &sel_to;
+		}
+
 		fd_count = select(tst_fdmax+1, &fds_read, &fds_write,
 						NULL, sel_to_ptr);
 		if (!fd_count) {
@@ -2262,8 +3131,9 @@ static void dev_main_loop(void *arg)
 #endif
 
 	/* when sending, the count of loop is equal to the number of write */
-	if (tst_max_msgs > 0 &&
-		(tst_mode == TST_MODE_TX || tst_mode == TST_MODE_REC))
+	if (tst_max_msgs > 0 && !tst_tx_rate && !tst_tx_load &&
+		(tst_mode == TST_MODE_TX || tst_mode == TST_MODE_REC ||
+		 tst_mode == TST_MODE_PING))
 		tst_max_loop = tst_max_msgs;
 
 	if (!tst_max_loop)
@@ -2279,7 +3149,9 @@ static void dev_main_loop(void *arg)
 #ifdef ONE_TASK_PER_DEVICE
 		tst = handle_single_device(pdev);
 #else
-		tst = handle_several_devices();
+		/* without any device, the task handles all of them */
+		tst = (pdev) ? handle_single_device(pdev) :
+			       handle_several_devices();
 #endif
 
 		if (tst_max_loop)
@@ -2322,8 +3194,152 @@ static void dev_main_loop(void *arg)
 
 	lprintf(VERBOSE, "end of test loop (tst=%u).\n", tst);
 
-	exit_status = !tst;
+	/* several tasks might run the test */
+	if (tst != OK)
+		exit_status = 1;
+}
+
+#ifndef RT
+/*
+ * Device thread main function (--threads)
+ */
+static void *dev_thread_main(void *arg)
+{
+	struct pcan_device *pdev = (struct pcan_device *)arg;
+
+	if (tst_cpus_count > 0) {
+		__u32 cpu = tst_cpus[(pdev - pcan_device) % tst_cpus_count];
+		cpu_set_t cpus;
+		int err;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+
+		err = pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+					     &cpus);
+		if (err)
+			lprintf(ALWAYS,
+				"WARNING: failed to pin %s thread on CPU %u "
+				"(err %d)\n", pdev->name, cpu, err);
+		else
+			lprintf(VERBOSE, "%s thread pinned on CPU %u\n",
+				pdev->name, cpu);
+	}
+
+	dev_main_loop(pdev);
+
+	pthread_mutex_lock(&tst_threads_lock);
+	pdev->thread_running = 0;
+	tst_threads_running--;
+	pthread_cond_signal(&tst_threads_cond);
+	pthread_mutex_unlock(&tst_threads_lock);
+
+	return NULL;
+}
+
+/* must be called with tst_threads_lock held */
+static void wait_threads(int timeout_ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += timeout_ms * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_cond_timedwait(&tst_threads_cond, &tst_threads_lock, &ts);
+}
+
+/*
+ * Run the test of each device in its own thread, until any of them ends.
+ */
+static void run_threads(void)
+{
+	int created[TST_DEV_PCAN_MAX] = { 0 };
+	struct pcan_device *pdev;
+	int i, err, started = 0;
+
+	/* lock all of the calling process virtual address space into RAM */
+	if (tst_thread_prio > 0)
+		mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	for (pdev = &pcan_device[i = 0]; i < pcan_device_count; i++, pdev++) {
+		struct sched_param sp = { .sched_priority = tst_thread_prio };
+		pthread_attr_t attr;
+
+		if (pdev->fd < 0)
+			continue;
+
+		pthread_attr_init(&attr);
+		if (tst_thread_prio > 0) {
+			pthread_attr_setinheritsched(&attr,
+						     PTHREAD_EXPLICIT_SCHED);
+			pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+			pthread_attr_setschedparam(&attr, &sp);
+		}
+
+		pthread_mutex_lock(&tst_threads_lock);
+		pdev->thread_running = 1;
+		tst_threads_running++;
+		pthread_mutex_unlock(&tst_threads_lock);
+
+		err = pthread_create(&pdev->thread, &attr, dev_thread_main,
+				     pdev);
+		if (err == EPERM) {
+			lprintf(ALWAYS, "WARNING: not allowed to run %s "
+				"thread with SCHED_FIFO priority %d\n",
+				pdev->name, tst_thread_prio);
+
+			err = pthread_create(&pdev->thread, NULL,
+					     dev_thread_main, pdev);
+		}
+
+		pthread_attr_destroy(&attr);
+
+		if (err) {
+			lprintf(ALWAYS, "failed to create %s thread (err %d)\n",
+				pdev->name, err);
+
+			pthread_mutex_lock(&tst_threads_lock);
+			pdev->thread_running = 0;
+			tst_threads_running--;
+			pthread_mutex_unlock(&tst_threads_lock);
+			continue;
+		}
+
+		created[i] = 1;
+		started++;
+	}
+
+	pthread_mutex_lock(&tst_threads_lock);
+
+	/* the test ends as soon as one thread ends or on signal */
+	while (tst_threads_running == started && !tst_threads_stop)
+		wait_threads(100);
+
+	/* the other threads might be blocked in a system call: SIGUSR2
+	 * interrupts it and ends their loop (see signal_handler()) */
+	tst_threads_stop = 1;
+	tst_max_loop = 1;
+
+	while (tst_threads_running > 0) {
+		for (pdev = &pcan_device[i = 0]; i < pcan_device_count;
+								i++, pdev++)
+			if (pdev->thread_running)
+				pthread_kill(pdev->thread, SIGUSR2);
+
+		wait_threads(100);
+	}
+
+	pthread_mutex_unlock(&tst_threads_lock);
+
+	for (pdev = &pcan_device[i = 0]; i < pcan_device_count; i++, pdev++)
+		if (created[i])
+			pthread_join(pdev->thread, NULL);
 }
+#endif
 
 /*
  * Application main process
@@ -2410,8 +3426,12 @@ static void run_application(void)
 
 #else
 
-	/* in non-RT context, simply run a single-task main loop... */
-	dev_main_loop(NULL);
+	/* in non-RT context, run one thread per device or simply run a
+	 * single-task main loop... */
+	if (tst_threads)
+		run_threads();
+	else
+		dev_main_loop(NULL);
 #endif
 }
 
@@ -2424,7 +3444,8 @@ int main(int argc, char *argv[])
 		IN_CLOCK, IN_MAXCANMSGS, IN_ID, IN_PAUSE, IN_TXPAUSE,
 		IN_LENGTH, IN_INCR, IN_TIMEOUT, IN_MUL, IN_ACCEPT,
 		IN_MAXDURATION, IN_PLAY, IN_PLAY_FOREVER, IN_FILLER,
-		IN_OPT_NAME, IN_OPT_SIZE, IN_OPT_VALUE,
+		IN_OPT_NAME, IN_OPT_SIZE, IN_OPT_VALUE, IN_CSV,
+		IN_TXRATE, IN_TXLOAD, IN_CPU, IN_PRIO,
 		IDLE
 	} opt_state = IDLE;
 	int i;
@@ -2692,6 +3713,41 @@ int main(int argc, char *argv[])
 					tst_play_file);
 				break;
 
+			case IN_TXRATE:
+				tst_tx_rate = strtounit(argv[i], "kM");
+				tst_tx_load = 0;
+				lprintf(DEBUG, "--tx-rate %u\n", tst_tx_rate);
+				break;
+
+			case IN_TXLOAD:
+				tst_tx_load = strtounit(argv[i], NULL);
+				if (!tst_tx_load || tst_tx_load > 100)
+					usage("wrong bus load: must be in [1..100]");
+				tst_tx_rate = 0;
+				lprintf(DEBUG, "--tx-load %u\n", tst_tx_load);
+				break;
+
+#ifndef RT
+			case IN_CPU:
+				tst_cpus_count = strtoulist(argv[i],
+						TST_DEV_PCAN_MAX, tst_cpus);
+				if (!tst_cpus_count)
+					usage("wrong CPU list");
+				tst_threads = 1;
+				lprintf(DEBUG, "--cpu %s\n", argv[i]);
+				break;
+
+			case IN_PRIO:
+				tst_thread_prio = strtounit(argv[i], NULL);
+				tst_threads = 1;
+				lprintf(DEBUG, "--prio %d\n", tst_thread_prio);
+				break;
+#endif
+			case IN_CSV:
+				tst_csv_file = argv[i];
+				lprintf(DEBUG, "--csv %s\n", tst_csv_file);
+				break;
+
 
 			default:
 				break;
@@ -2755,6 +3811,11 @@ int main(int argc, char *argv[])
 				} else if (!strcmp(argv[i]+2, "no-rtr")) {
 					tst_msg_flags &= ~PCANFD_MSG_RTR;
 					continue;
+
+				} else if (!strcmp(argv[i]+2, "ts-mono")) {
+					tst_flags &= ~PCANFD_INIT_TS_FMT_MASK;
+					tst_flags |= PCANFD_INIT_TS_MONO_NS;
+					continue;
 #ifndef PCANFD_OLD_STYLE_API
 				} else if (!strcmp(argv[i]+2, "fd-non-iso")) {
 					tst_flags |= PCANFD_INIT_FD|\
@@ -2795,6 +3856,26 @@ int main(int argc, char *argv[])
 				} else if (!strcmp(argv[i]+2, "play-forever")) {
 					opt_state = IN_PLAY_FOREVER;
 					continue;
+				} else if (!strcmp(argv[i]+2, "tx-rate")) {
+					opt_state = IN_TXRATE;
+					continue;
+				} else if (!strcmp(argv[i]+2, "tx-load")) {
+					opt_state = IN_TXLOAD;
+					continue;
+#ifndef RT
+				} else if (!strcmp(argv[i]+2, "threads")) {
+					tst_threads = 1;
+					continue;
+				} else if (!strcmp(argv[i]+2, "cpu")) {
+					opt_state = IN_CPU;
+					continue;
+				} else if (!strcmp(argv[i]+2, "prio")) {
+					opt_state = IN_PRIO;
+					continue;
+#endif
+				} else if (!strcmp(argv[i]+2, "csv")) {
+					opt_state = IN_CSV;
+					continue;
 				}
 			}
 
@@ -2931,6 +4012,8 @@ int main(int argc, char *argv[])
 			tst_mode = TST_MODE_REC;
 		} else if (!strncmp(argv[i], "none", 4)) {
 			tst_mode = TST_MODE_NONE;
+		} else if (!strncmp(argv[i], "ping", 4)) {
+			tst_mode = TST_MODE_PING;
 		} else if (pcan_device_count < TST_DEV_PCAN_MAX) {
 			memset(pdev, '\0', sizeof(*pdev));
 
@@ -2961,6 +4044,8 @@ int main(int argc, char *argv[])
 			pdev->seq_counter = 0;
 			pdev->ids_count = tst_ids_set;
 			pdev->ts_mode = tst_ts_mode;
+			pdev->tx_rate = tst_tx_rate;
+			pdev->tx_load = tst_tx_load;
 
 			pdev->opt.name = tst_opt.name;
 			pdev->opt.size = tst_opt.size;